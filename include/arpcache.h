@@ -0,0 +1,215 @@
+/*
+ * Copyright (c) 2017 Jacopo De Luca
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+*/
+
+/**
+ * @file arpcache.h
+ * @brief Provides an ARP neighbor cache with aging and asynchronous resolution.
+ *
+ * The cache never blocks: frames directed to unresolved neighbors are queued and flushed as soon as
+ * the reply is seen by arpcache_input(), retransmissions and aging are driven by arpcache_tick().
+ * @warning The cache is not thread safe, it is meant to be owned by the thread that drives the SpkSock.
+ */
+
+#ifndef SPARK_ARPCACHE_H
+#define SPARK_ARPCACHE_H
+
+#include <stdbool.h>
+
+#include "datatype.h"
+#include "spksock.h"
+#include "ethernet.h"
+#include "arp.h"
+
+#define ARPCACHE_DEFSIZE        1024    // Default number of buckets
+#define ARPCACHE_DEFREACHABLE   30000   // Milliseconds before a reachable entry become stale
+#define ARPCACHE_DEFGCSTALE     60000   // Milliseconds before an unused stale entry is removed
+#define ARPCACHE_DEFRETRANS     1000    // Milliseconds between two requests for the same address
+#define ARPCACHE_DEFRETRIES     3       // Requests sent before giving up
+#define ARPCACHE_DEFQLEN        16      // Max frames queued on an unresolved entry
+
+/// @brief Neighbor entry states.
+enum ArpState {
+    ARPST_NONE,         // No entry
+    ARPST_INCOMPLETE,   // Request sent, waiting for the reply
+    ARPST_REACHABLE,    // Recently confirmed
+    ARPST_STALE,        // Usable, but must be confirmed again
+    ARPST_PERMANENT     // Static entry, never expires
+};
+
+/// @brief Frame waiting for address resolution.
+struct ArpPending {
+    struct ArpPending *next;
+    unsigned int len;
+    unsigned char frame[];
+};
+
+/// @brief Neighbor entry.
+struct ArpEntry {
+    /// @brief IPv4 address of the neighbor.
+    struct netaddr_ip ip;
+    /// @brief Hardware address of the neighbor (valid if state > ARPST_INCOMPLETE).
+    struct netaddr_mac mac;
+    /// @brief Entry state.
+    enum ArpState state;
+    /// @brief Requests sent since last confirmation.
+    unsigned int probes;
+    /// @brief Number of queued frames.
+    unsigned int qlen;
+    /// @brief Time of last confirmation (ms).
+    unsigned long long confirmed;
+    /// @brief Time of last use (ms).
+    unsigned long long used;
+    /// @brief Time of the next request (ms).
+    unsigned long long next_probe;
+    struct ArpPending *qhead;
+    struct ArpPending *qtail;
+    struct ArpEntry *next;
+};
+
+/// @brief Cache statistics.
+struct ArpCacheStats {
+    /// @brief ARP requests sent.
+    unsigned long requests;
+    /// @brief Entries created or confirmed by ARP traffic.
+    unsigned long learned;
+    /// @brief Queued frames sent after resolution.
+    unsigned long flushed;
+    /// @brief Frames dropped, queue full or resolution failed.
+    unsigned long dropped;
+    /// @brief Entries that failed resolution.
+    unsigned long failed;
+};
+
+/// @brief Contains the neighbor table and its settings.
+struct ArpCache {
+    /// @brief Socket used to send requests and queued frames.
+    struct SpkSock *ssock;
+    /// @brief Local hardware address.
+    struct netaddr_mac hwaddr;
+    /// @brief Local IPv4 address.
+    struct netaddr_ip ipaddr;
+    /// @brief Learns every sender seen in ARP traffic, not only neighbors talking with us.
+    bool learn_all;
+    /// @brief Milliseconds before a reachable entry become stale.
+    unsigned int reachable_time;
+    /// @brief Milliseconds before an unused stale entry is removed.
+    unsigned int gc_stale_time;
+    /// @brief Milliseconds between two requests for the same address.
+    unsigned int retrans_time;
+    /// @brief Requests sent before giving up.
+    unsigned int max_probes;
+    /// @brief Max frames queued on an unresolved entry.
+    unsigned int max_queue;
+    /// @brief Number of entries.
+    unsigned int count;
+    /// @brief Statistics.
+    struct ArpCacheStats stats;
+
+    struct ArpEntry **table;
+    unsigned int mask;
+    unsigned char request[ETHHDRSIZE + ARPETHIPSIZE];
+};
+
+/**
+ * @brief Inspects a frame received by spark_read and learns the sender addresses if it is an ARP packet.
+ *
+ * When an incomplete entry is resolved all queued frames are sent.
+ * @param __IN__cache Pointer to ArpCache.
+ * @param __IN__frame Pointer to Ethernet frame.
+ * @param len Frame length.
+ * @return Function returns true if the frame updated the cache, false otherwise.
+ */
+bool arpcache_input(struct ArpCache *cache, unsigned char *frame, unsigned int len);
+
+/**
+ * @brief Obtains the hardware address of `ip`, starting resolution if needed.
+ *
+ * This function never blocks, if the address is unknown an ARP request is sent (rate limited) and false is returned.
+ * @param __IN__cache Pointer to ArpCache.
+ * @param __IN__ip Pointer to netaddr_ip structure contains the neighbor address.
+ * @param __OUT__mac Pointer to netaddr_mac structure.
+ * @return Function returns true if the hardware address has been obtained, false otherwise.
+ */
+bool arpcache_resolve(struct ArpCache *cache, struct netaddr_ip *ip, struct netaddr_mac *mac);
+
+/**
+ * @brief Adds or replaces an entry.
+ * @param __IN__cache Pointer to ArpCache.
+ * @param __IN__ip Pointer to netaddr_ip structure contains the neighbor address.
+ * @param __IN__mac Pointer to netaddr_mac structure contains the neighbor hardware address.
+ * @param permanent If true the entry never expires.
+ * @return On success returns true, otherwise false is returned.
+ */
+bool arpcache_set(struct ArpCache *cache, struct netaddr_ip *ip, struct netaddr_mac *mac, bool permanent);
+
+/**
+ * @brief Looks for a neighbor without starting resolution.
+ * @param __IN__cache Pointer to ArpCache.
+ * @param __IN__ip Pointer to netaddr_ip structure contains the neighbor address.
+ * @param __OUT__mac Pointer to netaddr_mac structure (can be NULL).
+ * @return The state of the entry, ARPST_NONE if the address is unknown.
+ */
+enum ArpState arpcache_lookup(struct ArpCache *cache, struct netaddr_ip *ip, struct netaddr_mac *mac);
+
+/**
+ * @brief Sends an Ethernet frame to the neighbor `ip`.
+ *
+ * Source and destination hardware addresses of the frame are filled by the cache.
+ * If the neighbor is not resolved yet, a copy of the frame is queued and sent when the reply arrives.
+ * @param __IN__cache Pointer to ArpCache.
+ * @param __IN__ip Pointer to netaddr_ip structure contains the next hop address.
+ * @param __IN__frame Pointer to Ethernet frame.
+ * @param len Frame length.
+ * @return If the frame was sent returns the number of bytes written, 0 if the frame was queued.
+ * Otherwise, a value < 0 shall be returned, you can use spark_strerror to get error message.
+ */
+int arpcache_send(struct ArpCache *cache, struct netaddr_ip *ip, unsigned char *frame, unsigned int len);
+
+/**
+ * @brief Allocates a new ARP cache.
+ * @param __IN__ssock Pointer to SpkSock structure which handles the active raw socket.
+ * @param __IN__ipaddr Pointer to netaddr_ip structure contains the local IPv4 address.
+ * @param size Number of buckets, rounded up to the next power of two (0 means ARPCACHE_DEFSIZE).
+ * @return On success returns the pointer to new ArpCache, otherwise return NULL.
+ */
+struct ArpCache *arpcache_new(struct SpkSock *ssock, struct netaddr_ip *ipaddr, unsigned int size);
+
+/**
+ * @brief Removes an entry, queued frames are dropped.
+ * @param __IN__cache Pointer to ArpCache.
+ * @param __IN__ip Pointer to netaddr_ip structure contains the neighbor address.
+ */
+void arpcache_del(struct ArpCache *cache, struct netaddr_ip *ip);
+
+/**
+ * @brief Frees the memory occupied by ArpCache.
+ * @param __IN__cache Pointer to ArpCache.
+ */
+void arpcache_free(struct ArpCache *cache);
+
+/**
+ * @brief Performs retransmissions and aging, must be called periodically (e.g. every 100ms).
+ * @param __IN__cache Pointer to ArpCache.
+ */
+void arpcache_tick(struct ArpCache *cache);
+
+#endif
@@ -0,0 +1,129 @@
+/*
+ * Copyright (c) 2017 Jacopo De Luca
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+*/
+
+/**
+ * @file arpsweep.h
+ * @brief Provides an engine for discovering live hosts on a L2 segment with ARP requests.
+ *
+ * Requests are built from a template directly into batches and sent at a fixed rate,
+ * replies are collected by a receive thread on a second socket that accepts only ARP replies (kernel filter).
+ * Hosts that did not answer are retried for a configurable number of rounds.
+ */
+
+#ifndef SPARK_ARPSWEEP_H
+#define SPARK_ARPSWEEP_H
+
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "datatype.h"
+#include "spksock.h"
+
+#define ARPSWEEP_DEFPPS     10000   // Requests per second
+#define ARPSWEEP_DEFBATCH   32      // Requests per batch
+#define ARPSWEEP_DEFRETRIES 2       // Extra rounds for non-responders
+#define ARPSWEEP_DEFWAIT    500     // Milliseconds to wait for replies after each round
+#define ARPSWEEP_MINPREFIX  12      // Largest network that can be swept (/12, 1M addresses)
+
+/// @brief Result for a single address of the swept network.
+struct ArpSweepHost {
+    /// @brief IPv4 address.
+    struct netaddr_ip ip;
+    /// @brief Hardware address, valid if alive is true.
+    struct netaddr_mac mac;
+    /// @brief Number of requests sent.
+    unsigned int tries;
+    /// @brief Round trip time of the first reply (microseconds).
+    unsigned int rtt;
+    /// @brief True if the host answered.
+    atomic_bool alive;
+    /// @brief Time the last request was sent (CLOCK_MONOTONIC, nanoseconds).
+    atomic_ullong sent;
+};
+
+/// @brief Contains sweep settings and results.
+struct ArpSweep {
+    /// @brief Socket used to send requests.
+    struct SpkSock *tx;
+    /// @brief Socket used by the receive thread.
+    struct SpkSock *rx;
+    /// @brief Source hardware address of the requests.
+    struct netaddr_mac hwaddr;
+    /// @brief Source IPv4 address of the requests.
+    struct netaddr_ip ipaddr;
+    /// @brief Requests per second, 0 means no limit.
+    unsigned int pps;
+    /// @brief Requests per batch.
+    unsigned int batch;
+    /// @brief Extra rounds for non-responders.
+    unsigned int retries;
+    /// @brief Milliseconds to wait for replies after each round.
+    unsigned int wait;
+    /// @brief Called by the receive thread when a host answers for the first time (can be NULL).
+    void (*on_reply)(struct ArpSweepHost *host, void *arg);
+    /// @brief Argument of on_reply.
+    void *arg;
+    /// @brief Results, one for each address of the network.
+    struct ArpSweepHost *hosts;
+    /// @brief Number of addresses.
+    unsigned int nhosts;
+    /// @brief Number of hosts that answered.
+    atomic_uint alive;
+    /// @brief ARP replies received (duplicates included).
+    atomic_ulong replies;
+
+    unsigned int first;
+    pthread_t rx_thread;
+    atomic_bool running;
+};
+
+/**
+ * @brief Prepares a sweep of the network `net`/`prefix` on device `device`.
+ *
+ * Network and broadcast addresses are skipped for prefixes shorter than 31.
+ * Source addresses are taken from the device, you can change them before calling arpsweep_run.
+ * @param device Interface name.
+ * @param __IN__net Pointer to netaddr_ip structure contains the network address.
+ * @param prefix Prefix length (at least ARPSWEEP_MINPREFIX).
+ * @param __OUT__sweep Pointer to the new ArpSweep structure.
+ * @return Upon successful completion, arpsweep_open() returns SPKSOCK_SUCCESS.
+ * If the IPv4 address of the device cannot be read SPKSOCK_ERROR is returned.
+ * Otherwise, a value < 0 shall be returned, you can use spark_strerror to get error message.
+ */
+int arpsweep_open(char *device, struct netaddr_ip *net, unsigned char prefix, struct ArpSweep **sweep);
+
+/**
+ * @brief Runs the sweep, returns when all rounds are completed.
+ * @param __IN__sweep Pointer to ArpSweep.
+ * @return On success returns the number of live hosts.
+ * Otherwise, a value < 0 shall be returned, you can use spark_strerror to get error message.
+ */
+int arpsweep_run(struct ArpSweep *sweep);
+
+/**
+ * @brief Closes the sockets and frees the memory occupied by ArpSweep.
+ * @param __IN__sweep Pointer to ArpSweep.
+ */
+void arpsweep_close(struct ArpSweep *sweep);
+
+#endif
@@ -0,0 +1,148 @@
+/*
+ * Copyright (c) 2017 Jacopo De Luca
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+*/
+
+/**
+ * @file capmerge.h
+ * @brief Provides a K-way merge of several capture streams into a single stream ordered by timestamp.
+ *
+ * Sources are SpkSocks: capture files opened with spark_openfile are read with spark_next and never copied,
+ * live sockets are switched to non-blocking mode and drained into a per-source FIFO.
+ * A heap keeps the sources ordered by the timestamp of their first pending packet. A packet is released when
+ * no live source can still deliver an older one: every live source either has a packet pending or has been
+ * silent for `latency` milliseconds past the packet timestamp, so the reorder delay is bounded by latency.
+ * A FIFO that fills up forces the release of the oldest packet to keep memory bounded.
+ * Packets older than the last one released are late: they are counted and either delivered immediately or
+ * dropped (droplate).
+ *
+ * Example:
+ * @code
+ * struct CapMerge *merge;
+ * capmerge_new(50, &merge);
+ * capmerge_add(merge, eth0);
+ * capmerge_add(merge, eth1);
+ * while ((len = capmerge_next(merge, &pkt, &ts, &src)) >= 0) {
+ *     if (len > 0)
+ *         pcapw_write(writer, pkt, len, &ts);
+ * }
+ * @endcode
+ */
+
+#ifndef SPARK_CAPMERGE_H
+#define SPARK_CAPMERGE_H
+
+#include <stdbool.h>
+
+#include "spksock.h"
+
+#define CAPMERGE_MAXSRC     64
+#define CAPMERGE_LATENCY    100         // Default reorder latency in milliseconds
+#define CAPMERGE_FIFOSIZE   (4 << 20)   // FIFO size of each live source
+
+/// @brief FIFO record header, followed by the packet padded to 16 bytes (this struct is private).
+struct CapMergeRec {
+    long long time;
+    unsigned int len;
+    unsigned int pad;
+};
+
+/// @brief Contains the state of a source (this struct is private).
+struct CapMergeSrc {
+    struct SpkSock *ssock;
+    bool live;
+    bool eof;
+    bool full;
+    // Pending packet of a capture file
+    unsigned char *pkt;
+    unsigned int len;
+    long long time;
+    // FIFO of a live socket
+    unsigned char *fifo;
+    unsigned long long head;
+    unsigned long long tail;
+    unsigned long long late;
+};
+
+/// @brief Contains merge settings and statistics.
+struct CapMerge {
+    /// @brief Milliseconds a packet waits for older packets from silent live sources.
+    unsigned int latency;
+    /// @brief Drop late packets instead of delivering them out of order.
+    bool droplate;
+    /// @brief Packets delivered.
+    unsigned long long packets;
+    /// @brief Packets older than a packet already delivered.
+    unsigned long long late;
+    /// @brief Late packets dropped.
+    unsigned long long dropped;
+    /// @brief Packets released before the latency expired because a FIFO was full.
+    unsigned long long forced;
+
+    struct CapMergeSrc src[CAPMERGE_MAXSRC];
+    unsigned int nsrc;
+    unsigned int heap[CAPMERGE_MAXSRC];
+    unsigned int hlen;
+    long long watermark;
+    int pending;
+};
+
+/**
+ * @brief Creates an empty merge.
+ * @param latency Reorder latency in milliseconds, 0 selects CAPMERGE_LATENCY.
+ * @param __OUT__merge Pointer to the new CapMerge structure.
+ * @return Upon successful completion, capmerge_new() returns SPKSOCK_SUCCESS.
+ * Otherwise, a value < 0 shall be returned, you can use spark_strerror to get error message.
+ */
+int capmerge_new(unsigned int latency, struct CapMerge **merge);
+
+/**
+ * @brief Adds a source, live sockets are switched to non-blocking mode.
+ *
+ * The socket is not closed by capmerge_free.
+ * @param __IN__merge Pointer to CapMerge.
+ * @param __IN__ssock Pointer to SpkSock, live socket or capture file.
+ * @return On success returns the index of the source.
+ * If the merge already contains CAPMERGE_MAXSRC sources SPKSOCK_ESIZE is returned.
+ * Otherwise, a value < 0 shall be returned, you can use spark_strerror to get error message.
+ */
+int capmerge_add(struct CapMerge *merge, struct SpkSock *ssock);
+
+/**
+ * @brief Returns the next packet in timestamp order.
+ *
+ * Waits at most latency milliseconds for new packets.
+ * @param __IN__merge Pointer to CapMerge.
+ * @param __OUT__pkt Pointer to the first byte of the packet (valid until the next call).
+ * @param __OUT__ts Pointer to SpkTimeStamp (nanosecond precision), can be NULL.
+ * @param __OUT__src Index of the source, can be NULL.
+ * @return Captured length of the packet, 0 if no packet arrived within the latency.
+ * When all the sources are exhausted SPKSOCK_EOF is returned.
+ * If a source fails it is removed from the merge and the error is returned.
+ */
+int capmerge_next(struct CapMerge *merge, unsigned char **pkt, struct SpkTimeStamp *ts, int *src);
+
+/**
+ * @brief Frees the memory occupied by CapMerge.
+ * @param __IN__merge Pointer to CapMerge.
+ */
+void capmerge_free(struct CapMerge *merge);
+
+#endif
@@ -0,0 +1,178 @@
+/*
+ * Copyright (c) 2017 Jacopo De Luca
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+*/
+
+/**
+ * @file capring.h
+ * @brief Provides an in-memory pre-trigger capture buffer that is written to disk only when a trigger fires.
+ *
+ * Packets are stored in a fixed size byte ring already formatted as pcap (nanosecond) records, the oldest
+ * are evicted when they are older than the configured window or when the ring is full, so memory never
+ * grows beyond the budget given at creation.
+ * capring_trigger freezes the current content: a background thread writes it, followed by the packets
+ * received in the next `post` seconds, to a pcap file with plain write() calls straight from the ring.
+ * While the dump is in progress records not yet written cannot be evicted, if the ring fills up new packets
+ * are dropped (and counted) instead of blocking the capture thread.
+ *
+ * Example:
+ * @code
+ * struct CapRing *ring;
+ * capring_new(256 << 20, 30, spark_getltype(ssock), 0, &ring);
+ * for (;;) {
+ *     capring_feed(ring, ssock);
+ *     if (problem_detected())
+ *         capring_trigger(ring, "incident.pcap", 10);
+ * }
+ * @endcode
+ */
+
+#ifndef SPARK_CAPRING_H
+#define SPARK_CAPRING_H
+
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "spksock.h"
+
+#define CAPRING_MINSIZE     (1 << 20)   // Smallest budget accepted
+#define CAPRING_SNAPLEN     65535       // Default snapshot length
+#define CAPRING_RECLEN      16          // pcap record header
+
+/// @brief Dump state.
+enum CapRingState {
+    CAPRING_IDLE,
+    CAPRING_REQUEST,
+    CAPRING_DUMPING
+};
+
+/// @brief Buffer statistics.
+struct CapRingStats {
+    /// @brief Packets stored.
+    unsigned long packets;
+    /// @brief Packets evicted by window or budget.
+    unsigned long evicted;
+    /// @brief Packets dropped because the ring was full of records still to dump.
+    unsigned long dropped;
+    /// @brief Bytes currently held.
+    unsigned long long used;
+    /// @brief Highest number of bytes held.
+    unsigned long long peak;
+    /// @brief Completed dumps.
+    unsigned long dumps;
+    /// @brief Failed writes.
+    unsigned long errors;
+};
+
+/// @brief Contains the state of a pre-trigger buffer (this struct is private).
+struct CapRing {
+    unsigned char *mem;
+    unsigned long long size;
+    unsigned int window;
+    unsigned int snaplen;
+    int lktype;
+    unsigned char *scratch;
+    unsigned int scratchlen;
+    atomic_ullong head;
+    atomic_ullong tail;
+    atomic_ullong dump;
+    atomic_ullong dumpend;
+    atomic_int state;
+    atomic_bool stop;
+    char *path;
+    unsigned int post;
+    long until;
+    atomic_ulong packets;
+    atomic_ulong evicted;
+    atomic_ulong dropped;
+    atomic_ulong dumps;
+    atomic_ulong errors;
+    unsigned long long peak;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+};
+
+/**
+ * @brief Creates a pre-trigger buffer.
+ * @param budget Memory reserved for the packets and the read buffer of capring_feed (bytes, at least CAPRING_MINSIZE).
+ * @param window Seconds of traffic to keep, 0 keeps as much as the budget allows.
+ * @param lktype Link type of the packets (DLT value, see spark_getltype).
+ * @param snaplen Packets longer than snaplen are truncated, 0 selects CAPRING_SNAPLEN.
+ * @param __OUT__ring Pointer to the new CapRing structure.
+ * @return Upon successful completion, capring_new() returns SPKSOCK_SUCCESS.
+ * Otherwise, a value < 0 shall be returned, you can use spark_strerror to get error message.
+ */
+int capring_new(unsigned long long budget, unsigned int window, int lktype, unsigned int snaplen,
+                struct CapRing **ring);
+
+/**
+ * @brief Stores a packet, never blocks.
+ *
+ * Must be called always from the same thread (the capture thread).
+ * @param __IN__ring Pointer to CapRing.
+ * @param __IN__pkt Pointer to the packet.
+ * @param len Packet length.
+ * @param __IN__ts Pointer to SpkTimeStamp contains the packet timestamp, if NULL the current time is used.
+ * @return Number of bytes stored (record header included), 0 if the packet was dropped.
+ */
+unsigned int capring_add(struct CapRing *ring, unsigned char *pkt, unsigned int len, struct SpkTimeStamp *ts);
+
+/**
+ * @brief Reads all the packets available on a non-blocking socket and stores them.
+ * @param __IN__ring Pointer to CapRing.
+ * @param __IN__ssock Pointer to SpkSock.
+ * @return On success returns the number of packets read.
+ * Otherwise, a value < 0 shall be returned, you can use spark_strerror to get error message.
+ */
+int capring_feed(struct CapRing *ring, struct SpkSock *ssock);
+
+/**
+ * @brief Requests a dump of the buffered packets plus those received in the next `post` seconds.
+ *
+ * Can be called from any thread, the window is frozen when the next packet is stored.
+ * @param __IN__ring Pointer to CapRing.
+ * @param path Output pcap file.
+ * @param post Seconds of traffic to add after the trigger.
+ * @return SPKSOCK_SUCCESS if the dump has been scheduled, SPKSOCK_ERROR if another dump is in progress.
+ */
+int capring_trigger(struct CapRing *ring, char *path, unsigned int post);
+
+/**
+ * @brief Returns true if a dump is pending or in progress.
+ * @param __IN__ring Pointer to CapRing.
+ */
+bool capring_dumping(struct CapRing *ring);
+
+/**
+ * @brief Obtains buffer statistics.
+ * @param __IN__ring Pointer to CapRing.
+ * @param __OUT__stats Pointer to CapRingStats.
+ */
+void capring_stats(struct CapRing *ring, struct CapRingStats *stats);
+
+/**
+ * @brief Completes the dump in progress (if any) and frees the memory occupied by CapRing.
+ * @param __IN__ring Pointer to CapRing.
+ */
+void capring_free(struct CapRing *ring);
+
+#endif
@@ -30,6 +30,10 @@
 
 #include "datatype.h"
 
+/* UDP ports */
+#define DHCP_SERVER_PORT    67
+#define DHCP_CLIENT_PORT    68
+
 /* Values for OP field */
 #define DHCP_OP_BOOT_REQUEST    1
 #define DHCP_OP_BOOT_REPLY      2
@@ -52,6 +56,7 @@
 #define DHCP_SERVER_IDENTIFIER      54
 #define DHCP_PARAMETER_REQUEST_LIST 55
 #define DHCP_CLIENT_IDENTIFIER      61
+#define DHCP_RELAY_AGENT_INFO       82
 
 /* Parameter request list */
 #define DHCP_REQ_SUBMASK        1
@@ -71,6 +76,10 @@
 #define DHCP_RELEASE     7
 #define DHCP_INFORM      8
 
+/* Special options */
+#define DHCP_OPT_PAD    0x00
+#define DHCP_OPT_END    0xFF
+
 #define DHCPPKTSIZE     548
 #define DHCP_CHADDRLEN  (16)
 #define DHCP_SNAMELEN   (64)
@@ -113,6 +122,30 @@ struct DhcpPacket {
     unsigned char options[DHCP_OPTLEN];
 };
 
+/// @brief Parsed view of the DHCP options, every option is located in O(1) without allocations.
+struct DhcpOptView {
+    /// @brief Parsed message.
+    struct DhcpPacket *pkt;
+    /// @brief Offset + 1 of the first occurrence of each option in the options field, 0 if missing.
+    unsigned short offset[256];
+    /// @brief Option codes in order of appearance.
+    unsigned char codes[DHCP_OPTLEN / 2];
+    /// @brief Number of options.
+    unsigned short count;
+    /// @brief Offset of the END option.
+    unsigned short end;
+};
+
+/// @brief Appends options to a DHCP message keeping track of the END option.
+struct DhcpOptBuilder {
+    /// @brief Message under construction.
+    struct DhcpPacket *pkt;
+    /// @brief Offset of the END option.
+    unsigned short tail;
+    /// @brief Size of the options field.
+    unsigned short size;
+};
+
 /**
  * @brief Append the new option at the end of DHCP message.
  *
@@ -242,6 +275,7 @@ unsigned char dhcp_get_type(struct DhcpPacket *dhcp);
  * @param __IN__dhcpPkt Pointer to remote DHCP packet.
  * @param __OUT__len Length of options list.
  * @return On success this function returns an array with all options contained in the DHCP messge, otherwise NULL is returned.
+ * PAD options are skipped.
  * @warning The returned array doesn't contains the null terminator!
  */
 unsigned char *dhcp_get_options(struct DhcpPacket *dhcpPkt, unsigned int *len);
@@ -266,10 +300,102 @@ unsigned char dhcp_get_option_uchar(struct DhcpPacket *dhcpPkt, unsigned char op
  */
 unsigned char *dhcp_get_option_value(struct DhcpPacket *dhcpPkt, unsigned char option, unsigned int *len);
 
+/**
+ * @brief Appends the new option at the end of DHCP message in O(1).
+ *
+ * @param __IN__builder Pointer to DhcpOptBuilder.
+ * @param op Option.
+ * @param len Option length.
+ * @param __IN__payload Option payload.
+ * @return On success returns true, if there is not enough space at the end of the message, false is returned.
+ */
+bool dhcp_optbuild_append(struct DhcpOptBuilder *builder, unsigned char op, unsigned char len, unsigned char *payload);
+
+/**
+ * @brief Initializes the builder on a DHCP message, the options field is scanned once to find the END option.
+ *
+ * @param __OUT__builder Pointer to DhcpOptBuilder.
+ * @param __IN__dhcpPkt Pointer to remote DHCP packet (e.g. built with injects_dhcp_raw).
+ * @param optlen Size of the options field, 0 means DHCP_OPTLEN.
+ * @return On success returns true, if the options field is malformed or not terminated, false is returned.
+ */
+bool dhcp_optbuild_init(struct DhcpOptBuilder *builder, struct DhcpPacket *dhcpPkt, unsigned short optlen);
+
+/**
+ * @brief Obtains the length of the DHCP message, up to and including the END option.
+ *
+ * @param __IN__builder Pointer to DhcpOptBuilder.
+ * @return Message length in bytes.
+ */
+unsigned int dhcp_optbuild_len(struct DhcpOptBuilder *builder);
+
+/**
+ * @brief Obtains the value of DHCP option.
+ *
+ * @param __IN__view Pointer to DhcpOptView.
+ * @param option DHCP option.
+ * @param __OUT__len Option length, maybe NULL.
+ * @return Pointer to the option value inside the message, NULL if the option is missing.
+ */
+unsigned char *dhcp_optview_get(struct DhcpOptView *view, unsigned char option, unsigned char *len);
+
+/**
+ * @brief Checks if the DHCP message contains the option.
+ *
+ * @param __IN__view Pointer to DhcpOptView.
+ * @param option DHCP option.
+ * @return Function returns true if the option is present, false otherwise.
+ */
+bool dhcp_optview_has(struct DhcpOptView *view, unsigned char option);
+
+/**
+ * @brief Indexes all options of a DHCP message in a single pass.
+ *
+ * PAD options are skipped, only the first occurrence of repeated options is indexed.
+ * @param __OUT__view Pointer to DhcpOptView.
+ * @param __IN__dhcpPkt Pointer to remote DHCP packet.
+ * @param len Length of the whole DHCP message.
+ * @return On success returns true, if the message is truncated or malformed, false is returned.
+ */
+bool dhcp_optview_parse(struct DhcpOptView *view, struct DhcpPacket *dhcpPkt, unsigned int len);
+
+/**
+ * @brief Obtains DHCP message type.
+ *
+ * @param __IN__view Pointer to DhcpOptView.
+ * @return DHCP message type, 0 if missing.
+ */
+unsigned char dhcp_optview_type(struct DhcpOptView *view);
+
+/**
+ * @brief Obtains the uchar value of DHCP option.
+ *
+ * @param __IN__view Pointer to DhcpOptView.
+ * @param option DHCP option.
+ * @return On success this function returns the value of the DHCP option, otherwise 0 is returned.
+ */
+unsigned char dhcp_optview_uchar(struct DhcpOptView *view, unsigned char option);
+
+/**
+ * @brief Obtains the uint value of DHCP option (in network byte order, like dhcp_get_option_uint).
+ *
+ * @param __IN__view Pointer to DhcpOptView.
+ * @param option DHCP option.
+ * @return On success this function returns the value of the DHCP option, otherwise 0 is returned.
+ */
+unsigned int dhcp_optview_uint(struct DhcpOptView *view, unsigned char option);
+
 /**
  * @brief Obtains a random ID for DHCP message.
  * @return Random transaction ID.
  */
 unsigned int dhcp_mkxid();
 
+/**
+ * @brief Fills an array with random transaction IDs.
+ * @param __OUT__xids Pointer to array of transaction IDs.
+ * @param n Array length.
+ */
+void dhcp_mkxid_bulk(unsigned int *xids, unsigned int n);
+
 #endif
@@ -0,0 +1,218 @@
+/*
+ * Copyright (c) 2017 Jacopo De Luca
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+*/
+
+/**
+ * @file dhcpfleet.h
+ * @brief Provides a DHCP client simulator for load testing DHCP servers.
+ *
+ * A fleet drives thousands of DHCP clients (DORA, renew, release) over a single SpkSock from one thread,
+ * every client has its own random hardware address. Replies are dispatched to clients through a hash table
+ * keyed by transaction ID, retransmissions use an exponential backoff scheduled on a timer wheel.
+ * For more throughput run one fleet (with its own socket) per thread.
+ */
+
+#ifndef SPARK_DHCPFLEET_H
+#define SPARK_DHCPFLEET_H
+
+#include <stdbool.h>
+
+#include "datatype.h"
+#include "spksock.h"
+#include "ethernet.h"
+#include "ipv4.h"
+#include "dhcp.h"
+#include "timerwheel.h"
+
+#define DHCPFLEET_DEFPPS        1000    // New clients started per second
+#define DHCPFLEET_DEFTIMEOUT    1000    // Milliseconds before the first retransmission
+#define DHCPFLEET_MAXTIMEOUT    64000   // Backoff limit (RFC 2131)
+#define DHCPFLEET_DEFTRIES      4       // Transmissions before giving up
+#define DHCPFLEET_HISTBUCKETS   32
+
+/// @brief Client states (RFC 2131).
+enum DhcpClientState {
+    DHCPCL_INIT,
+    DHCPCL_SELECTING,   // DISCOVER sent
+    DHCPCL_REQUESTING,  // REQUEST sent after OFFER
+    DHCPCL_BOUND,
+    DHCPCL_RENEWING,    // REQUEST sent to the server to extend the lease
+    DHCPCL_RELEASED,
+    DHCPCL_FAILED       // No answer after max_tries transmissions
+};
+
+/// @brief Phases measured by the fleet.
+enum DhcpFleetPhase {
+    DHCPPH_DISCOVER,    // DISCOVER -> OFFER
+    DHCPPH_REQUEST,     // REQUEST -> ACK
+    DHCPPH_DORA,        // First DISCOVER -> ACK, retransmissions included
+    DHCPPH_RENEW,       // REQUEST -> ACK while renewing
+    DHCPPH_COUNT
+};
+
+/// @brief Latency histogram, bucket n counts samples in [2^(n-1), 2^n) microseconds.
+struct DhcpHistogram {
+    unsigned long buckets[DHCPFLEET_HISTBUCKETS];
+    /// @brief Number of samples.
+    unsigned long count;
+    /// @brief Sum of samples in microseconds.
+    unsigned long long sum;
+    /// @brief Smallest sample in microseconds.
+    unsigned long min;
+    /// @brief Largest sample in microseconds.
+    unsigned long max;
+};
+
+/// @brief Simulated client.
+struct DhcpClient {
+    struct TimerNode timer;
+    /// @brief Client hardware address.
+    struct netaddr_mac mac;
+    /// @brief Current state.
+    enum DhcpClientState state;
+    /// @brief Current transaction ID.
+    unsigned int xid;
+    /// @brief Leased address.
+    struct netaddr_ip yiaddr;
+    /// @brief Server identifier.
+    struct netaddr_ip server;
+    /// @brief Server hardware address.
+    struct netaddr_mac server_mac;
+    /// @brief Lease time in seconds.
+    unsigned int lease;
+    /// @brief Transmissions of the current message.
+    unsigned char tries;
+    /// @brief Current retransmission timeout (ms).
+    unsigned int rto;
+    /// @brief Time the current phase started (ns).
+    unsigned long long phase_start;
+    /// @brief Time the DORA started (ns).
+    unsigned long long dora_start;
+    /// @brief Time of the first binding of the lease (ms).
+    unsigned long long bound_at;
+    struct DhcpClient *next;
+};
+
+/// @brief Fleet statistics.
+struct DhcpFleetStats {
+    unsigned long discovers;
+    unsigned long offers;
+    unsigned long requests;
+    unsigned long acks;
+    unsigned long naks;
+    unsigned long releases;
+    /// @brief Retransmissions.
+    unsigned long retrans;
+    /// @brief Clients that gave up.
+    unsigned long failed;
+    /// @brief Replies that did not match any client.
+    unsigned long unmatched;
+};
+
+/// @brief Contains the fleet settings and state.
+struct DhcpFleet {
+    /// @brief Socket used for sending and receiving.
+    struct SpkSock *ssock;
+    /// @brief Clients.
+    struct DhcpClient *clients;
+    /// @brief Number of clients.
+    unsigned int nclients;
+    /// @brief New clients started per second, 0 means no limit.
+    unsigned int pps;
+    /// @brief Milliseconds before the first retransmission.
+    unsigned int timeout;
+    /// @brief Transmissions before giving up.
+    unsigned char max_tries;
+    /// @brief Asks the server to broadcast the replies.
+    bool broadcast;
+    /// @brief Milliseconds after binding before renewing, 0 means at T1 (half lease, never for an infinite lease), no
+    /// renew if `renew` is false.
+    unsigned int renew_after;
+    /// @brief Renews the lease.
+    bool renew;
+    /// @brief Milliseconds after binding before releasing, 0 means never.
+    unsigned int release_after;
+    /// @brief Called when a client enters the BOUND state.
+    void (*on_bound)(struct DhcpClient *client, void *arg);
+    /// @brief Argument of on_bound.
+    void *arg;
+    /// @brief Number of clients in the BOUND state.
+    unsigned int bound;
+    /// @brief Statistics.
+    struct DhcpFleetStats stats;
+    /// @brief Latency histograms (DhcpFleetPhase).
+    struct DhcpHistogram hist[DHCPPH_COUNT];
+
+    struct DhcpClient **xids;
+    unsigned int mask;
+    unsigned int next_start;
+    struct TimerWheel wheel;
+    double tokens;
+    unsigned long long last_refill;
+    unsigned char *txbuf;
+    unsigned char **bufs;
+    unsigned int *lens;
+    unsigned int ntx;
+    unsigned char *rxbuf;
+};
+
+/**
+ * @brief Checks if the fleet has nothing more to do: all clients started and no pending timers.
+ * @param __IN__fleet Pointer to DhcpFleet.
+ * @return Function returns true if there is no more work, false otherwise.
+ */
+bool dhcpfleet_done(struct DhcpFleet *fleet);
+
+/**
+ * @brief Returns the latency under which the `p` fraction of samples lies (upper bound of the bucket).
+ * @param __IN__hist Pointer to DhcpHistogram.
+ * @param p Fraction between 0 and 1 (e.g. 0.99).
+ * @return Latency in microseconds.
+ */
+unsigned long dhcpfleet_percentile(struct DhcpHistogram *hist, double p);
+
+/**
+ * @brief Performs a fleet iteration: starts new clients allowed by the rate, waits up to `timeout` milliseconds
+ * for replies, processes them and fires the expired timers.
+ * @param __IN__fleet Pointer to DhcpFleet.
+ * @param timeout Max wait in milliseconds.
+ * @return On success returns the number of clients bound in this iteration.
+ * Otherwise, a value < 0 shall be returned, you can use spark_strerror to get error message.
+ */
+int dhcpfleet_poll(struct DhcpFleet *fleet, int timeout);
+
+/**
+ * @brief Allocates a new fleet of clients with random hardware addresses.
+ *
+ * The socket is switched to non-blocking and promiscuous mode (replies are addressed to the simulated clients).
+ * @param __IN__ssock Pointer to SpkSock structure which handles the active raw socket.
+ * @param nclients Number of clients.
+ * @return On success returns the pointer to new DhcpFleet, otherwise return NULL.
+ */
+struct DhcpFleet *dhcpfleet_new(struct SpkSock *ssock, unsigned int nclients);
+
+/**
+ * @brief Frees the memory occupied by DhcpFleet, no release is sent.
+ * @param __IN__fleet Pointer to DhcpFleet.
+ */
+void dhcpfleet_free(struct DhcpFleet *fleet);
+
+#endif
@@ -0,0 +1,187 @@
+/*
+ * Copyright (c) 2017 Jacopo De Luca
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+*/
+
+/**
+ * @file dhcprelay.h
+ * @brief Provides a DHCP relay agent (RFC 1542, RFC 3046).
+ *
+ * Client broadcasts received on the client side are forwarded to every configured server: hops and giaddr
+ * are rewritten in place, the Relay Agent Information option (82) is added and all checksums are updated
+ * incrementally. Server replies are stripped of option 82 and delivered to the client.
+ * Frames are processed in batches using preallocated buffers, nothing is allocated per message.
+ *
+ * Example:
+ * @code
+ * struct DhcpRelay *relay = dhcprelay_new(lan, &lanip, wan, &wanip, &gwmac);
+ * dhcprelay_addserver(relay, &server);
+ * for (;;)
+ *     dhcprelay_poll(relay, 100);
+ * @endcode
+ */
+
+#ifndef SPARK_DHCPRELAY_H
+#define SPARK_DHCPRELAY_H
+
+#include <stdbool.h>
+
+#include "datatype.h"
+#include "spksock.h"
+#include "ethernet.h"
+#include "ipv4.h"
+#include "udp.h"
+#include "dhcp.h"
+
+#define DHCPRELAY_MAXSERVERS    8
+#define DHCPRELAY_MAXHOPS       16      // RFC 1542 4.1.1
+#define DHCPRELAY_AGENTMAX      255     // Max length of option 82 (code and length included)
+#define DHCPRELAY_BATCH         32
+
+#define DHCPRELAY_CIRCUITID     1       // Agent Circuit ID sub-option
+#define DHCPRELAY_REMOTEID      2       // Agent Remote ID sub-option
+
+/// @brief Relay statistics.
+struct DhcpRelayStats {
+    /// @brief Messages received from clients.
+    unsigned long requests;
+    /// @brief Messages received from servers.
+    unsigned long replies;
+    /// @brief Frames sent to servers.
+    unsigned long forwarded;
+    /// @brief Frames sent to clients.
+    unsigned long relayed;
+    /// @brief Messages dropped because the hop count limit is reached.
+    unsigned long hops;
+    /// @brief Messages dropped because they contain option 82 but no giaddr (RFC 3046 2.1).
+    unsigned long untrusted;
+    /// @brief Messages dropped because they are malformed or not for us.
+    unsigned long dropped;
+};
+
+/// @brief Contains the relay settings and state.
+struct DhcpRelay {
+    /// @brief Socket connected to the clients network.
+    struct SpkSock *cside;
+    /// @brief Relay address on the clients network (giaddr).
+    struct netaddr_ip giaddr;
+    /// @brief Socket connected to the servers network, maybe the same of `cside`.
+    struct SpkSock *sside;
+    /// @brief Relay address on the servers network.
+    struct netaddr_ip saddr;
+    /// @brief Hardware address of the next hop towards the servers.
+    struct netaddr_mac nexthop;
+    /// @brief DHCP servers.
+    struct netaddr_ip servers[DHCPRELAY_MAXSERVERS];
+    /// @brief Number of servers.
+    unsigned int nservers;
+    /// @brief Messages with hops >= max_hops are dropped.
+    unsigned char max_hops;
+    /// @brief Forwards client messages containing option 82 even if giaddr is 0.
+    bool trusted;
+    /// @brief Statistics.
+    struct DhcpRelayStats stats;
+
+    unsigned char agentopt[DHCPRELAY_AGENTMAX];
+    unsigned int agentlen;
+    unsigned int slotlen;
+    unsigned char *txbuf;
+    unsigned char *sbufs[DHCPRELAY_BATCH];
+    unsigned int slens[DHCPRELAY_BATCH];
+    unsigned int nstx;
+    unsigned char *cbufs[DHCPRELAY_BATCH];
+    unsigned int clens[DHCPRELAY_BATCH];
+    unsigned int nctx;
+    unsigned char *rxbuf;
+};
+
+/**
+ * @brief Adds a DHCP server, client messages are forwarded to all servers.
+ * @param __IN__relay Pointer to DhcpRelay.
+ * @param __IN__server Pointer to netaddr_ip structure contains the server address.
+ * @return Function returns true if the server has been added, false if the servers table is full.
+ */
+bool dhcprelay_addserver(struct DhcpRelay *relay, struct netaddr_ip *server);
+
+/**
+ * @brief Sets the sub-options of the Relay Agent Information option added to client messages.
+ *
+ * By default the Circuit ID is the name of the client side interface.
+ * If both are NULL, option 82 is not added.
+ * @param __IN__relay Pointer to DhcpRelay.
+ * @param __IN__circuit Agent Circuit ID, maybe NULL.
+ * @param clen Circuit ID length.
+ * @param __IN__remote Agent Remote ID, maybe NULL.
+ * @param rlen Remote ID length.
+ * @return Function returns true if the option has been set, false if it is too long.
+ */
+bool dhcprelay_agentinfo(struct DhcpRelay *relay, unsigned char *circuit, unsigned char clen, unsigned char *remote,
+                         unsigned char rlen);
+
+/**
+ * @brief Sends the queued frames.
+ * @param __IN__relay Pointer to DhcpRelay.
+ * @return On success returns the number of frames sent.
+ * Otherwise, a value < 0 shall be returned, you can use spark_strerror to get error message.
+ */
+int dhcprelay_flush(struct DhcpRelay *relay);
+
+/**
+ * @brief Processes a frame received on either side and queues the relayed frames.
+ *
+ * Use it when the frames are read by your own loop instead of dhcprelay_poll, call dhcprelay_flush afterwards.
+ * @param __IN__relay Pointer to DhcpRelay.
+ * @param __IN__frame Pointer to Ethernet frame.
+ * @param len Frame length.
+ * @return Function returns the number of frames queued.
+ */
+unsigned int dhcprelay_input(struct DhcpRelay *relay, unsigned char *frame, unsigned int len);
+
+/**
+ * @brief Performs a relay iteration: waits up to `timeout` milliseconds for messages, relays them in batches.
+ * @param __IN__relay Pointer to DhcpRelay.
+ * @param timeout Max wait in milliseconds.
+ * @return On success returns the number of frames sent.
+ * Otherwise, a value < 0 shall be returned, you can use spark_strerror to get error message.
+ */
+int dhcprelay_poll(struct DhcpRelay *relay, int timeout);
+
+/**
+ * @brief Allocates a new DHCP relay agent.
+ *
+ * Both sockets are set in non-blocking mode and only incoming frames are received.
+ * @param __IN__cside Pointer to SpkSock structure connected to the clients network.
+ * @param __IN__giaddr Pointer to netaddr_ip structure contains the relay address on the clients network.
+ * @param __IN__sside Pointer to SpkSock structure connected to the servers network, maybe equal to `cside`.
+ * @param __IN__saddr Pointer to netaddr_ip structure contains the relay address on the servers network.
+ * @param __IN__nexthop Pointer to netaddr_mac structure contains the hardware address of the next hop towards
+ * the servers.
+ * @return On success returns the pointer to new DhcpRelay, otherwise return NULL.
+ */
+struct DhcpRelay *dhcprelay_new(struct SpkSock *cside, struct netaddr_ip *giaddr, struct SpkSock *sside,
+                                struct netaddr_ip *saddr, struct netaddr_mac *nexthop);
+
+/**
+ * @brief Frees the memory occupied by DhcpRelay.
+ * @param __IN__relay Pointer to DhcpRelay.
+ */
+void dhcprelay_free(struct DhcpRelay *relay);
+
+#endif
@@ -0,0 +1,205 @@
+/*
+ * Copyright (c) 2017 Jacopo De Luca
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+*/
+
+/**
+ * @file dhcpserver.h
+ * @brief Provides a lightweight DHCP server for lab and provisioning networks.
+ *
+ * Leases are stored in an array indexed by address (offset in the pool), which can be backed by a
+ * memory mapped file: after a restart the table is available as soon as the file is mapped.
+ * Clients are found through a hash on chaddr, free addresses through a bitmap.
+ * Replies are built by patching precomputed OFFER, ACK and NAK frames and are sent in batches.
+ * DHCPINFORM is not supported.
+ */
+
+#ifndef SPARK_DHCPSERVER_H
+#define SPARK_DHCPSERVER_H
+
+#include <stdbool.h>
+
+#include "datatype.h"
+#include "spksock.h"
+#include "ethernet.h"
+#include "ipv4.h"
+#include "udp.h"
+#include "dhcp.h"
+
+#define DHCPSRV_DEFLEASE    3600    // Lease time in seconds
+#define DHCPSRV_DEFOFFER    30      // Seconds an offered address is reserved
+#define DHCPSRV_DEFDECLINE  600     // Seconds a declined address is not used
+#define DHCPSRV_MAXDNS      4
+#define DHCPSRV_BATCH       32
+#define DHCPSRV_MAXPOOL     (1 << 24)
+
+/// @brief Lease states.
+enum DhcpLeaseState {
+    DHCPLEASE_FREE,
+    DHCPLEASE_OFFERED,
+    DHCPLEASE_BOUND,
+    DHCPLEASE_DECLINED, // Address in use by someone else
+    DHCPLEASE_RESERVED  // Never assigned (e.g. server address)
+};
+
+/// @brief Lease record, this is the format of the lease file.
+struct DhcpLease {
+    /// @brief Client hardware address.
+    unsigned char chaddr[ETHHWASIZE];
+    /// @brief Lease state (DhcpLeaseState).
+    unsigned char state;
+    unsigned char unused;
+    /// @brief Expiration time (seconds since the Epoch).
+    unsigned int expires;
+};
+
+/// @brief Server statistics.
+struct DhcpServerStats {
+    unsigned long discovers;
+    unsigned long requests;
+    unsigned long releases;
+    unsigned long declines;
+    unsigned long offers;
+    unsigned long acks;
+    unsigned long naks;
+    /// @brief DISCOVER not answered because the pool is exhausted.
+    unsigned long exhausted;
+    /// @brief Messages ignored (malformed, not for us, unsupported).
+    unsigned long ignored;
+};
+
+/// @brief Contains the server settings and state.
+struct DhcpServer {
+    /// @brief Socket used for sending and receiving.
+    struct SpkSock *ssock;
+    /// @brief Server hardware address.
+    struct netaddr_mac hwaddr;
+    /// @brief Server IPv4 address (server identifier).
+    struct netaddr_ip ipaddr;
+    /// @brief Subnet mask option.
+    struct netaddr_ip netmask;
+    /// @brief Router option, omitted if 0.
+    struct netaddr_ip router;
+    /// @brief DNS servers option.
+    struct netaddr_ip dns[DHCPSRV_MAXDNS];
+    /// @brief Number of DNS servers.
+    unsigned int ndns;
+    /// @brief Lease time in seconds.
+    unsigned int lease_time;
+    /// @brief Seconds an offered address is reserved.
+    unsigned int offer_time;
+    /// @brief Seconds a declined address is not used.
+    unsigned int decline_time;
+    /// @brief First address of the pool (host byte order).
+    unsigned int first;
+    /// @brief Number of addresses in the pool.
+    unsigned int count;
+    /// @brief Number of available addresses.
+    unsigned int available;
+    /// @brief Statistics.
+    struct DhcpServerStats stats;
+
+    struct DhcpLease *leases;
+    void *map;
+    unsigned long maplen;
+    int fd;
+    unsigned long long *bitmap;
+    unsigned int cursor;
+    unsigned int *buckets;
+    unsigned int *chain;
+    unsigned int mask;
+    bool ready;
+    unsigned char tmpl_offer[ETHHDRSIZE + IPV4HDRSIZE + UDPHDRSIZE + DHCPPKTSIZE];
+    unsigned char tmpl_ack[ETHHDRSIZE + IPV4HDRSIZE + UDPHDRSIZE + DHCPPKTSIZE];
+    unsigned char tmpl_nak[ETHHDRSIZE + IPV4HDRSIZE + UDPHDRSIZE + DHCPPKTSIZE];
+    unsigned short tmpl_len[3];
+    unsigned char *txbuf;
+    unsigned char *bufs[DHCPSRV_BATCH];
+    unsigned int lens[DHCPSRV_BATCH];
+    unsigned int ntx;
+    unsigned char *rxbuf;
+};
+
+/**
+ * @brief Sends the queued replies.
+ * @param __IN__srv Pointer to DhcpServer.
+ * @return On success returns the number of replies sent.
+ * Otherwise, a value < 0 shall be returned, you can use spark_strerror to get error message.
+ */
+int dhcpserver_flush(struct DhcpServer *srv);
+
+/**
+ * @brief Processes a frame and queues the reply, if any.
+ *
+ * Use it when the frames are read by your own loop instead of dhcpserver_poll, call dhcpserver_flush afterwards.
+ * @param __IN__srv Pointer to DhcpServer.
+ * @param __IN__frame Pointer to Ethernet frame.
+ * @param len Frame length.
+ * @return Function returns true if a reply was queued, false otherwise.
+ */
+bool dhcpserver_input(struct DhcpServer *srv, unsigned char *frame, unsigned int len);
+
+/**
+ * @brief Returns the lease of an address.
+ * @param __IN__srv Pointer to DhcpServer.
+ * @param __IN__ip Pointer to netaddr_ip structure contains the address.
+ * @return Pointer to the lease, NULL if the address is outside the pool.
+ */
+struct DhcpLease *dhcpserver_lease(struct DhcpServer *srv, struct netaddr_ip *ip);
+
+/**
+ * @brief Performs a server iteration: waits up to `timeout` milliseconds for requests, answers them in batches.
+ *
+ * Settings must not change after the first call.
+ * @param __IN__srv Pointer to DhcpServer.
+ * @param timeout Max wait in milliseconds.
+ * @return On success returns the number of replies sent.
+ * Otherwise, a value < 0 shall be returned, you can use spark_strerror to get error message.
+ */
+int dhcpserver_poll(struct DhcpServer *srv, int timeout);
+
+/**
+ * @brief Allocates a new DHCP server.
+ *
+ * If `leasefile` is not NULL, the lease table is memory mapped from it: existing leases are kept if the file
+ * describes the same pool, otherwise the file is reinitialized.
+ * @param __IN__ssock Pointer to SpkSock structure which handles the active raw socket.
+ * @param __IN__ipaddr Pointer to netaddr_ip structure contains the server address.
+ * @param __IN__first Pointer to netaddr_ip structure contains the first address of the pool.
+ * @param __IN__last Pointer to netaddr_ip structure contains the last address of the pool.
+ * @param __IN__leasefile Path of the lease file, maybe NULL.
+ * @return On success returns the pointer to new DhcpServer, otherwise return NULL.
+ */
+struct DhcpServer *dhcpserver_new(struct SpkSock *ssock, struct netaddr_ip *ipaddr, struct netaddr_ip *first,
+                                  struct netaddr_ip *last, char *leasefile);
+
+/**
+ * @brief Schedules the write of the lease file to disk.
+ * @param __IN__srv Pointer to DhcpServer.
+ */
+void dhcpserver_sync(struct DhcpServer *srv);
+
+/**
+ * @brief Frees the memory occupied by DhcpServer, the lease file is synced and unmapped.
+ * @param __IN__srv Pointer to DhcpServer.
+ */
+void dhcpserver_free(struct DhcpServer *srv);
+
+#endif
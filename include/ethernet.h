@@ -182,4 +182,13 @@ void build_ethmulti_addr(struct netaddr_mac *mac, struct netaddr_ip *ip);
  */
 void rndmac(struct netaddr_mac *mac);
 
+/**
+ * @brief Fills an array with random mac addresses.
+ *
+ * The mac addresses returned are never broadcast or multicast addresses!
+ * @param __OUT__macs Pointer to array of netaddr_mac structures.
+ * @param n Array length.
+ */
+void rndmac_bulk(struct netaddr_mac *macs, unsigned int n);
+
 #endif
@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2017 Jacopo De Luca
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+*/
+
+/**
+ * @file flow.h
+ * @brief Provides a minimal dissector that extracts the IPv4 5-tuple of a packet and direction-insensitive
+ * flow hashing.
+ */
+
+#ifndef SPARK_FLOW_H
+#define SPARK_FLOW_H
+
+#include <stdbool.h>
+
+#include "datatype.h"
+
+#define FLOW_MAXVLAN    2   // Stacked VLAN tags skipped by the dissector
+
+/// @brief IPv4 5-tuple, addresses and ports are in network byte order.
+struct FlowKey {
+    unsigned int saddr;
+    unsigned int daddr;
+    /// @brief Source port (0 for protocols without ports and non-first fragments).
+    unsigned short sport;
+    /// @brief Destination port (0 for protocols without ports and non-first fragments).
+    unsigned short dport;
+    unsigned char proto;
+    unsigned char pad[3];
+};
+
+/**
+ * @brief Extracts the 5-tuple of the packet.
+ *
+ * Supports DLT_EN10MB (with up to FLOW_MAXVLAN VLAN tags), DLT_LINUX_SLL, DLT_RAW, DLT_NULL and DLT_LOOP;
+ * ports are read for TCP, UDP and SCTP.
+ * @param __IN__pkt Pointer to the packet.
+ * @param len Captured length.
+ * @param lktype Link type (DLT value).
+ * @param __OUT__key Pointer to FlowKey.
+ * @return true if the packet contains an IPv4 header, false otherwise.
+ */
+bool flow_dissect(unsigned char *pkt, unsigned int len, int lktype, struct FlowKey *key);
+
+/**
+ * @brief Compares two keys ignoring the direction.
+ * @param __IN__k1 Pointer to first FlowKey.
+ * @param __IN__k2 Pointer to second FlowKey.
+ * @return true if k1 and k2 describe the same flow (in either direction), false otherwise.
+ */
+bool flow_equal(struct FlowKey *k1, struct FlowKey *k2);
+
+/**
+ * @brief Computes a direction-insensitive hash, both directions of a flow give the same value.
+ * @param __IN__key Pointer to FlowKey.
+ * @return 32 bit hash.
+ */
+unsigned int flow_hash(struct FlowKey *key);
+
+/**
+ * @brief Orders the endpoints of the key (lower address/port as source), so both directions give the same key.
+ * @param __IN__key Pointer to FlowKey.
+ */
+void flow_canonical(struct FlowKey *key);
+
+#endif
@@ -0,0 +1,207 @@
+/*
+ * Copyright (c) 2017 Jacopo De Luca
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+*/
+
+/**
+ * @file icmpprobe.h
+ * @brief Provides an engine for sending ICMP echo requests to many hosts concurrently.
+ *
+ * Outstanding requests are identified by the (id, sqn) pair of the IcmpHeader echo union: every engine uses
+ * its own id and the sequence number indexes the table of in-flight probes, timeouts are tracked by a timer wheel.
+ * Requests are paced and sent in batches, RTTs are computed from the kernel receive timestamp.
+ *
+ * @code
+ * struct IcmpProbe *probe = icmpprobe_new(ssock, &src, &gwmac);
+ * probe->on_result = print_result;
+ * for (...)
+ *     icmpprobe_add(probe, &target, NULL);
+ * while (!icmpprobe_done(probe))
+ *     icmpprobe_poll(probe, 10);
+ * @endcode
+ */
+
+#ifndef SPARK_ICMPPROBE_H
+#define SPARK_ICMPPROBE_H
+
+#include <stdbool.h>
+
+#include "datatype.h"
+#include "spksock.h"
+#include "ethernet.h"
+#include "ipv4.h"
+#include "icmp4.h"
+#include "timerwheel.h"
+
+#define ICMPPROBE_DEFPPS        10000   // Requests per second
+#define ICMPPROBE_DEFTIMEOUT    1000    // Milliseconds before a request is considered lost
+#define ICMPPROBE_DEFPAYLOAD    56      // Bytes of payload
+#define ICMPPROBE_DEFBATCH      32      // Requests per batch
+#define ICMPPROBE_MAXPAYLOAD    1472
+#define ICMPPROBE_MAXOUT        65535   // Limited by the sequence number
+
+/// @brief Probe outcome.
+enum IcmpProbeStatus {
+    ICMPPROBE_REPLY,        // Echo reply received
+    ICMPPROBE_UNREACHABLE,  // Destination unreachable received
+    ICMPPROBE_TIMEOUT       // No answer
+};
+
+/// @brief Result of a single probe.
+struct IcmpProbeResult {
+    /// @brief Probed address.
+    struct netaddr_ip target;
+    /// @brief Address that sent the answer (the target or a router for ICMPPROBE_UNREACHABLE).
+    struct netaddr_ip from;
+    /// @brief Probe outcome.
+    enum IcmpProbeStatus status;
+    /// @brief ICMP code of the answer.
+    unsigned char code;
+    /// @brief TTL of the answer.
+    unsigned char ttl;
+    /// @brief Sequence number used by the probe.
+    unsigned short sqn;
+    /// @brief Round trip time in nanoseconds (0 on timeout).
+    unsigned long rtt;
+    /// @brief Kernel receive timestamp of the answer.
+    struct SpkTimeStamp ts;
+    /// @brief User data passed to icmpprobe_add.
+    void *udata;
+};
+
+/// @brief In-flight request.
+struct IcmpProbeSlot {
+    struct TimerNode timer;
+    struct netaddr_ip target;
+    unsigned long long sent;
+    void *udata;
+    bool busy;
+};
+
+/// @brief Queued target.
+struct IcmpProbeTarget {
+    struct netaddr_ip ip;
+    void *udata;
+};
+
+/// @brief Engine statistics.
+struct IcmpProbeStats {
+    /// @brief Requests sent.
+    unsigned long sent;
+    /// @brief Echo replies matched.
+    unsigned long replies;
+    /// @brief Destination unreachable matched.
+    unsigned long unreachable;
+    /// @brief Requests timed out.
+    unsigned long timeouts;
+    /// @brief Echo replies that did not match any in-flight request (e.g. arrived after timeout).
+    unsigned long unmatched;
+};
+
+/// @brief Contains the engine settings and state.
+struct IcmpProbe {
+    /// @brief Socket used for sending and receiving.
+    struct SpkSock *ssock;
+    /// @brief Source hardware address.
+    struct netaddr_mac hwaddr;
+    /// @brief Next hop hardware address.
+    struct netaddr_mac nexthop;
+    /// @brief Source IPv4 address.
+    struct netaddr_ip ipaddr;
+    /// @brief ICMP identifier used by this engine.
+    unsigned short id;
+    /// @brief Time to live of the requests.
+    unsigned char ttl;
+    /// @brief Requests per second, 0 means no limit.
+    unsigned int pps;
+    /// @brief Milliseconds before a request is considered lost.
+    unsigned int timeout;
+    /// @brief Max number of in-flight requests.
+    unsigned int max_outstanding;
+    /// @brief Bytes of payload (applied to the next requests).
+    unsigned short payload;
+    /// @brief Called for every completed probe.
+    void (*on_result)(struct IcmpProbeResult *result, void *arg);
+    /// @brief Argument of on_result.
+    void *arg;
+    /// @brief Statistics.
+    struct IcmpProbeStats stats;
+    /// @brief Number of in-flight requests.
+    unsigned int outstanding;
+
+    struct IcmpProbeSlot *slots;
+    unsigned short next_sqn;
+    struct IcmpProbeTarget *queue;
+    unsigned int qhead;
+    unsigned int qlen;
+    unsigned int qcap;
+    struct TimerWheel wheel;
+    double tokens;
+    unsigned long long last_refill;
+    unsigned char *frames;
+    unsigned char *rxbuf;
+};
+
+/**
+ * @brief Checks if all queued targets have been probed and answered (or timed out).
+ * @param __IN__probe Pointer to IcmpProbe.
+ * @return Function returns true if there is no more work, false otherwise.
+ */
+bool icmpprobe_done(struct IcmpProbe *probe);
+
+/**
+ * @brief Queues a target, it will be probed by the next calls to icmpprobe_poll.
+ *
+ * A target can be queued many times, every time produces a distinct result.
+ * @param __IN__probe Pointer to IcmpProbe.
+ * @param __IN__target Pointer to netaddr_ip structure contains the target address.
+ * @param udata User data returned with the result.
+ * @return On success returns true, otherwise false is returned.
+ */
+bool icmpprobe_add(struct IcmpProbe *probe, struct netaddr_ip *target, void *udata);
+
+/**
+ * @brief Performs an engine iteration: sends the requests allowed by the rate, waits up to `timeout`
+ * milliseconds for answers, processes them and expires lost requests.
+ * @param __IN__probe Pointer to IcmpProbe.
+ * @param timeout Max wait in milliseconds.
+ * @return On success returns the number of results delivered.
+ * Otherwise, a value < 0 shall be returned, you can use spark_strerror to get error message.
+ */
+int icmpprobe_poll(struct IcmpProbe *probe, int timeout);
+
+/**
+ * @brief Allocates a new ICMP probing engine.
+ *
+ * The socket is switched to non-blocking mode and nanosecond timestamps (if supported).
+ * @param __IN__ssock Pointer to SpkSock structure which handles the active raw socket.
+ * @param __IN__src Pointer to netaddr_ip structure contains the source address.
+ * @param __IN__nexthop Pointer to netaddr_mac structure contains the hardware address of the next hop.
+ * @return On success returns the pointer to new IcmpProbe, otherwise return NULL.
+ */
+struct IcmpProbe *icmpprobe_new(struct SpkSock *ssock, struct netaddr_ip *src, struct netaddr_mac *nexthop);
+
+/**
+ * @brief Frees the memory occupied by IcmpProbe, in-flight requests are discarded.
+ * @param __IN__probe Pointer to IcmpProbe.
+ */
+void icmpprobe_free(struct IcmpProbe *probe);
+
+#endif
@@ -143,6 +143,17 @@ bool get_device_netmask(char *iface_name, struct netaddr_ip *netmask);
  */
 bool parse_ipv4addr(char *ipstr, unsigned int *ip);
 
+/**
+ * @brief Parse string contains a ipv4 network in the form `000.000.000.000/00`.
+ *
+ * If the prefix length is omitted, the string is treated as a single host (/32).
+ * @param cidrstr String contains ipv4 network in the form `000.000.000.000/00`.
+ * @param __OUT__ip Pointer to netaddr_ip structure, the host bits are cleared.
+ * @param __OUT__prefix Pointer to prefix length.
+ * @return Function returns true if the network has been converted, false otherwise.
+ */
+bool parse_ipv4cidr(char *cidrstr, struct netaddr_ip *ip, unsigned char *prefix);
+
 /**
  * @brief Obtains ipv4 address in the form `000.000.000.000`.
  * @param __IN__ip Pointer to integer(32bit) contains IPv4.
@@ -200,12 +211,60 @@ struct Ipv4Header *injects_ipv4_header(unsigned char *buf, struct netaddr_ip *sr
  */
 unsigned short ipv4_checksum(struct Ipv4Header *ipHeader);
 
+/**
+ * @brief Computes the one's complement sum of a buffer, without folding nor complementing it.
+ *
+ * The buffer must start at an even offset from the beginning of the checksummed data,
+ * an odd trailing byte is padded with zero.
+ * @param __IN__buf Pointer to bufer.
+ * @param len Bufer length.
+ * @param sum Partial sum of the previous data, 0 to start.
+ * @return The function returns the partial sum.
+ */
+unsigned int ipv4_csum_partial(void *buf, unsigned int len, unsigned int sum);
+
+/**
+ * @brief Updates a checksum after a region of the data changed (RFC 1624).
+ * @param check Old checksum.
+ * @param oldsum Partial sum of the region before the change, see ipv4_csum_partial.
+ * @param newsum Partial sum of the region after the change, see ipv4_csum_partial.
+ * @return The function returns the new checksum.
+ */
+unsigned short ipv4_csum_update(unsigned short check, unsigned int oldsum, unsigned int newsum);
+
+/**
+ * @brief Updates a checksum after a 16 bit field changed from `old` to `new` (RFC 1624).
+ *
+ * Values are used as they are stored in the packet, no byte order conversion is needed.
+ * @param check Old checksum.
+ * @param old Old value of the field.
+ * @param new New value of the field.
+ * @return The function returns the new checksum.
+ */
+unsigned short ipv4_csum_update16(unsigned short check, unsigned short old, unsigned short new);
+
+/**
+ * @brief Updates a checksum after a 32 bit field (e.g. an address) changed from `old` to `new` (RFC 1624).
+ * @param check Old checksum.
+ * @param old Old value of the field.
+ * @param new New value of the field.
+ * @return The function returns the new checksum.
+ */
+unsigned short ipv4_csum_update32(unsigned short check, unsigned int old, unsigned int new);
+
 /**
  * @brief Builds a random ID.
  * @return The function returns a random ID.
  */
 unsigned short ipv4_mkid();
 
+/**
+ * @brief Fills an array with random IDs.
+ * @param __OUT__ids Pointer to array of IDs.
+ * @param n Array length.
+ */
+void ipv4_mkid_bulk(unsigned short *ids, unsigned int n);
+
 /**
  * @brief Obtains broadcast IPv4 address.
  * @brief __IN__addr Pointer to netaddr_ip structure contains ip address.
@@ -222,6 +281,13 @@ void get_ipv4bcast_addr(struct netaddr_ip *addr, struct netaddr_ip *netmask, str
  */
 void get_ipv4net_addr(struct netaddr_ip *addr, struct netaddr_ip *netmask, struct netaddr_ip *net);
 
+/**
+ * @brief Builds the netmask for the given prefix length.
+ * @param prefix Prefix length (0-32).
+ * @param __OUT__netmask Pointer to netaddr_ip structure.
+ */
+void get_ipv4netmask(unsigned char prefix, struct netaddr_ip *netmask);
+
 /**
  * @brief Obtains wildcard mask.
  * @brief __IN__netmask Pointer to netaddr_ip structure contains the subnet mask.
@@ -241,4 +307,11 @@ void increment_ipv4addr(struct netaddr_ip *ip);
  */
 void rndipv4(struct netaddr_ip *ip);
 
+/**
+ * @brief Fills an array with random IPv4 addresses.
+ * @param __OUT__ips Pointer to array of netaddr_ip structures.
+ * @param n Array length.
+ */
+void rndipv4_bulk(struct netaddr_ip *ips, unsigned int n);
+
 #endif
@@ -0,0 +1,179 @@
+/*
+ * Copyright (c) 2017 Jacopo De Luca
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+*/
+
+/**
+ * @file ipv4perm.h
+ * @brief Provides a randomized iterator over IPv4 address ranges, suitable for scanning.
+ *
+ * Targets are visited exactly once in pseudo-random order by walking the cyclic multiplicative group
+ * of integers modulo a prime p slightly larger than the number of targets.
+ * The walk is fully determined by a seed, so the same permutation can be split across
+ * threads or processes that only share the seed and their shard index.
+ *
+ * @code
+ * struct Ipv4Perm *perm = ipv4perm_new();
+ * struct Ipv4PermShard shard;
+ * struct netaddr_ip net, ip;
+ * unsigned char prefix;
+ *
+ * parse_ipv4cidr("10.0.0.0/8", &net, &prefix);
+ * ipv4perm_add(perm, &net, prefix);
+ * parse_ipv4cidr("10.10.0.0/16", &net, &prefix);
+ * ipv4perm_exclude(perm, &net, prefix);
+ * ipv4perm_build(perm, seed);
+ * ipv4perm_shard(perm, worker, nworkers, &shard);
+ * while (ipv4perm_next(&shard, &ip))
+ *     ...
+ * @endcode
+ */
+
+#ifndef SPARK_IPV4PERM_H
+#define SPARK_IPV4PERM_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "datatype.h"
+
+/// @brief Inclusive range of IPv4 addresses in host byte order.
+struct Ipv4Range {
+    /// @brief First address of the range.
+    uint32_t first;
+    /// @brief Last address of the range.
+    uint32_t last;
+};
+
+/// @brief Contains the target set and the parameters of the permutation (this struct is private).
+struct Ipv4Perm {
+    struct Ipv4Range *incl;
+    struct Ipv4Range *excl;
+    unsigned int nincl;
+    unsigned int nexcl;
+    unsigned int cincl;
+    unsigned int cexcl;
+
+    struct Ipv4Range *ranges;
+    uint64_t *base;
+    unsigned int nranges;
+
+    uint64_t total;
+    uint64_t prime;
+    uint64_t gen;
+    uint64_t first;
+    bool ready;
+};
+
+/// @brief Iteration state of a single shard, each worker owns one of these.
+struct Ipv4PermShard {
+    struct Ipv4Perm *perm;
+    uint64_t cur;
+    uint64_t step;
+    uint64_t left;
+};
+
+/**
+ * @brief Adds a network to the target set.
+ * @param __IN__perm Pointer to Ipv4Perm.
+ * @param __IN__net Pointer to netaddr_ip structure contains the network address.
+ * @param prefix Prefix length.
+ * @return On success returns true, otherwise false is returned.
+ */
+bool ipv4perm_add(struct Ipv4Perm *perm, struct netaddr_ip *net, unsigned char prefix);
+
+/**
+ * @brief Adds an inclusive range of addresses to the target set.
+ * @param __IN__perm Pointer to Ipv4Perm.
+ * @param __IN__first Pointer to netaddr_ip structure contains the first address.
+ * @param __IN__last Pointer to netaddr_ip structure contains the last address.
+ * @return On success returns true, otherwise false is returned.
+ */
+bool ipv4perm_add_range(struct Ipv4Perm *perm, struct netaddr_ip *first, struct netaddr_ip *last);
+
+/**
+ * @brief Builds the permutation.
+ *
+ * Merges the target set, removes the excluded networks and selects prime, generator and starting point from seed.
+ * Instances built from the same targets and the same seed produce the same permutation.
+ * @param __IN__perm Pointer to Ipv4Perm.
+ * @param seed Permutation seed.
+ * @return On success returns true, otherwise false is returned.
+ */
+bool ipv4perm_build(struct Ipv4Perm *perm, uint64_t seed);
+
+/**
+ * @brief Removes a network from the target set (blocklist).
+ * @param __IN__perm Pointer to Ipv4Perm.
+ * @param __IN__net Pointer to netaddr_ip structure contains the network address.
+ * @param prefix Prefix length.
+ * @return On success returns true, otherwise false is returned.
+ */
+bool ipv4perm_exclude(struct Ipv4Perm *perm, struct netaddr_ip *net, unsigned char prefix);
+
+/**
+ * @brief Obtains the next address of the shard.
+ * @param __IN__shard Pointer to Ipv4PermShard.
+ * @param __OUT__ip Pointer to netaddr_ip structure.
+ * @return Function returns true if an address has been obtained, false if the shard is exhausted.
+ */
+bool ipv4perm_next(struct Ipv4PermShard *shard, struct netaddr_ip *ip);
+
+/**
+ * @brief Initializes the iteration state for the shard `shard` of `nshards`.
+ *
+ * The union of all shards visits every target exactly once, shards never overlap.
+ * @param __IN__perm Pointer to built Ipv4Perm.
+ * @param shard Shard index, between 0 and nshards-1.
+ * @param nshards Total number of shards.
+ * @param __OUT__state Pointer to Ipv4PermShard.
+ * @return On success returns true, otherwise false is returned.
+ */
+bool ipv4perm_shard(struct Ipv4Perm *perm, unsigned int shard, unsigned int nshards, struct Ipv4PermShard *state);
+
+/**
+ * @brief Allocates a new empty target set.
+ * @return On success returns the pointer to new Ipv4Perm, otherwise return NULL.
+ */
+struct Ipv4Perm *ipv4perm_new();
+
+/**
+ * @brief Obtains the number of targets after the exclusions.
+ * @param __IN__perm Pointer to built Ipv4Perm.
+ * @return Number of targets.
+ */
+uint64_t ipv4perm_count(struct Ipv4Perm *perm);
+
+/**
+ * @brief Fills `ips` with the next addresses of the shard.
+ * @param __IN__shard Pointer to Ipv4PermShard.
+ * @param __OUT__ips Pointer to array of netaddr_ip.
+ * @param n Array length.
+ * @return Number of addresses stored, less than `n` only when the shard is exhausted.
+ */
+unsigned int ipv4perm_next_bulk(struct Ipv4PermShard *shard, struct netaddr_ip *ips, unsigned int n);
+
+/**
+ * @brief Frees the memory occupied by Ipv4Perm.
+ * @param __IN__perm Pointer to Ipv4Perm.
+ */
+void ipv4perm_free(struct Ipv4Perm *perm);
+
+#endif
@@ -23,6 +23,10 @@
 /**
  * @file netdevice.h
  * @brief Provides functions for manage network devices.
+ *
+ * The netdev_* functions open a control socket for each call, the NetDevCtx object keeps the sockets open
+ * and caches the list of interfaces obtained with a single rtnetlink dump: use it when many interfaces must be
+ * queried or the same queries are repeated.
  */
 
 #ifndef SPARK_NETDEVICE_H
@@ -37,6 +41,9 @@
 #define NETD_FAILURE    0
 #define NETD_ENOSUPPORT -1
 
+#define NETD_UNCHANGED  0           // Profile value: keep the current setting
+#define NETD_MAX        0xFFFFFFFF  // Profile value: use the max supported by the device
+
 
 /// @brief Contains device information and pointer to the next structure.
 struct NetDevList {
@@ -50,6 +57,116 @@ struct NetDevList {
     struct NetDevList *next;
 };
 
+/// @brief 64 bit interface counters (IFLA_STATS64).
+struct NetDevStats {
+    unsigned long long rx_packets;
+    unsigned long long tx_packets;
+    unsigned long long rx_bytes;
+    unsigned long long tx_bytes;
+    unsigned long long rx_errors;
+    unsigned long long tx_errors;
+    /// @brief Packets dropped by the kernel (e.g. no buffer space).
+    unsigned long long rx_dropped;
+    unsigned long long tx_dropped;
+    /// @brief Packets missed by the NIC (e.g. RX ring full).
+    unsigned long long rx_missed;
+    unsigned long long rx_fifo_errors;
+    unsigned long long multicast;
+};
+
+/// @brief RX/TX ring sizes (ETHTOOL_GRINGPARAM).
+struct NetDevRing {
+    unsigned int rx;
+    unsigned int tx;
+    unsigned int rx_max;
+    unsigned int tx_max;
+};
+
+/// @brief Number of queues (ETHTOOL_GCHANNELS).
+struct NetDevChannels {
+    unsigned int rx;
+    unsigned int tx;
+    unsigned int combined;
+    unsigned int rx_max;
+    unsigned int tx_max;
+    unsigned int combined_max;
+};
+
+/// @brief Interrupt coalescing (ETHTOOL_GCOALESCE).
+struct NetDevCoalesce {
+    unsigned int rx_usecs;
+    unsigned int rx_frames;
+    unsigned int tx_usecs;
+    unsigned int tx_frames;
+    bool adaptive_rx;
+    bool adaptive_tx;
+};
+
+/// @brief Offload features: 1 enabled, 0 disabled, -1 unknown or not supported.
+struct NetDevOffloads {
+    /// @brief Generic receive offload.
+    signed char gro;
+    /// @brief Large receive offload.
+    signed char lro;
+    /// @brief Generic segmentation offload.
+    signed char gso;
+    /// @brief RX checksumming.
+    signed char rxcsum;
+};
+
+/**
+ * @brief Desired NIC state.
+ *
+ * Numeric fields equal to NETD_UNCHANGED are not modified, NETD_MAX selects the device maximum;
+ * offloads equal to -1 are not modified.
+ */
+struct NetDevProfile {
+    struct NetDevRing ring;
+    struct NetDevChannels channels;
+    /// @brief Applied only if set_coalesce is true.
+    struct NetDevCoalesce coalesce;
+    bool set_coalesce;
+    struct NetDevOffloads offloads;
+};
+
+/// @brief Interface record of a NetDevCtx.
+struct NetDevInfo {
+    /// @brief Interface index.
+    unsigned int ifindex;
+    /// @brief Device name.
+    char name[IFNAMSIZ];
+    /// @brief Device flags.
+    unsigned int flags;
+    /// @brief MTU.
+    unsigned int mtu;
+    /// @brief Device MAC address.
+    struct netaddr_mac mac;
+    /// @brief Operational state (IF_OPER_*).
+    unsigned char operstate;
+    /// @brief First IPv4 address, 0 if none.
+    struct netaddr_ip ipv4;
+    /// @brief Subnet mask of the first IPv4 address.
+    struct netaddr_ip netmask;
+    /// @brief Counters, updated by netdev_ctx_refresh and netdev_ctx_stats.
+    struct NetDevStats stats;
+};
+
+/// @brief Netdevice context: persistent sockets and interfaces cache.
+struct NetDevCtx {
+    /// @brief Interfaces sorted by index, contiguous array.
+    struct NetDevInfo *devs;
+    /// @brief Number of interfaces.
+    unsigned int ndevs;
+    /// @brief Time of the last counters update (CLOCK_MONOTONIC, nanoseconds).
+    unsigned long long stats_time;
+
+    unsigned int size;
+    unsigned int *names;
+    unsigned int mask;
+    int ctl;
+    void *nl;
+};
+
 /**
  * @brief Obtains device burned-in mac address.
  * @param iface_name Interface name.
@@ -59,6 +176,43 @@ struct NetDevList {
  */
 int netdev_burnedin_mac(char *iface_name, struct netaddr_mac *mac) ;
 
+/**
+ * @brief Puts a device in the desired state and reports the resulting settings.
+ * @param iface_name Interface name.
+ * @param __IN__profile Pointer to NetDevProfile contains the desired settings.
+ * @param __OUT__applied Pointer to NetDevProfile filled with the settings read back from the device, maybe NULL.
+ * Values the device does not report are 0 (offloads -1).
+ * @return NETD_SUCCESS if every set request was accepted, the device may still adjust the values (compare applied).
+ * Otherwise, NETD_FAILURE is returned and errno is set appropriately (the first error).
+ * If function is not supported NETD_ENOSUPPORT is returned.
+ */
+int netdev_apply_profile(char *iface_name, struct NetDevProfile *profile, struct NetDevProfile *applied);
+
+/**
+ * @brief Fills a profile suitable for packet capture: largest RX ring, GRO/LRO/GSO disabled
+ * (frames are seen as they are on the wire), other settings (TX ring included) unchanged.
+ * @param __OUT__profile Pointer to NetDevProfile.
+ */
+void netdev_capture_profile(struct NetDevProfile *profile);
+
+/**
+ * @brief Obtains the number of queues of the device.
+ * @param iface_name Interface name.
+ * @param __OUT__channels Pointer to NetDevChannels.
+ * @return On success NETD_SUCCESS is returned.
+ * Otherwise, NETD_FAILURE is returned and errno is set appropriately. If function is not supported NETD_ENOSUPPORT is returned.
+ */
+int netdev_get_channels(char *iface_name, struct NetDevChannels *channels);
+
+/**
+ * @brief Obtains the interrupt coalescing settings of the device.
+ * @param iface_name Interface name.
+ * @param __OUT__coalesce Pointer to NetDevCoalesce.
+ * @return On success NETD_SUCCESS is returned.
+ * Otherwise, NETD_FAILURE is returned and errno is set appropriately. If function is not supported NETD_ENOSUPPORT is returned.
+ */
+int netdev_get_coalesce(char *iface_name, struct NetDevCoalesce *coalesce);
+
 /**
  * @brief Get the active flag word of the device.
  * @param iface_name Interface name.
@@ -77,6 +231,60 @@ int netdev_get_flags(char *iface_name, short *flags);
  */
 int netdev_get_mac(char *iface_name, struct netaddr_mac *mac);
 
+/**
+ * @brief Obtains the state of the offload features of the device.
+ * @param iface_name Interface name.
+ * @param __OUT__offloads Pointer to NetDevOffloads, the features that cannot be read are set to -1.
+ * @return On success NETD_SUCCESS is returned.
+ * Otherwise, NETD_FAILURE is returned and errno is set appropriately. If function is not supported NETD_ENOSUPPORT is returned.
+ */
+int netdev_get_offloads(char *iface_name, struct NetDevOffloads *offloads);
+
+/**
+ * @brief Obtains the RX/TX ring sizes of the device.
+ * @param iface_name Interface name.
+ * @param __OUT__ring Pointer to NetDevRing.
+ * @return On success NETD_SUCCESS is returned.
+ * Otherwise, NETD_FAILURE is returned and errno is set appropriately. If function is not supported NETD_ENOSUPPORT is returned.
+ */
+int netdev_get_ring(char *iface_name, struct NetDevRing *ring);
+
+/**
+ * @brief Set the number of queues, only rx, tx and combined are used (NETD_UNCHANGED and NETD_MAX are accepted).
+ * @param iface_name Interface name.
+ * @param __IN__channels Pointer to NetDevChannels.
+ * @return On success NETD_SUCCESS is returned.
+ * Otherwise, NETD_FAILURE is returned and errno is set appropriately. If function is not supported NETD_ENOSUPPORT is returned.
+ */
+int netdev_set_channels(char *iface_name, struct NetDevChannels *channels);
+
+/**
+ * @brief Set the interrupt coalescing settings.
+ * @param iface_name Interface name.
+ * @param __IN__coalesce Pointer to NetDevCoalesce.
+ * @return On success NETD_SUCCESS is returned.
+ * Otherwise, NETD_FAILURE is returned and errno is set appropriately. If function is not supported NETD_ENOSUPPORT is returned.
+ */
+int netdev_set_coalesce(char *iface_name, struct NetDevCoalesce *coalesce);
+
+/**
+ * @brief Enables or disables offload features, the features equal to -1 are not modified.
+ * @param iface_name Interface name.
+ * @param __IN__offloads Pointer to NetDevOffloads.
+ * @return On success NETD_SUCCESS is returned.
+ * Otherwise, NETD_FAILURE is returned and errno is set appropriately. If function is not supported NETD_ENOSUPPORT is returned.
+ */
+int netdev_set_offloads(char *iface_name, struct NetDevOffloads *offloads);
+
+/**
+ * @brief Set the RX/TX ring sizes, only rx and tx are used (NETD_UNCHANGED and NETD_MAX are accepted).
+ * @param iface_name Interface name.
+ * @param __IN__ring Pointer to NetDevRing.
+ * @return On success NETD_SUCCESS is returned.
+ * Otherwise, NETD_FAILURE is returned and errno is set appropriately. If function is not supported NETD_ENOSUPPORT is returned.
+ */
+int netdev_set_ring(char *iface_name, struct NetDevRing *ring);
+
 /**
  * @brief Set device flags.
  * @param iface_name Interface name.
@@ -104,8 +312,90 @@ int netdev_set_mac(char *iface_name, struct netaddr_mac *mac);
  */
 struct NetDevList *netdev_get_iflist(unsigned int filter);
 
+/**
+ * @brief Finds an interface by index in the context cache.
+ * @param __IN__ctx Pointer to NetDevCtx.
+ * @param ifindex Interface index.
+ * @return Pointer to the interface, NULL if not found.
+ */
+struct NetDevInfo *netdev_ctx_byindex(struct NetDevCtx *ctx, unsigned int ifindex);
+
+/**
+ * @brief Finds an interface by name in the context cache.
+ * @param __IN__ctx Pointer to NetDevCtx.
+ * @param iface_name Interface name.
+ * @return Pointer to the interface, NULL if not found.
+ */
+struct NetDevInfo *netdev_ctx_find(struct NetDevCtx *ctx, char *iface_name);
+
+/**
+ * @brief Frees the memory occupied by NetDevCtx and closes its sockets.
+ * @param __IN__ctx Pointer to NetDevCtx.
+ */
+void netdev_ctx_free(struct NetDevCtx *ctx);
+
+/**
+ * @brief Allocates a new netdevice context and loads the interfaces.
+ * @return On success returns the pointer to new NetDevCtx, otherwise return NULL.
+ */
+struct NetDevCtx *netdev_ctx_new();
+
+/**
+ * @brief Looks up many interfaces at once in the context cache.
+ * @param __IN__ctx Pointer to NetDevCtx.
+ * @param __IN__names Array of interface names.
+ * @param n Array length.
+ * @param __OUT__devs Array of n pointers, NULL is stored for the interfaces not found.
+ * @return Function returns the number of interfaces found.
+ */
+unsigned int netdev_ctx_query(struct NetDevCtx *ctx, char **names, unsigned int n, struct NetDevInfo **devs);
+
+/**
+ * @brief Reloads the interfaces with one link dump and one IPv4 address dump.
+ *
+ * Pointers previously returned by the context are invalidated.
+ * @param __IN__ctx Pointer to NetDevCtx.
+ * @return On success returns the number of interfaces.
+ * Otherwise, NETD_FAILURE is returned and errno is set appropriately. If function is not supported NETD_ENOSUPPORT is returned.
+ */
+int netdev_ctx_refresh(struct NetDevCtx *ctx);
+
+/**
+ * @brief Updates the counters of all cached interfaces with a single dump.
+ *
+ * Only the counters are transferred (RTM_GETSTATS), on older kernels a link dump is used instead.
+ * Interfaces created after the last netdev_ctx_refresh are ignored.
+ * @param __IN__ctx Pointer to NetDevCtx.
+ * @return On success returns the number of interfaces updated.
+ * Otherwise, NETD_FAILURE is returned and errno is set appropriately. If function is not supported NETD_ENOSUPPORT is returned.
+ */
+int netdev_ctx_stats(struct NetDevCtx *ctx);
+
+/**
+ * @brief Set device flags through the context control socket, the cache is updated.
+ * @param __IN__ctx Pointer to NetDevCtx.
+ * @param iface_name Interface name.
+ * @param flags New device flags word.
+ * @return On success NETD_SUCCESS is returned.
+ * Otherwise, NETD_FAILURE is returned, and errno is set appropriately.
+ */
+int netdev_ctx_set_flags(struct NetDevCtx *ctx, char *iface_name, short flags);
+
+/**
+ * @brief Set new mac address through the context control socket, the cache is updated.
+ * @param __IN__ctx Pointer to NetDevCtx.
+ * @param iface_name Interface name.
+ * @param __IN__mac Pointer to netaddr_mac structure contains new MAC address.
+ * @return On success NETD_SUCCESS is returned.
+ * Otherwise, NETD_FAILURE is returned, and errno is set appropriately.
+ */
+int netdev_ctx_set_mac(struct NetDevCtx *ctx, char *iface_name, struct netaddr_mac *mac);
+
 /**
  * @brief Frees the memory occupied by netdev_get_iflist() function.
+ *
+ * On Linux the whole list is a single allocation: pass the head returned by netdev_get_iflist(),
+ * nodes cannot be freed or unlinked one by one.
  * @param __IN__NetDevList pointer to NetDevList list.
  */
 void netdev_iflist_cleanup(struct NetDevList *NetDevList);
@@ -0,0 +1,255 @@
+/*
+ * Copyright (c) 2017 Jacopo De Luca
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+*/
+
+/**
+ * @file nlmonitor.h
+ * @brief Provides a live view of interfaces, IPv4 addresses, routes and neighbors kept updated by rtnetlink events.
+ *
+ * The monitor subscribes to the link, IPv4 address, IPv4 route and neighbor groups, loads the current state
+ * with a dump and applies the notifications received by nlmon_poll. After each batch of changes a new immutable
+ * snapshot is published: readers on other threads take it with nlmon_acquire without locks and release it
+ * with nlmon_release; an old snapshot is freed only when no reader can still see it (readers announce the
+ * version they entered with, like an epoch counter).
+ * Available on Linux only.
+ *
+ * Example:
+ * @code
+ * // Writer thread
+ * struct NlMonitor *mon = nlmon_new(NLMON_ALL);
+ * for (;;)
+ *     nlmon_poll(mon, 1000);
+ *
+ * // Reader thread
+ * int slot = nlmon_reader(mon);
+ * struct NlmSnapshot *snap = nlmon_acquire(mon, slot);
+ * nlmon_ipv4(snap, "eth0", &ip, &netmask);
+ * nlmon_release(mon, slot);
+ * @endcode
+ */
+
+#ifndef SPARK_NLMONITOR_H
+#define SPARK_NLMONITOR_H
+
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <net/if.h>
+
+#include "datatype.h"
+#include "routev4.h"
+
+#define NLMON_MAXREADERS    64
+
+/* Groups */
+#define NLMON_LINK      0x01
+#define NLMON_ADDR      0x02
+#define NLMON_ROUTE     0x04
+#define NLMON_NEIGH     0x08
+#define NLMON_ALL       (NLMON_LINK | NLMON_ADDR | NLMON_ROUTE | NLMON_NEIGH)
+
+/// @brief Kind of object changed.
+enum NlmEvent {
+    NLMON_EV_LINK,
+    NLMON_EV_ADDR,
+    NLMON_EV_ROUTE,
+    NLMON_EV_NEIGH
+};
+
+/// @brief Network interface.
+struct NlmLink {
+    /// @brief Interface index.
+    unsigned int ifindex;
+    /// @brief Interface name.
+    char name[IFNAMSIZ];
+    /// @brief Device flags (IFF_*).
+    unsigned int flags;
+    /// @brief MTU.
+    unsigned int mtu;
+    /// @brief Hardware address.
+    struct netaddr_mac mac;
+    /// @brief Operational state (IF_OPER_*).
+    unsigned char operstate;
+};
+
+/// @brief IPv4 address of an interface.
+struct NlmAddr {
+    /// @brief Interface index.
+    unsigned int ifindex;
+    /// @brief Address.
+    struct netaddr_ip addr;
+    /// @brief Prefix length.
+    unsigned char prefix;
+    /// @brief Subnet mask.
+    struct netaddr_ip netmask;
+    /// @brief Broadcast address, 0 if not set.
+    struct netaddr_ip broadcast;
+    /// @brief Address label.
+    char label[IFNAMSIZ];
+};
+
+/// @brief IPv4 route of the main table.
+struct NlmRoute {
+    /// @brief Destination network.
+    struct netaddr_ip dst;
+    /// @brief Prefix length.
+    unsigned char prefix;
+    /// @brief Route priority, lower is preferred.
+    unsigned int metric;
+    /// @brief Next hop.
+    struct Route4Nexthop nh;
+};
+
+/// @brief IPv4 neighbor.
+struct NlmNeigh {
+    /// @brief Interface index.
+    unsigned int ifindex;
+    /// @brief Neighbor address.
+    struct netaddr_ip ip;
+    /// @brief Neighbor hardware address.
+    struct netaddr_mac mac;
+    /// @brief Neighbor state (NUD_*).
+    unsigned short state;
+};
+
+/// @brief Immutable view of the network state.
+struct NlmSnapshot {
+    /// @brief Snapshot version, incremented at each change.
+    unsigned long version;
+    /// @brief Interfaces sorted by index.
+    struct NlmLink *links;
+    unsigned int nlinks;
+    struct NlmAddr *addrs;
+    unsigned int naddrs;
+    struct NlmRoute *routes;
+    unsigned int nroutes;
+    struct NlmNeigh *neighs;
+    unsigned int nneighs;
+    /// @brief Compiled routes, available if NlMonitor.lpm is true.
+    struct Route4Table *lpm;
+
+    struct NlmSnapshot *next;
+};
+
+/// @brief Growable array of records (this struct is private).
+struct NlmVector {
+    unsigned char *data;
+    unsigned int count;
+    unsigned int size;
+    unsigned int recsize;
+    unsigned int keylen;
+};
+
+/// @brief Contains the monitor state.
+struct NlMonitor {
+    /// @brief Called for each change after the snapshot containing it has been published (can be NULL).
+    void (*on_change)(struct NlMonitor *mon, enum NlmEvent ev, bool removed, void *record, void *arg);
+    /// @brief Argument of on_change.
+    void *arg;
+    /// @brief Compiles the routes of each snapshot for routev4_lookup (a DIR-24-8 table is 32 MB).
+    bool lpm;
+    /// @brief Subscribed groups.
+    unsigned int groups;
+    /// @brief Notifications lost because the socket buffer was full (followed by a full reload).
+    unsigned long overruns;
+
+    _Atomic(struct NlmSnapshot *) current;
+    atomic_ulong version;
+    atomic_ulong readers[NLMON_MAXREADERS];
+    atomic_uint nreaders;
+    struct NlmSnapshot *retired;
+    struct NlmVector state[4];
+    struct NlmVector events;
+    unsigned int changes;
+    bool dirty;
+    void *nl;
+};
+
+/**
+ * @brief Takes the current snapshot, it remains valid until nlmon_release.
+ * @param __IN__mon Pointer to NlMonitor.
+ * @param slot Reader slot returned by nlmon_reader.
+ * @return Pointer to the current snapshot.
+ */
+struct NlmSnapshot *nlmon_acquire(struct NlMonitor *mon, int slot);
+
+/**
+ * @brief Obtains the first IPv4 address of an interface.
+ * @param __IN__snap Pointer to NlmSnapshot.
+ * @param iface_name Interface name.
+ * @param __OUT__ip Pointer to netaddr_ip structure, maybe NULL.
+ * @param __OUT__netmask Pointer to netaddr_ip structure, maybe NULL.
+ * @return Function returns true if the interface has an IPv4 address, false otherwise.
+ */
+bool nlmon_ipv4(struct NlmSnapshot *snap, char *iface_name, struct netaddr_ip *ip, struct netaddr_ip *netmask);
+
+/**
+ * @brief Finds an interface by name.
+ * @param __IN__snap Pointer to NlmSnapshot.
+ * @param iface_name Interface name.
+ * @return Pointer to the interface, NULL if not found.
+ */
+struct NlmLink *nlmon_link(struct NlmSnapshot *snap, char *iface_name);
+
+/**
+ * @brief Finds an interface by index.
+ * @param __IN__snap Pointer to NlmSnapshot.
+ * @param ifindex Interface index.
+ * @return Pointer to the interface, NULL if not found.
+ */
+struct NlmLink *nlmon_link_byindex(struct NlmSnapshot *snap, unsigned int ifindex);
+
+/**
+ * @brief Applies the pending notifications, publishes a new snapshot and fires the callbacks.
+ * @param __IN__mon Pointer to NlMonitor.
+ * @param timeout Max wait for notifications in milliseconds.
+ * @return On success returns the number of changes applied.
+ * Otherwise, a value < 0 shall be returned, you can use spark_strerror to get error message.
+ */
+int nlmon_poll(struct NlMonitor *mon, int timeout);
+
+/**
+ * @brief Registers a reader, each reader thread needs its own slot.
+ * @param __IN__mon Pointer to NlMonitor.
+ * @return On success returns the slot, -1 if there are already NLMON_MAXREADERS readers.
+ */
+int nlmon_reader(struct NlMonitor *mon);
+
+/**
+ * @brief Releases the snapshot taken by nlmon_acquire.
+ * @param __IN__mon Pointer to NlMonitor.
+ * @param slot Reader slot.
+ */
+void nlmon_release(struct NlMonitor *mon, int slot);
+
+/**
+ * @brief Allocates a new monitor and loads the current state.
+ * @param groups Groups to monitor (NLMON_*).
+ * @return On success returns the pointer to new NlMonitor, otherwise return NULL.
+ */
+struct NlMonitor *nlmon_new(unsigned int groups);
+
+/**
+ * @brief Frees the memory occupied by NlMonitor, no reader must be active.
+ * @param __IN__mon Pointer to NlMonitor.
+ */
+void nlmon_free(struct NlMonitor *mon);
+
+#endif
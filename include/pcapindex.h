@@ -0,0 +1,242 @@
+/*
+ * Copyright (c) 2017 Jacopo De Luca
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+*/
+
+/**
+ * @file pcapindex.h
+ * @brief Provides a sidecar index for pcap files with time checkpoints and per-flow record offsets.
+ *
+ * The index contains a checkpoint (timestamp, file offset) every PCAPIDX_STEP bytes of capture and, for
+ * each IPv4 flow (direction-insensitive 5-tuple, see flow.h), the sorted list of the offsets of its records.
+ * It can be built while writing (see pcapw_setindex) or afterwards from the file (pcapidx_build).
+ * The reader maps both files: a time lookup is a binary search on the checkpoints followed by a short
+ * sequential scan, a flow lookup is a binary search on the flow table; in both cases only the pages of the
+ * capture containing the requested records are touched.
+ * Only classic pcap files are indexed and packets are expected in timestamp order.
+ *
+ * Example:
+ * @code
+ * struct PcapIdx *idx;
+ * struct PcapIdxCursor cur;
+ * pcapidx_build("big.pcap", "big.pcap.idx");
+ * pcapidx_open("big.pcap", "big.pcap.idx", &idx);
+ * pcapidx_flow(idx, &key, &cur);
+ * while ((len = pcapidx_next(idx, &cur, &pkt, &ts)) >= 0)
+ *     analyze(pkt, len);
+ * pcapidx_close(idx);
+ * @endcode
+ */
+
+#ifndef SPARK_PCAPINDEX_H
+#define SPARK_PCAPINDEX_H
+
+#include <stdbool.h>
+
+#include "spksock.h"
+#include "flow.h"
+
+#define PCAPIDX_MAGIC       0x58504B53  // "SPKX"
+#define PCAPIDX_VERSION     1
+#define PCAPIDX_STEP        (256 << 10) // Bytes of capture between two checkpoints
+
+/// @brief Index file header.
+struct PcapIdxHeader {
+    unsigned int magic;
+    unsigned int version;
+    /// @brief Bytes of capture covered by the index.
+    unsigned long long covered;
+    /// @brief Packets indexed.
+    unsigned long long packets;
+    unsigned long long checks_off;
+    unsigned long long flows_off;
+    unsigned long long offsets_off;
+    unsigned int nchecks;
+    unsigned int nflows;
+    unsigned long long noffsets;
+};
+
+/// @brief Time checkpoint.
+struct PcapIdxCheck {
+    /// @brief Timestamp in nanoseconds.
+    long long time;
+    /// @brief Offset of the record.
+    unsigned long long offset;
+};
+
+/// @brief Flow table entry, sorted by hash and key.
+struct PcapIdxFlow {
+    /// @brief Canonical key (see flow_canonical).
+    struct FlowKey key;
+    unsigned int hash;
+    /// @brief Number of records.
+    unsigned int count;
+    /// @brief Position of the first offset in the offsets table.
+    unsigned long long first;
+};
+
+/// @brief Collects the index entries (this struct is private).
+struct PcapIdxBuilder {
+    int lktype;
+    struct PcapIdxCheck *checks;
+    unsigned int nchecks;
+    unsigned int maxchecks;
+    struct PcapIdxFlow *flows;
+    unsigned int *slots;
+    unsigned int nflows;
+    unsigned int nslots;
+    unsigned long long *offsets;
+    unsigned int *owners;
+    unsigned long long noffsets;
+    unsigned long long maxoffsets;
+    unsigned long long packets;
+    unsigned long long covered;
+    bool failed;
+};
+
+/// @brief Opened capture and index (this struct is private).
+struct PcapIdx {
+    unsigned char *base;
+    unsigned long long size;
+    unsigned char *ibase;
+    unsigned long long isize;
+    struct PcapIdxHeader *hdr;
+    struct PcapIdxCheck *checks;
+    struct PcapIdxFlow *flows;
+    unsigned long long *offsets;
+    bool swap;
+    bool nsec;
+    int lktype;
+};
+
+/// @brief Position of a lookup.
+struct PcapIdxCursor {
+    /// @brief Next record (time lookup).
+    unsigned long long pos;
+    /// @brief First timestamp accepted in nanoseconds (time lookup).
+    long long from;
+    /// @brief Last timestamp accepted in nanoseconds (time lookup).
+    long long to;
+    /// @brief Offsets of the flow records (flow lookup), NULL for time lookups.
+    unsigned long long *offsets;
+    unsigned long long count;
+    unsigned long long next;
+};
+
+/**
+ * @brief Creates an empty index builder.
+ * @param lktype Link type of the packets (DLT value).
+ * @param __OUT__ib Pointer to the new PcapIdxBuilder structure.
+ * @return Upon successful completion, pcapidx_new() returns SPKSOCK_SUCCESS.
+ * Otherwise, a value < 0 shall be returned, you can use spark_strerror to get error message.
+ */
+int pcapidx_new(int lktype, struct PcapIdxBuilder **ib);
+
+/**
+ * @brief Adds a record to the index, records must be added in file order.
+ * @param __IN__ib Pointer to PcapIdxBuilder.
+ * @param offset File offset of the record header.
+ * @param __IN__pkt Pointer to the packet.
+ * @param caplen Captured length.
+ * @param __IN__ts Pointer to SpkTimeStamp contains the packet timestamp.
+ * @return On success SPKSOCK_SUCCESS is returned, otherwise SPKSOCK_ENOMEM.
+ */
+int pcapidx_add(struct PcapIdxBuilder *ib, unsigned long long offset, unsigned char *pkt, unsigned int caplen,
+                struct SpkTimeStamp *ts);
+
+/**
+ * @brief Writes the index file.
+ * @param __IN__ib Pointer to PcapIdxBuilder.
+ * @param path Index file path.
+ * @return On success SPKSOCK_SUCCESS is returned.
+ * If a previous pcapidx_add failed the index is incomplete, nothing is written and SPKSOCK_ENOMEM is returned.
+ * Otherwise, a value < 0 shall be returned, you can use spark_strerror to get error message.
+ */
+int pcapidx_save(struct PcapIdxBuilder *ib, char *path);
+
+/**
+ * @brief Frees the memory occupied by PcapIdxBuilder.
+ * @param __IN__ib Pointer to PcapIdxBuilder.
+ */
+void pcapidx_free(struct PcapIdxBuilder *ib);
+
+/**
+ * @brief Indexes an existing pcap file.
+ * @param pcap Capture file path.
+ * @param path Index file path.
+ * @return On success SPKSOCK_SUCCESS is returned.
+ * If the capture is not a pcap file SPKSOCK_ENOSUPPORT is returned.
+ * Otherwise, a value < 0 shall be returned, you can use spark_strerror to get error message.
+ */
+int pcapidx_build(char *pcap, char *path);
+
+/**
+ * @brief Opens a capture with its index.
+ * @param pcap Capture file path.
+ * @param path Index file path.
+ * @param __OUT__idx Pointer to the new PcapIdx structure.
+ * @return On success SPKSOCK_SUCCESS is returned.
+ * If the index does not match the capture SPKSOCK_ENOSUPPORT is returned.
+ * Otherwise, a value < 0 shall be returned, you can use spark_strerror to get error message.
+ */
+int pcapidx_open(char *pcap, char *path, struct PcapIdx **idx);
+
+/**
+ * @brief Prepares a cursor over the packets with timestamp between from and to (inclusive).
+ * @param __IN__idx Pointer to PcapIdx.
+ * @param __IN__from Pointer to SpkTimeStamp, first timestamp.
+ * @param __IN__to Pointer to SpkTimeStamp, last timestamp (NULL means until the end).
+ * @param __OUT__cur Pointer to PcapIdxCursor.
+ */
+void pcapidx_time(struct PcapIdx *idx, struct SpkTimeStamp *from, struct SpkTimeStamp *to,
+                  struct PcapIdxCursor *cur);
+
+/**
+ * @brief Prepares a cursor over the packets of a flow (both directions).
+ * @param __IN__idx Pointer to PcapIdx.
+ * @param __IN__key Pointer to FlowKey.
+ * @param __OUT__cur Pointer to PcapIdxCursor.
+ * @return Number of packets of the flow, 0 if the flow is not in the index.
+ */
+unsigned long long pcapidx_flow(struct PcapIdx *idx, struct FlowKey *key, struct PcapIdxCursor *cur);
+
+/**
+ * @brief Returns the next packet of the cursor without copying it.
+ * @param __IN__idx Pointer to PcapIdx.
+ * @param __IN__cur Pointer to PcapIdxCursor.
+ * @param __OUT__pkt Pointer to the first byte of the packet (valid until pcapidx_close).
+ * @param __OUT__ts Pointer to SpkTimeStamp (nanosecond precision), can be NULL.
+ * @return Captured length of the packet, SPKSOCK_EOF when the cursor is exhausted.
+ */
+int pcapidx_next(struct PcapIdx *idx, struct PcapIdxCursor *cur, unsigned char **pkt, struct SpkTimeStamp *ts);
+
+/**
+ * @brief Returns the link type of the indexed capture (DLT value).
+ * @param __IN__idx Pointer to PcapIdx.
+ */
+int pcapidx_lktype(struct PcapIdx *idx);
+
+/**
+ * @brief Unmaps the files and frees the memory occupied by PcapIdx.
+ * @param __IN__idx Pointer to PcapIdx.
+ */
+void pcapidx_close(struct PcapIdx *idx);
+
+#endif
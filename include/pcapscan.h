@@ -0,0 +1,186 @@
+/*
+ * Copyright (c) 2017 Jacopo De Luca
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+*/
+
+/**
+ * @file pcapscan.h
+ * @brief Provides a parallel reader that spreads the analysis of a single pcap file over a pool of threads.
+ *
+ * The file is mapped and split into chunks of about PcapScan.chunk bytes; chunk boundaries are moved
+ * forward to the next position where PCAPSCAN_SYNC consecutive plausible record headers are found, so
+ * each worker can walk its chunks without reading what precedes them.
+ * By default workers take chunks as they become free and on_packet sees the packets of a chunk in file
+ * order. When byflow is set the packets are re-sharded by direction-insensitive flow hash (see flow.h):
+ * every flow is delivered to a single worker and each worker receives its packets in file order, packets
+ * without an IPv4 header go to worker 0. Packets are never copied, on_packet receives pointers into the map.
+ * Workers can produce results with pcapscan_emit, pcapscan_merge delivers them ordered by timestamp.
+ * Only classic pcap files are supported.
+ *
+ * Example:
+ * @code
+ * struct PcapScan *scan;
+ * pcapscan_open("big.pcap", &scan);
+ * scan->byflow = true;
+ * scan->on_packet = analyze;
+ * scan->arg = scan;
+ * pcapscan_run(scan);
+ * pcapscan_merge(scan, print_result, NULL);
+ * pcapscan_close(scan);
+ * @endcode
+ */
+
+#ifndef SPARK_PCAPSCAN_H
+#define SPARK_PCAPSCAN_H
+
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "spksock.h"
+#include "flow.h"
+
+#define PCAPSCAN_MAXWORKERS 64
+#define PCAPSCAN_CHUNK      (8 << 20)   // Default chunk size
+#define PCAPSCAN_MINCHUNK   (64 << 10)  // Smallest chunk size accepted
+#define PCAPSCAN_SYNC       8           // Consecutive record headers needed to accept a chunk boundary
+#define PCAPSCAN_QLEN       2048        // Slots of each re-sharding queue (power of 2)
+
+/// @brief Result header, followed by the data padded to 8 bytes (this struct is private).
+struct PcapScanResult {
+    long long time;
+    unsigned int len;
+    unsigned int pad;
+};
+
+/// @brief Re-sharding queue between two workers (this struct is private).
+struct PcapScanQueue {
+    _Alignas(64) atomic_uint head;
+    _Alignas(64) atomic_uint tail;
+    unsigned long long *slots;
+};
+
+/// @brief Contains the state of a worker (this struct is private).
+struct PcapScanWorker {
+    struct PcapScan *scan;
+    unsigned int id;
+    pthread_t thread;
+    unsigned char *results;
+    unsigned long long rlen;
+    unsigned long long rmax;
+    unsigned long long nresults;
+    // Chunk being read
+    unsigned long long chunk;
+    unsigned long long off;
+    unsigned int mark;
+    // Chunk being consumed (byflow)
+    unsigned long long cchunk;
+    unsigned long long packets;
+    unsigned long long resyncs;
+};
+
+/// @brief Contains scan settings and results.
+struct PcapScan {
+    /// @brief Number of worker threads, 0 uses one for each online CPU (at most PCAPSCAN_MAXWORKERS).
+    unsigned int nworkers;
+    /// @brief Chunk size in bytes (at least PCAPSCAN_MINCHUNK).
+    unsigned long long chunk;
+    /// @brief Re-shard packets so that each flow is handled by a single worker.
+    bool byflow;
+    /// @brief Called by the worker threads for each packet, pkt is valid until pcapscan_close.
+    void (*on_packet)(unsigned int worker, unsigned char *pkt, unsigned int caplen, struct SpkTimeStamp *ts,
+                      void *arg);
+    /// @brief Argument of on_packet.
+    void *arg;
+    /// @brief Link type of the capture (DLT value).
+    int lktype;
+    /// @brief Packets processed by the last run.
+    unsigned long long packets;
+    /// @brief Chunks whose records did not end exactly at the next boundary (damaged or truncated file).
+    unsigned long long resyncs;
+
+    unsigned char *base;
+    unsigned long long size;
+    bool swap;
+    bool nsec;
+    unsigned int snaplen;
+    unsigned long first;
+    unsigned long long *bounds;
+    unsigned long long nchunks;
+    atomic_ullong next;
+    atomic_int go;
+    struct PcapScanWorker *workers;
+    struct PcapScanQueue *queues;
+    unsigned int nw;
+};
+
+/**
+ * @brief Maps a pcap file and prepares a scan, settings can be changed before calling pcapscan_run.
+ * @param path Capture file path.
+ * @param __OUT__scan Pointer to the new PcapScan structure.
+ * @return Upon successful completion, pcapscan_open() returns SPKSOCK_SUCCESS.
+ * If the file is not a pcap file SPKSOCK_ENOSUPPORT is returned.
+ * Otherwise, a value < 0 shall be returned, you can use spark_strerror to get error message.
+ */
+int pcapscan_open(char *path, struct PcapScan **scan);
+
+/**
+ * @brief Processes the whole file, returns when all workers are done.
+ *
+ * Results emitted by a previous run are discarded.
+ * @param __IN__scan Pointer to PcapScan.
+ * @return On success returns the number of packets processed.
+ * Otherwise, a value < 0 shall be returned, you can use spark_strerror to get error message.
+ */
+long long pcapscan_run(struct PcapScan *scan);
+
+/**
+ * @brief Stores a result, must be called by on_packet with its worker index.
+ * @param __IN__scan Pointer to PcapScan.
+ * @param worker Worker index received by on_packet.
+ * @param __IN__ts Pointer to SpkTimeStamp used to order the results.
+ * @param __IN__data Pointer to the result, it is copied.
+ * @param len Result length.
+ * @return On success SPKSOCK_SUCCESS is returned, otherwise SPKSOCK_ENOMEM.
+ */
+int pcapscan_emit(struct PcapScan *scan, unsigned int worker, struct SpkTimeStamp *ts, void *data,
+                  unsigned int len);
+
+/**
+ * @brief Delivers the results of the last run ordered by timestamp.
+ *
+ * Results with the same timestamp emitted by the same worker keep their order.
+ * @param __IN__scan Pointer to PcapScan.
+ * @param on_result Called for each result, data is valid until the next run or pcapscan_close.
+ * @param arg Argument of on_result.
+ * @return On success returns the number of results delivered.
+ * Otherwise, a value < 0 shall be returned, you can use spark_strerror to get error message.
+ */
+long long pcapscan_merge(struct PcapScan *scan,
+                         void (*on_result)(struct SpkTimeStamp *ts, void *data, unsigned int len, void *arg),
+                         void *arg);
+
+/**
+ * @brief Unmaps the file and frees the memory occupied by PcapScan.
+ * @param __IN__scan Pointer to PcapScan.
+ */
+void pcapscan_close(struct PcapScan *scan);
+
+#endif
@@ -0,0 +1,187 @@
+/*
+ * Copyright (c) 2017 Jacopo De Luca
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+*/
+
+/**
+ * @file pcapwriter.h
+ * @brief Provides a capture writer that never blocks the capture thread.
+ *
+ * Packets are appended to large page aligned buffers (records may span two buffers), full buffers are
+ * handed to a background thread that writes them with O_DIRECT when the file system allows it.
+ * If all the buffers are waiting for the disk the packet is dropped and counted instead of waiting.
+ * Files are written in pcap (nanosecond magic) or pcapng (if_tsresol 9) format.
+ *
+ * With pcapw_open_ring the capture is split in files named `path`.0, `path`.1, ... rolled by size and/or time
+ * (packet timestamps) keeping only the last N files. The writer thread opens and preallocates the next file
+ * in advance and switches to it exactly at the record boundary chosen by the capture thread, so the files
+ * are contiguous and the capture thread never waits for the file system.
+ *
+ * Example:
+ * @code
+ * struct PcapWriter *pw;
+ * pcapw_open("out.pcapng", PCAPW_PCAPNG, spark_getltype(ssock), 0, &pw);
+ * while ((len = spark_read(ssock, buf, &ts)) >= 0)
+ *     pcapw_write(pw, buf, len, &ts);
+ * pcapw_close(pw);
+ * @endcode
+ */
+
+#ifndef SPARK_PCAPWRITER_H
+#define SPARK_PCAPWRITER_H
+
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "spksock.h"
+#include "pcapindex.h"
+
+#define PCAPW_BUFSIZE       (4 << 20)   // Size of each buffer (multiple of PCAPW_ALIGN)
+#define PCAPW_NBUFS         16          // Number of buffers
+#define PCAPW_ALIGN         4096        // Alignment required by O_DIRECT
+#define PCAPW_SNAPLEN       262144      // Default snapshot length
+#define PCAPW_LAST          0x80000000  // Buffer closes the current file
+
+/// @brief Output file format.
+enum PcapwFormat {
+    PCAPW_PCAP,
+    PCAPW_PCAPNG
+};
+
+/// @brief Writer statistics.
+struct PcapwStats {
+    /// @brief Packets queued for writing.
+    unsigned long packets;
+    /// @brief Packets dropped because all the buffers were full.
+    unsigned long dropped;
+    /// @brief Bytes written to the file.
+    unsigned long long written;
+    /// @brief Failed writes.
+    unsigned long errors;
+    /// @brief Files completed (ring mode).
+    unsigned long files;
+};
+
+/// @brief Contains the state of a capture writer (this struct is private).
+struct PcapWriter {
+    enum PcapwFormat format;
+    int lktype;
+    unsigned int snaplen;
+    int fd;
+    bool direct;
+    unsigned long long offset;
+    char *path;
+    char *name;
+    unsigned long long maxsize;
+    unsigned int maxsecs;
+    unsigned int maxfiles;
+    unsigned int seq;
+    int nextfd;
+    bool nextdirect;
+    unsigned long long fbytes;
+    long fstart;
+    struct PcapIdxBuilder *index;
+    unsigned char *mem;
+    unsigned int lens[PCAPW_NBUFS];
+    unsigned int fill;
+    atomic_uint head;
+    atomic_uint tail;
+    atomic_bool stop;
+    atomic_ulong packets;
+    atomic_ulong dropped;
+    atomic_ullong written;
+    atomic_ulong errors;
+    atomic_ulong files;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+};
+
+/**
+ * @brief Creates (or truncates) the file `path` and starts the writer thread.
+ * @param path File path.
+ * @param format File format.
+ * @param lktype Link type of the packets (DLT value, see spark_getltype).
+ * @param snaplen Packets longer than snaplen are truncated, 0 selects PCAPW_SNAPLEN.
+ * @param __OUT__writer Pointer to the new PcapWriter structure.
+ * @return Upon successful completion, pcapw_open() returns SPKSOCK_SUCCESS.
+ * Otherwise, a value < 0 shall be returned, you can use spark_strerror to get error message.
+ */
+int pcapw_open(char *path, enum PcapwFormat format, int lktype, unsigned int snaplen, struct PcapWriter **writer);
+
+/**
+ * @brief Starts a capture on a ring of files `path`.0, `path`.1, ...
+ *
+ * A new file is started when the next record would exceed maxsize bytes or when the packet timestamp is
+ * maxsecs seconds past the first packet of the current file (each file contains at least one packet).
+ * @param path Files path prefix.
+ * @param format File format.
+ * @param lktype Link type of the packets (DLT value, see spark_getltype).
+ * @param snaplen Packets longer than snaplen are truncated, 0 selects PCAPW_SNAPLEN.
+ * @param maxsize Maximum file size in bytes, 0 means no limit.
+ * @param maxsecs Maximum seconds of traffic per file, 0 means no limit.
+ * @param maxfiles Number of files to keep, the oldest is deleted when a new one is started; 0 keeps all files.
+ * @param __OUT__writer Pointer to the new PcapWriter structure.
+ * @return Upon successful completion, pcapw_open_ring() returns SPKSOCK_SUCCESS.
+ * Otherwise, a value < 0 shall be returned, you can use spark_strerror to get error message.
+ */
+int pcapw_open_ring(char *path, enum PcapwFormat format, int lktype, unsigned int snaplen, unsigned long long maxsize,
+                    unsigned int maxsecs, unsigned int maxfiles, struct PcapWriter **writer);
+
+/**
+ * @brief Queues a packet, never blocks.
+ *
+ * Must be called always from the same thread.
+ * @param __IN__writer Pointer to PcapWriter.
+ * @param __IN__pkt Pointer to the packet.
+ * @param len Packet length.
+ * @param __IN__ts Pointer to SpkTimeStamp contains the packet timestamp, if NULL the current time is used.
+ * @return Number of bytes queued (record header included), 0 if the packet was dropped.
+ */
+unsigned int pcapw_write(struct PcapWriter *writer, unsigned char *pkt, unsigned int len, struct SpkTimeStamp *ts);
+
+/**
+ * @brief Indexes the packets while they are written (see pcapindex.h).
+ *
+ * Only for pcap writers opened with pcapw_open, the index must be saved by the caller after pcapw_close
+ * (pcapidx_save fails if a record could not be indexed).
+ * Indexing runs on the capture thread.
+ * @param __IN__writer Pointer to PcapWriter.
+ * @param __IN__ib Pointer to PcapIdxBuilder, NULL to stop indexing.
+ * @return On success SPKSOCK_SUCCESS is returned, SPKSOCK_ENOSUPPORT for pcapng or ring writers.
+ */
+int pcapw_setindex(struct PcapWriter *writer, struct PcapIdxBuilder *ib);
+
+/**
+ * @brief Writes the queued packets, stops the writer thread and closes the file.
+ * @param __IN__writer Pointer to PcapWriter.
+ * @return SPKSOCK_SUCCESS if all data has been written, SPKSOCK_ERROR otherwise.
+ */
+int pcapw_close(struct PcapWriter *writer);
+
+/**
+ * @brief Obtains writer statistics.
+ * @param __IN__writer Pointer to PcapWriter.
+ * @param __OUT__stats Pointer to PcapwStats.
+ */
+void pcapw_stats(struct PcapWriter *writer, struct PcapwStats *stats);
+
+#endif
@@ -0,0 +1,203 @@
+/*
+ * Copyright (c) 2017 Jacopo De Luca
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+*/
+
+/**
+ * @file pmtu.h
+ * @brief Provides path MTU discovery and a per-destination PMTU cache.
+ *
+ * Discovery sends ICMP echo requests with the Don't Fragment flag set: a reply confirms the probe size,
+ * a fragmentation needed message (RFC 1191) lowers the upper bound to the MTU reported by the router.
+ * When ICMP errors are filtered, lost probes are treated as too big and the size is found with a binary
+ * search between confirmed and failed sizes (packetization layer PMTUD, RFC 4821).
+ * Fragmentation needed messages for other traffic of ours update the cache as well.
+ */
+
+#ifndef SPARK_PMTU_H
+#define SPARK_PMTU_H
+
+#include <stdbool.h>
+
+#include "datatype.h"
+#include "spksock.h"
+#include "ethernet.h"
+#include "ipv4.h"
+#include "timerwheel.h"
+
+#define PMTU_MINMTU         68      // RFC 791
+#define PMTU_DEFSIZE        1024    // Default number of buckets
+#define PMTU_DEFLINKMTU     1500
+#define PMTU_DEFEXPIRY      600000  // Milliseconds before a discovered PMTU is discarded (RFC 1191)
+#define PMTU_DEFTIMEOUT     1000    // Milliseconds before a probe is considered lost
+#define PMTU_DEFTRIES       3       // Probes of the same size before considering it too big
+#define PMTU_DEFGRANULARITY 8       // Search stops when bounds are closer than this
+
+/// @brief Discovery states.
+enum PmtuState {
+    PMTU_NONE,      // No entry
+    PMTU_SEARCHING, // Probe in flight
+    PMTU_DONE,      // PMTU known
+    PMTU_FAILED     // Destination does not answer, even to the smallest probe
+};
+
+/// @brief Destination entry.
+struct PmtuEntry {
+    struct TimerNode timer;
+    /// @brief Destination address.
+    struct netaddr_ip ip;
+    /// @brief Entry state.
+    enum PmtuState state;
+    /// @brief Path MTU (valid if state is PMTU_DONE).
+    unsigned short mtu;
+    /// @brief Largest size confirmed.
+    unsigned short lo;
+    /// @brief Largest size not known to fail.
+    unsigned short hi;
+    /// @brief Size of the probe in flight.
+    unsigned short probe;
+    /// @brief Sequence number of the probe in flight.
+    unsigned short sqn;
+    /// @brief Probes of the current size sent.
+    unsigned char tries;
+    /// @brief Expiration time (ms).
+    unsigned long long expires;
+    struct PmtuEntry *next;
+};
+
+/// @brief Cache statistics.
+struct PmtuStats {
+    /// @brief Probes sent.
+    unsigned long probes;
+    /// @brief Probes confirmed by an echo reply.
+    unsigned long confirmed;
+    /// @brief Fragmentation needed messages processed.
+    unsigned long fragneeded;
+    /// @brief Probes lost.
+    unsigned long lost;
+};
+
+/// @brief Contains the PMTU table and its settings.
+struct PmtuCache {
+    /// @brief Socket used for probing.
+    struct SpkSock *ssock;
+    /// @brief Source hardware address.
+    struct netaddr_mac hwaddr;
+    /// @brief Next hop hardware address.
+    struct netaddr_mac nexthop;
+    /// @brief Source IPv4 address.
+    struct netaddr_ip ipaddr;
+    /// @brief MTU of the outgoing link, upper bound of every search.
+    unsigned short link_mtu;
+    /// @brief ICMP identifier of the probes.
+    unsigned short id;
+    /// @brief Milliseconds before a discovered PMTU is discarded.
+    unsigned int expiry;
+    /// @brief Milliseconds before a probe is considered lost.
+    unsigned int timeout;
+    /// @brief Probes of the same size before considering it too big.
+    unsigned char max_tries;
+    /// @brief Search stops when bounds are closer than this.
+    unsigned short granularity;
+    /// @brief Called when a search completes or a PMTU changes.
+    void (*on_update)(struct PmtuEntry *entry, void *arg);
+    /// @brief Argument of on_update.
+    void *arg;
+    /// @brief Number of entries.
+    unsigned int count;
+    /// @brief Number of searches in progress.
+    unsigned int searching;
+    /// @brief Statistics.
+    struct PmtuStats stats;
+
+    struct PmtuEntry **table;
+    unsigned int mask;
+    unsigned short next_sqn;
+    unsigned int updates;
+    struct TimerWheel wheel;
+    unsigned char *frame;
+    unsigned char *rxbuf;
+};
+
+/**
+ * @brief Starts the discovery of the PMTU towards `dst`, nothing happens if a search is in progress
+ * or a valid PMTU is cached.
+ * @param __IN__cache Pointer to PmtuCache.
+ * @param __IN__dst Pointer to netaddr_ip structure contains the destination address.
+ * @return On success returns true, otherwise false is returned.
+ */
+bool pmtu_discover(struct PmtuCache *cache, struct netaddr_ip *dst);
+
+/**
+ * @brief Processes a frame, echo replies and fragmentation needed messages update the cache.
+ *
+ * Use it when the frames are read by your own loop instead of pmtu_poll.
+ * @param __IN__cache Pointer to PmtuCache.
+ * @param __IN__frame Pointer to Ethernet frame.
+ * @param len Frame length.
+ * @return Function returns true if the frame was consumed, false otherwise.
+ */
+bool pmtu_input(struct PmtuCache *cache, unsigned char *frame, unsigned int len);
+
+/**
+ * @brief Returns the cached PMTU towards `dst`.
+ * @param __IN__cache Pointer to PmtuCache.
+ * @param __IN__dst Pointer to netaddr_ip structure contains the destination address.
+ * @return The PMTU, or 0 if it is unknown or expired.
+ */
+unsigned short pmtu_lookup(struct PmtuCache *cache, struct netaddr_ip *dst);
+
+/**
+ * @brief Performs an iteration: waits up to `timeout` milliseconds for answers, processes them and retransmits
+ * lost probes.
+ * @param __IN__cache Pointer to PmtuCache.
+ * @param timeout Max wait in milliseconds.
+ * @return On success returns the number of searches completed or PMTUs changed.
+ * Otherwise, a value < 0 shall be returned, you can use spark_strerror to get error message.
+ */
+int pmtu_poll(struct PmtuCache *cache, int timeout);
+
+/**
+ * @brief Allocates a new PMTU cache.
+ *
+ * The link MTU is read from the socket interface, the socket is switched to non-blocking mode.
+ * @param __IN__ssock Pointer to SpkSock structure which handles the active raw socket.
+ * @param __IN__src Pointer to netaddr_ip structure contains the source address.
+ * @param __IN__nexthop Pointer to netaddr_mac structure contains the hardware address of the next hop.
+ * @param size Number of buckets (rounded to power of two), 0 means PMTU_DEFSIZE.
+ * @return On success returns the pointer to new PmtuCache, otherwise return NULL.
+ */
+struct PmtuCache *pmtu_new(struct SpkSock *ssock, struct netaddr_ip *src, struct netaddr_mac *nexthop,
+                           unsigned int size);
+
+/**
+ * @brief Removes the entry of `dst`, the next search restarts from the link MTU.
+ * @param __IN__cache Pointer to PmtuCache.
+ * @param __IN__dst Pointer to netaddr_ip structure contains the destination address.
+ */
+void pmtu_del(struct PmtuCache *cache, struct netaddr_ip *dst);
+
+/**
+ * @brief Frees the memory occupied by PmtuCache.
+ * @param __IN__cache Pointer to PmtuCache.
+ */
+void pmtu_free(struct PmtuCache *cache);
+
+#endif
@@ -0,0 +1,148 @@
+/*
+ * Copyright (c) 2017 Jacopo De Luca
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+*/
+
+/**
+ * @file replay.h
+ * @brief Provides a packet replay engine for pcap and pcapng captures.
+ *
+ * The capture is loaded once into memory (and locked there when possible), so loops never touch the
+ * file again. Packets are sent in batches with spark_writeb, each packet has a due time computed from an
+ * absolute schedule (original timing scaled by speed, fixed pps or fixed bps) so errors do not accumulate;
+ * the engine sleeps until `spin` nanoseconds before the due time and busy-waits the rest, then sends the
+ * packet together with the following ones that are already due (at most `batch`).
+ * If rewrite rules are set they are applied to a copy of each packet, the loaded capture never changes.
+ *
+ * Example:
+ * @code
+ * struct Replay *rp;
+ * replay_open("traffic.pcap", tx, &rp);
+ * rp->mode = REPLAY_TIMED;
+ * rp->speed = 2.0;
+ * rp->loops = 10;
+ * replay_run(rp);
+ * replay_close(rp);
+ * @endcode
+ */
+
+#ifndef SPARK_REPLAY_H
+#define SPARK_REPLAY_H
+
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#include "spksock.h"
+#include "rewrite.h"
+
+#define REPLAY_BATCH        64          // Default and largest number of packets per spark_writeb call
+#define REPLAY_SPIN         50000       // Default busy-wait before the due time (ns)
+
+/// @brief Pacing modes.
+enum ReplayMode {
+    /// @brief Original inter-packet gaps divided by speed.
+    REPLAY_TIMED,
+    /// @brief Fixed packets per second.
+    REPLAY_PPS,
+    /// @brief Fixed bits per second (captured bytes).
+    REPLAY_BPS,
+    /// @brief As fast as possible.
+    REPLAY_TOPSPEED
+};
+
+/// @brief Loaded packet (this struct is private).
+struct ReplayPkt {
+    unsigned char *data;
+    unsigned int len;
+    long long time;
+};
+
+/// @brief Contains replay settings and statistics.
+struct Replay {
+    /// @brief Pacing mode.
+    enum ReplayMode mode;
+    /// @brief Time multiplier for REPLAY_TIMED (2.0 replays twice as fast).
+    double speed;
+    /// @brief Packets per second (REPLAY_PPS) or bits per second (REPLAY_BPS).
+    unsigned long long rate;
+    /// @brief Number of passes over the capture, 0 means until replay_stop.
+    unsigned int loops;
+    /// @brief Largest batch passed to spark_writeb (1 - REPLAY_BATCH).
+    unsigned int batch;
+    /// @brief Nanoseconds of busy-wait before each due time, 0 only sleeps.
+    unsigned int spin;
+    /// @brief Rules applied before sending (can be NULL).
+    struct Rewrite *rewrite;
+    /// @brief Packets sent.
+    unsigned long long packets;
+    /// @brief Bytes sent.
+    unsigned long long bytes;
+    /// @brief Packets skipped because larger than the MTU of the interface.
+    unsigned long long skipped;
+    /// @brief Completed passes.
+    unsigned int passes;
+    /// @brief Largest delay of a packet from its due time (ns).
+    unsigned long long maxlag;
+    /// @brief Link type of the capture (DLT value).
+    int lktype;
+
+    struct SpkSock *tx;
+    unsigned char *arena;
+    unsigned long long size;
+    bool locked;
+    struct ReplayPkt *pkts;
+    unsigned long long npkts;
+    unsigned int maxlen;
+    atomic_bool stop;
+};
+
+/**
+ * @brief Loads a capture file and prepares its replay on socket tx.
+ * @param path Capture file path (pcap or pcapng).
+ * @param __IN__tx Pointer to SpkSock used to send the packets.
+ * @param __OUT__replay Pointer to the new Replay structure.
+ * @return Upon successful completion, replay_open() returns SPKSOCK_SUCCESS.
+ * If the capture is empty or its format is not recognized SPKSOCK_ENOSUPPORT is returned.
+ * Otherwise, a value < 0 shall be returned, you can use spark_strerror to get error message.
+ */
+int replay_open(char *path, struct SpkSock *tx, struct Replay **replay);
+
+/**
+ * @brief Replays the capture, returns when all loops are completed or replay_stop is called.
+ * @param __IN__replay Pointer to Replay.
+ * @return On success returns the number of packets sent, packets larger than the MTU are counted in skipped.
+ * If the link type of the socket or of the rules differs from the capture SPKSOCK_ENOSUPPORT is returned.
+ * Otherwise, a value < 0 shall be returned, you can use spark_strerror to get error message.
+ */
+long long replay_run(struct Replay *replay);
+
+/**
+ * @brief Stops a running replay, can be called from any thread.
+ * @param __IN__replay Pointer to Replay.
+ */
+void replay_stop(struct Replay *replay);
+
+/**
+ * @brief Frees the memory occupied by Replay, the socket is not closed.
+ * @param __IN__replay Pointer to Replay.
+ */
+void replay_close(struct Replay *replay);
+
+#endif
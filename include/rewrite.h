@@ -0,0 +1,198 @@
+/*
+ * Copyright (c) 2017 Jacopo De Luca
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+*/
+
+/**
+ * @file rewrite.h
+ * @brief Provides in-place rewriting of frame headers with incremental checksum updates.
+ *
+ * Rules remap MAC addresses, IPv4 addresses (exact or CIDR to CIDR keeping the host part), TCP/UDP ports,
+ * the VLAN id of the outer tag and the TTL. Source and destination fields are translated independently,
+ * so a single rule covers both directions of a flow.
+ * The IPv4, TCP and UDP checksums are updated from the changed fields only (RFC 1624) and never
+ * recomputed, packets truncated by the capture are handled as well. Ports are rewritten only in the
+ * first fragment of a datagram.
+ * The same Rewrite can be used by a replay (see Replay.rewrite) or by a forwarding loop:
+ *
+ * @code
+ * struct Rewrite *rw;
+ * rewrite_new(DLT_EN10MB, &rw);
+ * parse_ipv4cidr("192.168.0.0/16", &from, &prefix);
+ * parse_ipv4addr("10.20.0.0", &to.ip);
+ * rewrite_cidr(rw, &from, prefix, &to);
+ * rewrite_port(rw, 80, 8080);
+ * while ((len = spark_read(rx, buf, NULL)) > 0) {
+ *     rewrite_apply(rw, buf, len);
+ *     spark_write(tx, buf, len);
+ * }
+ * @endcode
+ */
+
+#ifndef SPARK_REWRITE_H
+#define SPARK_REWRITE_H
+
+#include <stdbool.h>
+
+#include "datatype.h"
+#include "spksock.h"
+
+#define REWRITE_ANYVLAN     -1      // Matches every VLAN id in rewrite_vlan
+#define REWRITE_NOVLAN      0xFFFF
+
+/// @brief MAC address rule (this struct is private).
+struct RewriteMac {
+    unsigned char from[6];
+    unsigned char to[6];
+};
+
+/// @brief IPv4 network rule (this struct is private).
+struct RewriteNet {
+    unsigned int from;
+    unsigned int mask;
+    unsigned int to;
+};
+
+/// @brief Exact IPv4 address rule (this struct is private).
+struct RewriteHost {
+    unsigned int from;
+    unsigned int to;
+    bool used;
+};
+
+/// @brief Contains the rewrite rules.
+struct Rewrite {
+    /// @brief Frames processed.
+    unsigned long long packets;
+    /// @brief Frames with at least a field changed.
+    unsigned long long modified;
+
+    int lktype;
+    struct RewriteMac *macs;
+    unsigned int nmacs;
+    bool set_smac;
+    bool set_dmac;
+    unsigned char smac[6];
+    unsigned char dmac[6];
+    struct RewriteHost *hosts;
+    unsigned int nhosts;
+    unsigned int hslots;
+    struct RewriteNet *nets;
+    unsigned int nnets;
+    unsigned short *ports;
+    unsigned short *vlans;
+    unsigned short anyvlan;
+    unsigned char ttl;
+    bool ttl_dec;
+};
+
+/**
+ * @brief Creates an empty set of rules.
+ * @param lktype Link type of the frames, DLT_EN10MB (up to 2 VLAN tags) or DLT_RAW.
+ * @param __OUT__rw Pointer to the new Rewrite structure.
+ * @return Upon successful completion, rewrite_new() returns SPKSOCK_SUCCESS.
+ * If the link type is not supported SPKSOCK_ENOSUPPORT is returned.
+ * Otherwise, a value < 0 shall be returned, you can use spark_strerror to get error message.
+ */
+int rewrite_new(int lktype, struct Rewrite **rw);
+
+/**
+ * @brief Replaces the MAC address `from` with `to` (source and destination).
+ * @param __IN__rw Pointer to Rewrite.
+ * @param __IN__from Pointer to netaddr_mac, address to replace.
+ * @param __IN__to Pointer to netaddr_mac, new address.
+ * @return On success SPKSOCK_SUCCESS is returned, otherwise SPKSOCK_ENOMEM.
+ */
+int rewrite_mac(struct Rewrite *rw, struct netaddr_mac *from, struct netaddr_mac *to);
+
+/**
+ * @brief Sets the MAC addresses of every frame, applied after the other MAC rules.
+ * @param __IN__rw Pointer to Rewrite.
+ * @param __IN__src Pointer to netaddr_mac, new source address (NULL leaves it unchanged).
+ * @param __IN__dst Pointer to netaddr_mac, new destination address (NULL leaves it unchanged).
+ */
+void rewrite_setmac(struct Rewrite *rw, struct netaddr_mac *src, struct netaddr_mac *dst);
+
+/**
+ * @brief Replaces the IPv4 address `from` with `to` (source and destination), takes precedence over the networks.
+ * @param __IN__rw Pointer to Rewrite.
+ * @param __IN__from Pointer to netaddr_ip, address to replace.
+ * @param __IN__to Pointer to netaddr_ip, new address.
+ * @return On success SPKSOCK_SUCCESS is returned, otherwise SPKSOCK_ENOMEM.
+ */
+int rewrite_ip(struct Rewrite *rw, struct netaddr_ip *from, struct netaddr_ip *to);
+
+/**
+ * @brief Moves the addresses of network `from`/`prefix` into network `to`, keeping the host part.
+ *
+ * When networks overlap the longest prefix wins.
+ * @param __IN__rw Pointer to Rewrite.
+ * @param __IN__from Pointer to netaddr_ip, network to replace.
+ * @param prefix Prefix length.
+ * @param __IN__to Pointer to netaddr_ip, new network.
+ * @return On success SPKSOCK_SUCCESS is returned.
+ * If prefix is greater than 32 SPKSOCK_ERROR is returned, otherwise SPKSOCK_ENOMEM.
+ */
+int rewrite_cidr(struct Rewrite *rw, struct netaddr_ip *from, unsigned char prefix, struct netaddr_ip *to);
+
+/**
+ * @brief Replaces the TCP and UDP port `from` with `to` (source and destination).
+ * @param __IN__rw Pointer to Rewrite.
+ * @param from Port to replace.
+ * @param to New port (not 0).
+ * @return On success SPKSOCK_SUCCESS is returned.
+ * If to is 0 SPKSOCK_ERROR is returned, otherwise SPKSOCK_ENOMEM.
+ */
+int rewrite_port(struct Rewrite *rw, unsigned short from, unsigned short to);
+
+/**
+ * @brief Replaces the VLAN id of the outer tag.
+ * @param __IN__rw Pointer to Rewrite.
+ * @param from VLAN id to replace, REWRITE_ANYVLAN for every tagged frame without a specific rule.
+ * @param to New VLAN id.
+ * @return On success SPKSOCK_SUCCESS is returned.
+ * If the VLAN ids are not valid SPKSOCK_ERROR is returned, otherwise SPKSOCK_ENOMEM.
+ */
+int rewrite_vlan(struct Rewrite *rw, int from, unsigned short to);
+
+/**
+ * @brief Sets or decrements the TTL of IPv4 packets.
+ * @param __IN__rw Pointer to Rewrite.
+ * @param ttl New TTL, or the amount to subtract if dec is true (the TTL never goes below 1), 0 disables the rule.
+ * @param dec Decrement instead of setting.
+ */
+void rewrite_ttl(struct Rewrite *rw, unsigned char ttl, bool dec);
+
+/**
+ * @brief Applies the rules to a frame in place.
+ * @param __IN__rw Pointer to Rewrite.
+ * @param __IN__frame Pointer to the frame.
+ * @param len Frame length (captured length).
+ * @return Number of fields changed.
+ */
+unsigned int rewrite_apply(struct Rewrite *rw, unsigned char *frame, unsigned int len);
+
+/**
+ * @brief Frees the memory occupied by Rewrite.
+ * @param __IN__rw Pointer to Rewrite.
+ */
+void rewrite_free(struct Rewrite *rw);
+
+#endif
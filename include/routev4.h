@@ -23,16 +23,70 @@
 /**
  * @file routev4.h
  * @brief Provides useful functions for manage kernel IPv4 routing table.
+ *
+ * routev4_load takes a snapshot of the main routing table and compiles it in a DIR-24-8 structure:
+ * a 2^24 entries table indexed by the first 24 bits of the destination and 256 entries tables for the
+ * prefixes longer than /24, a lookup costs one or two memory accesses.
+ * The snapshot is not updated when the kernel table changes.
  */
 
 #ifndef SPARK_ROUTEV4_H
 #define SPARK_ROUTEV4_H
 
 #include <stdbool.h>
+#include <net/if.h>
 #include "datatype.h"
 
 #define ROUTETABLE   "/proc/net/route"
 
+#define ROUTEV4_TBL24       (1 << 24)
+#define ROUTEV4_TBL8        256
+#define ROUTEV4_EXTENDED    0x8000      // The entry is the index of a tbl8 group
+#define ROUTEV4_MAXNH       0x7FFF      // Max number of distinct next hops
+
+/// @brief Next hop of a route.
+struct Route4Nexthop {
+    /// @brief Gateway address, 0 if the destination is directly connected.
+    struct netaddr_ip gateway;
+    /// @brief Preferred source address, 0 if not specified.
+    struct netaddr_ip prefsrc;
+    /// @brief Output interface index.
+    unsigned int ifindex;
+    /// @brief Output interface name.
+    char ifname[IF_NAMESIZE];
+};
+
+/// @brief Route of the snapshot.
+struct Route4Entry {
+    /// @brief Destination network.
+    struct netaddr_ip dst;
+    /// @brief Prefix length.
+    unsigned char prefix;
+    /// @brief Route priority, lower is preferred.
+    unsigned int metric;
+    /// @brief Index of the next hop.
+    unsigned short nh;
+};
+
+/// @brief Snapshot of the IPv4 routing table.
+struct Route4Table {
+    /// @brief Routes.
+    struct Route4Entry *routes;
+    /// @brief Number of routes.
+    unsigned int nroutes;
+    /// @brief Next hops, shared between routes.
+    struct Route4Nexthop *nexthops;
+    /// @brief Number of next hops.
+    unsigned int nnexthops;
+
+    unsigned short *tbl24;
+    unsigned short *tbl8;
+    unsigned int ntbl8;
+    unsigned int maxtbl8;
+    unsigned int maxroutes;
+    unsigned int maxnexthops;
+};
+
 /**
  * @brief Obtains the address of default gateway.
  * @param iface_name Interface name.
@@ -41,4 +95,51 @@
  */
 bool get_defgateway(char *iface_name, struct netaddr_ip *gateway);
 
+/**
+ * @brief Adds a route to the snapshot, the lookup structure is rebuilt by routev4_build.
+ * @param __IN__tbl Pointer to Route4Table.
+ * @param __IN__dst Pointer to netaddr_ip structure contains the destination network.
+ * @param prefix Prefix length.
+ * @param metric Route priority, lower is preferred.
+ * @param __IN__nh Pointer to Route4Nexthop.
+ * @return Function returns true if the route has been added, false otherwise.
+ */
+bool routev4_add(struct Route4Table *tbl, struct netaddr_ip *dst, unsigned char prefix, unsigned int metric,
+                 struct Route4Nexthop *nh);
+
+/**
+ * @brief Compiles the routes in the lookup structure.
+ * @param __IN__tbl Pointer to Route4Table.
+ * @return Function returns true on success, false otherwise.
+ */
+bool routev4_build(struct Route4Table *tbl);
+
+/**
+ * @brief Loads the main IPv4 routing table (RTM_GETROUTE dump) and compiles it.
+ *
+ * Only unicast routes are considered, for multipath routes the first next hop is used.
+ * @return On success returns the pointer to new Route4Table, otherwise return NULL.
+ */
+struct Route4Table *routev4_load();
+
+/**
+ * @brief Finds the longest prefix matching the destination.
+ * @param __IN__tbl Pointer to Route4Table.
+ * @param __IN__dst Pointer to netaddr_ip structure contains the destination address.
+ * @return Pointer to the next hop, NULL if there is no route.
+ */
+struct Route4Nexthop *routev4_lookup(struct Route4Table *tbl, struct netaddr_ip *dst);
+
+/**
+ * @brief Allocates an empty routing table snapshot, fill it with routev4_add and routev4_build.
+ * @return On success returns the pointer to new Route4Table, otherwise return NULL.
+ */
+struct Route4Table *routev4_new();
+
+/**
+ * @brief Frees the memory occupied by Route4Table.
+ * @param __IN__tbl Pointer to Route4Table.
+ */
+void routev4_free(struct Route4Table *tbl);
+
 #endif
@@ -0,0 +1,71 @@
+/*
+ * Copyright (c) 2017 Jacopo De Luca
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+*/
+
+/**
+ * @file spkrand.h
+ * @brief Provides a fast per-thread pseudo random number generator.
+ *
+ * Every thread owns an independent xoshiro256** state, lazily seeded from the kernel entropy pool
+ * the first time the thread asks for a number. The generator is not suitable for cryptographic use.
+ */
+
+#ifndef SPARK_SPKRAND_H
+#define SPARK_SPKRAND_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief Obtains a random number in the range [0, bound).
+ * @param bound Upper bound (excluded), must be greater than zero.
+ * @return The function returns a random number lower than bound.
+ */
+uint32_t spkrand_bounded(uint32_t bound);
+
+/**
+ * @brief Obtains 32 random bits.
+ * @return The function returns a random number.
+ */
+uint32_t spkrand_u32();
+
+/**
+ * @brief Obtains 64 random bits.
+ * @return The function returns a random number.
+ */
+uint64_t spkrand_u64();
+
+/**
+ * @brief Fills the bufer pointed by `buf` with random bytes.
+ * @param __OUT__buf Pointer to bufer.
+ * @param len Bufer length.
+ */
+void spkrand_bytes(void *buf, size_t len);
+
+/**
+ * @brief Reseeds the generator of the calling thread.
+ *
+ * Useful to get reproducible sequences, the other threads are not affected.
+ * @param seed New seed.
+ */
+void spkrand_seed(uint64_t seed);
+
+#endif
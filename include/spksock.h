@@ -42,6 +42,7 @@
 #define SPKSOCK_ENODEV      -6
 #define SPKSOCK_EINTR       -7
 #define SPKSOCK_ESIZE       -8
+#define SPKSOCK_EOF         -9
 
 /// @brief Define packets direction.
 enum SpkDirection {
@@ -68,6 +69,18 @@ struct SpkTimeStamp {
     enum SpkTimesPrc prc;
 };
 
+/// @brief Classic BPF instruction, same layout of Linux `struct sock_filter` and BSD `struct bpf_insn`.
+struct SpkFilterInsn {
+    /// @brief Opcode.
+    unsigned short code;
+    /// @brief Jump offset if true.
+    unsigned char jt;
+    /// @brief Jump offset if false.
+    unsigned char jf;
+    /// @brief Generic field.
+    unsigned int k;
+};
+
 /// @brief Socket statistics.
 struct SpkStats {
     /// @brief Total packets received.
@@ -93,16 +106,22 @@ struct SpkSock {
     void *aux;
 
     struct {
-        int (*read)(struct SpkSock *, unsigned char *, struct SpkTimeStamp *);
+        int (*read)(struct SpkSock *, unsigned char *, unsigned int, struct SpkTimeStamp *);
+
+        int (*next)(struct SpkSock *, unsigned char **, struct SpkTimeStamp *);
 
         int (*setdir)(struct SpkSock *, enum SpkDirection);
 
+        int (*setfilter)(struct SpkSock *, struct SpkFilterInsn *, unsigned int);
+
         int (*setprc)(struct SpkSock *, enum SpkTimesPrc);
 
         int (*setpromisc)(struct SpkSock *, bool promisc);
 
         int (*write)(struct SpkSock *, unsigned char *, unsigned int);
 
+        int (*writeb)(struct SpkSock *, unsigned char **, unsigned int *, unsigned int);
+
         int (*setnblk)(struct SpkSock *, bool nonblock);
 
         void (*finalize)(struct SpkSock *);
@@ -123,6 +142,36 @@ char *spark_strerror(int error);
  */
 int spark_getltype(struct SpkSock *ssock);
 
+/**
+ * @brief Returns the next packet without copying it (zero-copy).
+ *
+ * Only supported by file-backed sockets (see spark_openfile), the packet is not copied and
+ * remains valid until spark_close() is called.
+ * @param __IN__ssock Pointer to SpkSock structure which handles the active raw socket.
+ * @param __OUT__pkt Pointer to the first byte of the packet.
+ * @param __OUT__ts Pointer to SpkTimeStamp structure to handle packet timestamp (can be NULL).
+ * @return Upon successful completion, spark_next() shall return the captured length of the packet in bytes.
+ * At the end of the capture SPKSOCK_EOF is returned.
+ * Otherwise, a value < 0 shall be returned, you can use spark_strerror to get error message.
+ */
+int spark_next(struct SpkSock *ssock, unsigned char **pkt, struct SpkTimeStamp *ts);
+
+/**
+ * @brief Open a pcap or pcapng capture file as read-only socket.
+ *
+ * The file is memory-mapped and read sequentially, packets are returned by spark_read or spark_next
+ * and the link type is taken from the file (with pcapng it follows the interface of the last packet read).
+ * When the capture is exhausted the read functions return SPKSOCK_EOF, reads never block and writing
+ * is not supported (spark_setnblock and spark_write return SPKSOCK_ENOSUPPORT).
+ * @param path Capture file path.
+ * @param bufl Set length of buffer for read operation.
+ * @param __OUT__ssock Pointer to the empty SpkSock structure.
+ * @return Upon successful completion, spark_openfile() returns SPKSOCK_SUCCESS.
+ * If the file format is not recognized SPKSOCK_ENOSUPPORT is returned.
+ * Otherwise, a value < 0 shall be returned, you can use spark_strerror to get error message.
+ */
+int spark_openfile(char *path, unsigned int buflen, struct SpkSock **ssock);
+
 /**
  * @brief Open raw socket on selected network device.
  * @param device Interface name.
@@ -144,6 +193,16 @@ int spark_opensock(char *device, unsigned int buflen, struct SpkSock **ssock);
  */
 int spark_read(struct SpkSock *ssock, unsigned char *buf, struct SpkTimeStamp *ts);
 
+/**
+ * @brief Receive data from the raw socket into a buffer of the given length instead of the socket one.
+ * @param __IN__ssock Pointer to SpkSock structure which handles the active raw socket.
+ * @param __OUT__buf Pointer to buffer.
+ * @param len Buffer length, longer packets are truncated.
+ * @param __OUT__ts Pointer to SpkTimeStamp structure to handle packet timestamp (can be NULL).
+ * @return Same as spark_read().
+ */
+int spark_readlen(struct SpkSock *ssock, unsigned char *buf, unsigned int len, struct SpkTimeStamp *ts);
+
 /**
  * @brief Set packets direction filter.
  *
@@ -156,6 +215,18 @@ int spark_read(struct SpkSock *ssock, unsigned char *buf, struct SpkTimeStamp *t
  */
 int spark_setdirection(struct SpkSock *ssock, enum SpkDirection direction);
 
+/**
+ * @brief Attach a classic BPF program to the socket.
+ *
+ * Packets rejected by the program are discarded by the kernel and never copied to user space.
+ * @param __IN__ssock Pointer to SpkSock structure which handles the active raw socket.
+ * @param __IN__insns Pointer to array of SpkFilterInsn.
+ * @param len Number of instructions.
+ * @return On success, SPKSOCK_SUCCESS is returned.
+ * Otherwise, a value < 0 shall be returned, you can use spark_strerror to get error message.
+ */
+int spark_setfilter(struct SpkSock *ssock, struct SpkFilterInsn *insns, unsigned int len);
+
 /**
  * @brief Set socket blocking mode.
  * @param __IN__ssock Pointer to SpkSock structure which handles the active raw socket.
@@ -194,6 +265,19 @@ int spark_settsprc(struct SpkSock *ssock, enum SpkTimesPrc prc);
  */
 int spark_write(struct SpkSock *ssock, unsigned char *buf, unsigned int len);
 
+/**
+ * @brief Send a batch of frames to the raw socket.
+ *
+ * Where supported (Linux) the whole batch is sent with a single system call.
+ * @param __IN__ssock Pointer to SpkSock structure which handles the active raw socket.
+ * @param __IN__bufs Pointer to array of buffers.
+ * @param __IN__lens Pointer to array of buffer lengths.
+ * @param count Number of frames.
+ * @return On success, the number of frames sent is returned.
+ * Otherwise, a value < 0 shall be returned, you can use spark_strerror to get error message.
+ */
+int spark_writeb(struct SpkSock *ssock, unsigned char **bufs, unsigned int *lens, unsigned int count);
+
 /**
  * @brief Close raw socket.
  *
@@ -0,0 +1,112 @@
+/*
+ * Copyright (c) 2017 Jacopo De Luca
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+*/
+
+/**
+ * @file timerwheel.h
+ * @brief Provides a hierarchical timer wheel for managing large numbers of timeouts.
+ *
+ * Timers are intrusive: the TimerNode is embedded in the caller structure, so adding and removing
+ * a timer never allocates memory and costs O(1). Time is expressed in ticks, the meaning of a tick
+ * (e.g. one millisecond) is up to the caller.
+ */
+
+#ifndef SPARK_TIMERWHEEL_H
+#define SPARK_TIMERWHEEL_H
+
+#include <stdbool.h>
+
+#define TWHEEL_LEVELS   4
+#define TWHEEL_BITS     8
+#define TWHEEL_SLOTS    (1 << TWHEEL_BITS)
+#define TWHEEL_MASK     (TWHEEL_SLOTS - 1)
+
+struct TimerNode;
+
+/// @brief Timer callback, invoked by twheel_advance when the timer expires.
+typedef void (*twheel_cb)(struct TimerNode *node, void *arg);
+
+/// @brief Timer, embed it in your own structure.
+struct TimerNode {
+    struct TimerNode *next;
+    struct TimerNode **pprev;
+    /// @brief Expiration tick.
+    unsigned long long expires;
+    /// @brief Callback.
+    twheel_cb cb;
+    /// @brief Callback argument.
+    void *arg;
+};
+
+/// @brief Contains the wheel levels.
+struct TimerWheel {
+    struct TimerNode *slots[TWHEEL_LEVELS][TWHEEL_SLOTS];
+    /// @brief Next tick to be processed.
+    unsigned long long next;
+    /// @brief Number of pending timers.
+    unsigned int count;
+};
+
+/**
+ * @brief Checks if the timer is scheduled.
+ * @param __IN__node Pointer to TimerNode.
+ * @return Function returns true if the timer is pending, false otherwise.
+ */
+bool twheel_pending(struct TimerNode *node);
+
+/**
+ * @brief Advances the wheel up to tick `now`, firing all expired timers.
+ *
+ * Callbacks may add or delete timers (including the expired one).
+ * @param __IN__wheel Pointer to TimerWheel.
+ * @param now Current tick.
+ * @return Number of timers fired.
+ */
+unsigned int twheel_advance(struct TimerWheel *wheel, unsigned long long now);
+
+/**
+ * @brief Schedules a timer, if the timer is already pending it is rescheduled.
+ *
+ * Timers that expire in the past fire on the next twheel_advance.
+ * @param __IN__wheel Pointer to TimerWheel.
+ * @param __IN__node Pointer to TimerNode.
+ * @param expires Expiration tick.
+ * @param cb Callback.
+ * @param arg Callback argument.
+ */
+void twheel_add(struct TimerWheel *wheel, struct TimerNode *node, unsigned long long expires, twheel_cb cb,
+                void *arg);
+
+/**
+ * @brief Cancels a pending timer, nothing happens if the timer is not pending.
+ * @param __IN__wheel Pointer to TimerWheel.
+ * @param __IN__node Pointer to TimerNode.
+ */
+void twheel_del(struct TimerWheel *wheel, struct TimerNode *node);
+
+/**
+ * @brief Initializes an empty wheel.
+ * @param __OUT__wheel Pointer to TimerWheel.
+ * @param now Current tick.
+ */
+void twheel_init(struct TimerWheel *wheel, unsigned long long now);
+
+#endif
@@ -0,0 +1,237 @@
+/*
+ * Copyright (c) 2017 Jacopo De Luca
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+*/
+
+/**
+ * @file traceroute.h
+ * @brief Provides an engine for tracing the path to many destinations concurrently.
+ *
+ * Probes with increasing TTL are sent to all targets at once, the answers (ICMP time exceeded or
+ * destination unreachable) are matched to the probe by parsing the IPv4 and L4 headers quoted by the router.
+ * Every probe carries a 16-bit key: in the echo sequence number (ICMP), in the IPv4 id (UDP) or in the
+ * sequence number (TCP SYN); the flow fields stay constant for all probes so that load balancers keep the path stable.
+ * Low TTLs share the first routers, so besides the global rate every TTL has its own rate limit.
+ */
+
+#ifndef SPARK_TRACEROUTE_H
+#define SPARK_TRACEROUTE_H
+
+#include <stdbool.h>
+
+#include "datatype.h"
+#include "spksock.h"
+#include "ethernet.h"
+#include "ipv4.h"
+#include "timerwheel.h"
+
+#define TRACE_MAXTTL        64
+#define TRACE_DEFMAXTTL     30
+#define TRACE_DEFPPS        5000    // Probes per second
+#define TRACE_DEFHOPPPS     500     // Probes per second for every TTL
+#define TRACE_DEFTIMEOUT    2000    // Milliseconds before a probe is considered lost
+#define TRACE_DEFWINDOW     4       // In-flight probes per target
+#define TRACE_DEFGAPLIMIT   5       // Consecutive silent hops before giving up
+#define TRACE_DEFACTIVE     1024    // Targets traced at the same time
+#define TRACE_DEFUDPPORT    33434
+#define TRACE_DEFTCPPORT    80
+
+/// @brief Probe protocol.
+enum TraceProto {
+    TRACE_UDP,
+    TRACE_ICMP,
+    TRACE_TCP
+};
+
+/// @brief Hop answer.
+enum TraceHopStatus {
+    TRACEHOP_NONE,          // No answer
+    TRACEHOP_TIMEEXCEEDED,  // Intermediate router
+    TRACEHOP_UNREACHABLE,   // Destination unreachable (port unreachable from the target itself ends the trace)
+    TRACEHOP_REPLY          // Echo reply, SYN/ACK or RST from the target
+};
+
+/// @brief Single hop, the hop of TTL n is at index n - 1.
+struct TraceHop {
+    /// @brief Address that answered.
+    struct netaddr_ip addr;
+    /// @brief Round trip time in microseconds.
+    unsigned int rtt;
+    /// @brief Hop answer (TraceHopStatus).
+    unsigned char status;
+    /// @brief ICMP code of the answer (TCP flags for TCP replies).
+    unsigned char code;
+    /// @brief TTL of the answer.
+    unsigned char ttl;
+};
+
+/// @brief Trace state of a single destination.
+struct TraceTarget {
+    /// @brief Destination address.
+    struct netaddr_ip ip;
+    /// @brief User data passed to traceroute_add.
+    void *udata;
+    /// @brief Number of meaningful hops: the destination distance if reached, otherwise the last answering hop.
+    unsigned char nhops;
+    /// @brief True if the destination answered.
+    bool reached;
+    /// @brief True if the trace is complete.
+    bool done;
+
+    unsigned char next_ttl;
+    unsigned char outstanding;
+    unsigned char gaps;
+    unsigned int active;
+};
+
+/// @brief In-flight probe.
+struct TraceSlot {
+    struct TimerNode timer;
+    unsigned long long sent;
+    unsigned int target;
+    unsigned char ttl;
+    bool busy;
+};
+
+/// @brief Engine statistics.
+struct TraceStats {
+    /// @brief Probes sent.
+    unsigned long sent;
+    /// @brief Probes answered.
+    unsigned long answered;
+    /// @brief Probes timed out.
+    unsigned long timeouts;
+    /// @brief Answers that did not match any in-flight probe.
+    unsigned long unmatched;
+};
+
+/// @brief Contains the engine settings and state.
+struct Traceroute {
+    /// @brief Socket used for sending and receiving.
+    struct SpkSock *ssock;
+    /// @brief Source hardware address.
+    struct netaddr_mac hwaddr;
+    /// @brief Next hop hardware address.
+    struct netaddr_mac nexthop;
+    /// @brief Source IPv4 address.
+    struct netaddr_ip ipaddr;
+    /// @brief Probe protocol.
+    enum TraceProto proto;
+    /// @brief Source port (UDP/TCP) or ICMP identifier.
+    unsigned short port;
+    /// @brief Destination port (UDP/TCP).
+    unsigned short dport;
+    /// @brief First TTL probed.
+    unsigned char first_ttl;
+    /// @brief Last TTL probed (max TRACE_MAXTTL).
+    unsigned char max_ttl;
+    /// @brief In-flight probes per target.
+    unsigned char window;
+    /// @brief Consecutive silent hops before giving up.
+    unsigned char gaplimit;
+    /// @brief Probes per second, 0 means no limit.
+    unsigned int pps;
+    /// @brief Probes per second for every TTL, 0 means no limit.
+    unsigned int hop_pps;
+    /// @brief Milliseconds before a probe is considered lost.
+    unsigned int timeout;
+    /// @brief Targets traced at the same time (set it before the first traceroute_poll).
+    unsigned int max_active;
+    /// @brief Called when a target trace is complete.
+    void (*on_done)(struct TraceTarget *target, struct TraceHop *hops, void *arg);
+    /// @brief Argument of on_done.
+    void *arg;
+    /// @brief Statistics.
+    struct TraceStats stats;
+
+    struct TraceTarget *targets;
+    struct TraceHop *hops;
+    unsigned int ntargets;
+    unsigned int cap;
+    unsigned int next_target;
+    unsigned int ndone;
+    unsigned int *active;
+    unsigned int nactive;
+    unsigned int cursor;
+    struct TraceSlot *slots;
+    unsigned short next_key;
+    unsigned int outstanding;
+    struct TimerWheel wheel;
+    double tokens;
+    double hop_tokens[TRACE_MAXTTL + 1];
+    unsigned long long last_refill;
+    unsigned char *frames;
+    unsigned char *rxbuf;
+};
+
+/**
+ * @brief Checks if all targets have been traced.
+ * @param __IN__tr Pointer to Traceroute.
+ * @return Function returns true if there is no more work, false otherwise.
+ */
+bool traceroute_done(struct Traceroute *tr);
+
+/**
+ * @brief Returns the hops of a target.
+ * @param __IN__tr Pointer to Traceroute.
+ * @param index Index of the target (in order of traceroute_add).
+ * @return Pointer to the first of max_ttl hops.
+ */
+struct TraceHop *traceroute_hops(struct Traceroute *tr, unsigned int index);
+
+/**
+ * @brief Adds a target, max_ttl cannot be changed after the first target has been added.
+ * @param __IN__tr Pointer to Traceroute.
+ * @param __IN__target Pointer to netaddr_ip structure contains the destination address.
+ * @param udata User data returned with the result.
+ * @return On success returns true, otherwise false is returned.
+ */
+bool traceroute_add(struct Traceroute *tr, struct netaddr_ip *target, void *udata);
+
+/**
+ * @brief Performs an engine iteration: sends the probes allowed by the rates, waits up to `timeout`
+ * milliseconds for answers, processes them and expires lost probes.
+ * @param __IN__tr Pointer to Traceroute.
+ * @param timeout Max wait in milliseconds.
+ * @return On success returns the number of targets completed.
+ * Otherwise, a value < 0 shall be returned, you can use spark_strerror to get error message.
+ */
+int traceroute_poll(struct Traceroute *tr, int timeout);
+
+/**
+ * @brief Allocates a new traceroute engine.
+ *
+ * The socket is switched to non-blocking mode and nanosecond timestamps (if supported).
+ * @param __IN__ssock Pointer to SpkSock structure which handles the active raw socket.
+ * @param __IN__src Pointer to netaddr_ip structure contains the source address.
+ * @param __IN__nexthop Pointer to netaddr_mac structure contains the hardware address of the next hop.
+ * @param proto Probe protocol.
+ * @return On success returns the pointer to new Traceroute, otherwise return NULL.
+ */
+struct Traceroute *traceroute_new(struct SpkSock *ssock, struct netaddr_ip *src, struct netaddr_mac *nexthop,
+                                  enum TraceProto proto);
+
+/**
+ * @brief Frees the memory occupied by Traceroute.
+ * @param __IN__tr Pointer to Traceroute.
+ */
+void traceroute_free(struct Traceroute *tr);
+
+#endif
@@ -0,0 +1,346 @@
+/*
+ * Copyright (c) 2017 Jacopo De Luca
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <datatype.h>
+#include <ethernet.h>
+#include <arp.h>
+#include <arpcache.h>
+
+#define ARPC_TPAOFF (ETHHDRSIZE + ARPHDRSIZE + ETHHWASIZE + IPV4ADDRSIZE + ETHHWASIZE)
+
+static unsigned long long __arpc_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static inline unsigned int __arpc_hash(struct ArpCache *cache, unsigned int ip) {
+    unsigned int h = ip * 0x9E3779B1U;
+    return (h ^ (h >> 16)) & cache->mask;
+}
+
+static struct ArpEntry **__arpc_find(struct ArpCache *cache, struct netaddr_ip *ip) {
+    struct ArpEntry **curr = &cache->table[__arpc_hash(cache, ip->ip)];
+    for (; *curr != NULL && (*curr)->ip.ip != ip->ip; curr = &(*curr)->next);
+    return curr;
+}
+
+static struct ArpEntry *__arpc_insert(struct ArpCache *cache, struct netaddr_ip *ip) {
+    struct ArpEntry **head = &cache->table[__arpc_hash(cache, ip->ip)];
+    struct ArpEntry *entry;
+
+    if ((entry = (struct ArpEntry *) calloc(1, sizeof(struct ArpEntry))) == NULL)
+        return NULL;
+    entry->ip.ip = ip->ip;
+    entry->next = *head;
+    *head = entry;
+    cache->count++;
+    return entry;
+}
+
+static void __arpc_drop_queue(struct ArpCache *cache, struct ArpEntry *entry) {
+    struct ArpPending *tmp;
+    while (entry->qhead != NULL) {
+        tmp = entry->qhead->next;
+        free(entry->qhead);
+        entry->qhead = tmp;
+        cache->stats.dropped++;
+    }
+    entry->qtail = NULL;
+    entry->qlen = 0;
+}
+
+static void __arpc_remove(struct ArpCache *cache, struct ArpEntry **link) {
+    struct ArpEntry *entry = *link;
+    *link = entry->next;
+    __arpc_drop_queue(cache, entry);
+    free(entry);
+    cache->count--;
+}
+
+static void __arpc_probe(struct ArpCache *cache, struct ArpEntry *entry, unsigned long long now) {
+    struct EthHeader *eth = (struct EthHeader *) cache->request;
+
+    // Stale entries are refreshed with unicast requests, unknown ones with broadcast
+    if (entry->state == ARPST_STALE)
+        memcpy(eth->dhwaddr, entry->mac.mac, ETHHWASIZE);
+    else
+        memset(eth->dhwaddr, 0xFF, ETHHWASIZE);
+    memcpy(cache->request + ARPC_TPAOFF, &entry->ip.ip, IPV4ADDRSIZE);
+    spark_write(cache->ssock, cache->request, sizeof(cache->request));
+    cache->stats.requests++;
+    entry->probes++;
+    entry->next_probe = now + cache->retrans_time;
+}
+
+static int __arpc_xmit(struct ArpCache *cache, struct ArpEntry *entry, unsigned char *frame, unsigned int len) {
+    struct EthHeader *eth = (struct EthHeader *) frame;
+    memcpy(eth->dhwaddr, entry->mac.mac, ETHHWASIZE);
+    memcpy(eth->shwaddr, cache->hwaddr.mac, ETHHWASIZE);
+    return spark_write(cache->ssock, frame, len);
+}
+
+static void __arpc_flush(struct ArpCache *cache, struct ArpEntry *entry) {
+    struct ArpPending *tmp;
+    while (entry->qhead != NULL) {
+        tmp = entry->qhead->next;
+        if (__arpc_xmit(cache, entry, entry->qhead->frame, entry->qhead->len) > 0)
+            cache->stats.flushed++;
+        else
+            cache->stats.dropped++;
+        free(entry->qhead);
+        entry->qhead = tmp;
+    }
+    entry->qtail = NULL;
+    entry->qlen = 0;
+}
+
+static struct ArpEntry *__arpc_resolve(struct ArpCache *cache, struct netaddr_ip *ip, unsigned long long now) {
+    struct ArpEntry *entry = *__arpc_find(cache, ip);
+
+    if (entry == NULL) {
+        if ((entry = __arpc_insert(cache, ip)) == NULL)
+            return NULL;
+        entry->state = ARPST_INCOMPLETE;
+        __arpc_probe(cache, entry, now);
+        return entry;
+    }
+
+    entry->used = now;
+    switch (entry->state) {
+        case ARPST_INCOMPLETE:
+            if (now >= entry->next_probe && entry->probes < cache->max_probes)
+                __arpc_probe(cache, entry, now);
+            break;
+        case ARPST_REACHABLE:
+            if (now - entry->confirmed < cache->reachable_time)
+                break;
+            entry->state = ARPST_STALE;
+            entry->probes = 0;
+            // fallthrough
+        case ARPST_STALE:
+            if (entry->probes == 0 || (now >= entry->next_probe && entry->probes < cache->max_probes))
+                __arpc_probe(cache, entry, now);
+            break;
+        default:
+            break;
+    }
+    return entry;
+}
+
+bool arpcache_input(struct ArpCache *cache, unsigned char *frame, unsigned int len) {
+    struct EthHeader *eth = (struct EthHeader *) frame;
+    struct ArpPacket *arp = (struct ArpPacket *) eth->data;
+    struct ArpEntry *entry;
+    struct netaddr_ip sip;
+    struct netaddr_ip tip;
+
+    if (len < ETHHDRSIZE + ARPETHIPSIZE || eth->eth_type != htons(ETHTYPE_ARP))
+        return false;
+    if (arp->hwalen != ETHHWASIZE || arp->pralen != IPV4ADDRSIZE || arp->proto != htons(ETHTYPE_IP))
+        return false;
+
+    sip = arp_getaddr_s(arp);
+    tip = arp_getaddr_d(arp);
+    // Skips ARP probes (RFC 5227) and our own traffic
+    if (sip.ip == 0 || sip.ip == cache->ipaddr.ip)
+        return false;
+
+    if ((entry = *__arpc_find(cache, &sip)) == NULL) {
+        if (!cache->learn_all && tip.ip != cache->ipaddr.ip)
+            return false;
+        if ((entry = __arpc_insert(cache, &sip)) == NULL)
+            return false;
+    }
+    if (entry->state == ARPST_PERMANENT)
+        return false;
+
+    entry->mac = arp_gethwaddr_s(arp);
+    entry->state = ARPST_REACHABLE;
+    entry->confirmed = __arpc_now();
+    entry->used = entry->confirmed;
+    entry->probes = 0;
+    cache->stats.learned++;
+    __arpc_flush(cache, entry);
+    return true;
+}
+
+bool arpcache_resolve(struct ArpCache *cache, struct netaddr_ip *ip, struct netaddr_mac *mac) {
+    struct ArpEntry *entry = __arpc_resolve(cache, ip, __arpc_now());
+
+    if (entry == NULL || entry->state == ARPST_INCOMPLETE)
+        return false;
+    if (mac != NULL)
+        memcpy(mac->mac, entry->mac.mac, ETHHWASIZE);
+    return true;
+}
+
+bool arpcache_set(struct ArpCache *cache, struct netaddr_ip *ip, struct netaddr_mac *mac, bool permanent) {
+    struct ArpEntry *entry = *__arpc_find(cache, ip);
+
+    if (entry == NULL && (entry = __arpc_insert(cache, ip)) == NULL)
+        return false;
+    memcpy(entry->mac.mac, mac->mac, ETHHWASIZE);
+    entry->state = permanent ? ARPST_PERMANENT : ARPST_REACHABLE;
+    entry->confirmed = __arpc_now();
+    entry->used = entry->confirmed;
+    entry->probes = 0;
+    __arpc_flush(cache, entry);
+    return true;
+}
+
+enum ArpState arpcache_lookup(struct ArpCache *cache, struct netaddr_ip *ip, struct netaddr_mac *mac) {
+    struct ArpEntry *entry = *__arpc_find(cache, ip);
+
+    if (entry == NULL)
+        return ARPST_NONE;
+    if (mac != NULL && entry->state != ARPST_INCOMPLETE)
+        memcpy(mac->mac, entry->mac.mac, ETHHWASIZE);
+    return entry->state;
+}
+
+int arpcache_send(struct ArpCache *cache, struct netaddr_ip *ip, unsigned char *frame, unsigned int len) {
+    struct ArpEntry *entry;
+    struct ArpPending *pending;
+
+    if ((entry = __arpc_resolve(cache, ip, __arpc_now())) == NULL)
+        return SPKSOCK_ENOMEM;
+    if (entry->state != ARPST_INCOMPLETE)
+        return __arpc_xmit(cache, entry, frame, len);
+
+    // Unresolved, the oldest frame is sacrificed when the queue is full
+    if (entry->qlen >= cache->max_queue) {
+        if ((pending = entry->qhead) == NULL)
+            return SPKSOCK_ENOMEM;
+        entry->qhead = pending->next;
+        entry->qlen--;
+        free(pending);
+        cache->stats.dropped++;
+    }
+    if ((pending = (struct ArpPending *) malloc(sizeof(struct ArpPending) + len)) == NULL)
+        return SPKSOCK_ENOMEM;
+    pending->next = NULL;
+    pending->len = len;
+    memcpy(pending->frame, frame, len);
+    if (entry->qhead == NULL)
+        entry->qhead = pending;
+    else
+        entry->qtail->next = pending;
+    entry->qtail = pending;
+    entry->qlen++;
+    return 0;
+}
+
+struct ArpCache *arpcache_new(struct SpkSock *ssock, struct netaddr_ip *ipaddr, unsigned int size) {
+    struct ArpCache *cache;
+    struct netaddr_mac bcast;
+    unsigned int buckets = 1;
+
+    for (size = size == 0 ? ARPCACHE_DEFSIZE : size; buckets < size; buckets <<= 1);
+
+    if ((cache = (struct ArpCache *) calloc(1, sizeof(struct ArpCache))) == NULL)
+        return NULL;
+    if ((cache->table = (struct ArpEntry **) calloc(buckets, sizeof(struct ArpEntry *))) == NULL) {
+        free(cache);
+        return NULL;
+    }
+    cache->mask = buckets - 1;
+    cache->ssock = ssock;
+    cache->hwaddr = ssock->iaddr;
+    cache->ipaddr.ip = ipaddr->ip;
+    cache->reachable_time = ARPCACHE_DEFREACHABLE;
+    cache->gc_stale_time = ARPCACHE_DEFGCSTALE;
+    cache->retrans_time = ARPCACHE_DEFRETRANS;
+    cache->max_probes = ARPCACHE_DEFRETRIES;
+    cache->max_queue = ARPCACHE_DEFQLEN;
+
+    // Request template, only destination addresses change between requests
+    build_ethbroad_addr(&bcast);
+    injects_ethernet_header(cache->request, &cache->hwaddr, &bcast, ETHTYPE_ARP);
+    injects_arp_request(cache->request + ETHHDRSIZE, &cache->hwaddr, &cache->ipaddr, NULL, NULL);
+    return cache;
+}
+
+void arpcache_del(struct ArpCache *cache, struct netaddr_ip *ip) {
+    struct ArpEntry **link = __arpc_find(cache, ip);
+    if (*link != NULL)
+        __arpc_remove(cache, link);
+}
+
+void arpcache_free(struct ArpCache *cache) {
+    if (cache == NULL)
+        return;
+    for (unsigned int i = 0; i <= cache->mask; i++)
+        while (cache->table[i] != NULL)
+            __arpc_remove(cache, &cache->table[i]);
+    free(cache->table);
+    free(cache);
+}
+
+void arpcache_tick(struct ArpCache *cache) {
+    unsigned long long now = __arpc_now();
+    struct ArpEntry **link;
+    struct ArpEntry *entry;
+
+    for (unsigned int i = 0; i <= cache->mask; i++) {
+        for (link = &cache->table[i]; (entry = *link) != NULL;) {
+            switch (entry->state) {
+                case ARPST_INCOMPLETE:
+                    if (now < entry->next_probe)
+                        break;
+                    if (entry->probes >= cache->max_probes) {
+                        cache->stats.failed++;
+                        __arpc_remove(cache, link);
+                        continue;
+                    }
+                    __arpc_probe(cache, entry, now);
+                    break;
+                case ARPST_REACHABLE:
+                    if (now - entry->confirmed >= cache->reachable_time) {
+                        entry->state = ARPST_STALE;
+                        entry->probes = 0;
+                    }
+                    break;
+                case ARPST_STALE:
+                    if (entry->probes > 0 && now >= entry->next_probe) {
+                        if (entry->probes >= cache->max_probes) {
+                            cache->stats.failed++;
+                            __arpc_remove(cache, link);
+                            continue;
+                        }
+                        __arpc_probe(cache, entry, now);
+                    } else if (entry->probes == 0 && now - entry->used >= cache->gc_stale_time) {
+                        __arpc_remove(cache, link);
+                        continue;
+                    }
+                    break;
+                default:
+                    break;
+            }
+            link = &entry->next;
+        }
+    }
+}
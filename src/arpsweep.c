@@ -0,0 +1,295 @@
+/*
+ * Copyright (c) 2017 Jacopo De Luca
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <poll.h>
+#include <time.h>
+#include <errno.h>
+
+#include <datatype.h>
+#include <ethernet.h>
+#include <ipv4.h>
+#include <arp.h>
+#include <arpsweep.h>
+
+#define ARPSWEEP_FRAMELEN   (ETHHDRSIZE + ARPETHIPSIZE)
+#define ARPSWEEP_TPAOFF     (ETHHDRSIZE + ARPHDRSIZE + ETHHWASIZE + IPV4ADDRSIZE + ETHHWASIZE)
+#define ARPSWEEP_POLLMS     50
+
+// ldh [12]; jeq #0x806; ldh [20]; jeq #ARPOP_REPLY; ret #65535; ret #0
+static struct SpkFilterInsn __sweep_filter[] = {
+        {0x28, 0, 0, 12},
+        {0x15, 0, 3, ETHTYPE_ARP},
+        {0x28, 0, 0, ETHHDRSIZE + 6},
+        {0x15, 0, 1, ARPOP_REPLY},
+        {0x06, 0, 0, 0xFFFF},
+        {0x06, 0, 0, 0}
+};
+
+static unsigned long long __sweep_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void __sweep_sleep_until(unsigned long long deadline) {
+    struct timespec ts;
+    ts.tv_sec = (time_t) (deadline / 1000000000ULL);
+    ts.tv_nsec = (long) (deadline % 1000000000ULL);
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
+static void __sweep_input(struct ArpSweep *sweep, unsigned char *buf, unsigned int len) {
+    struct EthHeader *eth = (struct EthHeader *) buf;
+    struct ArpPacket *arp = (struct ArpPacket *) eth->data;
+    struct ArpSweepHost *host;
+    unsigned int idx;
+    bool expected = false;
+
+    if (len < ARPSWEEP_FRAMELEN || eth->eth_type != htons(ETHTYPE_ARP) || arp->opcode != htons(ARPOP_REPLY))
+        return;
+    if (arp->hwalen != ETHHWASIZE || arp->pralen != IPV4ADDRSIZE)
+        return;
+    atomic_fetch_add_explicit(&sweep->replies, 1, memory_order_relaxed);
+
+    if ((idx = ntohl(arp_getaddr_s(arp).ip) - sweep->first) >= sweep->nhosts)
+        return;
+    host = sweep->hosts + idx;
+    if (atomic_load_explicit(&host->alive, memory_order_acquire))
+        return;
+    host->mac = arp_gethwaddr_s(arp);
+    host->rtt = (unsigned int) ((__sweep_now_ns() - atomic_load_explicit(&host->sent, memory_order_relaxed)) / 1000);
+    if (!atomic_compare_exchange_strong(&host->alive, &expected, true))
+        return;
+    atomic_fetch_add_explicit(&sweep->alive, 1, memory_order_relaxed);
+    if (sweep->on_reply != NULL)
+        sweep->on_reply(host, sweep->arg);
+}
+
+static void *__sweep_rx(void *arg) {
+    struct ArpSweep *sweep = (struct ArpSweep *) arg;
+    struct pollfd pfd;
+    unsigned char *buf;
+    int len;
+
+    if ((buf = (unsigned char *) malloc(sweep->rx->bufl)) == NULL)
+        return NULL;
+    pfd.fd = sweep->rx->sfd;
+    pfd.events = POLLIN;
+    while (atomic_load_explicit(&sweep->running, memory_order_relaxed)) {
+        if (poll(&pfd, 1, ARPSWEEP_POLLMS) <= 0)
+            continue;
+        while ((len = spark_read(sweep->rx, buf, NULL)) > 0)
+            __sweep_input(sweep, buf, (unsigned int) len);
+    }
+    free(buf);
+    return NULL;
+}
+
+static int __sweep_flush(struct ArpSweep *sweep, unsigned char **frames, unsigned int *lens, unsigned int *idx,
+                         unsigned int count, unsigned long long *due) {
+    struct pollfd pfd;
+    unsigned long long now;
+    unsigned long long gap;
+    unsigned int sent = 0;
+    int ret;
+
+    if (count == 0)
+        return 0;
+    if (sweep->pps > 0) {
+        gap = (unsigned long long) count * 1000000000ULL / sweep->pps;
+        // Never accumulates more than one batch of credit after a stall
+        if (*due + gap < (now = __sweep_now_ns()))
+            *due = now - gap;
+        __sweep_sleep_until(*due);
+        *due += gap;
+    }
+    now = __sweep_now_ns();
+    for (unsigned int i = 0; i < count; i++)
+        atomic_store_explicit(&sweep->hosts[idx[i]].sent, now, memory_order_relaxed);
+    pfd.fd = sweep->tx->sfd;
+    pfd.events = POLLOUT;
+    while (sent < count) {
+        if ((ret = spark_writeb(sweep->tx, frames + sent, lens + sent, count - sent)) < 0) {
+            if (ret == SPKSOCK_EINTR)
+                continue;
+            return ret;
+        }
+        // The socket buffer is full, waits for room instead of spinning
+        if (ret == 0 && poll(&pfd, 1, ARPSWEEP_POLLMS) < 0 && errno != EINTR)
+            return SPKSOCK_ERROR;
+        sent += (unsigned int) ret;
+    }
+    return 0;
+}
+
+int arpsweep_open(char *device, struct netaddr_ip *net, unsigned char prefix, struct ArpSweep **sweep) {
+    struct ArpSweep *sw;
+    struct netaddr_ip mask;
+    unsigned int first;
+    unsigned int last;
+    int err;
+
+    if (device == NULL || sweep == NULL || prefix < ARPSWEEP_MINPREFIX || prefix > 32)
+        return SPKSOCK_ERROR;
+    if ((sw = (struct ArpSweep *) calloc(1, sizeof(struct ArpSweep))) == NULL)
+        return SPKSOCK_ENOMEM;
+
+    get_ipv4netmask(prefix, &mask);
+    first = ntohl(net->ip & mask.ip);
+    last = first | ~ntohl(mask.ip);
+    if (prefix < 31) {
+        first++;
+        last--;
+    }
+    sw->first = first;
+    sw->nhosts = last - first + 1;
+    sw->pps = ARPSWEEP_DEFPPS;
+    sw->batch = ARPSWEEP_DEFBATCH;
+    sw->retries = ARPSWEEP_DEFRETRIES;
+    sw->wait = ARPSWEEP_DEFWAIT;
+
+    if ((sw->hosts = (struct ArpSweepHost *) calloc(sw->nhosts, sizeof(struct ArpSweepHost))) == NULL) {
+        free(sw);
+        return SPKSOCK_ENOMEM;
+    }
+    for (unsigned int i = 0; i < sw->nhosts; i++)
+        sw->hosts[i].ip.ip = htonl(first + i);
+
+    if ((err = spark_opensock(device, ETHFRAME, &sw->tx)) < 0) {
+        arpsweep_close(sw);
+        return err;
+    }
+    if ((err = spark_opensock(device, ETHFRAME, &sw->rx)) < 0) {
+        arpsweep_close(sw);
+        return err;
+    }
+    sw->hwaddr = sw->tx->iaddr;
+    if (!get_device_ipv4(device, &sw->ipaddr)) {
+        arpsweep_close(sw);
+        return SPKSOCK_ERROR;
+    }
+
+    // Without kernel filter the receive thread discards the other packets by itself
+    if ((err = spark_setfilter(sw->rx, __sweep_filter, sizeof(__sweep_filter) / sizeof(struct SpkFilterInsn))) < 0
+        && err != SPKSOCK_ENOSUPPORT) {
+        arpsweep_close(sw);
+        return err;
+    }
+    spark_setdirection(sw->rx, SPKDIR_IN);
+    if ((err = spark_setnblock(sw->rx, true)) < 0) {
+        arpsweep_close(sw);
+        return err;
+    }
+    *sweep = sw;
+    return SPKSOCK_SUCCESS;
+}
+
+int arpsweep_run(struct ArpSweep *sweep) {
+    struct netaddr_mac bcast;
+    unsigned char *frames;
+    unsigned char **bufs;
+    unsigned int *lens;
+    unsigned int *idx;
+    unsigned long long due = 0;
+    unsigned int batch = sweep->batch == 0 ? 1 : sweep->batch;
+    unsigned int count;
+    unsigned int pending;
+    int err = SPKSOCK_SUCCESS;
+
+    if ((frames = (unsigned char *) malloc(batch * ARPSWEEP_FRAMELEN)) == NULL)
+        return SPKSOCK_ENOMEM;
+    bufs = (unsigned char **) malloc(batch * sizeof(unsigned char *));
+    lens = (unsigned int *) malloc(batch * sizeof(unsigned int));
+    idx = (unsigned int *) malloc(batch * sizeof(unsigned int));
+    if (bufs == NULL || lens == NULL || idx == NULL) {
+        free(frames);
+        free(bufs);
+        free(lens);
+        free(idx);
+        return SPKSOCK_ENOMEM;
+    }
+
+    // Every frame of the batch starts as a copy of the template, only the target address changes
+    build_ethbroad_addr(&bcast);
+    injects_ethernet_header(frames, &sweep->hwaddr, &bcast, ETHTYPE_ARP);
+    injects_arp_request(frames + ETHHDRSIZE, &sweep->hwaddr, &sweep->ipaddr, NULL, NULL);
+    for (unsigned int i = 0; i < batch; i++) {
+        bufs[i] = frames + i * ARPSWEEP_FRAMELEN;
+        lens[i] = ARPSWEEP_FRAMELEN;
+        if (i > 0)
+            memcpy(bufs[i], frames, ARPSWEEP_FRAMELEN);
+    }
+
+    atomic_store(&sweep->running, true);
+    if (pthread_create(&sweep->rx_thread, NULL, __sweep_rx, sweep) != 0) {
+        atomic_store(&sweep->running, false);
+        free(frames);
+        free(bufs);
+        free(lens);
+        free(idx);
+        return SPKSOCK_ERROR;
+    }
+
+    for (unsigned int round = 0; round <= sweep->retries && err == SPKSOCK_SUCCESS; round++) {
+        count = 0;
+        pending = 0;
+        for (unsigned int i = 0; i < sweep->nhosts; i++) {
+            if (atomic_load_explicit(&sweep->hosts[i].alive, memory_order_relaxed))
+                continue;
+            memcpy(bufs[count] + ARPSWEEP_TPAOFF, &sweep->hosts[i].ip.ip, IPV4ADDRSIZE);
+            idx[count++] = i;
+            sweep->hosts[i].tries++;
+            pending++;
+            if (count == batch) {
+                if ((err = __sweep_flush(sweep, bufs, lens, idx, count, &due)) < 0)
+                    break;
+                count = 0;
+            }
+        }
+        if (err == SPKSOCK_SUCCESS)
+            err = __sweep_flush(sweep, bufs, lens, idx, count, &due);
+        if (pending == 0)
+            break;
+        __sweep_sleep_until(__sweep_now_ns() + sweep->wait * 1000000ULL);
+    }
+
+    atomic_store(&sweep->running, false);
+    pthread_join(sweep->rx_thread, NULL);
+    free(frames);
+    free(bufs);
+    free(lens);
+    free(idx);
+    return err < 0 ? err : (int) atomic_load(&sweep->alive);
+}
+
+void arpsweep_close(struct ArpSweep *sweep) {
+    if (sweep == NULL)
+        return;
+    if (sweep->tx != NULL)
+        spark_close(sweep->tx);
+    if (sweep->rx != NULL)
+        spark_close(sweep->rx);
+    free(sweep->hosts);
+    free(sweep);
+}
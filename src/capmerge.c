@@ -0,0 +1,341 @@
+/*
+ * Copyright (c) 2017 Jacopo De Luca
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <poll.h>
+#include <time.h>
+
+#include <capmerge.h>
+
+#define CAPMERGE_SKIP   0xFFFFFFFF  // Marks the unused end of the FIFO
+
+static inline long long __capmerge_time(struct SpkTimeStamp *ts) {
+    return (long long) ts->sec * 1000000000LL + (ts->prc == SPKSTAMP_NANO ? ts->nsec : ts->usec * 1000LL);
+}
+
+static inline long long __capmerge_now() {
+    struct timespec now;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (long long) now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+// Returns the first record of a live source, NULL if the FIFO is empty
+static struct CapMergeRec *__capmerge_front(struct CapMergeSrc *s) {
+    struct CapMergeRec *rec;
+
+    if (s->head == s->tail)
+        return NULL;
+    rec = (struct CapMergeRec *) (s->fifo + s->head % CAPMERGE_FIFOSIZE);
+    if (rec->len == CAPMERGE_SKIP) {
+        s->head += CAPMERGE_FIFOSIZE - s->head % CAPMERGE_FIFOSIZE;
+        if (s->head == s->tail)
+            return NULL;
+        rec = (struct CapMergeRec *) s->fifo;
+    }
+    return rec;
+}
+
+static inline long long __capmerge_key(struct CapMerge *merge, unsigned int i) {
+    struct CapMergeSrc *s = &merge->src[i];
+
+    return s->live ? __capmerge_front(s)->time : s->time;
+}
+
+static inline bool __capmerge_before(struct CapMerge *merge, unsigned int i1, unsigned int i2) {
+    long long t1 = __capmerge_key(merge, i1);
+    long long t2 = __capmerge_key(merge, i2);
+
+    return t1 < t2 || (t1 == t2 && i1 < i2);
+}
+
+static void __capmerge_push(struct CapMerge *merge, unsigned int i) {
+    unsigned int pos = merge->hlen++;
+    unsigned int parent;
+
+    for (; pos > 0; pos = parent) {
+        parent = (pos - 1) >> 1;
+        if (!__capmerge_before(merge, i, merge->heap[parent]))
+            break;
+        merge->heap[pos] = merge->heap[parent];
+    }
+    merge->heap[pos] = i;
+}
+
+static void __capmerge_pop(struct CapMerge *merge) {
+    unsigned int last = merge->heap[--merge->hlen];
+    unsigned int pos = 0;
+    unsigned int child;
+
+    for (; (child = 2 * pos + 1) < merge->hlen; pos = child) {
+        if (child + 1 < merge->hlen && __capmerge_before(merge, merge->heap[child + 1], merge->heap[child]))
+            child++;
+        if (!__capmerge_before(merge, merge->heap[child], last))
+            break;
+        merge->heap[pos] = merge->heap[child];
+    }
+    merge->heap[pos] = last;
+}
+
+// Checks a new packet against the packets already delivered, returns false if it must be dropped
+static bool __capmerge_accept(struct CapMerge *merge, struct CapMergeSrc *s, long long time) {
+    if (time >= merge->watermark)
+        return true;
+    s->late++;
+    merge->late++;
+    if (!merge->droplate)
+        return true;
+    merge->dropped++;
+    return false;
+}
+
+// Reads the next packet of a capture file
+static int __capmerge_fetch(struct CapMerge *merge, unsigned int i) {
+    struct CapMergeSrc *s = &merge->src[i];
+    struct SpkTimeStamp ts;
+    int len;
+
+    do {
+        if ((len = spark_next(s->ssock, &s->pkt, &ts)) < 0) {
+            s->eof = true;
+            return len == SPKSOCK_EOF ? SPKSOCK_SUCCESS : len;
+        }
+        s->len = (unsigned int) len;
+        s->time = __capmerge_time(&ts);
+    } while (!__capmerge_accept(merge, s, s->time));
+    __capmerge_push(merge, i);
+    return SPKSOCK_SUCCESS;
+}
+
+// Moves the packets available on a live socket into its FIFO
+static int __capmerge_drain(struct CapMerge *merge, unsigned int i) {
+    struct CapMergeSrc *s = &merge->src[i];
+    struct CapMergeRec rec;
+    struct SpkTimeStamp ts;
+    unsigned long long need = sizeof(struct CapMergeRec) + s->ssock->bufl;
+    unsigned long long pos;
+    bool empty = __capmerge_front(s) == NULL;
+    int len = 0;
+
+    s->full = false;
+    for (;;) {
+        pos = s->tail % CAPMERGE_FIFOSIZE;
+        if (CAPMERGE_FIFOSIZE - pos < need) {
+            // Packets are never split, the end of the FIFO is skipped
+            if (CAPMERGE_FIFOSIZE - (s->tail - s->head) < CAPMERGE_FIFOSIZE - pos + need) {
+                s->full = true;
+                break;
+            }
+            rec.len = CAPMERGE_SKIP;
+            memcpy(s->fifo + pos, &rec, sizeof(struct CapMergeRec));
+            s->tail += CAPMERGE_FIFOSIZE - pos;
+            pos = 0;
+        } else if (CAPMERGE_FIFOSIZE - (s->tail - s->head) < need) {
+            s->full = true;
+            break;
+        }
+
+        if ((len = spark_read(s->ssock, s->fifo + pos + sizeof(struct CapMergeRec), &ts)) == 0
+            || len == SPKSOCK_EINTR)
+            break;
+        if (len < 0) {
+            s->eof = true;
+            break;
+        }
+        rec.time = __capmerge_time(&ts);
+        rec.len = (unsigned int) len < s->ssock->bufl ? (unsigned int) len : s->ssock->bufl;
+        if (!__capmerge_accept(merge, s, rec.time))
+            continue;
+        memcpy(s->fifo + pos, &rec, sizeof(struct CapMergeRec));
+        s->tail += sizeof(struct CapMergeRec) + ((rec.len + 15ULL) & ~15ULL);
+    }
+
+    if (empty && __capmerge_front(s) != NULL)
+        __capmerge_push(merge, i);
+    return len < 0 && len != SPKSOCK_EINTR ? len : SPKSOCK_SUCCESS;
+}
+
+// Waits for packets on the live sources
+static void __capmerge_wait(struct CapMerge *merge, int timeout) {
+    struct pollfd fds[CAPMERGE_MAXSRC];
+    unsigned int nfds = 0;
+
+    for (unsigned int i = 0; i < merge->nsrc; i++) {
+        if (merge->src[i].live && !merge->src[i].eof) {
+            fds[nfds].fd = merge->src[i].ssock->sfd;
+            fds[nfds].events = POLLIN;
+            nfds++;
+        }
+    }
+    poll(fds, nfds, timeout);
+}
+
+// Removes the packet delivered by the previous call
+static int __capmerge_release(struct CapMerge *merge) {
+    struct CapMergeSrc *s;
+    struct CapMergeRec *rec;
+
+    if (merge->pending < 0)
+        return SPKSOCK_SUCCESS;
+    s = &merge->src[merge->pending];
+    __capmerge_pop(merge);
+    if (!s->live)
+        return __capmerge_fetch(merge, (unsigned int) merge->pending);
+    rec = __capmerge_front(s);
+    s->head += sizeof(struct CapMergeRec) + ((rec->len + 15ULL) & ~15ULL);
+    if (__capmerge_front(s) != NULL)
+        __capmerge_push(merge, (unsigned int) merge->pending);
+    return SPKSOCK_SUCCESS;
+}
+
+int capmerge_new(unsigned int latency, struct CapMerge **merge) {
+    struct CapMerge *mg;
+
+    if (merge == NULL)
+        return SPKSOCK_ERROR;
+    if ((mg = calloc(1, sizeof(struct CapMerge))) == NULL)
+        return SPKSOCK_ENOMEM;
+    mg->latency = latency == 0 ? CAPMERGE_LATENCY : latency;
+    mg->pending = -1;
+    *merge = mg;
+    return SPKSOCK_SUCCESS;
+}
+
+int capmerge_add(struct CapMerge *merge, struct SpkSock *ssock) {
+    struct CapMergeSrc *s = &merge->src[merge->nsrc];
+    int err;
+
+    if (merge->nsrc == CAPMERGE_MAXSRC)
+        return SPKSOCK_ESIZE;
+
+    memset(s, 0x00, sizeof(struct CapMergeSrc));
+    s->ssock = ssock;
+    // Only capture files can be read without copying
+    s->live = ssock->op.next == NULL;
+    spark_settsprc(ssock, SPKSTAMP_NANO);
+    if (!s->live) {
+        if ((err = __capmerge_fetch(merge, merge->nsrc)) < 0)
+            return err;
+        return merge->nsrc++;
+    }
+
+    if (sizeof(struct CapMergeRec) + ssock->bufl > CAPMERGE_FIFOSIZE / 2)
+        return SPKSOCK_ESIZE;
+    if ((err = spark_setnblock(ssock, true)) < 0)
+        return err;
+    if ((s->fifo = malloc(CAPMERGE_FIFOSIZE)) == NULL)
+        return SPKSOCK_ENOMEM;
+    return merge->nsrc++;
+}
+
+int capmerge_next(struct CapMerge *merge, unsigned char **pkt, struct SpkTimeStamp *ts, int *src) {
+    struct CapMergeSrc *s;
+    struct CapMergeRec *rec;
+    long long deadline;
+    long long wait;
+    long long time;
+    bool waited = false;
+    bool full;
+    bool live;
+    int err;
+
+    if ((err = __capmerge_release(merge)) < 0)
+        return err;
+    merge->pending = -1;
+
+    for (;;) {
+        full = false;
+        live = false;
+        for (unsigned int i = 0; i < merge->nsrc; i++) {
+            s = &merge->src[i];
+            if (!s->live || s->eof)
+                continue;
+            if ((err = __capmerge_drain(merge, i)) < 0)
+                return err;
+            full |= s->full;
+            live |= !s->eof;
+        }
+
+        if (merge->hlen == 0) {
+            if (!live)
+                return SPKSOCK_EOF;
+            if (waited)
+                return 0;
+            __capmerge_wait(merge, (int) merge->latency);
+            waited = true;
+            continue;
+        }
+
+        // The oldest packet waits for the live sources that are silent
+        time = __capmerge_key(merge, merge->heap[0]);
+        deadline = time + merge->latency * 1000000LL;
+        wait = 0;
+        for (unsigned int i = 0; i < merge->nsrc; i++) {
+            s = &merge->src[i];
+            if (s->live && !s->eof && __capmerge_front(s) == NULL) {
+                wait = deadline - __capmerge_now();
+                break;
+            }
+        }
+        if (wait > 0 && full) {
+            merge->forced++;
+            wait = 0;
+        }
+        if (wait > 0) {
+            __capmerge_wait(merge, (int) ((wait + 999999) / 1000000));
+            continue;
+        }
+        break;
+    }
+
+    merge->pending = (int) merge->heap[0];
+    s = &merge->src[merge->pending];
+    if (s->live) {
+        rec = __capmerge_front(s);
+        *pkt = (unsigned char *) rec + sizeof(struct CapMergeRec);
+        time = rec->time;
+        err = (int) rec->len;
+    } else {
+        *pkt = s->pkt;
+        time = s->time;
+        err = (int) s->len;
+    }
+    if (ts != NULL) {
+        ts->sec = (long) (time / 1000000000LL);
+        ts->nsec = (long) (time % 1000000000LL);
+        ts->usec = ts->nsec / 1000;
+        ts->prc = SPKSTAMP_NANO;
+    }
+    if (src != NULL)
+        *src = merge->pending;
+    if (time > merge->watermark)
+        merge->watermark = time;
+    merge->packets++;
+    return err;
+}
+
+void capmerge_free(struct CapMerge *merge) {
+    for (unsigned int i = 0; i < merge->nsrc; i++)
+        free(merge->src[i].fifo);
+    free(merge);
+}
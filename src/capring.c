@@ -0,0 +1,343 @@
+/*
+ * Copyright (c) 2017 Jacopo De Luca
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <capring.h>
+
+#define CAPRING_MAGIC_NSEC  0xA1B23C4D
+#define CAPRING_NOEND       0xFFFFFFFFFFFFFFFFULL
+
+static void __capring_copy(struct CapRing *ring, unsigned long long pos, const void *src, unsigned int len) {
+    unsigned long long off = pos % ring->size;
+    unsigned long long n = ring->size - off;
+
+    if (n >= len) {
+        memcpy(ring->mem + off, src, len);
+        return;
+    }
+    memcpy(ring->mem + off, src, n);
+    memcpy(ring->mem, (const unsigned char *) src + n, len - n);
+}
+
+static void __capring_peek(struct CapRing *ring, unsigned long long pos, void *dst, unsigned int len) {
+    unsigned long long off = pos % ring->size;
+    unsigned long long n = ring->size - off;
+
+    if (n >= len) {
+        memcpy(dst, ring->mem + off, len);
+        return;
+    }
+    memcpy(dst, ring->mem + off, n);
+    memcpy((unsigned char *) dst + n, ring->mem, len - n);
+}
+
+static bool __capring_evict(struct CapRing *ring, unsigned long long *tail, long oldest) {
+    unsigned int rec[4];
+
+    // Records not yet dumped are frozen
+    if (atomic_load_explicit(&ring->state, memory_order_acquire) == CAPRING_DUMPING
+        && *tail >= atomic_load_explicit(&ring->dump, memory_order_acquire))
+        return false;
+
+    __capring_peek(ring, *tail, rec, CAPRING_RECLEN);
+    if (oldest >= 0 && (long) rec[0] >= oldest)
+        return false;
+    *tail += CAPRING_RECLEN + rec[2];
+    atomic_fetch_add_explicit(&ring->evicted, 1, memory_order_relaxed);
+    return true;
+}
+
+static bool __capring_write(struct CapRing *ring, int fd, unsigned long long from, unsigned long long to) {
+    unsigned long long off;
+    unsigned long long len;
+    ssize_t n;
+
+    while (from < to) {
+        off = from % ring->size;
+        len = ring->size - off < to - from ? ring->size - off : to - from;
+        if ((n = write(fd, ring->mem + off, len)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        from += n;
+    }
+    return true;
+}
+
+static void __capring_dump(struct CapRing *ring) {
+    struct timespec nap = {0, 1000000};
+    unsigned long long pos = atomic_load_explicit(&ring->dump, memory_order_relaxed);
+    unsigned long long last = CAPRING_NOEND;
+    unsigned long long head;
+    unsigned long long end;
+    unsigned long long lim;
+    unsigned long idle = 0;
+    bool failed;
+    int fd;
+    struct {
+        unsigned int magic;
+        unsigned short major;
+        unsigned short minor;
+        int thiszone;
+        unsigned int sigfigs;
+        unsigned int snaplen;
+        unsigned int linktype;
+    } ghdr = {CAPRING_MAGIC_NSEC, 2, 4, 0, 0, ring->snaplen, ring->lktype < 0 ? 0 : (unsigned int) ring->lktype};
+
+    fd = open(ring->path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    failed = fd < 0 || write(fd, &ghdr, sizeof(ghdr)) != sizeof(ghdr);
+
+    for (;;) {
+        end = atomic_load_explicit(&ring->dumpend, memory_order_acquire);
+        head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        lim = end < head ? end : head;
+        if (pos < lim) {
+            // Records are released even if they cannot be written
+            if (!failed && !__capring_write(ring, fd, pos, lim))
+                failed = true;
+            pos = lim;
+            atomic_store_explicit(&ring->dump, pos, memory_order_release);
+            continue;
+        }
+        if (end != CAPRING_NOEND)
+            break;
+
+        // Traffic stopped: the dump is closed after post + 1 seconds without packets
+        if (head != last) {
+            last = head;
+            idle = 0;
+        } else if (++idle > (ring->post + 1) * 1000UL)
+            atomic_compare_exchange_strong(&ring->dumpend, &end, head);
+        nanosleep(&nap, NULL);
+    }
+
+    if (fd >= 0 && close(fd) < 0)
+        failed = true;
+    if (failed)
+        atomic_fetch_add_explicit(&ring->errors, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&ring->dumps, 1, memory_order_relaxed);
+}
+
+static void *__capring_thread(void *arg) {
+    struct CapRing *ring = arg;
+
+    for (;;) {
+        pthread_mutex_lock(&ring->lock);
+        while (atomic_load(&ring->state) != CAPRING_DUMPING && !ring->stop)
+            pthread_cond_wait(&ring->wake, &ring->lock);
+        pthread_mutex_unlock(&ring->lock);
+        if (atomic_load(&ring->state) != CAPRING_DUMPING)
+            break;
+        __capring_dump(ring);
+        atomic_store_explicit(&ring->state, CAPRING_IDLE, memory_order_release);
+    }
+    return NULL;
+}
+
+int capring_new(unsigned long long budget, unsigned int window, int lktype, unsigned int snaplen,
+                struct CapRing **ring) {
+    struct CapRing *cr;
+
+    snaplen = snaplen == 0 ? CAPRING_SNAPLEN : snaplen;
+    // The scratch buffer of capring_feed comes out of the budget, the rest must hold at least one packet
+    if (ring == NULL || budget < CAPRING_MINSIZE || budget - snaplen < CAPRING_RECLEN + (unsigned long long) snaplen)
+        return SPKSOCK_ERROR;
+
+    if ((cr = calloc(1, sizeof(struct CapRing))) == NULL)
+        return SPKSOCK_ENOMEM;
+
+    if ((cr->mem = malloc(budget)) == NULL) {
+        free(cr);
+        return SPKSOCK_ENOMEM;
+    }
+
+    cr->size = budget - snaplen;
+    cr->scratch = cr->mem + cr->size;
+    cr->scratchlen = snaplen;
+    cr->window = window;
+    cr->lktype = lktype;
+    cr->snaplen = snaplen;
+    atomic_init(&cr->dumpend, CAPRING_NOEND);
+    pthread_mutex_init(&cr->lock, NULL);
+    pthread_cond_init(&cr->wake, NULL);
+
+    if (pthread_create(&cr->thread, NULL, __capring_thread, cr) != 0) {
+        pthread_mutex_destroy(&cr->lock);
+        pthread_cond_destroy(&cr->wake);
+        free(cr->mem);
+        free(cr);
+        return SPKSOCK_ERROR;
+    }
+
+    *ring = cr;
+    return SPKSOCK_SUCCESS;
+}
+
+unsigned int capring_add(struct CapRing *ring, unsigned char *pkt, unsigned int len, struct SpkTimeStamp *ts) {
+    unsigned long long head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    unsigned long long tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    unsigned long long end = CAPRING_NOEND;
+    struct timespec now;
+    unsigned int rec[4];
+    unsigned int reclen;
+    long sec;
+    long nsec;
+
+    if (ts == NULL) {
+        clock_gettime(CLOCK_REALTIME, &now);
+        sec = now.tv_sec;
+        nsec = now.tv_nsec;
+    } else {
+        sec = ts->sec;
+        nsec = ts->prc == SPKSTAMP_NANO ? ts->nsec : ts->usec * 1000;
+    }
+
+    switch (atomic_load_explicit(&ring->state, memory_order_acquire)) {
+        case CAPRING_REQUEST:
+            // Freezes the window
+            ring->until = sec + ring->post;
+            atomic_store_explicit(&ring->dump, tail, memory_order_relaxed);
+            atomic_store_explicit(&ring->dumpend, CAPRING_NOEND, memory_order_relaxed);
+            pthread_mutex_lock(&ring->lock);
+            atomic_store_explicit(&ring->state, CAPRING_DUMPING, memory_order_release);
+            pthread_cond_signal(&ring->wake);
+            pthread_mutex_unlock(&ring->lock);
+            break;
+        case CAPRING_DUMPING:
+            if (sec >= ring->until)
+                atomic_compare_exchange_strong(&ring->dumpend, &end, head);
+            break;
+        default:
+            break;
+    }
+
+    rec[2] = len > ring->snaplen ? ring->snaplen : len;
+    reclen = CAPRING_RECLEN + rec[2];
+    if (reclen > ring->size) {
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+        return 0;
+    }
+
+    if (ring->window > 0) {
+        while (tail < head && __capring_evict(ring, &tail, sec - (long) ring->window));
+    }
+    while (head + reclen - tail > ring->size) {
+        if (!__capring_evict(ring, &tail, -1)) {
+            atomic_store_explicit(&ring->tail, tail, memory_order_relaxed);
+            atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+            return 0;
+        }
+    }
+
+    rec[0] = (unsigned int) sec;
+    rec[1] = (unsigned int) nsec;
+    rec[3] = len;
+    __capring_copy(ring, head, rec, CAPRING_RECLEN);
+    __capring_copy(ring, head + CAPRING_RECLEN, pkt, rec[2]);
+    head += reclen;
+
+    if (head - tail > ring->peak)
+        ring->peak = head - tail;
+    atomic_store_explicit(&ring->tail, tail, memory_order_relaxed);
+    atomic_store_explicit(&ring->head, head, memory_order_release);
+    atomic_fetch_add_explicit(&ring->packets, 1, memory_order_relaxed);
+    return reclen;
+}
+
+int capring_feed(struct CapRing *ring, struct SpkSock *ssock) {
+    struct SpkTimeStamp ts;
+    int count = 0;
+    int len;
+
+    // The scratch holds snaplen bytes, capring_add stores as many plus the original length
+    while ((len = spark_readlen(ssock, ring->scratch, ring->scratchlen, &ts)) > 0) {
+        capring_add(ring, ring->scratch, (unsigned int) len, &ts);
+        count++;
+    }
+    return len < 0 && count == 0 ? len : count;
+}
+
+int capring_trigger(struct CapRing *ring, char *path, unsigned int post) {
+    int idle = CAPRING_IDLE;
+    char *dup;
+
+    if ((dup = strdup(path)) == NULL)
+        return SPKSOCK_ENOMEM;
+
+    pthread_mutex_lock(&ring->lock);
+    if (atomic_load(&ring->state) != CAPRING_IDLE) {
+        pthread_mutex_unlock(&ring->lock);
+        free(dup);
+        return SPKSOCK_ERROR;
+    }
+    free(ring->path);
+    ring->path = dup;
+    ring->post = post;
+    atomic_compare_exchange_strong(&ring->state, &idle, CAPRING_REQUEST);
+    pthread_mutex_unlock(&ring->lock);
+    return SPKSOCK_SUCCESS;
+}
+
+inline bool capring_dumping(struct CapRing *ring) {
+    return atomic_load(&ring->state) != CAPRING_IDLE;
+}
+
+void capring_stats(struct CapRing *ring, struct CapRingStats *stats) {
+    stats->packets = atomic_load_explicit(&ring->packets, memory_order_relaxed);
+    stats->evicted = atomic_load_explicit(&ring->evicted, memory_order_relaxed);
+    stats->dropped = atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+    stats->used = atomic_load_explicit(&ring->head, memory_order_relaxed)
+                  - atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    stats->peak = ring->peak;
+    stats->dumps = atomic_load_explicit(&ring->dumps, memory_order_relaxed);
+    stats->errors = atomic_load_explicit(&ring->errors, memory_order_relaxed);
+}
+
+void capring_free(struct CapRing *ring) {
+    unsigned long long end = CAPRING_NOEND;
+    int request = CAPRING_REQUEST;
+
+    if (ring == NULL)
+        return;
+
+    // A pending request is dropped, a dump in progress ends with the packets already stored
+    pthread_mutex_lock(&ring->lock);
+    atomic_compare_exchange_strong(&ring->state, &request, CAPRING_IDLE);
+    atomic_compare_exchange_strong(&ring->dumpend, &end, atomic_load(&ring->head));
+    ring->stop = true;
+    pthread_cond_signal(&ring->wake);
+    pthread_mutex_unlock(&ring->lock);
+    pthread_join(ring->thread, NULL);
+
+    pthread_mutex_destroy(&ring->lock);
+    pthread_cond_destroy(&ring->wake);
+    free(ring->path);
+    free(ring->mem);
+    free(ring);
+}
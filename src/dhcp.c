@@ -21,17 +21,18 @@
 */
 
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
-#include <time.h>
 
 #include <datatype.h>
 #include <ethernet.h>
 #include <ipv4.h>
 #include <dhcp.h>
+#include <spkrand.h>
 
 bool dhcp_append_option(struct DhcpPacket *dhcpPkt, unsigned char op, unsigned char len, unsigned char *payload) {
     int i = 0;
-    for (i; i < DHCP_OPTLEN && dhcpPkt->options[i] != 0xFF; i++);
+    for (; i < DHCP_OPTLEN && dhcpPkt->options[i] != 0xFF; i++);
     if (i == DHCP_OPTLEN || (DHCP_OPTLEN - i) < 2 + len)
         return false;
     dhcpPkt->options[i++] = op;
@@ -72,6 +73,7 @@ struct DhcpPacket *injects_dhcp_discover(unsigned char *buf, struct netaddr_mac
     struct DhcpPacket *dhcpPkt = injects_dhcp_raw(buf, DHCP_OP_BOOT_REQUEST, DHCP_HTYPE_ETHER, ETHHWASIZE, 0,
                                                   dhcp_mkxid(), 0, flags, NULL, NULL, NULL, NULL,
                                                   (struct netaddr *) chaddr, NULL);
+    struct DhcpOptBuilder builder;
     int optoff = 0;
 
     dhcpPkt->options[optoff++] = DHCP_MESSAGE_TYPE;
@@ -83,10 +85,11 @@ struct DhcpPacket *injects_dhcp_discover(unsigned char *buf, struct netaddr_mac
     buf_client_id[0] = DHCP_HTYPE_ETHER;
     memcpy(buf_client_id + 1, chaddr->mac, ETHHWASIZE);
 
+    dhcp_optbuild_init(&builder, dhcpPkt, 0);
     if (ipreq != NULL)
-        dhcp_append_option(dhcpPkt, DHCP_REQUESTED_ADDRESS, IPV4ADDRSIZE, (unsigned char *) &(ipreq->ip));
+        dhcp_optbuild_append(&builder, DHCP_REQUESTED_ADDRESS, IPV4ADDRSIZE, (unsigned char *) &(ipreq->ip));
     unsigned char buf_parameter_request[] = {DHCP_REQ_SUBMASK, DHCP_REQ_ROUTERS, DHCP_REQ_DOMAIN_NAME, DHCP_REQ_DNS};
-    dhcp_append_option(dhcpPkt, DHCP_PARAMETER_REQUEST_LIST, 0x04, buf_parameter_request);
+    dhcp_optbuild_append(&builder, DHCP_PARAMETER_REQUEST_LIST, 0x04, buf_parameter_request);
     return dhcpPkt;
 }
 
@@ -126,13 +129,15 @@ struct DhcpPacket *injects_dhcp_release(unsigned char *buf, struct netaddr_mac *
     struct DhcpPacket *dhcpPkt = injects_dhcp_raw(buf, DHCP_OP_BOOT_REQUEST, DHCP_HTYPE_ETHER, ETHHWASIZE, 0,
                                                   dhcp_mkxid(), 0, flags, ciaddr, NULL, NULL, NULL,
                                                   (struct netaddr *) chaddr, NULL);
+    struct DhcpOptBuilder builder;
     int optoff = 0;
     dhcpPkt->options[(optoff)++] = DHCP_MESSAGE_TYPE;
     dhcpPkt->options[(optoff)++] = 0x01;
     dhcpPkt->options[(optoff)++] = DHCP_RELEASE;
     dhcpPkt->options[(optoff)] = 0xFF;
 
-    dhcp_append_option(dhcpPkt, DHCP_SERVER_IDENTIFIER, IPV4ADDRSIZE, (unsigned char *) &server->ip);
+    dhcp_optbuild_init(&builder, dhcpPkt, 0);
+    dhcp_optbuild_append(&builder, DHCP_SERVER_IDENTIFIER, IPV4ADDRSIZE, (unsigned char *) &server->ip);
     return dhcpPkt;
 }
 
@@ -141,14 +146,16 @@ struct DhcpPacket *injects_dhcp_request(unsigned char *buf, struct netaddr_mac *
                                         unsigned short flags) {
     struct DhcpPacket *dhcpPkt = injects_dhcp_raw(buf, DHCP_OP_BOOT_REQUEST, DHCP_HTYPE_ETHER, ETHHWASIZE, 0, xid, 0,
                                                   flags, NULL, NULL, siaddr, NULL, (struct netaddr *) chaddr, NULL);
+    struct DhcpOptBuilder builder;
     int optoff = 0;
     dhcpPkt->options[(optoff)++] = DHCP_MESSAGE_TYPE;
     dhcpPkt->options[(optoff)++] = 0x01;
     dhcpPkt->options[(optoff)++] = DHCP_REQUEST;
     dhcpPkt->options[(optoff)] = 0xFF;
 
-    dhcp_append_option(dhcpPkt, DHCP_SERVER_IDENTIFIER, IPV4ADDRSIZE, (unsigned char *) &siaddr->ip);
-    dhcp_append_option(dhcpPkt, DHCP_REQUESTED_ADDRESS, IPV4ADDRSIZE, (unsigned char *) &ipreq->ip);
+    dhcp_optbuild_init(&builder, dhcpPkt, 0);
+    dhcp_optbuild_append(&builder, DHCP_SERVER_IDENTIFIER, IPV4ADDRSIZE, (unsigned char *) &siaddr->ip);
+    dhcp_optbuild_append(&builder, DHCP_REQUESTED_ADDRESS, IPV4ADDRSIZE, (unsigned char *) &ipreq->ip);
     return dhcpPkt;
 }
 
@@ -157,17 +164,23 @@ unsigned char dhcp_get_type(struct DhcpPacket *dhcp) {
 }
 
 unsigned char *dhcp_get_options(struct DhcpPacket *dhcpPkt, unsigned int *len) {
-    *len = 0;
     unsigned char *bufopt = dhcpPkt->options;
-    unsigned char *olist = NULL;
-    for (unsigned int i = 0; i < DHCP_OPTLEN && bufopt[i] != 0xFF; i += bufopt[i + 1] + 2) {
-        unsigned char *tmp = (unsigned char *) realloc(olist, ++(*len));
-        if (tmp == NULL) {
-            free(olist);
-            return NULL;
+    unsigned char *olist;
+    *len = 0;
+    // PAD and END are single bytes but never listed, every listed option takes at least two bytes
+    if ((olist = (unsigned char *) malloc(DHCP_OPTLEN / 2)) == NULL)
+        return NULL;
+    for (unsigned int i = 0; i < DHCP_OPTLEN - 1 && bufopt[i] != DHCP_OPT_END;) {
+        if (bufopt[i] == DHCP_OPT_PAD) {
+            i++;
+            continue;
         }
-        olist = tmp;
-        olist[(*len) - 1] = bufopt[i];
+        olist[(*len)++] = bufopt[i];
+        i += bufopt[i + 1] + 2;
+    }
+    if (*len == 0) {
+        free(olist);
+        return NULL;
     }
     return olist;
 }
@@ -198,7 +211,119 @@ unsigned char *dhcp_get_option_value(struct DhcpPacket *dhcpPkt, unsigned char o
     return data;
 }
 
+bool dhcp_optbuild_append(struct DhcpOptBuilder *builder, unsigned char op, unsigned char len,
+                          unsigned char *payload) {
+    unsigned char *bufopt = builder->pkt->options + builder->tail;
+
+    // Option header + value + END
+    if (builder->size - builder->tail < 3 + len)
+        return false;
+    bufopt[0] = op;
+    bufopt[1] = len;
+    memcpy(bufopt + 2, payload, len);
+    bufopt[2 + len] = DHCP_OPT_END;
+    builder->tail += 2 + len;
+    return true;
+}
+
+bool dhcp_optbuild_init(struct DhcpOptBuilder *builder, struct DhcpPacket *dhcpPkt, unsigned short optlen) {
+    unsigned char *bufopt = dhcpPkt->options;
+    unsigned int i = 0;
+
+    builder->pkt = dhcpPkt;
+    builder->size = optlen == 0 ? (unsigned short) DHCP_OPTLEN : optlen;
+    while (i < builder->size && bufopt[i] != DHCP_OPT_END) {
+        if (bufopt[i] == DHCP_OPT_PAD)
+            i++;
+        else if (i + 1 < builder->size)
+            i += bufopt[i + 1] + 2;
+        else
+            break;
+    }
+    if (i >= builder->size || bufopt[i] != DHCP_OPT_END)
+        return false;
+    builder->tail = (unsigned short) i;
+    return true;
+}
+
+inline unsigned int dhcp_optbuild_len(struct DhcpOptBuilder *builder) {
+    return (unsigned int) offsetof(struct DhcpPacket, options) + builder->tail + 1;
+}
+
+inline unsigned char *dhcp_optview_get(struct DhcpOptView *view, unsigned char option, unsigned char *len) {
+    unsigned char *opt;
+
+    if (view->offset[option] == 0)
+        return NULL;
+    opt = view->pkt->options + view->offset[option] - 1;
+    if (len != NULL)
+        *len = opt[1];
+    return opt + 2;
+}
+
+inline bool dhcp_optview_has(struct DhcpOptView *view, unsigned char option) {
+    return view->offset[option] != 0;
+}
+
+bool dhcp_optview_parse(struct DhcpOptView *view, struct DhcpPacket *dhcpPkt, unsigned int len) {
+    unsigned char *bufopt = dhcpPkt->options;
+    unsigned int optlen;
+    unsigned int i = 0;
+
+    view->pkt = dhcpPkt;
+    view->count = 0;
+    view->end = 0;
+    memset(view->offset, 0x00, sizeof(view->offset));
+    if (len <= offsetof(struct DhcpPacket, options) || dhcpPkt->option != htonl(DHCP_MAGIC_COOKIE))
+        return false;
+    optlen = len - (unsigned int) offsetof(struct DhcpPacket, options);
+
+    while (i < optlen) {
+        if (bufopt[i] == DHCP_OPT_END) {
+            view->end = (unsigned short) i;
+            return true;
+        }
+        if (bufopt[i] == DHCP_OPT_PAD) {
+            i++;
+            continue;
+        }
+        if (i + 2 > optlen || i + 2 + bufopt[i + 1] > optlen)
+            return false;
+        if (view->offset[bufopt[i]] == 0) {
+            view->offset[bufopt[i]] = (unsigned short) (i + 1);
+            if (view->count < sizeof(view->codes))
+                view->codes[view->count++] = bufopt[i];
+        }
+        i += bufopt[i + 1] + 2;
+    }
+    // END missing
+    return false;
+}
+
+inline unsigned char dhcp_optview_type(struct DhcpOptView *view) {
+    return dhcp_optview_uchar(view, DHCP_MESSAGE_TYPE);
+}
+
+inline unsigned char dhcp_optview_uchar(struct DhcpOptView *view, unsigned char option) {
+    unsigned char len;
+    unsigned char *value = dhcp_optview_get(view, option, &len);
+    return value != NULL && len >= 1 ? value[0] : (unsigned char) 0;
+}
+
+unsigned int dhcp_optview_uint(struct DhcpOptView *view, unsigned char option) {
+    unsigned char len;
+    unsigned char *value = dhcp_optview_get(view, option, &len);
+    unsigned int ret = 0;
+
+    if (value != NULL && len >= 4)
+        memcpy(&ret, value, sizeof(unsigned int));
+    return ret;
+}
+
 inline unsigned int dhcp_mkxid() {
-    srand((unsigned int) clock());
-    return (unsigned int) rand();
+    return spkrand_u32();
+}
+
+void dhcp_mkxid_bulk(unsigned int *xids, unsigned int n) {
+    spkrand_bytes(xids, n * sizeof(unsigned int));
 }
\ No newline at end of file
@@ -0,0 +1,444 @@
+/*
+ * Copyright (c) 2017 Jacopo De Luca
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <poll.h>
+#include <time.h>
+
+#include <datatype.h>
+#include <ethernet.h>
+#include <ipv4.h>
+#include <udp.h>
+#include <dhcp.h>
+#include <spkrand.h>
+#include <dhcpfleet.h>
+
+#define DHCPFLEET_HDRLEN    (ETHHDRSIZE + IPV4HDRSIZE + UDPHDRSIZE)
+#define DHCPFLEET_FRAMELEN  (DHCPFLEET_HDRLEN + DHCPPKTSIZE)
+#define DHCPFLEET_MINMSG    300     // BOOTP minimum message size (RFC 1542)
+#define DHCPFLEET_BATCH     32
+
+// udp dst port 68: ldh [12]; jeq #0x800; ldb [23]; jeq #17; ldh [20]; jset #0x1fff; ldxb 4*([14]&0xf);
+// ldh [x + 16]; jeq #68; ret #65535; ret #0
+static struct SpkFilterInsn __fleet_filter[] = {
+        {0x28, 0, 0, 12},
+        {0x15, 0, 8, ETHTYPE_IP},
+        {0x30, 0, 0, ETHHDRSIZE + 9},
+        {0x15, 0, 6, IPPROTO_UDP},
+        {0x28, 0, 0, ETHHDRSIZE + 6},
+        {0x45, 4, 0, 0x1FFF},
+        {0xB1, 0, 0, ETHHDRSIZE},
+        {0x48, 0, 0, ETHHDRSIZE + 2},
+        {0x15, 0, 1, DHCP_CLIENT_PORT},
+        {0x06, 0, 0, 0xFFFF},
+        {0x06, 0, 0, 0}
+};
+
+static unsigned long long __fleet_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline unsigned int __fleet_hash(struct DhcpFleet *fleet, unsigned int xid) {
+    unsigned int h = xid * 0x9E3779B1U;
+    return (h ^ (h >> 16)) & fleet->mask;
+}
+
+static void __fleet_xid_del(struct DhcpFleet *fleet, struct DhcpClient *client) {
+    struct DhcpClient **curr = &fleet->xids[__fleet_hash(fleet, client->xid)];
+    for (; *curr != NULL && *curr != client; curr = &(*curr)->next);
+    if (*curr != NULL)
+        *curr = client->next;
+    client->next = NULL;
+}
+
+static void __fleet_xid_set(struct DhcpFleet *fleet, struct DhcpClient *client) {
+    struct DhcpClient **head;
+
+    __fleet_xid_del(fleet, client);
+    client->xid = dhcp_mkxid();
+    head = &fleet->xids[__fleet_hash(fleet, client->xid)];
+    client->next = *head;
+    *head = client;
+}
+
+static struct DhcpClient *__fleet_xid_find(struct DhcpFleet *fleet, unsigned int xid) {
+    struct DhcpClient *curr = fleet->xids[__fleet_hash(fleet, xid)];
+    for (; curr != NULL && curr->xid != xid; curr = curr->next);
+    return curr;
+}
+
+static void __fleet_hist_add(struct DhcpHistogram *hist, unsigned long long start) {
+    unsigned long us = (unsigned long) ((__fleet_now_ns() - start) / 1000);
+    unsigned int bucket = us == 0 ? 0 : 64 - (unsigned int) __builtin_clzll(us);
+
+    if (bucket >= DHCPFLEET_HISTBUCKETS)
+        bucket = DHCPFLEET_HISTBUCKETS - 1;
+    hist->buckets[bucket]++;
+    if (hist->count == 0 || us < hist->min)
+        hist->min = us;
+    if (us > hist->max)
+        hist->max = us;
+    hist->count++;
+    hist->sum += us;
+}
+
+static int __fleet_flush(struct DhcpFleet *fleet) {
+    unsigned int sent = 0;
+    int ret;
+
+    while (sent < fleet->ntx) {
+        if ((ret = spark_writeb(fleet->ssock, fleet->bufs + sent, fleet->lens + sent, fleet->ntx - sent)) < 0) {
+            if (ret == SPKSOCK_EINTR)
+                continue;
+            // Lost messages are recovered by retransmissions
+            fleet->ntx = 0;
+            return ret;
+        }
+        sent += ret;
+    }
+    fleet->ntx = 0;
+    return SPKSOCK_SUCCESS;
+}
+
+static struct DhcpPacket *__fleet_slot(struct DhcpFleet *fleet) {
+    if (fleet->ntx == DHCPFLEET_BATCH)
+        __fleet_flush(fleet);
+    return (struct DhcpPacket *) (fleet->bufs[fleet->ntx] + DHCPFLEET_HDRLEN);
+}
+
+static void __fleet_queue(struct DhcpFleet *fleet, struct DhcpClient *client, struct DhcpPacket *dhcp, bool unicast) {
+    unsigned char *frame = fleet->bufs[fleet->ntx];
+    struct Ipv4Header *ipv4 = (struct Ipv4Header *) (frame + ETHHDRSIZE);
+    struct UdpHeader *udp = (struct UdpHeader *) ipv4->data;
+    struct DhcpOptBuilder builder;
+    struct netaddr_mac dst;
+    struct netaddr_ip src = {0};
+    struct netaddr_ip bcast = {0xFFFFFFFF};
+    unsigned short len = DHCPFLEET_MINMSG;
+
+    dhcp->xid = client->xid;
+    if (fleet->broadcast && !unicast)
+        dhcp->flags = htons(DHCP_FLAGS_BROADCAST);
+    if (dhcp_optbuild_init(&builder, dhcp, 0) && dhcp_optbuild_len(&builder) > len)
+        len = (unsigned short) dhcp_optbuild_len(&builder);
+
+    // Renew and release go straight to the server, everything else is broadcast
+    if (unicast)
+        dst = client->server_mac;
+    else
+        build_ethbroad_addr(&dst);
+    injects_ethernet_header(frame, &client->mac, &dst, ETHTYPE_IP);
+    injects_udp_header((unsigned char *) udp, DHCP_CLIENT_PORT, DHCP_SERVER_PORT, len);
+    injects_ipv4_header((unsigned char *) ipv4, unicast ? &client->yiaddr : &src, unicast ? &client->server : &bcast,
+                        IPV4DEFIHL, ipv4_mkid(), (unsigned short) (UDPHDRSIZE + len), IPV4DEFTTL, IPPROTO_UDP);
+    udp->checksum = udp_checksum4(udp, ipv4);
+    fleet->lens[fleet->ntx++] = DHCPFLEET_HDRLEN + len;
+}
+
+static void __fleet_timer(struct TimerNode *node, void *arg);
+
+static void __fleet_arm(struct DhcpFleet *fleet, struct DhcpClient *client, unsigned long long ms) {
+    twheel_add(&fleet->wheel, &client->timer, __fleet_now_ns() / 1000000ULL + ms, __fleet_timer, fleet);
+}
+
+static void __fleet_send(struct DhcpFleet *fleet, struct DhcpClient *client) {
+    struct DhcpPacket *dhcp = __fleet_slot(fleet);
+    struct DhcpOptBuilder builder;
+    unsigned char type = DHCP_REQUEST;
+
+    switch (client->state) {
+        case DHCPCL_SELECTING:
+            injects_dhcp_discover((unsigned char *) dhcp, &client->mac, NULL, 0);
+            fleet->stats.discovers++;
+            break;
+        case DHCPCL_REQUESTING:
+            injects_dhcp_request((unsigned char *) dhcp, &client->mac, &client->yiaddr, client->xid, &client->server, 0);
+            dhcp->siaddr = 0;
+            fleet->stats.requests++;
+            break;
+        case DHCPCL_RENEWING:
+            // RFC 2131 4.3.2: ciaddr filled, no server identifier nor requested address
+            injects_dhcp_raw((unsigned char *) dhcp, DHCP_OP_BOOT_REQUEST, DHCP_HTYPE_ETHER, ETHHWASIZE, 0,
+                             client->xid, 0, 0, &client->yiaddr, NULL, NULL, NULL, (struct netaddr *) &client->mac,
+                             NULL);
+            dhcp_optbuild_init(&builder, dhcp, 0);
+            dhcp_optbuild_append(&builder, DHCP_MESSAGE_TYPE, 1, &type);
+            fleet->stats.requests++;
+            break;
+        case DHCPCL_RELEASED:
+            injects_dhcp_release((unsigned char *) dhcp, &client->mac, &client->yiaddr, &client->server, 0);
+            fleet->stats.releases++;
+            break;
+        default:
+            return;
+    }
+    __fleet_queue(fleet, client, dhcp, client->state == DHCPCL_RENEWING || client->state == DHCPCL_RELEASED);
+    client->tries++;
+    if (client->state != DHCPCL_RELEASED)
+        __fleet_arm(fleet, client, client->rto);
+}
+
+static void __fleet_start(struct DhcpFleet *fleet, struct DhcpClient *client) {
+    client->state = DHCPCL_SELECTING;
+    client->tries = 0;
+    client->rto = fleet->timeout;
+    client->yiaddr.ip = 0;
+    client->server.ip = 0;
+    __fleet_xid_set(fleet, client);
+    client->dora_start = client->phase_start = __fleet_now_ns();
+    __fleet_send(fleet, client);
+}
+
+static void __fleet_bound(struct DhcpFleet *fleet, struct DhcpClient *client) {
+    unsigned long long now = __fleet_now_ns() / 1000000ULL;
+    unsigned long long next = 0;
+    unsigned long long release;
+
+    if (client->state == DHCPCL_REQUESTING)
+        client->bound_at = now;
+    client->state = DHCPCL_BOUND;
+    fleet->bound++;
+    // An infinite lease (RFC 2131 3.3) is never renewed
+    if (fleet->renew && (fleet->renew_after != 0 || client->lease != 0xFFFFFFFF))
+        next = fleet->renew_after != 0 ? fleet->renew_after : client->lease * 500ULL;
+    if (fleet->release_after != 0) {
+        release = client->bound_at + fleet->release_after;
+        release = release > now ? release - now : 0;
+        if (next == 0 || release < next)
+            next = release;
+    }
+    if (next != 0 || fleet->release_after != 0)
+        __fleet_arm(fleet, client, next);
+    if (fleet->on_bound != NULL)
+        fleet->on_bound(client, fleet->arg);
+}
+
+static void __fleet_timer(struct TimerNode *node, void *arg) {
+    struct DhcpFleet *fleet = (struct DhcpFleet *) arg;
+    struct DhcpClient *client = (struct DhcpClient *) node;
+
+    if (client->state == DHCPCL_BOUND) {
+        fleet->bound--;
+        client->tries = 0;
+        client->rto = fleet->timeout;
+        __fleet_xid_set(fleet, client);
+        client->phase_start = __fleet_now_ns();
+        // Renew unless the release is due
+        if (fleet->release_after == 0 || __fleet_now_ns() / 1000000ULL < client->bound_at + fleet->release_after)
+            client->state = DHCPCL_RENEWING;
+        else {
+            client->state = DHCPCL_RELEASED;
+            __fleet_xid_del(fleet, client);
+        }
+        __fleet_send(fleet, client);
+        return;
+    }
+
+    if (client->tries >= fleet->max_tries) {
+        client->state = DHCPCL_FAILED;
+        __fleet_xid_del(fleet, client);
+        fleet->stats.failed++;
+        return;
+    }
+    // Exponential backoff, a new transaction keeps the same xid (RFC 2131 4.1)
+    client->rto = client->rto * 2 > DHCPFLEET_MAXTIMEOUT ? DHCPFLEET_MAXTIMEOUT : client->rto * 2;
+    fleet->stats.retrans++;
+    __fleet_send(fleet, client);
+}
+
+static int __fleet_input(struct DhcpFleet *fleet, unsigned int len) {
+    struct EthHeader *eth = (struct EthHeader *) fleet->rxbuf;
+    struct Ipv4Header *ipv4 = (struct Ipv4Header *) eth->data;
+    struct UdpHeader *udp;
+    struct DhcpPacket *dhcp;
+    struct DhcpClient *client;
+    struct DhcpOptView view;
+    unsigned int hlen = (unsigned int) ipv4->ihl << 2;
+    unsigned int lease;
+    unsigned char type;
+
+    if (len < DHCPFLEET_HDRLEN || eth->eth_type != htons(ETHTYPE_IP) || ipv4->protocol != IPPROTO_UDP
+        || hlen < IPV4HDRSIZE || len < ETHHDRSIZE + hlen + UDPHDRSIZE)
+        return 0;
+    udp = (struct UdpHeader *) (eth->data + hlen);
+    dhcp = (struct DhcpPacket *) udp->data;
+    if (udp->dstport != htons(DHCP_CLIENT_PORT) || !dhcp_optview_parse(&view, dhcp, len - ETHHDRSIZE - hlen - UDPHDRSIZE)
+        || dhcp->op != DHCP_OP_BOOT_REPLY)
+        return 0;
+    if ((client = __fleet_xid_find(fleet, dhcp->xid)) == NULL || memcmp(dhcp->chaddr, client->mac.mac, ETHHWASIZE) != 0) {
+        fleet->stats.unmatched++;
+        return 0;
+    }
+
+    type = dhcp_optview_type(&view);
+    if (type == DHCP_OFFER && client->state == DHCPCL_SELECTING) {
+        fleet->stats.offers++;
+        __fleet_hist_add(&fleet->hist[DHCPPH_DISCOVER], client->phase_start);
+        client->yiaddr.ip = dhcp->yiaddr;
+        client->server.ip = dhcp_optview_has(&view, DHCP_SERVER_IDENTIFIER)
+                            ? dhcp_optview_uint(&view, DHCP_SERVER_IDENTIFIER) : ipv4->saddr;
+        memcpy(client->server_mac.mac, eth->shwaddr, ETHHWASIZE);
+        client->state = DHCPCL_REQUESTING;
+        client->tries = 0;
+        client->rto = fleet->timeout;
+        client->phase_start = __fleet_now_ns();
+        __fleet_send(fleet, client);
+        return 0;
+    }
+    if (type == DHCP_NAK && (client->state == DHCPCL_REQUESTING || client->state == DHCPCL_RENEWING)) {
+        fleet->stats.naks++;
+        twheel_del(&fleet->wheel, &client->timer);
+        __fleet_start(fleet, client);
+        return 0;
+    }
+    if (type != DHCP_ACK || (client->state != DHCPCL_REQUESTING && client->state != DHCPCL_RENEWING))
+        return 0;
+
+    fleet->stats.acks++;
+    twheel_del(&fleet->wheel, &client->timer);
+    lease = dhcp_optview_uint(&view, DHCP_ADDR_LEASE_TIME);
+    client->lease = lease != 0 ? ntohl(lease) : client->lease;
+    if (client->state == DHCPCL_REQUESTING) {
+        __fleet_hist_add(&fleet->hist[DHCPPH_REQUEST], client->phase_start);
+        __fleet_hist_add(&fleet->hist[DHCPPH_DORA], client->dora_start);
+    } else
+        __fleet_hist_add(&fleet->hist[DHCPPH_RENEW], client->phase_start);
+    __fleet_bound(fleet, client);
+    return 1;
+}
+
+static void __fleet_refill(struct DhcpFleet *fleet) {
+    unsigned long long now = __fleet_now_ns();
+
+    if (fleet->pps == 0)
+        fleet->tokens = DHCPFLEET_BATCH;
+    else {
+        fleet->tokens += (double) (now - fleet->last_refill) * fleet->pps / 1e9;
+        if (fleet->tokens > DHCPFLEET_BATCH)
+            fleet->tokens = DHCPFLEET_BATCH;
+    }
+    fleet->last_refill = now;
+}
+
+bool dhcpfleet_done(struct DhcpFleet *fleet) {
+    return fleet->next_start >= fleet->nclients && fleet->wheel.count == 0;
+}
+
+unsigned long dhcpfleet_percentile(struct DhcpHistogram *hist, double p) {
+    unsigned long long target = (unsigned long long) (p * hist->count + 0.5);
+    unsigned long long seen = 0;
+
+    if (hist->count == 0)
+        return 0;
+    for (unsigned int i = 0; i < DHCPFLEET_HISTBUCKETS; i++) {
+        if ((seen += hist->buckets[i]) >= target && seen > 0)
+            return i == 0 ? 0 : 1UL << i;
+    }
+    return hist->max;
+}
+
+int dhcpfleet_poll(struct DhcpFleet *fleet, int timeout) {
+    struct pollfd pfd;
+    int bound = 0;
+    int ret;
+
+    __fleet_refill(fleet);
+    while (fleet->next_start < fleet->nclients && fleet->tokens >= 1) {
+        __fleet_start(fleet, fleet->clients + fleet->next_start++);
+        fleet->tokens -= 1;
+    }
+    if ((ret = __fleet_flush(fleet)) < 0)
+        return ret;
+
+    // Do not sleep past the next start
+    if (fleet->next_start < fleet->nclients && fleet->pps > 0
+        && (ret = (int) ((1 - fleet->tokens) * 1000 / fleet->pps)) < timeout)
+        timeout = ret;
+    pfd.fd = fleet->ssock->sfd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    poll(&pfd, 1, timeout);
+
+    while ((ret = spark_read(fleet->ssock, fleet->rxbuf, NULL)) > 0)
+        bound += __fleet_input(fleet, (unsigned int) ret);
+    if (ret < 0 && ret != SPKSOCK_EINTR)
+        return ret;
+    twheel_advance(&fleet->wheel, __fleet_now_ns() / 1000000ULL);
+    if ((ret = __fleet_flush(fleet)) < 0)
+        return ret;
+    return bound;
+}
+
+struct DhcpFleet *dhcpfleet_new(struct SpkSock *ssock, unsigned int nclients) {
+    struct DhcpFleet *fleet;
+    unsigned int buckets = 1;
+
+    if (nclients == 0)
+        return NULL;
+    for (; buckets < nclients * 2; buckets <<= 1);
+    if ((fleet = (struct DhcpFleet *) calloc(1, sizeof(struct DhcpFleet))) == NULL)
+        return NULL;
+    fleet->clients = (struct DhcpClient *) calloc(nclients, sizeof(struct DhcpClient));
+    fleet->xids = (struct DhcpClient **) calloc(buckets, sizeof(struct DhcpClient *));
+    fleet->txbuf = (unsigned char *) malloc(DHCPFLEET_BATCH * DHCPFLEET_FRAMELEN);
+    fleet->bufs = (unsigned char **) malloc(DHCPFLEET_BATCH * sizeof(unsigned char *));
+    fleet->lens = (unsigned int *) malloc(DHCPFLEET_BATCH * sizeof(unsigned int));
+    fleet->rxbuf = (unsigned char *) malloc(ssock->bufl);
+    if (fleet->clients == NULL || fleet->xids == NULL || fleet->txbuf == NULL || fleet->bufs == NULL
+        || fleet->lens == NULL || fleet->rxbuf == NULL) {
+        dhcpfleet_free(fleet);
+        return NULL;
+    }
+    for (unsigned int i = 0; i < DHCPFLEET_BATCH; i++)
+        fleet->bufs[i] = fleet->txbuf + i * DHCPFLEET_FRAMELEN;
+    for (unsigned int i = 0; i < nclients; i++)
+        rndmac(&fleet->clients[i].mac);
+    fleet->mask = buckets - 1;
+    fleet->ssock = ssock;
+    fleet->nclients = nclients;
+    fleet->pps = DHCPFLEET_DEFPPS;
+    fleet->timeout = DHCPFLEET_DEFTIMEOUT;
+    fleet->max_tries = DHCPFLEET_DEFTRIES;
+    fleet->broadcast = true;
+    fleet->last_refill = __fleet_now_ns();
+    twheel_init(&fleet->wheel, fleet->last_refill / 1000000ULL);
+
+    spark_setfilter(ssock, __fleet_filter, sizeof(__fleet_filter) / sizeof(struct SpkFilterInsn));
+    spark_setpromisc(ssock, true);
+    spark_setnblock(ssock, true);
+    return fleet;
+}
+
+void dhcpfleet_free(struct DhcpFleet *fleet) {
+    if (fleet == NULL)
+        return;
+    free(fleet->clients);
+    free(fleet->xids);
+    free(fleet->txbuf);
+    free(fleet->bufs);
+    free(fleet->lens);
+    free(fleet->rxbuf);
+    free(fleet);
+}
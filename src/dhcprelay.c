@@ -0,0 +1,449 @@
+/*
+ * Copyright (c) 2017 Jacopo De Luca
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <poll.h>
+
+#include <datatype.h>
+#include <ethernet.h>
+#include <ipv4.h>
+#include <udp.h>
+#include <dhcp.h>
+#include <dhcprelay.h>
+
+#define DHCPRELAY_HDRLEN    (ETHHDRSIZE + IPV4HDRSIZE + UDPHDRSIZE)
+#define DHCPRELAY_OPTOFF    ((unsigned int) offsetof(struct DhcpPacket, options))
+
+// udp dst port 67: see dhcpserver.c
+static struct SpkFilterInsn __relay_filter[] = {
+        {0x28, 0, 0, 12},
+        {0x15, 0, 8, ETHTYPE_IP},
+        {0x30, 0, 0, ETHHDRSIZE + 9},
+        {0x15, 0, 6, IPPROTO_UDP},
+        {0x28, 0, 0, ETHHDRSIZE + 6},
+        {0x45, 4, 0, 0x1FFF},
+        {0xB1, 0, 0, ETHHDRSIZE},
+        {0x48, 0, 0, ETHHDRSIZE + 2},
+        {0x15, 0, 1, DHCP_SERVER_PORT},
+        {0x06, 0, 0, 0xFFFF},
+        {0x06, 0, 0, 0}
+};
+
+/// @brief Pointers to the headers of a frame being relayed.
+struct RelayFrame {
+    struct EthHeader *eth;
+    struct Ipv4Header *ipv4;
+    struct UdpHeader *udp;
+    struct DhcpPacket *dhcp;
+    unsigned short udpsum;
+    bool csum;
+};
+
+static void __relay_frame(struct RelayFrame *rf, unsigned char *frame) {
+    rf->eth = (struct EthHeader *) frame;
+    rf->ipv4 = (struct Ipv4Header *) rf->eth->data;
+    rf->udp = (struct UdpHeader *) (rf->eth->data + (rf->ipv4->ihl << 2));
+    rf->dhcp = (struct DhcpPacket *) rf->udp->data;
+    rf->udpsum = rf->udp->checksum;
+    rf->csum = rf->udpsum != 0;
+}
+
+static inline void __relay_set16(struct RelayFrame *rf, unsigned short *field, unsigned short value, bool pseudo,
+                                 bool iphdr) {
+    if (pseudo && rf->csum)
+        rf->udpsum = ipv4_csum_update16(rf->udpsum, *field, value);
+    if (iphdr)
+        rf->ipv4->checksum = ipv4_csum_update16(rf->ipv4->checksum, *field, value);
+    *field = value;
+}
+
+static inline void __relay_set32(struct RelayFrame *rf, unsigned int *field, unsigned int value, bool iphdr) {
+    if (rf->csum)
+        rf->udpsum = ipv4_csum_update32(rf->udpsum, *field, value);
+    if (iphdr)
+        rf->ipv4->checksum = ipv4_csum_update32(rf->ipv4->checksum, *field, value);
+    *field = value;
+}
+
+/*
+ * Rewrites the addresses, TTL and ports of the IPv4/UDP headers.
+ * The UDP checksum covers the addresses through the pseudo header.
+ */
+static void __relay_readdress(struct RelayFrame *rf, unsigned int saddr, unsigned int daddr, unsigned short sport,
+                              unsigned short dport) {
+    unsigned short oldttl;
+    unsigned short newttl;
+
+    __relay_set32(rf, &rf->ipv4->saddr, saddr, true);
+    __relay_set32(rf, &rf->ipv4->daddr, daddr, true);
+    memcpy(&oldttl, &rf->ipv4->ttl, 2);
+    rf->ipv4->ttl = IPV4DEFTTL;
+    memcpy(&newttl, &rf->ipv4->ttl, 2);
+    rf->ipv4->checksum = ipv4_csum_update16(rf->ipv4->checksum, oldttl, newttl);
+    __relay_set16(rf, &rf->udp->srcport, sport, true, false);
+    __relay_set16(rf, &rf->udp->dstport, dport, true, false);
+}
+
+static void __relay_done(struct RelayFrame *rf) {
+    // 0 means no checksum
+    if (rf->csum)
+        rf->udp->checksum = rf->udpsum != 0 ? rf->udpsum : 0xFFFF;
+}
+
+/*
+ * Replaces `len` bytes at offset `off` of the UDP datagram, the region is widened to even offsets
+ * so that partial sums stay aligned with the checksum words.
+ */
+static void __relay_patch(struct RelayFrame *rf, unsigned int off, unsigned char *data, unsigned int len) {
+    unsigned char *udp = (unsigned char *) rf->udp;
+    unsigned int start = off & ~1U;
+    unsigned int stop = (off + len + 1) & ~1U;
+    unsigned int oldsum = 0;
+
+    if (rf->csum)
+        oldsum = ipv4_csum_partial(udp + start, stop - start, 0);
+    if (data != NULL)
+        memcpy(udp + off, data, len);
+    else
+        memset(udp + off, DHCP_OPT_PAD, len);
+    if (rf->csum)
+        rf->udpsum = ipv4_csum_update(rf->udpsum, oldsum, ipv4_csum_partial(udp + start, stop - start, 0));
+}
+
+static unsigned int __relay_addagent(struct DhcpRelay *relay, struct RelayFrame *rf, unsigned int paylen,
+                                     unsigned short end) {
+    unsigned int off = UDPHDRSIZE + DHCPRELAY_OPTOFF + end;
+    unsigned int newlen = off + relay->agentlen + 1;
+    unsigned int hdrlen = (unsigned int) ((unsigned char *) rf->udp - (unsigned char *) rf->eth);
+    unsigned short value;
+
+    if (hdrlen + newlen + 1 > relay->slotlen)
+        return paylen;
+    if (newlen < paylen)
+        newlen = paylen;
+    // Bytes beyond the old datagram count as zero padding
+    memset((unsigned char *) rf->udp + paylen, 0x00, newlen + 1 - paylen);
+    relay->agentopt[relay->agentlen] = DHCP_OPT_END;
+    __relay_patch(rf, off, relay->agentopt, relay->agentlen + 1);
+    if (newlen != paylen) {
+        value = htons((unsigned short) newlen);
+        // UDP length is both in the header and in the pseudo header
+        if (rf->csum)
+            rf->udpsum = ipv4_csum_update16(rf->udpsum, rf->udp->len, value);
+        __relay_set16(rf, &rf->udp->len, value, true, false);
+        __relay_set16(rf, &rf->ipv4->len, htons((unsigned short) (newlen + (rf->ipv4->ihl << 2))), false, true);
+    }
+    return newlen;
+}
+
+static unsigned char *__relay_slot(struct DhcpRelay *relay, bool server) {
+    if (server) {
+        if (relay->nstx == DHCPRELAY_BATCH)
+            dhcprelay_flush(relay);
+        return relay->sbufs[relay->nstx];
+    }
+    if (relay->nctx == DHCPRELAY_BATCH)
+        dhcprelay_flush(relay);
+    return relay->cbufs[relay->nctx];
+}
+
+static unsigned int __relay_request(struct DhcpRelay *relay, unsigned char *frame, struct DhcpOptView *view,
+                                    unsigned int paylen) {
+    struct Ipv4Header *ipv4 = (struct Ipv4Header *) (frame + ETHHDRSIZE);
+    struct RelayFrame rf;
+    unsigned char *prev;
+    unsigned char *slot;
+    unsigned short word;
+    unsigned int len;
+    bool has82 = dhcp_optview_has(view, DHCP_RELAY_AGENT_INFO);
+
+    // Unicast traffic to other hosts is routed, not relayed
+    if (ipv4->daddr != 0xFFFFFFFF && ipv4->daddr != relay->giaddr.ip)
+        return 0;
+    relay->stats.requests++;
+    if (relay->nservers == 0)
+        return 0;
+    if (view->pkt->hops >= relay->max_hops) {
+        relay->stats.hops++;
+        return 0;
+    }
+    if (view->pkt->giaddr == 0 && has82 && !relay->trusted) {
+        relay->stats.untrusted++;
+        return 0;
+    }
+
+    slot = __relay_slot(relay, true);
+    len = (unsigned int) ((unsigned char *) view->pkt - frame) - UDPHDRSIZE + paylen;
+    memcpy(slot, frame, len);
+    __relay_frame(&rf, slot);
+
+    memcpy(&word, &rf.dhcp->hlen, 2);
+    rf.dhcp->hops++;
+    if (rf.csum) {
+        unsigned short hops;
+        memcpy(&hops, &rf.dhcp->hlen, 2);
+        rf.udpsum = ipv4_csum_update16(rf.udpsum, word, hops);
+    }
+    // Only the first relay sets giaddr and adds its own information (RFC 3046 2.1)
+    if (rf.dhcp->giaddr == 0) {
+        __relay_set32(&rf, &rf.dhcp->giaddr, relay->giaddr.ip, false);
+        if (relay->agentlen > 0 && !has82) {
+            paylen = __relay_addagent(relay, &rf, paylen, view->end);
+            len = (unsigned int) ((unsigned char *) rf.udp - slot) + paylen;
+        }
+    }
+    __relay_readdress(&rf, relay->saddr.ip, relay->servers[0].ip, htons(DHCP_SERVER_PORT), htons(DHCP_SERVER_PORT));
+    memcpy(rf.eth->shwaddr, relay->sside->iaddr.mac, ETHHWASIZE);
+    memcpy(rf.eth->dhwaddr, relay->nexthop.mac, ETHHWASIZE);
+    __relay_done(&rf);
+    relay->slens[relay->nstx++] = len;
+
+    // The other servers differ only by destination address
+    for (unsigned int i = 1; i < relay->nservers; i++) {
+        prev = slot;
+        slot = __relay_slot(relay, true);
+        memcpy(slot, prev, len);
+        __relay_frame(&rf, slot);
+        __relay_set32(&rf, &rf.ipv4->daddr, relay->servers[i].ip, true);
+        __relay_done(&rf);
+        relay->slens[relay->nstx++] = len;
+    }
+    relay->stats.forwarded += relay->nservers;
+    return relay->nservers;
+}
+
+static unsigned int __relay_reply(struct DhcpRelay *relay, unsigned char *frame, struct DhcpOptView *view,
+                                  unsigned int paylen) {
+    struct Ipv4Header *ipv4 = (struct Ipv4Header *) (frame + ETHHDRSIZE);
+    struct RelayFrame rf;
+    struct DhcpPacket *dhcp = view->pkt;
+    unsigned char *slot;
+    unsigned char *agent;
+    unsigned char agentlen;
+    unsigned int daddr;
+    unsigned int len;
+
+    if (ipv4->daddr != relay->giaddr.ip && ipv4->daddr != relay->saddr.ip)
+        return 0;
+    relay->stats.replies++;
+    if (dhcp->giaddr != relay->giaddr.ip) {
+        relay->stats.dropped++;
+        return 0;
+    }
+    slot = __relay_slot(relay, false);
+    len = (unsigned int) ((unsigned char *) dhcp - frame) - UDPHDRSIZE + paylen;
+    memcpy(slot, frame, len);
+    __relay_frame(&rf, slot);
+
+    // Option 82 must not reach the client (RFC 3046 2.1), it is overwritten with PAD
+    if ((agent = dhcp_optview_get(view, DHCP_RELAY_AGENT_INFO, &agentlen)) != NULL)
+        __relay_patch(&rf, (unsigned int) (agent - 2 - (unsigned char *) dhcp) + UDPHDRSIZE, NULL,
+                      (unsigned int) agentlen + 2);
+
+    // RFC 2131 4.1
+    if ((dhcp->flags & htons(DHCP_FLAGS_BROADCAST)) != 0 || dhcp_optview_type(view) == DHCP_NAK) {
+        daddr = 0xFFFFFFFF;
+        memset(rf.eth->dhwaddr, 0xFF, ETHHWASIZE);
+    } else {
+        daddr = dhcp->ciaddr != 0 ? dhcp->ciaddr : dhcp->yiaddr;
+        memcpy(rf.eth->dhwaddr, dhcp->chaddr, ETHHWASIZE);
+    }
+    __relay_readdress(&rf, relay->giaddr.ip, daddr, htons(DHCP_SERVER_PORT), htons(DHCP_CLIENT_PORT));
+    memcpy(rf.eth->shwaddr, relay->cside->iaddr.mac, ETHHWASIZE);
+    __relay_done(&rf);
+    relay->clens[relay->nctx++] = len;
+    relay->stats.relayed++;
+    return 1;
+}
+
+bool dhcprelay_addserver(struct DhcpRelay *relay, struct netaddr_ip *server) {
+    if (relay->nservers == DHCPRELAY_MAXSERVERS)
+        return false;
+    relay->servers[relay->nservers++] = *server;
+    return true;
+}
+
+bool dhcprelay_agentinfo(struct DhcpRelay *relay, unsigned char *circuit, unsigned char clen, unsigned char *remote,
+                         unsigned char rlen) {
+    unsigned int len = 2;
+
+    if (circuit != NULL)
+        len += 2 + clen;
+    if (remote != NULL)
+        len += 2 + rlen;
+    // One byte is left for END
+    if (len > DHCPRELAY_AGENTMAX - 1)
+        return false;
+    if (circuit == NULL && remote == NULL) {
+        relay->agentlen = 0;
+        return true;
+    }
+    relay->agentopt[0] = DHCP_RELAY_AGENT_INFO;
+    relay->agentopt[1] = (unsigned char) (len - 2);
+    relay->agentlen = 2;
+    if (circuit != NULL) {
+        relay->agentopt[relay->agentlen++] = DHCPRELAY_CIRCUITID;
+        relay->agentopt[relay->agentlen++] = clen;
+        memcpy(relay->agentopt + relay->agentlen, circuit, clen);
+        relay->agentlen += clen;
+    }
+    if (remote != NULL) {
+        relay->agentopt[relay->agentlen++] = DHCPRELAY_REMOTEID;
+        relay->agentopt[relay->agentlen++] = rlen;
+        memcpy(relay->agentopt + relay->agentlen, remote, rlen);
+        relay->agentlen += rlen;
+    }
+    return true;
+}
+
+static int __relay_send(struct SpkSock *ssock, unsigned char **bufs, unsigned int *lens, unsigned int *n) {
+    unsigned int sent = 0;
+    int ret;
+
+    while (sent < *n) {
+        if ((ret = spark_writeb(ssock, bufs + sent, lens + sent, *n - sent)) < 0) {
+            if (ret == SPKSOCK_EINTR)
+                continue;
+            // Clients retransmit
+            *n = 0;
+            return ret;
+        }
+        sent += ret;
+    }
+    *n = 0;
+    return (int) sent;
+}
+
+int dhcprelay_flush(struct DhcpRelay *relay) {
+    int sent;
+    int ret;
+
+    if ((sent = __relay_send(relay->sside, relay->sbufs, relay->slens, &relay->nstx)) < 0) {
+        relay->nctx = 0;
+        return sent;
+    }
+    if ((ret = __relay_send(relay->cside, relay->cbufs, relay->clens, &relay->nctx)) < 0)
+        return ret;
+    return sent + ret;
+}
+
+unsigned int dhcprelay_input(struct DhcpRelay *relay, unsigned char *frame, unsigned int len) {
+    struct EthHeader *eth = (struct EthHeader *) frame;
+    struct Ipv4Header *ipv4 = (struct Ipv4Header *) eth->data;
+    struct UdpHeader *udp;
+    struct DhcpOptView view;
+    unsigned int hlen;
+    unsigned int paylen;
+
+    if (len < DHCPRELAY_HDRLEN || eth->eth_type != htons(ETHTYPE_IP) || ipv4->protocol != IPPROTO_UDP)
+        return 0;
+    hlen = (unsigned int) ipv4->ihl << 2;
+    if (hlen < IPV4HDRSIZE || (ipv4->frag_off & htons(0x3FFF)) != 0 || len < ETHHDRSIZE + hlen + UDPHDRSIZE)
+        return 0;
+    udp = (struct UdpHeader *) (eth->data + hlen);
+    paylen = ntohs(udp->len);
+    if (udp->dstport != htons(DHCP_SERVER_PORT))
+        return 0;
+    // Ethernet padding is not part of the datagram
+    if (paylen < UDPHDRSIZE || ETHHDRSIZE + hlen + paylen > len || ETHHDRSIZE + hlen + paylen > relay->slotlen
+        || !dhcp_optview_parse(&view, (struct DhcpPacket *) udp->data, paylen - UDPHDRSIZE)) {
+        relay->stats.dropped++;
+        return 0;
+    }
+    if (view.pkt->op == DHCP_OP_BOOT_REQUEST)
+        return __relay_request(relay, frame, &view, paylen);
+    if (view.pkt->op == DHCP_OP_BOOT_REPLY)
+        return __relay_reply(relay, frame, &view, paylen);
+    relay->stats.dropped++;
+    return 0;
+}
+
+static void __relay_drain(struct DhcpRelay *relay, struct SpkSock *ssock) {
+    int len;
+
+    while ((len = spark_read(ssock, relay->rxbuf, NULL)) > 0)
+        dhcprelay_input(relay, relay->rxbuf, (unsigned int) len);
+}
+
+int dhcprelay_poll(struct DhcpRelay *relay, int timeout) {
+    struct pollfd pfd[2];
+    nfds_t nfds = relay->sside != relay->cside ? 2 : 1;
+
+    pfd[0].fd = relay->cside->sfd;
+    pfd[1].fd = relay->sside->sfd;
+    pfd[0].events = pfd[1].events = POLLIN;
+    pfd[0].revents = pfd[1].revents = 0;
+    poll(pfd, nfds, timeout);
+    __relay_drain(relay, relay->cside);
+    if (nfds == 2)
+        __relay_drain(relay, relay->sside);
+    return dhcprelay_flush(relay);
+}
+
+static void __relay_setup(struct SpkSock *ssock) {
+    spark_setfilter(ssock, __relay_filter, sizeof(__relay_filter) / sizeof(struct SpkFilterInsn));
+    // Forwarded requests are addressed to port 67 too
+    spark_setdirection(ssock, SPKDIR_IN);
+    spark_setnblock(ssock, true);
+}
+
+struct DhcpRelay *dhcprelay_new(struct SpkSock *cside, struct netaddr_ip *giaddr, struct SpkSock *sside,
+                                struct netaddr_ip *saddr, struct netaddr_mac *nexthop) {
+    struct DhcpRelay *relay;
+
+    if ((relay = (struct DhcpRelay *) calloc(1, sizeof(struct DhcpRelay))) == NULL)
+        return NULL;
+    relay->slotlen = (cside->bufl > sside->bufl ? cside->bufl : sside->bufl) + DHCPRELAY_AGENTMAX + 1;
+    relay->txbuf = (unsigned char *) malloc(2 * DHCPRELAY_BATCH * relay->slotlen);
+    relay->rxbuf = (unsigned char *) malloc(relay->slotlen);
+    if (relay->txbuf == NULL || relay->rxbuf == NULL) {
+        dhcprelay_free(relay);
+        return NULL;
+    }
+    for (unsigned int i = 0; i < DHCPRELAY_BATCH; i++) {
+        relay->sbufs[i] = relay->txbuf + i * relay->slotlen;
+        relay->cbufs[i] = relay->txbuf + (DHCPRELAY_BATCH + i) * relay->slotlen;
+    }
+    relay->cside = cside;
+    relay->giaddr = *giaddr;
+    relay->sside = sside;
+    relay->saddr = *saddr;
+    relay->nexthop = *nexthop;
+    relay->max_hops = DHCPRELAY_MAXHOPS;
+    dhcprelay_agentinfo(relay, (unsigned char *) cside->iface_name, (unsigned char) strlen(cside->iface_name),
+                        NULL, 0);
+
+    __relay_setup(cside);
+    if (sside != cside)
+        __relay_setup(sside);
+    return relay;
+}
+
+void dhcprelay_free(struct DhcpRelay *relay) {
+    if (relay == NULL)
+        return;
+    free(relay->txbuf);
+    free(relay->rxbuf);
+    free(relay);
+}
@@ -0,0 +1,560 @@
+/*
+ * Copyright (c) 2017 Jacopo De Luca
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <poll.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <datatype.h>
+#include <ethernet.h>
+#include <ipv4.h>
+#include <udp.h>
+#include <dhcp.h>
+#include <dhcpserver.h>
+
+#define DHCPSRV_HDRLEN      (ETHHDRSIZE + IPV4HDRSIZE + UDPHDRSIZE)
+#define DHCPSRV_FRAMELEN    (DHCPSRV_HDRLEN + DHCPPKTSIZE)
+#define DHCPSRV_MINMSG      300     // BOOTP minimum message size (RFC 1542)
+#define DHCPSRV_MAGIC       0x53504B4CU
+#define DHCPSRV_VERSION     1
+#define DHCPSRV_NONE        0xFFFFFFFFU
+#define DHCPSRV_T1          58
+#define DHCPSRV_T2          59
+#define DHCPSRV_SUBNETMASK  1
+#define DHCPSRV_ROUTER      3
+#define DHCPSRV_DNS         6
+
+enum {
+    DHCPSRV_TMPL_OFFER,
+    DHCPSRV_TMPL_ACK,
+    DHCPSRV_TMPL_NAK
+};
+
+/// @brief Lease file header, followed by `count` DhcpLease records.
+struct DhcpLeaseFile {
+    unsigned int magic;
+    unsigned int version;
+    unsigned int first;
+    unsigned int count;
+};
+
+// udp dst port 67: see dhcpfleet.c
+static struct SpkFilterInsn __srv_filter[] = {
+        {0x28, 0, 0, 12},
+        {0x15, 0, 8, ETHTYPE_IP},
+        {0x30, 0, 0, ETHHDRSIZE + 9},
+        {0x15, 0, 6, IPPROTO_UDP},
+        {0x28, 0, 0, ETHHDRSIZE + 6},
+        {0x45, 4, 0, 0x1FFF},
+        {0xB1, 0, 0, ETHHDRSIZE},
+        {0x48, 0, 0, ETHHDRSIZE + 2},
+        {0x15, 0, 1, DHCP_SERVER_PORT},
+        {0x06, 0, 0, 0xFFFF},
+        {0x06, 0, 0, 0}
+};
+
+static inline unsigned int __srv_now() {
+    return (unsigned int) time(NULL);
+}
+
+static inline unsigned int __srv_hash(struct DhcpServer *srv, unsigned char *chaddr) {
+    unsigned long long key = 0;
+    memcpy(&key, chaddr, ETHHWASIZE);
+    key *= 0x9E3779B97F4A7C15ULL;
+    return (unsigned int) (key >> 32) & srv->mask;
+}
+
+static inline bool __srv_empty(unsigned char *chaddr) {
+    static const unsigned char zero[ETHHWASIZE] = {0};
+    return memcmp(chaddr, zero, ETHHWASIZE) == 0;
+}
+
+static inline bool __srv_expired(struct DhcpLease *lease, unsigned int now) {
+    return lease->state == DHCPLEASE_FREE || (lease->state != DHCPLEASE_RESERVED && lease->expires <= now);
+}
+
+static inline void __srv_setfree(struct DhcpServer *srv, unsigned int idx, bool free) {
+    unsigned long long bit = 1ULL << (idx & 63);
+
+    if (free == ((srv->bitmap[idx >> 6] & bit) != 0))
+        return;
+    srv->bitmap[idx >> 6] ^= bit;
+    if (free)
+        srv->available++;
+    else
+        srv->available--;
+}
+
+static unsigned int __srv_find(struct DhcpServer *srv, unsigned char *chaddr) {
+    unsigned int idx = srv->buckets[__srv_hash(srv, chaddr)];
+    for (; idx != DHCPSRV_NONE && memcmp(srv->leases[idx].chaddr, chaddr, ETHHWASIZE) != 0; idx = srv->chain[idx]);
+    return idx;
+}
+
+static void __srv_link(struct DhcpServer *srv, unsigned int idx) {
+    unsigned int *head = &srv->buckets[__srv_hash(srv, srv->leases[idx].chaddr)];
+    srv->chain[idx] = *head;
+    *head = idx;
+}
+
+static void __srv_unlink(struct DhcpServer *srv, unsigned int idx) {
+    unsigned int *curr = &srv->buckets[__srv_hash(srv, srv->leases[idx].chaddr)];
+    for (; *curr != DHCPSRV_NONE && *curr != idx; curr = &srv->chain[*curr]);
+    if (*curr == idx)
+        *curr = srv->chain[idx];
+    srv->chain[idx] = DHCPSRV_NONE;
+}
+
+static void __srv_take(struct DhcpServer *srv, unsigned int idx, unsigned char *chaddr) {
+    struct DhcpLease *lease = srv->leases + idx;
+
+    if (memcmp(lease->chaddr, chaddr, ETHHWASIZE) != 0) {
+        if (!__srv_empty(lease->chaddr))
+            __srv_unlink(srv, idx);
+        memcpy(lease->chaddr, chaddr, ETHHWASIZE);
+        __srv_link(srv, idx);
+    }
+    __srv_setfree(srv, idx, false);
+}
+
+static void __srv_reclaim(struct DhcpServer *srv) {
+    unsigned int now = __srv_now();
+
+    for (unsigned int i = 0; i < srv->count; i++) {
+        if (srv->leases[i].state != DHCPLEASE_FREE && __srv_expired(srv->leases + i, now)) {
+            srv->leases[i].state = DHCPLEASE_FREE;
+            __srv_setfree(srv, i, true);
+        }
+    }
+}
+
+static unsigned int __srv_bitmap_next(struct DhcpServer *srv) {
+    unsigned int words = (srv->count + 63) >> 6;
+    unsigned int w = srv->cursor >> 6;
+
+    for (unsigned int i = 0; i < words; i++, w = w + 1 == words ? 0 : w + 1) {
+        if (srv->bitmap[w] != 0) {
+            srv->cursor = (w << 6) + (unsigned int) __builtin_ctzll(srv->bitmap[w]);
+            return srv->cursor;
+        }
+    }
+    return DHCPSRV_NONE;
+}
+
+static inline unsigned int __srv_index(struct DhcpServer *srv, unsigned int ip) {
+    unsigned int off = ntohl(ip) - srv->first;
+    return off < srv->count ? off : DHCPSRV_NONE;
+}
+
+static unsigned int __srv_alloc(struct DhcpServer *srv, unsigned char *chaddr, unsigned int reqip) {
+    unsigned int now = __srv_now();
+    unsigned int idx;
+
+    // The same client always gets back its address, if it is still available
+    if ((idx = __srv_find(srv, chaddr)) != DHCPSRV_NONE && srv->leases[idx].state != DHCPLEASE_DECLINED
+        && srv->leases[idx].state != DHCPLEASE_RESERVED) {
+        __srv_take(srv, idx, chaddr);
+        return idx;
+    }
+    if (reqip != 0 && (idx = __srv_index(srv, reqip)) != DHCPSRV_NONE && __srv_expired(srv->leases + idx, now)) {
+        __srv_take(srv, idx, chaddr);
+        return idx;
+    }
+    if ((idx = __srv_bitmap_next(srv)) == DHCPSRV_NONE) {
+        __srv_reclaim(srv);
+        if ((idx = __srv_bitmap_next(srv)) == DHCPSRV_NONE)
+            return DHCPSRV_NONE;
+    }
+    __srv_take(srv, idx, chaddr);
+    return idx;
+}
+
+static void __srv_template(struct DhcpServer *srv, int type) {
+    unsigned char *frame = type == DHCPSRV_TMPL_OFFER ? srv->tmpl_offer
+                                                      : type == DHCPSRV_TMPL_ACK ? srv->tmpl_ack : srv->tmpl_nak;
+    struct Ipv4Header *ipv4 = (struct Ipv4Header *) (frame + ETHHDRSIZE);
+    struct UdpHeader *udp = (struct UdpHeader *) ipv4->data;
+    struct DhcpPacket *dhcp = (struct DhcpPacket *) udp->data;
+    struct DhcpOptBuilder builder;
+    struct netaddr_mac bcast;
+    struct netaddr_ip dst = {0xFFFFFFFF};
+    unsigned char msgtype[] = {DHCP_OFFER, DHCP_ACK, DHCP_NAK};
+    unsigned int value;
+    unsigned short len;
+
+    injects_dhcp_raw((unsigned char *) dhcp, DHCP_OP_BOOT_REPLY, DHCP_HTYPE_ETHER, ETHHWASIZE, 0, 0, 0, 0, NULL,
+                     NULL, NULL, NULL, NULL, NULL);
+    dhcp_optbuild_init(&builder, dhcp, 0);
+    dhcp_optbuild_append(&builder, DHCP_MESSAGE_TYPE, 1, msgtype + type);
+    dhcp_optbuild_append(&builder, DHCP_SERVER_IDENTIFIER, IPV4ADDRSIZE, (unsigned char *) &srv->ipaddr.ip);
+    if (type != DHCPSRV_TMPL_NAK) {
+        value = htonl(srv->lease_time);
+        dhcp_optbuild_append(&builder, DHCP_ADDR_LEASE_TIME, 4, (unsigned char *) &value);
+        value = htonl(srv->lease_time / 2);
+        dhcp_optbuild_append(&builder, DHCPSRV_T1, 4, (unsigned char *) &value);
+        value = htonl((unsigned int) ((unsigned long long) srv->lease_time * 7 / 8));
+        dhcp_optbuild_append(&builder, DHCPSRV_T2, 4, (unsigned char *) &value);
+        dhcp_optbuild_append(&builder, DHCPSRV_SUBNETMASK, IPV4ADDRSIZE, (unsigned char *) &srv->netmask.ip);
+        if (srv->router.ip != 0)
+            dhcp_optbuild_append(&builder, DHCPSRV_ROUTER, IPV4ADDRSIZE, (unsigned char *) &srv->router.ip);
+        if (srv->ndns > 0)
+            dhcp_optbuild_append(&builder, DHCPSRV_DNS, (unsigned char) (srv->ndns * IPV4ADDRSIZE),
+                                 (unsigned char *) srv->dns);
+    }
+    len = (unsigned short) dhcp_optbuild_len(&builder);
+    if (len < DHCPSRV_MINMSG)
+        len = DHCPSRV_MINMSG;
+
+    build_ethbroad_addr(&bcast);
+    injects_ethernet_header(frame, &srv->hwaddr, &bcast, ETHTYPE_IP);
+    injects_ipv4_header((unsigned char *) ipv4, &srv->ipaddr, &dst, IPV4DEFIHL, 0, (unsigned short) (UDPHDRSIZE + len),
+                        IPV4DEFTTL, IPPROTO_UDP);
+    ipv4->frag_off = 0;
+    injects_udp_header((unsigned char *) udp, DHCP_SERVER_PORT, DHCP_CLIENT_PORT, len);
+    srv->tmpl_len[type] = (unsigned short) (DHCPSRV_HDRLEN + len);
+}
+
+static void __srv_reply(struct DhcpServer *srv, int type, struct EthHeader *reqeth, struct DhcpPacket *req,
+                        unsigned int yiaddr) {
+    unsigned char *frame;
+    unsigned char *tmpl = type == DHCPSRV_TMPL_OFFER ? srv->tmpl_offer
+                                                     : type == DHCPSRV_TMPL_ACK ? srv->tmpl_ack : srv->tmpl_nak;
+    struct Ipv4Header *ipv4;
+    struct UdpHeader *udp;
+    struct DhcpPacket *dhcp;
+
+    if (srv->ntx == DHCPSRV_BATCH)
+        dhcpserver_flush(srv);
+    frame = srv->bufs[srv->ntx];
+    memcpy(frame, tmpl, srv->tmpl_len[type]);
+    ipv4 = (struct Ipv4Header *) (frame + ETHHDRSIZE);
+    udp = (struct UdpHeader *) ipv4->data;
+    dhcp = (struct DhcpPacket *) udp->data;
+
+    dhcp->xid = req->xid;
+    dhcp->flags = req->flags;
+    dhcp->giaddr = req->giaddr;
+    dhcp->yiaddr = yiaddr;
+    if (type == DHCPSRV_TMPL_ACK)
+        dhcp->ciaddr = req->ciaddr;
+    memcpy(dhcp->chaddr, req->chaddr, DHCP_CHADDRLEN);
+
+    // RFC 2131 4.1: relay, renewing client, broadcast flag, unicast to the new address
+    if (req->giaddr != 0) {
+        ipv4->daddr = req->giaddr;
+        udp->dstport = htons(DHCP_SERVER_PORT);
+        memcpy(((struct EthHeader *) frame)->dhwaddr, reqeth->shwaddr, ETHHWASIZE);
+    } else if (type == DHCPSRV_TMPL_NAK || (req->flags & htons(DHCP_FLAGS_BROADCAST)) != 0) {
+        // Template default: broadcast
+    } else if (req->ciaddr != 0) {
+        // The client may be behind a router
+        ipv4->daddr = req->ciaddr;
+        memcpy(((struct EthHeader *) frame)->dhwaddr, reqeth->shwaddr, ETHHWASIZE);
+    } else {
+        ipv4->daddr = yiaddr;
+        memcpy(((struct EthHeader *) frame)->dhwaddr, req->chaddr, ETHHWASIZE);
+    }
+    ipv4->id = ipv4_mkid();
+    ipv4->checksum = ipv4_checksum(ipv4);
+    udp->checksum = udp_checksum4(udp, ipv4);
+    srv->lens[srv->ntx++] = srv->tmpl_len[type];
+}
+
+static bool __srv_request(struct DhcpServer *srv, struct EthHeader *eth, struct DhcpPacket *req,
+                          struct DhcpOptView *view) {
+    struct DhcpLease *lease;
+    unsigned int now = __srv_now();
+    unsigned int sid = dhcp_optview_uint(view, DHCP_SERVER_IDENTIFIER);
+    unsigned int reqip = dhcp_optview_uint(view, DHCP_REQUESTED_ADDRESS);
+    unsigned int idx = __srv_find(srv, req->chaddr);
+
+    srv->stats.requests++;
+    if (reqip == 0)
+        reqip = req->ciaddr;
+    if (sid != 0 && sid != srv->ipaddr.ip) {
+        // The client selected another server, our offer is withdrawn
+        if (idx != DHCPSRV_NONE && srv->leases[idx].state == DHCPLEASE_OFFERED) {
+            srv->leases[idx].state = DHCPLEASE_FREE;
+            __srv_setfree(srv, idx, true);
+        }
+        return false;
+    }
+
+    if (idx != DHCPSRV_NONE && __srv_index(srv, reqip) == idx
+        && (srv->leases[idx].state == DHCPLEASE_OFFERED || srv->leases[idx].state == DHCPLEASE_BOUND
+            || srv->leases[idx].state == DHCPLEASE_FREE)) {
+        __srv_take(srv, idx, req->chaddr);
+    } else if (sid == 0 && (idx = __srv_index(srv, reqip)) != DHCPSRV_NONE && __srv_expired(srv->leases + idx, now)) {
+        // INIT-REBOOT or renew of an address we have no record of, but that is free
+        __srv_take(srv, idx, req->chaddr);
+    } else {
+        if (sid == 0 && (reqip & srv->netmask.ip) != (srv->ipaddr.ip & srv->netmask.ip))
+            return false;
+        srv->stats.naks++;
+        __srv_reply(srv, DHCPSRV_TMPL_NAK, eth, req, 0);
+        return true;
+    }
+    lease = srv->leases + idx;
+    lease->state = DHCPLEASE_BOUND;
+    lease->expires = now + srv->lease_time;
+    srv->stats.acks++;
+    __srv_reply(srv, DHCPSRV_TMPL_ACK, eth, req, htonl(srv->first + idx));
+    return true;
+}
+
+int dhcpserver_flush(struct DhcpServer *srv) {
+    unsigned int sent = 0;
+    int ret;
+
+    while (sent < srv->ntx) {
+        if ((ret = spark_writeb(srv->ssock, srv->bufs + sent, srv->lens + sent, srv->ntx - sent)) < 0) {
+            if (ret == SPKSOCK_EINTR)
+                continue;
+            // Clients retransmit
+            srv->ntx = 0;
+            return ret;
+        }
+        sent += ret;
+    }
+    srv->ntx = 0;
+    return (int) sent;
+}
+
+bool dhcpserver_input(struct DhcpServer *srv, unsigned char *frame, unsigned int len) {
+    struct EthHeader *eth = (struct EthHeader *) frame;
+    struct Ipv4Header *ipv4 = (struct Ipv4Header *) eth->data;
+    struct UdpHeader *udp;
+    struct DhcpPacket *req;
+    struct DhcpOptView view;
+    struct DhcpLease *lease;
+    unsigned int hlen = (unsigned int) ipv4->ihl << 2;
+    unsigned int idx;
+
+    if (!srv->ready) {
+        __srv_template(srv, DHCPSRV_TMPL_OFFER);
+        __srv_template(srv, DHCPSRV_TMPL_ACK);
+        __srv_template(srv, DHCPSRV_TMPL_NAK);
+        srv->ready = true;
+    }
+    if (len < DHCPSRV_HDRLEN || eth->eth_type != htons(ETHTYPE_IP) || ipv4->protocol != IPPROTO_UDP
+        || hlen < IPV4HDRSIZE || len < ETHHDRSIZE + hlen + UDPHDRSIZE)
+        return false;
+    udp = (struct UdpHeader *) (eth->data + hlen);
+    req = (struct DhcpPacket *) udp->data;
+    if (udp->dstport != htons(DHCP_SERVER_PORT))
+        return false;
+    if (!dhcp_optview_parse(&view, req, len - ETHHDRSIZE - hlen - UDPHDRSIZE) || req->op != DHCP_OP_BOOT_REQUEST
+        || req->htype != DHCP_HTYPE_ETHER || req->hlen != ETHHWASIZE) {
+        srv->stats.ignored++;
+        return false;
+    }
+
+    switch (dhcp_optview_type(&view)) {
+        case DHCP_DISCOVER:
+            srv->stats.discovers++;
+            if ((idx = __srv_alloc(srv, req->chaddr, dhcp_optview_uint(&view, DHCP_REQUESTED_ADDRESS)))
+                == DHCPSRV_NONE) {
+                srv->stats.exhausted++;
+                return false;
+            }
+            lease = srv->leases + idx;
+            if (lease->state != DHCPLEASE_BOUND || __srv_expired(lease, __srv_now())) {
+                lease->state = DHCPLEASE_OFFERED;
+                lease->expires = __srv_now() + srv->offer_time;
+            }
+            srv->stats.offers++;
+            __srv_reply(srv, DHCPSRV_TMPL_OFFER, eth, req, htonl(srv->first + idx));
+            return true;
+        case DHCP_REQUEST:
+            return __srv_request(srv, eth, req, &view);
+        case DHCP_RELEASE:
+            srv->stats.releases++;
+            if ((idx = __srv_find(srv, req->chaddr)) != DHCPSRV_NONE && __srv_index(srv, req->ciaddr) == idx
+                && srv->leases[idx].state == DHCPLEASE_BOUND) {
+                // chaddr is kept, the client will get the same address next time
+                srv->leases[idx].state = DHCPLEASE_FREE;
+                __srv_setfree(srv, idx, true);
+            }
+            return false;
+        case DHCP_DECLINE:
+            srv->stats.declines++;
+            idx = __srv_index(srv, dhcp_optview_uint(&view, DHCP_REQUESTED_ADDRESS));
+            if (idx != DHCPSRV_NONE && memcmp(srv->leases[idx].chaddr, req->chaddr, ETHHWASIZE) == 0) {
+                __srv_unlink(srv, idx);
+                memset(srv->leases[idx].chaddr, 0x00, ETHHWASIZE);
+                srv->leases[idx].state = DHCPLEASE_DECLINED;
+                srv->leases[idx].expires = __srv_now() + srv->decline_time;
+            }
+            return false;
+        default:
+            srv->stats.ignored++;
+            return false;
+    }
+}
+
+struct DhcpLease *dhcpserver_lease(struct DhcpServer *srv, struct netaddr_ip *ip) {
+    unsigned int idx = __srv_index(srv, ip->ip);
+    return idx == DHCPSRV_NONE ? NULL : srv->leases + idx;
+}
+
+int dhcpserver_poll(struct DhcpServer *srv, int timeout) {
+    struct pollfd pfd;
+    int sent;
+    int len;
+
+    pfd.fd = srv->ssock->sfd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    poll(&pfd, 1, timeout);
+    while ((len = spark_read(srv->ssock, srv->rxbuf, NULL)) > 0)
+        dhcpserver_input(srv, srv->rxbuf, (unsigned int) len);
+    if ((sent = dhcpserver_flush(srv)) < 0)
+        return sent;
+    return len < 0 && len != SPKSOCK_EINTR ? len : sent;
+}
+
+static bool __srv_map(struct DhcpServer *srv, char *leasefile) {
+    struct DhcpLeaseFile *hdr;
+    struct stat st;
+    bool fresh;
+
+    srv->maplen = sizeof(struct DhcpLeaseFile) + (unsigned long) srv->count * sizeof(struct DhcpLease);
+    if (leasefile == NULL) {
+        srv->fd = -1;
+        if ((srv->map = calloc(1, srv->maplen)) == NULL)
+            return false;
+        fresh = true;
+    } else {
+        if ((srv->fd = open(leasefile, O_RDWR | O_CREAT, 0644)) < 0)
+            return false;
+        if (fstat(srv->fd, &st) < 0)
+            return false;
+        fresh = (unsigned long) st.st_size != srv->maplen;
+        if (fresh && (ftruncate(srv->fd, 0) < 0 || ftruncate(srv->fd, (off_t) srv->maplen) < 0))
+            return false;
+        srv->map = mmap(NULL, srv->maplen, PROT_READ | PROT_WRITE, MAP_SHARED, srv->fd, 0);
+        if (srv->map == MAP_FAILED) {
+            srv->map = NULL;
+            return false;
+        }
+    }
+    hdr = (struct DhcpLeaseFile *) srv->map;
+    if (!fresh && (hdr->magic != DHCPSRV_MAGIC || hdr->version != DHCPSRV_VERSION || hdr->first != srv->first
+                   || hdr->count != srv->count)) {
+        memset(srv->map, 0x00, srv->maplen);
+        fresh = true;
+    }
+    hdr->magic = DHCPSRV_MAGIC;
+    hdr->version = DHCPSRV_VERSION;
+    hdr->first = srv->first;
+    hdr->count = srv->count;
+    srv->leases = (struct DhcpLease *) ((unsigned char *) srv->map + sizeof(struct DhcpLeaseFile));
+    return true;
+}
+
+struct DhcpServer *dhcpserver_new(struct SpkSock *ssock, struct netaddr_ip *ipaddr, struct netaddr_ip *first,
+                                  struct netaddr_ip *last, char *leasefile) {
+    struct DhcpServer *srv;
+    unsigned int buckets = 1;
+    unsigned int now = __srv_now();
+    unsigned int idx;
+
+    if (ntohl(last->ip) < ntohl(first->ip) || ntohl(last->ip) - ntohl(first->ip) >= DHCPSRV_MAXPOOL)
+        return NULL;
+    if ((srv = (struct DhcpServer *) calloc(1, sizeof(struct DhcpServer))) == NULL)
+        return NULL;
+    srv->fd = -1;
+    srv->first = ntohl(first->ip);
+    srv->count = ntohl(last->ip) - srv->first + 1;
+    for (; buckets < srv->count; buckets <<= 1);
+    srv->mask = buckets - 1;
+    srv->bitmap = (unsigned long long *) calloc((srv->count + 63) >> 6, sizeof(unsigned long long));
+    srv->buckets = (unsigned int *) malloc(buckets * sizeof(unsigned int));
+    srv->chain = (unsigned int *) malloc(srv->count * sizeof(unsigned int));
+    srv->txbuf = (unsigned char *) malloc(DHCPSRV_BATCH * DHCPSRV_FRAMELEN);
+    srv->rxbuf = (unsigned char *) malloc(ssock->bufl);
+    if (srv->bitmap == NULL || srv->buckets == NULL || srv->chain == NULL || srv->txbuf == NULL
+        || srv->rxbuf == NULL || !__srv_map(srv, leasefile)) {
+        dhcpserver_free(srv);
+        return NULL;
+    }
+    for (unsigned int i = 0; i < DHCPSRV_BATCH; i++)
+        srv->bufs[i] = srv->txbuf + i * DHCPSRV_FRAMELEN;
+    memset(srv->buckets, 0xFF, buckets * sizeof(unsigned int));
+
+    // Rebuilds the indexes from the lease table
+    for (unsigned int i = 0; i < srv->count; i++) {
+        srv->chain[i] = DHCPSRV_NONE;
+        if (srv->leases[i].state != DHCPLEASE_FREE && __srv_expired(srv->leases + i, now))
+            srv->leases[i].state = DHCPLEASE_FREE;
+        if (srv->leases[i].state == DHCPLEASE_FREE)
+            __srv_setfree(srv, i, true);
+        if (!__srv_empty(srv->leases[i].chaddr))
+            __srv_link(srv, i);
+    }
+    if ((idx = __srv_index(srv, ipaddr->ip)) != DHCPSRV_NONE) {
+        srv->leases[idx].state = DHCPLEASE_RESERVED;
+        __srv_setfree(srv, idx, false);
+    }
+
+    srv->ssock = ssock;
+    srv->hwaddr = ssock->iaddr;
+    srv->ipaddr = *ipaddr;
+    srv->netmask.ip = htonl(0xFFFFFF00);
+    srv->lease_time = DHCPSRV_DEFLEASE;
+    srv->offer_time = DHCPSRV_DEFOFFER;
+    srv->decline_time = DHCPSRV_DEFDECLINE;
+
+    spark_setfilter(ssock, __srv_filter, sizeof(__srv_filter) / sizeof(struct SpkFilterInsn));
+    spark_setnblock(ssock, true);
+    return srv;
+}
+
+void dhcpserver_sync(struct DhcpServer *srv) {
+    if (srv->fd >= 0)
+        msync(srv->map, srv->maplen, MS_ASYNC);
+}
+
+void dhcpserver_free(struct DhcpServer *srv) {
+    if (srv == NULL)
+        return;
+    if (srv->fd >= 0) {
+        if (srv->map != NULL) {
+            msync(srv->map, srv->maplen, MS_SYNC);
+            munmap(srv->map, srv->maplen);
+        }
+        close(srv->fd);
+    } else
+        free(srv->map);
+    free(srv->bitmap);
+    free(srv->buckets);
+    free(srv->chain);
+    free(srv->txbuf);
+    free(srv->rxbuf);
+    free(srv);
+}
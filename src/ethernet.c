@@ -26,10 +26,10 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <netinet/in.h>
-#include <time.h>
 
 #include <datatype.h>
 #include <ethernet.h>
+#include <spkrand.h>
 
 bool ethcmp(struct netaddr_mac *mac1, struct netaddr_mac *mac2) {
     for (int i = 0; i < ETHHWASIZE; i++)
@@ -147,12 +147,18 @@ void build_ethmulti_addr(struct netaddr_mac *mac, struct netaddr_ip *ip) {
     return;
 }
 
-void rndmac(struct netaddr_mac *mac) {
+inline void rndmac(struct netaddr_mac *mac) {
+    rndmac_bulk(mac, 1);
+}
+
+void rndmac_bulk(struct netaddr_mac *macs, unsigned int n) {
 /* The lsb of the MSB can not be set,
  * because those are multicast mac addr!
  */
-    srand((unsigned int) clock());
-    *((unsigned int *) mac->mac) = (unsigned int) rand();
-    *((unsigned short *) (mac->mac + 4)) = (unsigned short) rand();
-    mac->mac[0] &= ((char) 0xFE);
+    uint64_t rnd;
+    for (unsigned int i = 0; i < n; i++) {
+        rnd = spkrand_u64();
+        memcpy(macs[i].mac, &rnd, ETHHWASIZE);
+        macs[i].mac[0] &= ((char) 0xFE);
+    }
 }
\ No newline at end of file
@@ -0,0 +1,146 @@
+/*
+ * Copyright (c) 2017 Jacopo De Luca
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+*/
+
+#include <string.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include <ethernet.h>
+#include <ipv4.h>
+#include <flow.h>
+#include <dlt_table.h>
+
+#define FLOW_ETHTYPE_VLAN   0x8100
+#define FLOW_ETHTYPE_QINQ   0x88A8
+#define FLOW_ETHTYPE_QINQ1  0x9100
+
+static inline unsigned short __flow_u16(unsigned char *p) {
+    unsigned short v;
+
+    memcpy(&v, p, sizeof(unsigned short));
+    return ntohs(v);
+}
+
+static inline unsigned long long __flow_endpoint(unsigned int addr, unsigned short port) {
+    return ((unsigned long long) ntohl(addr) << 16) | ntohs(port);
+}
+
+bool flow_dissect(unsigned char *pkt, unsigned int len, int lktype, struct FlowKey *key) {
+    struct Ipv4Header *ip;
+    unsigned int family;
+    unsigned int off;
+    unsigned int ihl;
+    unsigned short type;
+
+    switch (lktype) {
+        case DLT_EN10MB:
+            if (len < ETHHDRSIZE)
+                return false;
+            type = __flow_u16(pkt + 12);
+            off = ETHHDRSIZE;
+            for (int i = 0; i < FLOW_MAXVLAN && len >= off + 4
+                            && (type == FLOW_ETHTYPE_VLAN || type == FLOW_ETHTYPE_QINQ || type == FLOW_ETHTYPE_QINQ1); i++) {
+                type = __flow_u16(pkt + off + 2);
+                off += 4;
+            }
+            break;
+        case DLT_LINUX_SLL:
+            if (len < 16)
+                return false;
+            type = __flow_u16(pkt + 14);
+            off = 16;
+            break;
+        case DLT_RAW:
+            type = ETHTYPE_IP;
+            off = 0;
+            break;
+        case DLT_NULL:
+        case DLT_LOOP:
+            // Address family in host (DLT_NULL) or network (DLT_LOOP) byte order
+            if (len < 4)
+                return false;
+            memcpy(&family, pkt, sizeof(unsigned int));
+            type = family == AF_INET || ntohl(family) == AF_INET ? ETHTYPE_IP : 0;
+            off = 4;
+            break;
+        default:
+            return false;
+    }
+
+    if (type != ETHTYPE_IP || len - off < IPV4HDRSIZE)
+        return false;
+
+    ip = (struct Ipv4Header *) (pkt + off);
+    ihl = (unsigned int) ip->ihl << 2;
+    if (ip->version != IPV4VERSION || ihl < IPV4HDRSIZE || ihl > len - off)
+        return false;
+
+    memset(key, 0x00, sizeof(struct FlowKey));
+    memcpy(&key->saddr, &ip->saddr, IPV4ADDRSIZE);
+    memcpy(&key->daddr, &ip->daddr, IPV4ADDRSIZE);
+    key->proto = ip->protocol;
+
+    off += ihl;
+    if ((ntohs(ip->frag_off) & 0x1FFF) == 0 && len - off >= 4
+        && (ip->protocol == IPPROTO_TCP || ip->protocol == IPPROTO_UDP || ip->protocol == IPPROTO_SCTP)) {
+        memcpy(&key->sport, pkt + off, sizeof(unsigned short));
+        memcpy(&key->dport, pkt + off + 2, sizeof(unsigned short));
+    }
+    return true;
+}
+
+bool flow_equal(struct FlowKey *k1, struct FlowKey *k2) {
+    if (k1->proto != k2->proto)
+        return false;
+    if (k1->saddr == k2->saddr && k1->sport == k2->sport && k1->daddr == k2->daddr && k1->dport == k2->dport)
+        return true;
+    return k1->saddr == k2->daddr && k1->sport == k2->dport && k1->daddr == k2->saddr && k1->dport == k2->sport;
+}
+
+unsigned int flow_hash(struct FlowKey *key) {
+    unsigned long long a = __flow_endpoint(key->saddr, key->sport);
+    unsigned long long b = __flow_endpoint(key->daddr, key->dport);
+    unsigned long long h;
+
+    if (a > b) {
+        h = a;
+        a = b;
+        b = h;
+    }
+    h = a * 0x9E3779B97F4A7C15ULL;
+    h = (h ^ b ^ ((unsigned long long) key->proto << 56)) * 0x9E3779B97F4A7C15ULL;
+    return (unsigned int) (h >> 32);
+}
+
+void flow_canonical(struct FlowKey *key) {
+    unsigned int addr;
+    unsigned short port;
+
+    if (__flow_endpoint(key->saddr, key->sport) <= __flow_endpoint(key->daddr, key->dport))
+        return;
+    addr = key->saddr;
+    key->saddr = key->daddr;
+    key->daddr = addr;
+    port = key->sport;
+    key->sport = key->dport;
+    key->dport = port;
+}
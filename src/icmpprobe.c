@@ -0,0 +1,364 @@
+/*
+ * Copyright (c) 2017 Jacopo De Luca
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <poll.h>
+#include <time.h>
+
+#include <datatype.h>
+#include <ethernet.h>
+#include <ipv4.h>
+#include <icmp4.h>
+#include <spkrand.h>
+#include <icmpprobe.h>
+
+#define ICMPPROBE_HDRLEN    (ETHHDRSIZE + IPV4HDRSIZE + ICMP4HDRSIZE)
+#define ICMPPROBE_MAXFRAME  (ICMPPROBE_HDRLEN + ICMPPROBE_MAXPAYLOAD)
+#define ICMPPROBE_NSLOTS    65536
+#define ICMPPROBE_MINQUEUE  64
+
+// ldh [12]; jeq #0x800; ldb [23]; jeq #IPPROTO_ICMP; ret #65535; ret #0
+static struct SpkFilterInsn __probe_filter[] = {
+        {0x28, 0, 0, 12},
+        {0x15, 0, 3, ETHTYPE_IP},
+        {0x30, 0, 0, ETHHDRSIZE + 9},
+        {0x15, 0, 1, IPPROTO_ICMP},
+        {0x06, 0, 0, 0xFFFF},
+        {0x06, 0, 0, 0}
+};
+
+static unsigned long long __probe_clock(clockid_t clk) {
+    struct timespec ts;
+    clock_gettime(clk, &ts);
+    return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static unsigned long long __probe_tsns(struct SpkTimeStamp *ts) {
+    if (ts->prc == SPKSTAMP_NANO)
+        return (unsigned long long) ts->sec * 1000000000ULL + ts->nsec;
+    return (unsigned long long) ts->sec * 1000000000ULL + ts->usec * 1000ULL;
+}
+
+static void __probe_complete(struct IcmpProbe *probe, struct IcmpProbeSlot *slot, struct IcmpProbeResult *res) {
+    res->target = slot->target;
+    res->sqn = (unsigned short) (slot - probe->slots);
+    res->udata = slot->udata;
+    slot->busy = false;
+    probe->outstanding--;
+    if (probe->on_result != NULL)
+        probe->on_result(res, probe->arg);
+}
+
+static void __probe_expired(struct TimerNode *node, void *arg) {
+    struct IcmpProbe *probe = (struct IcmpProbe *) arg;
+    struct IcmpProbeSlot *slot = (struct IcmpProbeSlot *) node;
+    struct IcmpProbeResult res;
+
+    memset(&res, 0x00, sizeof(struct IcmpProbeResult));
+    res.status = ICMPPROBE_TIMEOUT;
+    probe->stats.timeouts++;
+    __probe_complete(probe, slot, &res);
+}
+
+static bool __probe_match(struct IcmpProbe *probe, struct Ipv4Header *ipv4, struct IcmpHeader *icmp,
+                          unsigned int len, struct SpkTimeStamp *ts) {
+    struct IcmpProbeResult res;
+    struct IcmpProbeSlot *slot;
+    struct Ipv4Header *qip;
+    struct IcmpHeader *qicmp;
+    unsigned int target;
+    unsigned short id;
+    unsigned short sqn;
+
+    if (icmp->type == ICMPTY_ECHO_REPLY) {
+        id = ntohs(icmp->echo.id);
+        sqn = ntohs(icmp->echo.sqn);
+        target = ipv4->saddr;
+        res.status = ICMPPROBE_REPLY;
+    } else if (icmp->type == ICMPTY_DST_UNREACHABLE) {
+        // The error quotes our IPv4 header plus the first 8 bytes of the echo request
+        if (len < ICMP4HDRSIZE + IPV4HDRSIZE)
+            return false;
+        qip = (struct Ipv4Header *) icmp->data;
+        if (qip->protocol != IPPROTO_ICMP || qip->saddr != probe->ipaddr.ip || qip->ihl < 5
+            || len < ICMP4HDRSIZE + (unsigned int) (qip->ihl << 2) + ICMP4HDRSIZE)
+            return false;
+        qicmp = (struct IcmpHeader *) (icmp->data + (qip->ihl << 2));
+        if (qicmp->type != ICMPTY_ECHO_REQUEST)
+            return false;
+        id = ntohs(qicmp->echo.id);
+        sqn = ntohs(qicmp->echo.sqn);
+        target = qip->daddr;
+        res.status = ICMPPROBE_UNREACHABLE;
+    } else
+        return false;
+
+    if (id != probe->id)
+        return false;
+    slot = probe->slots + sqn;
+    if (!slot->busy || slot->target.ip != target) {
+        probe->stats.unmatched++;
+        return false;
+    }
+    twheel_del(&probe->wheel, &slot->timer);
+    res.from.ip = ipv4->saddr;
+    res.code = icmp->code;
+    res.ttl = ipv4->ttl;
+    res.ts = *ts;
+    res.rtt = __probe_tsns(ts) > slot->sent ? (unsigned long) (__probe_tsns(ts) - slot->sent) : 0;
+    if (res.status == ICMPPROBE_REPLY)
+        probe->stats.replies++;
+    else
+        probe->stats.unreachable++;
+    __probe_complete(probe, slot, &res);
+    return true;
+}
+
+static int __probe_input(struct IcmpProbe *probe) {
+    struct EthHeader *eth = (struct EthHeader *) probe->rxbuf;
+    struct Ipv4Header *ipv4 = (struct Ipv4Header *) eth->data;
+    struct SpkTimeStamp ts;
+    unsigned int hlen;
+    unsigned int plen;
+    int delivered = 0;
+    int len;
+
+    memset(&ts, 0x00, sizeof(struct SpkTimeStamp));
+    while ((len = spark_read(probe->ssock, probe->rxbuf, &ts)) > 0) {
+        if (len < ETHHDRSIZE + IPV4HDRSIZE + ICMP4HDRSIZE || eth->eth_type != htons(ETHTYPE_IP))
+            continue;
+        hlen = (unsigned int) ipv4->ihl << 2;
+        plen = ntohs(ipv4->len);
+        if (ipv4->protocol != IPPROTO_ICMP || ipv4->daddr != probe->ipaddr.ip || hlen < IPV4HDRSIZE
+            || plen < hlen + ICMP4HDRSIZE || plen > (unsigned int) len - ETHHDRSIZE)
+            continue;
+        if (ts.sec == 0 && ts.usec == 0 && ts.nsec == 0) {
+            unsigned long long now = __probe_clock(CLOCK_REALTIME);
+            ts.sec = (long) (now / 1000000000ULL);
+            ts.nsec = (long) (now % 1000000000ULL);
+            ts.usec = ts.nsec / 1000;
+            ts.prc = SPKSTAMP_NANO;
+        }
+        if (__probe_match(probe, ipv4, (struct IcmpHeader *) (eth->data + hlen), plen - hlen, &ts))
+            delivered++;
+        memset(&ts, 0x00, sizeof(struct SpkTimeStamp));
+    }
+    return len < 0 && len != SPKSOCK_EINTR ? len : delivered;
+}
+
+static void __probe_refill(struct IcmpProbe *probe, unsigned long long now) {
+    double burst = ICMPPROBE_DEFBATCH;
+
+    if (probe->pps == 0) {
+        probe->tokens = burst;
+        return;
+    }
+    probe->tokens += (double) (now - probe->last_refill) * probe->pps / 1e9;
+    if (probe->tokens > burst)
+        probe->tokens = burst;
+    probe->last_refill = now;
+}
+
+static int __probe_output(struct IcmpProbe *probe) {
+    unsigned char *bufs[ICMPPROBE_DEFBATCH];
+    unsigned int lens[ICMPPROBE_DEFBATCH];
+    unsigned short sqns[ICMPPROBE_DEFBATCH];
+    struct IcmpProbeTarget *target;
+    struct IcmpProbeSlot *slot;
+    struct Ipv4Header *ipv4;
+    struct IcmpHeader *icmp;
+    unsigned short paysize = probe->payload > ICMPPROBE_MAXPAYLOAD ? ICMPPROBE_MAXPAYLOAD : probe->payload;
+    unsigned long long sent;
+    unsigned long long expires;
+    unsigned int tmplsum;
+    unsigned int count = 0;
+    unsigned int sum;
+    unsigned int done = 0;
+    int ret;
+
+    __probe_refill(probe, __probe_clock(CLOCK_MONOTONIC));
+    if (probe->qlen == 0 || probe->tokens < 1 || probe->outstanding >= probe->max_outstanding)
+        return 0;
+
+    // All requests share the template: only the destination, the IP id and the sequence number change
+    ipv4 = (struct Ipv4Header *) (probe->frames + ETHHDRSIZE);
+    icmp = (struct IcmpHeader *) ipv4->data;
+    injects_ethernet_header(probe->frames, &probe->hwaddr, &probe->nexthop, ETHTYPE_IP);
+    injects_ipv4_header((unsigned char *) ipv4, &probe->ipaddr, &probe->ipaddr, IPV4DEFIHL, 0,
+                        (unsigned short) (ICMP4HDRSIZE + paysize), probe->ttl, IPPROTO_ICMP);
+    injects_icmp4_echo_request((unsigned char *) icmp, probe->id, 0);
+    for (unsigned short i = 0; i < paysize; i++)
+        icmp->data[i] = (unsigned char) i;
+    if (paysize & 1)
+        icmp->data[paysize] = 0; // icmp4_checksum pads odd payloads with the following byte
+    tmplsum = (unsigned short) ~icmp4_checksum(icmp, paysize);
+
+    while (count < ICMPPROBE_DEFBATCH && probe->qlen > 0 && probe->tokens >= 1
+           && probe->outstanding < probe->max_outstanding) {
+        while (probe->slots[probe->next_sqn].busy)
+            probe->next_sqn++;
+        sqns[count] = probe->next_sqn++;
+        target = probe->queue + probe->qhead;
+        probe->qhead = (probe->qhead + 1) % probe->qcap;
+        probe->qlen--;
+
+        slot = probe->slots + sqns[count];
+        slot->target = target->ip;
+        slot->udata = target->udata;
+        slot->busy = true;
+        probe->outstanding++;
+        probe->tokens -= 1;
+
+        bufs[count] = probe->frames + (count + 1) * ICMPPROBE_MAXFRAME;
+        lens[count] = ICMPPROBE_HDRLEN + paysize;
+        memcpy(bufs[count], probe->frames, lens[count]);
+        ipv4 = (struct Ipv4Header *) (bufs[count] + ETHHDRSIZE);
+        icmp = (struct IcmpHeader *) ipv4->data;
+        ipv4->daddr = target->ip.ip;
+        ipv4->id = ipv4_mkid();
+        ipv4->checksum = ipv4_checksum(ipv4);
+        icmp->echo.sqn = htons(sqns[count]);
+        sum = tmplsum + icmp->echo.sqn;
+        sum = (sum >> 16) + (sum & 0xFFFF);
+        icmp->chksum = (unsigned short) ~(sum + (sum >> 16));
+        count++;
+    }
+
+    sent = __probe_clock(CLOCK_REALTIME);
+    expires = __probe_clock(CLOCK_MONOTONIC) / 1000000ULL + probe->timeout;
+    for (unsigned int i = 0; i < count; i++) {
+        slot = probe->slots + sqns[i];
+        slot->sent = sent;
+        twheel_add(&probe->wheel, &slot->timer, expires, __probe_expired, probe);
+    }
+    while (done < count) {
+        if ((ret = spark_writeb(probe->ssock, bufs + done, lens + done, count - done)) < 0) {
+            if (ret == SPKSOCK_EINTR)
+                continue;
+            // Unsent requests will be reported as timed out
+            return ret;
+        }
+        done += ret;
+    }
+    probe->stats.sent += done;
+    return (int) done;
+}
+
+bool icmpprobe_done(struct IcmpProbe *probe) {
+    return probe->qlen == 0 && probe->outstanding == 0;
+}
+
+bool icmpprobe_add(struct IcmpProbe *probe, struct netaddr_ip *target, void *udata) {
+    struct IcmpProbeTarget *queue;
+    unsigned int cap;
+
+    if (probe->qlen == probe->qcap) {
+        cap = probe->qcap == 0 ? ICMPPROBE_MINQUEUE : probe->qcap << 1;
+        if ((queue = (struct IcmpProbeTarget *) malloc(cap * sizeof(struct IcmpProbeTarget))) == NULL)
+            return false;
+        for (unsigned int i = 0; i < probe->qlen; i++)
+            queue[i] = probe->queue[(probe->qhead + i) % probe->qcap];
+        free(probe->queue);
+        probe->queue = queue;
+        probe->qcap = cap;
+        probe->qhead = 0;
+    }
+    queue = probe->queue + (probe->qhead + probe->qlen) % probe->qcap;
+    queue->ip = *target;
+    queue->udata = udata;
+    probe->qlen++;
+    return true;
+}
+
+int icmpprobe_poll(struct IcmpProbe *probe, int timeout) {
+    struct pollfd pfd;
+    unsigned long long now;
+    int delivered;
+    int wait = timeout;
+    int ret;
+
+    if (probe->max_outstanding > ICMPPROBE_MAXOUT)
+        probe->max_outstanding = ICMPPROBE_MAXOUT;
+    if ((ret = __probe_output(probe)) < 0)
+        return ret;
+
+    // Do not sleep past the next send opportunity
+    if (probe->qlen > 0 && probe->outstanding < probe->max_outstanding && probe->pps > 0) {
+        ret = (int) ((1 - probe->tokens) * 1000 / probe->pps);
+        if (ret < wait)
+            wait = ret < 0 ? 0 : ret;
+    }
+    pfd.fd = probe->ssock->sfd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    poll(&pfd, 1, wait);
+
+    if ((delivered = __probe_input(probe)) < 0)
+        return delivered;
+    now = __probe_clock(CLOCK_MONOTONIC) / 1000000ULL;
+    delivered += (int) twheel_advance(&probe->wheel, now);
+    return delivered;
+}
+
+struct IcmpProbe *icmpprobe_new(struct SpkSock *ssock, struct netaddr_ip *src, struct netaddr_mac *nexthop) {
+    struct IcmpProbe *probe;
+
+    if ((probe = (struct IcmpProbe *) calloc(1, sizeof(struct IcmpProbe))) == NULL)
+        return NULL;
+    probe->slots = (struct IcmpProbeSlot *) calloc(ICMPPROBE_NSLOTS, sizeof(struct IcmpProbeSlot));
+    probe->frames = (unsigned char *) malloc((ICMPPROBE_DEFBATCH + 1) * ICMPPROBE_MAXFRAME);
+    probe->rxbuf = (unsigned char *) malloc(ssock->bufl);
+    if (probe->slots == NULL || probe->frames == NULL || probe->rxbuf == NULL) {
+        icmpprobe_free(probe);
+        return NULL;
+    }
+    probe->ssock = ssock;
+    probe->hwaddr = ssock->iaddr;
+    probe->nexthop = *nexthop;
+    probe->ipaddr = *src;
+    probe->id = (unsigned short) spkrand_u32();
+    probe->ttl = IPV4DEFTTL;
+    probe->pps = ICMPPROBE_DEFPPS;
+    probe->timeout = ICMPPROBE_DEFTIMEOUT;
+    probe->max_outstanding = ICMPPROBE_MAXOUT;
+    probe->payload = ICMPPROBE_DEFPAYLOAD;
+    probe->next_sqn = (unsigned short) spkrand_u32();
+    probe->last_refill = __probe_clock(CLOCK_MONOTONIC);
+    twheel_init(&probe->wheel, probe->last_refill / 1000000ULL);
+
+    // Filter and timestamp precision are optimizations, the engine works without them
+    spark_setfilter(ssock, __probe_filter, sizeof(__probe_filter) / sizeof(struct SpkFilterInsn));
+    spark_settsprc(ssock, SPKSTAMP_NANO);
+    spark_setnblock(ssock, true);
+    return probe;
+}
+
+void icmpprobe_free(struct IcmpProbe *probe) {
+    if (probe == NULL)
+        return;
+    free(probe->slots);
+    free(probe->queue);
+    free(probe->frames);
+    free(probe->rxbuf);
+    free(probe);
+}
@@ -26,12 +26,12 @@
 #include <stdbool.h>
 #include <netinet/in.h>
 #include <net/if.h>
-#include <time.h>
 #include <sys/ioctl.h>
 #include <unistd.h>
 
 #include <datatype.h>
 #include <ipv4.h>
+#include <spkrand.h>
 
 inline bool ipv4cmp(struct netaddr_ip *ip1, struct netaddr_ip *ip2) {
     return ip1->ip == ip2->ip;
@@ -112,6 +112,32 @@ bool parse_ipv4addr(char *ipstr, unsigned int *ip) {
     return true;
 }
 
+bool parse_ipv4cidr(char *cidrstr, struct netaddr_ip *ip, unsigned char *prefix) {
+    char addr[IPV4STRLEN];
+    char *slash = strchr(cidrstr, '/');
+    unsigned int plen = 32;
+    unsigned int alen;
+    struct netaddr_ip mask;
+
+    alen = (unsigned int) (slash != NULL ? (size_t) (slash - cidrstr) : strlen(cidrstr));
+    if (alen >= IPV4STRLEN)
+        return false;
+    memcpy(addr, cidrstr, alen);
+    addr[alen] = '\0';
+    if (slash != NULL && (sscanf(slash + 1, "%u", &plen) != 1 || plen > 32))
+        return false;
+    if (!parse_ipv4addr(addr, &mask.ip))
+        return false;
+    if (ip != NULL) {
+        ip->ip = mask.ip;
+        get_ipv4netmask((unsigned char) plen, &mask);
+        ip->ip &= mask.ip;
+    }
+    if (prefix != NULL)
+        *prefix = (unsigned char) plen;
+    return true;
+}
+
 char *get_stripv4(unsigned int *ip, bool _static) {
     static char static_buf[IPV4STRLEN];
     char *ipstr = static_buf;
@@ -168,9 +194,52 @@ unsigned short ipv4_checksum(struct Ipv4Header *ipHeader) {
     return (unsigned short) ~sum;
 }
 
+unsigned int ipv4_csum_partial(void *buf, unsigned int len, unsigned int sum) {
+    unsigned char *bytes = (unsigned char *) buf;
+    unsigned short word;
+
+    for (; len > 1; bytes += 2, len -= 2) {
+        memcpy(&word, bytes, 2);
+        sum += word;
+    }
+    if (len == 1) {
+        word = 0;
+        *((unsigned char *) &word) = *bytes;
+        sum += word;
+    }
+    sum = (sum >> 16) + (sum & 0xffff);
+    return (sum + (sum >> 16)) & 0xffff;
+}
+
+unsigned short ipv4_csum_update(unsigned short check, unsigned int oldsum, unsigned int newsum) {
+    unsigned int sum;
+
+    oldsum = (oldsum >> 16) + (oldsum & 0xffff);
+    oldsum += oldsum >> 16;
+    sum = (unsigned short) ~check;
+    sum += (unsigned short) ~oldsum;
+    sum += newsum & 0xffff;
+    sum += newsum >> 16;
+    sum = (sum >> 16) + (sum & 0xffff);
+    sum += (sum >> 16);
+    return (unsigned short) ~sum;
+}
+
+inline unsigned short ipv4_csum_update16(unsigned short check, unsigned short old, unsigned short new) {
+    return ipv4_csum_update(check, old, new);
+}
+
+inline unsigned short ipv4_csum_update32(unsigned short check, unsigned int old, unsigned int new) {
+    check = ipv4_csum_update(check, old >> 16, new >> 16);
+    return ipv4_csum_update(check, old & 0xffff, new & 0xffff);
+}
+
 inline unsigned short ipv4_mkid() {
-    srand((unsigned int) clock());
-    return ((uint16_t) rand());
+    return (unsigned short) spkrand_u32();
+}
+
+void ipv4_mkid_bulk(unsigned short *ids, unsigned int n) {
+    spkrand_bytes(ids, n * sizeof(unsigned short));
 }
 
 inline void get_ipv4bcast_addr(struct netaddr_ip *addr, struct netaddr_ip *netmask, struct netaddr_ip *broadcast) {
@@ -181,6 +250,10 @@ inline void get_ipv4net_addr(struct netaddr_ip *addr, struct netaddr_ip *netmask
     net->ip = addr->ip & netmask->ip;
 }
 
+inline void get_ipv4netmask(unsigned char prefix, struct netaddr_ip *netmask) {
+    netmask->ip = prefix == 0 ? 0 : htonl(0xFFFFFFFF << (32 - (prefix > 32 ? 32 : prefix)));
+}
+
 inline void get_ipv4wildcard_mask(struct netaddr_ip *netmask, struct netaddr_ip *ret_wildcard) {
     ret_wildcard->ip = ~netmask->ip;
 }
@@ -192,7 +265,11 @@ void increment_ipv4addr(struct netaddr_ip *ip) {
             break;
 }
 
-void rndipv4(struct netaddr_ip *ip) {
-    srand((unsigned int) clock());
-    ip->ip = (unsigned int) rand();
+inline void rndipv4(struct netaddr_ip *ip) {
+    ip->ip = spkrand_u32();
+}
+
+void rndipv4_bulk(struct netaddr_ip *ips, unsigned int n) {
+    for (unsigned int i = 0; i < n; i++)
+        ips[i].ip = spkrand_u32();
 }
\ No newline at end of file
@@ -0,0 +1,315 @@
+/*
+ * Copyright (c) 2017 Jacopo De Luca
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include <datatype.h>
+#include <ipv4.h>
+#include <ipv4perm.h>
+
+#define IPV4PERM_MINCAP 8
+
+#if defined(__SIZEOF_INT128__)
+__extension__ typedef unsigned __int128 __perm_u128;
+#endif
+
+static bool __perm_push(struct Ipv4Range **vec, unsigned int *len, unsigned int *cap, uint32_t first, uint32_t last) {
+    struct Ipv4Range *tmp;
+    unsigned int ncap;
+
+    if (*len == *cap) {
+        ncap = *cap == 0 ? IPV4PERM_MINCAP : *cap * 2;
+        if ((tmp = (struct Ipv4Range *) realloc(*vec, ncap * sizeof(struct Ipv4Range))) == NULL)
+            return false;
+        *vec = tmp;
+        *cap = ncap;
+    }
+    (*vec)[*len].first = first;
+    (*vec)[(*len)++].last = last;
+    return true;
+}
+
+static int __perm_rangecmp(const void *r1, const void *r2) {
+    uint32_t f1 = ((struct Ipv4Range *) r1)->first;
+    uint32_t f2 = ((struct Ipv4Range *) r2)->first;
+    return f1 < f2 ? -1 : (f1 > f2 ? 1 : 0);
+}
+
+static unsigned int __perm_merge(struct Ipv4Range *vec, unsigned int len) {
+    unsigned int j = 0;
+
+    if (len == 0)
+        return 0;
+    qsort(vec, len, sizeof(struct Ipv4Range), __perm_rangecmp);
+    for (unsigned int i = 1; i < len; i++) {
+        if ((uint64_t) vec[i].first <= (uint64_t) vec[j].last + 1) {
+            if (vec[i].last > vec[j].last)
+                vec[j].last = vec[i].last;
+            continue;
+        }
+        vec[++j] = vec[i];
+    }
+    return j + 1;
+}
+
+static uint64_t __perm_mulmod(uint64_t a, uint64_t b, uint64_t m) {
+#if defined(__SIZEOF_INT128__)
+    return (uint64_t) (((__perm_u128) a * b) % m);
+#else
+    uint64_t res = 0;
+    a %= m;
+    for (; b > 0; b >>= 1) {
+        if (b & 1)
+            res = (res + a) % m;
+        a = (a << 1) % m;
+    }
+    return res;
+#endif
+}
+
+static uint64_t __perm_powmod(uint64_t b, uint64_t e, uint64_t m) {
+    uint64_t res = 1 % m;
+    for (b %= m; e > 0; e >>= 1) {
+        if (e & 1)
+            res = __perm_mulmod(res, b, m);
+        b = __perm_mulmod(b, b, m);
+    }
+    return res;
+}
+
+static bool __perm_isprime(uint64_t n) {
+    // Deterministic Miller-Rabin, these bases are enough for n < 2^64
+    static const uint64_t bases[] = {2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37};
+    uint64_t d = n - 1;
+    uint64_t x;
+    int r = 0;
+
+    if (n < 2)
+        return false;
+    for (unsigned int i = 0; i < sizeof(bases) / sizeof(uint64_t); i++) {
+        if (n == bases[i])
+            return true;
+        if (n % bases[i] == 0)
+            return false;
+    }
+    for (; (d & 1) == 0; d >>= 1, r++);
+    for (unsigned int i = 0; i < sizeof(bases) / sizeof(uint64_t); i++) {
+        if ((x = __perm_powmod(bases[i], d, n)) == 1 || x == n - 1)
+            continue;
+        int j;
+        for (j = 1; j < r; j++)
+            if ((x = __perm_mulmod(x, x, n)) == n - 1)
+                break;
+        if (j == r)
+            return false;
+    }
+    return true;
+}
+
+static uint64_t __perm_splitmix(uint64_t *state) {
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+static bool __perm_isgenerator(uint64_t g, uint64_t p, uint64_t *factors, unsigned int nfact) {
+    for (unsigned int i = 0; i < nfact; i++)
+        if (__perm_powmod(g, (p - 1) / factors[i], p) == 1)
+            return false;
+    return true;
+}
+
+static inline uint32_t __perm_addr(struct Ipv4Perm *perm, uint64_t idx) {
+    unsigned int lo = 0;
+    unsigned int hi = perm->nranges - 1;
+    unsigned int mid;
+
+    while (lo < hi) {
+        mid = (lo + hi + 1) >> 1;
+        if (perm->base[mid] <= idx)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    return perm->ranges[lo].first + (uint32_t) (idx - perm->base[lo]);
+}
+
+bool ipv4perm_add(struct Ipv4Perm *perm, struct netaddr_ip *net, unsigned char prefix) {
+    struct netaddr_ip mask;
+    uint32_t first;
+
+    if (prefix > 32)
+        return false;
+    get_ipv4netmask(prefix, &mask);
+    first = ntohl(net->ip & mask.ip);
+    return __perm_push(&perm->incl, &perm->nincl, &perm->cincl, first, first | ~ntohl(mask.ip));
+}
+
+bool ipv4perm_add_range(struct Ipv4Perm *perm, struct netaddr_ip *first, struct netaddr_ip *last) {
+    if (ntohl(first->ip) > ntohl(last->ip))
+        return false;
+    return __perm_push(&perm->incl, &perm->nincl, &perm->cincl, ntohl(first->ip), ntohl(last->ip));
+}
+
+bool ipv4perm_build(struct Ipv4Perm *perm, uint64_t seed) {
+    uint64_t factors[16];
+    unsigned int nfact = 0;
+    unsigned int j = 0;
+    uint64_t first;
+    uint64_t n;
+
+    free(perm->ranges);
+    free(perm->base);
+    perm->ranges = NULL;
+    perm->base = NULL;
+    perm->nranges = 0;
+    perm->total = 0;
+    perm->ready = false;
+
+    perm->nincl = __perm_merge(perm->incl, perm->nincl);
+    perm->nexcl = __perm_merge(perm->excl, perm->nexcl);
+
+    // Every exclusion can split at most one included range
+    if (perm->nincl == 0)
+        return false;
+    if ((perm->ranges = (struct Ipv4Range *) malloc((perm->nincl + perm->nexcl) * sizeof(struct Ipv4Range))) == NULL)
+        return false;
+    if ((perm->base = (uint64_t *) malloc((perm->nincl + perm->nexcl) * sizeof(uint64_t))) == NULL)
+        return false;
+
+    for (unsigned int i = 0; i < perm->nincl; i++) {
+        first = perm->incl[i].first;
+        for (; j < perm->nexcl && perm->excl[j].last < first; j++);
+        for (unsigned int k = j; k < perm->nexcl && perm->excl[k].first <= perm->incl[i].last; k++) {
+            if (perm->excl[k].first > first) {
+                perm->ranges[perm->nranges].first = (uint32_t) first;
+                perm->ranges[perm->nranges++].last = perm->excl[k].first - 1;
+            }
+            first = (uint64_t) perm->excl[k].last + 1;
+        }
+        if (first <= perm->incl[i].last) {
+            perm->ranges[perm->nranges].first = (uint32_t) first;
+            perm->ranges[perm->nranges++].last = perm->incl[i].last;
+        }
+    }
+
+    for (unsigned int i = 0; i < perm->nranges; i++) {
+        perm->base[i] = perm->total;
+        perm->total += (uint64_t) perm->ranges[i].last - perm->ranges[i].first + 1;
+    }
+    if (perm->total == 0)
+        return false;
+
+    // Smallest prime greater than the number of targets, the group Z*p has p-1 >= total elements
+    for (perm->prime = perm->total + 1; !__perm_isprime(perm->prime); perm->prime++);
+
+    n = perm->prime - 1;
+    for (uint64_t f = 2; f * f <= n; f++) {
+        if (n % f != 0)
+            continue;
+        factors[nfact++] = f;
+        while (n % f == 0)
+            n /= f;
+    }
+    if (n > 1)
+        factors[nfact++] = n;
+
+    if (perm->prime <= 3)
+        perm->gen = perm->prime - 1;
+    else {
+        do
+            perm->gen = 2 + __perm_splitmix(&seed) % (perm->prime - 2);
+        while (!__perm_isgenerator(perm->gen, perm->prime, factors, nfact));
+    }
+    perm->first = 1 + __perm_splitmix(&seed) % (perm->prime - 1);
+    perm->ready = true;
+    return true;
+}
+
+bool ipv4perm_exclude(struct Ipv4Perm *perm, struct netaddr_ip *net, unsigned char prefix) {
+    struct netaddr_ip mask;
+    uint32_t first;
+
+    if (prefix > 32)
+        return false;
+    get_ipv4netmask(prefix, &mask);
+    first = ntohl(net->ip & mask.ip);
+    return __perm_push(&perm->excl, &perm->nexcl, &perm->cexcl, first, first | ~ntohl(mask.ip));
+}
+
+bool ipv4perm_next(struct Ipv4PermShard *shard, struct netaddr_ip *ip) {
+    struct Ipv4Perm *perm = shard->perm;
+    uint64_t x;
+
+    while (shard->left > 0) {
+        x = shard->cur;
+        shard->cur = __perm_mulmod(x, shard->step, perm->prime);
+        shard->left--;
+        // Group elements are 1..p-1, values past the target count are skipped
+        if (x - 1 < perm->total) {
+            ip->ip = htonl(perm->nranges == 1 ? perm->ranges[0].first + (uint32_t) (x - 1)
+                                               : __perm_addr(perm, x - 1));
+            return true;
+        }
+    }
+    return false;
+}
+
+bool ipv4perm_shard(struct Ipv4Perm *perm, unsigned int shard, unsigned int nshards, struct Ipv4PermShard *state) {
+    uint64_t order;
+
+    if (!perm->ready || nshards == 0 || shard >= nshards)
+        return false;
+    order = perm->prime - 1;
+    state->perm = perm;
+    state->cur = __perm_mulmod(perm->first, __perm_powmod(perm->gen, shard, perm->prime), perm->prime);
+    state->step = __perm_powmod(perm->gen, nshards, perm->prime);
+    state->left = shard < order ? (order - 1 - shard) / nshards + 1 : 0;
+    return true;
+}
+
+struct Ipv4Perm *ipv4perm_new() {
+    return (struct Ipv4Perm *) calloc(1, sizeof(struct Ipv4Perm));
+}
+
+inline uint64_t ipv4perm_count(struct Ipv4Perm *perm) {
+    return perm->total;
+}
+
+unsigned int ipv4perm_next_bulk(struct Ipv4PermShard *shard, struct netaddr_ip *ips, unsigned int n) {
+    unsigned int i;
+    for (i = 0; i < n && ipv4perm_next(shard, ips + i); i++);
+    return i;
+}
+
+void ipv4perm_free(struct Ipv4Perm *perm) {
+    if (perm != NULL) {
+        free(perm->incl);
+        free(perm->excl);
+        free(perm->ranges);
+        free(perm->base);
+        free(perm);
+    }
+}
@@ -37,6 +37,27 @@ int netdev_burnedin_mac(char *iface_name, struct netaddr_mac *mac) {
     return NETD_ENOSUPPORT;
 }
 
+int netdev_apply_profile(char *iface_name, struct NetDevProfile *profile, struct NetDevProfile *applied) {
+    return NETD_ENOSUPPORT;
+}
+
+void netdev_capture_profile(struct NetDevProfile *profile) {
+    memset(profile, 0x00, sizeof(struct NetDevProfile));
+    profile->ring.rx = NETD_MAX;
+    profile->offloads.gro = 0;
+    profile->offloads.lro = 0;
+    profile->offloads.gso = 0;
+    profile->offloads.rxcsum = -1;
+}
+
+int netdev_get_channels(char *iface_name, struct NetDevChannels *channels) {
+    return NETD_ENOSUPPORT;
+}
+
+int netdev_get_coalesce(char *iface_name, struct NetDevCoalesce *coalesce) {
+    return NETD_ENOSUPPORT;
+}
+
 int netdev_get_flags(char *iface_name, short *flags) {
     int ret;
     int ctl_sock;
@@ -94,6 +115,30 @@ int netdev_get_mac(char *iface_name, struct netaddr_mac *mac) {
     return NETD_FAILURE;
 }
 
+int netdev_get_offloads(char *iface_name, struct NetDevOffloads *offloads) {
+    return NETD_ENOSUPPORT;
+}
+
+int netdev_get_ring(char *iface_name, struct NetDevRing *ring) {
+    return NETD_ENOSUPPORT;
+}
+
+int netdev_set_channels(char *iface_name, struct NetDevChannels *channels) {
+    return NETD_ENOSUPPORT;
+}
+
+int netdev_set_coalesce(char *iface_name, struct NetDevCoalesce *coalesce) {
+    return NETD_ENOSUPPORT;
+}
+
+int netdev_set_offloads(char *iface_name, struct NetDevOffloads *offloads) {
+    return NETD_ENOSUPPORT;
+}
+
+int netdev_set_ring(char *iface_name, struct NetDevRing *ring) {
+    return NETD_ENOSUPPORT;
+}
+
 int netdev_set_flags(char *iface_name, short flags) {
     int ret;
     int ctl_sock;
@@ -166,4 +211,41 @@ struct NetDevList *netdev_get_iflist(unsigned int filter) {
 inline void netdev_iflist_cleanup(struct NetDevList *NetDevList) {
     struct NetDevList *tmp, *curr;
     for (curr = NetDevList; curr != NULL; tmp = curr->next, free(curr), curr = tmp);
-}
\ No newline at end of file
+}
+
+struct NetDevInfo *netdev_ctx_byindex(struct NetDevCtx *ctx, unsigned int ifindex) {
+    return NULL;
+}
+
+struct NetDevInfo *netdev_ctx_find(struct NetDevCtx *ctx, char *iface_name) {
+    return NULL;
+}
+
+void netdev_ctx_free(struct NetDevCtx *ctx) {
+    free(ctx);
+}
+
+struct NetDevCtx *netdev_ctx_new() {
+    // STUB
+    return NULL;
+}
+
+unsigned int netdev_ctx_query(struct NetDevCtx *ctx, char **names, unsigned int n, struct NetDevInfo **devs) {
+    return 0;
+}
+
+int netdev_ctx_refresh(struct NetDevCtx *ctx) {
+    return NETD_ENOSUPPORT;
+}
+
+int netdev_ctx_stats(struct NetDevCtx *ctx) {
+    return NETD_ENOSUPPORT;
+}
+
+int netdev_ctx_set_flags(struct NetDevCtx *ctx, char *iface_name, short flags) {
+    return NETD_ENOSUPPORT;
+}
+
+int netdev_ctx_set_mac(struct NetDevCtx *ctx, char *iface_name, struct netaddr_mac *mac) {
+    return NETD_ENOSUPPORT;
+}
@@ -22,18 +22,367 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <errno.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/ioctl.h>
 #include <net/if.h>
-#include <ifaddrs.h>
 #include <unistd.h>
+#include <time.h>
 #include <linux/ethtool.h>
 #include <linux/sockios.h>
-#include <linux/if_packet.h>
 
 #include <ethernet.h>
+#include <ipv4.h>
+#include <spksock.h>
 #include <netdevice.h>
+#include "../netlink/netlink.h"
+
+static int __ctx_cmp(const void *a, const void *b) {
+    unsigned int i1 = ((const struct NetDevInfo *) a)->ifindex;
+    unsigned int i2 = ((const struct NetDevInfo *) b)->ifindex;
+    return i1 < i2 ? -1 : i1 > i2;
+}
+
+static inline unsigned int __ctx_hash(char *name) {
+    unsigned int h = 2166136261U;
+    for (int i = 0; i < IFNAMSIZ && name[i] != '\0'; i++)
+        h = (h ^ (unsigned char) name[i]) * 16777619U;
+    return h;
+}
+
+/// @brief State of a counters dump.
+struct CtxStatsDump {
+    struct NetDevCtx *ctx;
+    unsigned int updated;
+};
+
+static void __ctx_stats64(struct NetDevStats *stats, struct rtattr *rta) {
+    struct rtnl_link_stats64 ls;
+
+    memset(&ls, 0x00, sizeof(struct rtnl_link_stats64));
+    memcpy(&ls, RTA_DATA(rta), RTA_PAYLOAD(rta) < sizeof(ls) ? RTA_PAYLOAD(rta) : sizeof(ls));
+    stats->rx_packets = ls.rx_packets;
+    stats->tx_packets = ls.tx_packets;
+    stats->rx_bytes = ls.rx_bytes;
+    stats->tx_bytes = ls.tx_bytes;
+    stats->rx_errors = ls.rx_errors;
+    stats->tx_errors = ls.tx_errors;
+    stats->rx_dropped = ls.rx_dropped;
+    stats->tx_dropped = ls.tx_dropped;
+    stats->rx_missed = ls.rx_missed_errors;
+    stats->rx_fifo_errors = ls.rx_fifo_errors;
+    stats->multicast = ls.multicast;
+}
+
+static int __ctx_stats(struct nlmsghdr *hdr, void *arg) {
+    struct CtxStatsDump *dump = (struct CtxStatsDump *) arg;
+    struct if_stats_msg *ism = (struct if_stats_msg *) NLMSG_DATA(hdr);
+    struct rtattr *tb[IFLA_STATS_MAX + 1];
+    struct NetDevInfo *dev;
+
+    if (hdr->nlmsg_type != RTM_NEWSTATS || (dev = netdev_ctx_byindex(dump->ctx, ism->ifindex)) == NULL)
+        return 0;
+    netlink_attrs(tb, IFLA_STATS_MAX,
+                  (struct rtattr *) ((unsigned char *) ism + NLMSG_ALIGN(sizeof(struct if_stats_msg))),
+                  (int) (hdr->nlmsg_len - NLMSG_LENGTH(sizeof(struct if_stats_msg))));
+    if (tb[IFLA_STATS_LINK_64] != NULL) {
+        __ctx_stats64(&dev->stats, tb[IFLA_STATS_LINK_64]);
+        dump->updated++;
+    }
+    return 0;
+}
+
+static int __ctx_link_stats(struct nlmsghdr *hdr, void *arg) {
+    struct CtxStatsDump *dump = (struct CtxStatsDump *) arg;
+    struct ifinfomsg *ifi = (struct ifinfomsg *) NLMSG_DATA(hdr);
+    struct rtattr *tb[IFLA_MAX + 1];
+    struct NetDevInfo *dev;
+
+    if (hdr->nlmsg_type != RTM_NEWLINK || (dev = netdev_ctx_byindex(dump->ctx, (unsigned int) ifi->ifi_index)) == NULL)
+        return 0;
+    netlink_attrs(tb, IFLA_MAX, IFLA_RTA(ifi), (int) IFLA_PAYLOAD(hdr));
+    if (tb[IFLA_STATS64] != NULL) {
+        __ctx_stats64(&dev->stats, tb[IFLA_STATS64]);
+        dump->updated++;
+    }
+    return 0;
+}
+
+static unsigned long long __ctx_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long) ts.tv_sec * 1000000000ULL + (unsigned long long) ts.tv_nsec;
+}
+
+static int __ctx_link(struct nlmsghdr *hdr, void *arg) {
+    struct NetDevCtx *ctx = (struct NetDevCtx *) arg;
+    struct ifinfomsg *ifi = (struct ifinfomsg *) NLMSG_DATA(hdr);
+    struct rtattr *tb[IFLA_MAX + 1];
+    struct NetDevInfo *dev;
+    unsigned int size;
+
+    if (hdr->nlmsg_type != RTM_NEWLINK)
+        return 0;
+    if (ctx->ndevs == ctx->size) {
+        size = ctx->size == 0 ? 64 : ctx->size * 2;
+        if ((dev = realloc(ctx->devs, size * sizeof(struct NetDevInfo))) == NULL)
+            return SPKSOCK_ENOMEM;
+        ctx->devs = dev;
+        ctx->size = size;
+    }
+    dev = ctx->devs + ctx->ndevs++;
+    memset(dev, 0x00, sizeof(struct NetDevInfo));
+    netlink_attrs(tb, IFLA_MAX, IFLA_RTA(ifi), (int) IFLA_PAYLOAD(hdr));
+    dev->ifindex = (unsigned int) ifi->ifi_index;
+    dev->flags = ifi->ifi_flags;
+    if (tb[IFLA_IFNAME] != NULL)
+        strncpy(dev->name, (char *) RTA_DATA(tb[IFLA_IFNAME]), IFNAMSIZ - 1);
+    if (tb[IFLA_MTU] != NULL)
+        dev->mtu = *(unsigned int *) RTA_DATA(tb[IFLA_MTU]);
+    if (tb[IFLA_ADDRESS] != NULL && RTA_PAYLOAD(tb[IFLA_ADDRESS]) == ETHHWASIZE)
+        memcpy(dev->mac.mac, RTA_DATA(tb[IFLA_ADDRESS]), ETHHWASIZE);
+    if (tb[IFLA_OPERSTATE] != NULL)
+        dev->operstate = *(unsigned char *) RTA_DATA(tb[IFLA_OPERSTATE]);
+    if (tb[IFLA_STATS64] != NULL)
+        __ctx_stats64(&dev->stats, tb[IFLA_STATS64]);
+    return 0;
+}
+
+static int __ctx_addr(struct nlmsghdr *hdr, void *arg) {
+    struct NetDevCtx *ctx = (struct NetDevCtx *) arg;
+    struct ifaddrmsg *ifa = (struct ifaddrmsg *) NLMSG_DATA(hdr);
+    struct rtattr *tb[IFA_MAX + 1];
+    struct NetDevInfo *dev;
+
+    if (hdr->nlmsg_type != RTM_NEWADDR || ifa->ifa_family != AF_INET)
+        return 0;
+    if ((dev = netdev_ctx_byindex(ctx, ifa->ifa_index)) == NULL || dev->ipv4.ip != 0)
+        return 0;
+    netlink_attrs(tb, IFA_MAX, IFA_RTA(ifa), (int) IFA_PAYLOAD(hdr));
+    if (tb[IFA_LOCAL] != NULL)
+        memcpy(&dev->ipv4.ip, RTA_DATA(tb[IFA_LOCAL]), IPV4ADDRSIZE);
+    else if (tb[IFA_ADDRESS] != NULL)
+        memcpy(&dev->ipv4.ip, RTA_DATA(tb[IFA_ADDRESS]), IPV4ADDRSIZE);
+    get_ipv4netmask(ifa->ifa_prefixlen, &dev->netmask);
+    return 0;
+}
+
+static bool __ctx_index(struct NetDevCtx *ctx) {
+    unsigned int size = 16;
+    unsigned int h;
+
+    for (; size < ctx->ndevs * 2; size <<= 1);
+    if (size - 1 != ctx->mask || ctx->names == NULL) {
+        free(ctx->names);
+        if ((ctx->names = (unsigned int *) malloc(size * sizeof(unsigned int))) == NULL)
+            return false;
+        ctx->mask = size - 1;
+    }
+    memset(ctx->names, 0x00, size * sizeof(unsigned int));
+    for (unsigned int i = 0; i < ctx->ndevs; i++) {
+        for (h = __ctx_hash(ctx->devs[i].name) & ctx->mask; ctx->names[h] != 0; h = (h + 1) & ctx->mask);
+        ctx->names[h] = i + 1;
+    }
+    return true;
+}
+
+static int __ethtool(int ctl, char *iface_name, void *cmd) {
+    struct ifreq req;
+
+    memset(&req, 0x00, sizeof(struct ifreq));
+    strncpy(req.ifr_name, iface_name, IFNAMSIZ - 1);
+    req.ifr_data = (caddr_t) cmd;
+    return ioctl(ctl, SIOCETHTOOL, &req) < 0 ? NETD_FAILURE : NETD_SUCCESS;
+}
+
+static void __ethtool_close(int ctl) {
+    int err = errno;
+
+    // The error of the request is reported, not the one of close
+    close(ctl);
+    errno = err;
+}
+
+static inline unsigned int __ethtool_param(unsigned int value, unsigned int current, unsigned int max) {
+    // A device that reports no maximum keeps its current value on NETD_MAX
+    if (value == NETD_UNCHANGED || (value == NETD_MAX && max == 0))
+        return current;
+    if (value == NETD_MAX || (max != 0 && value > max))
+        return max;
+    return value;
+}
+
+static int __ethtool_value(int ctl, char *iface_name, unsigned int cmd, unsigned int *data) {
+    struct ethtool_value ev = {.cmd = cmd, .data = *data};
+
+    if (__ethtool(ctl, iface_name, &ev) != NETD_SUCCESS)
+        return NETD_FAILURE;
+    *data = ev.data;
+    return NETD_SUCCESS;
+}
+
+static int __ethtool_get_channels(int ctl, char *iface_name, struct NetDevChannels *channels) {
+    struct ethtool_channels ec = {.cmd = ETHTOOL_GCHANNELS};
+
+    if (__ethtool(ctl, iface_name, &ec) != NETD_SUCCESS)
+        return NETD_FAILURE;
+    channels->rx = ec.rx_count;
+    channels->tx = ec.tx_count;
+    channels->combined = ec.combined_count;
+    channels->rx_max = ec.max_rx;
+    channels->tx_max = ec.max_tx;
+    channels->combined_max = ec.max_combined;
+    return NETD_SUCCESS;
+}
+
+static int __ethtool_get_coalesce(int ctl, char *iface_name, struct NetDevCoalesce *coalesce) {
+    struct ethtool_coalesce ec = {.cmd = ETHTOOL_GCOALESCE};
+
+    if (__ethtool(ctl, iface_name, &ec) != NETD_SUCCESS)
+        return NETD_FAILURE;
+    coalesce->rx_usecs = ec.rx_coalesce_usecs;
+    coalesce->rx_frames = ec.rx_max_coalesced_frames;
+    coalesce->tx_usecs = ec.tx_coalesce_usecs;
+    coalesce->tx_frames = ec.tx_max_coalesced_frames;
+    coalesce->adaptive_rx = ec.use_adaptive_rx_coalesce != 0;
+    coalesce->adaptive_tx = ec.use_adaptive_tx_coalesce != 0;
+    return NETD_SUCCESS;
+}
+
+static int __ethtool_get_offloads(int ctl, char *iface_name, struct NetDevOffloads *offloads) {
+    unsigned int data = 0;
+
+    offloads->gro =
+            __ethtool_value(ctl, iface_name, ETHTOOL_GGRO, &data) == NETD_SUCCESS ? (signed char) (data != 0) : -1;
+    offloads->gso =
+            __ethtool_value(ctl, iface_name, ETHTOOL_GGSO, &data) == NETD_SUCCESS ? (signed char) (data != 0) : -1;
+    offloads->rxcsum =
+            __ethtool_value(ctl, iface_name, ETHTOOL_GRXCSUM, &data) == NETD_SUCCESS ? (signed char) (data != 0) : -1;
+    offloads->lro = __ethtool_value(ctl, iface_name, ETHTOOL_GFLAGS, &data) == NETD_SUCCESS
+                    ? (signed char) ((data & ETH_FLAG_LRO) != 0) : -1;
+
+    if (offloads->gro < 0 && offloads->gso < 0 && offloads->rxcsum < 0 && offloads->lro < 0)
+        return NETD_FAILURE;
+    return NETD_SUCCESS;
+}
+
+static int __ethtool_get_ring(int ctl, char *iface_name, struct NetDevRing *ring) {
+    struct ethtool_ringparam er = {.cmd = ETHTOOL_GRINGPARAM};
+
+    if (__ethtool(ctl, iface_name, &er) != NETD_SUCCESS)
+        return NETD_FAILURE;
+    ring->rx = er.rx_pending;
+    ring->tx = er.tx_pending;
+    ring->rx_max = er.rx_max_pending;
+    ring->tx_max = er.tx_max_pending;
+    return NETD_SUCCESS;
+}
+
+static int __ethtool_set_channels(int ctl, char *iface_name, struct NetDevChannels *channels) {
+    struct ethtool_channels ec = {.cmd = ETHTOOL_GCHANNELS};
+    unsigned int rx, tx, combined;
+
+    if (__ethtool(ctl, iface_name, &ec) != NETD_SUCCESS)
+        return NETD_FAILURE;
+
+    rx = __ethtool_param(channels->rx, ec.rx_count, ec.max_rx);
+    tx = __ethtool_param(channels->tx, ec.tx_count, ec.max_tx);
+    combined = __ethtool_param(channels->combined, ec.combined_count, ec.max_combined);
+    if (rx == ec.rx_count && tx == ec.tx_count && combined == ec.combined_count)
+        return NETD_SUCCESS;
+
+    ec.cmd = ETHTOOL_SCHANNELS;
+    ec.rx_count = rx;
+    ec.tx_count = tx;
+    ec.combined_count = combined;
+    return __ethtool(ctl, iface_name, &ec);
+}
+
+static int __ethtool_set_coalesce(int ctl, char *iface_name, struct NetDevCoalesce *coalesce) {
+    struct ethtool_coalesce ec = {.cmd = ETHTOOL_GCOALESCE};
+
+    // Read first, the driver rejects the request if unsupported fields differ from the current values
+    if (__ethtool(ctl, iface_name, &ec) != NETD_SUCCESS)
+        return NETD_FAILURE;
+
+    ec.cmd = ETHTOOL_SCOALESCE;
+    ec.rx_coalesce_usecs = coalesce->rx_usecs;
+    ec.rx_max_coalesced_frames = coalesce->rx_frames;
+    ec.tx_coalesce_usecs = coalesce->tx_usecs;
+    ec.tx_max_coalesced_frames = coalesce->tx_frames;
+    ec.use_adaptive_rx_coalesce = coalesce->adaptive_rx;
+    ec.use_adaptive_tx_coalesce = coalesce->adaptive_tx;
+    return __ethtool(ctl, iface_name, &ec);
+}
+
+static int __ethtool_set_offloads(int ctl, char *iface_name, struct NetDevOffloads *offloads) {
+    unsigned int data;
+    int ret = NETD_SUCCESS;
+    int err = 0;
+
+    if (offloads->gro >= 0) {
+        data = (unsigned int) offloads->gro;
+        if (__ethtool_value(ctl, iface_name, ETHTOOL_SGRO, &data) != NETD_SUCCESS) {
+            ret = NETD_FAILURE;
+            err = errno;
+        }
+    }
+
+    if (offloads->gso >= 0) {
+        data = (unsigned int) offloads->gso;
+        if (__ethtool_value(ctl, iface_name, ETHTOOL_SGSO, &data) != NETD_SUCCESS && ret == NETD_SUCCESS) {
+            ret = NETD_FAILURE;
+            err = errno;
+        }
+    }
+
+    if (offloads->rxcsum >= 0) {
+        data = (unsigned int) offloads->rxcsum;
+        if (__ethtool_value(ctl, iface_name, ETHTOOL_SRXCSUM, &data) != NETD_SUCCESS && ret == NETD_SUCCESS) {
+            ret = NETD_FAILURE;
+            err = errno;
+        }
+    }
+
+    if (offloads->lro >= 0) {
+        // LRO is only exposed through the legacy flag word
+        data = 0;
+        if (__ethtool_value(ctl, iface_name, ETHTOOL_GFLAGS, &data) == NETD_SUCCESS) {
+            unsigned int flags = offloads->lro ? data | ETH_FLAG_LRO : data & ~ETH_FLAG_LRO;
+            if (flags != data && __ethtool_value(ctl, iface_name, ETHTOOL_SFLAGS, &flags) != NETD_SUCCESS
+                && ret == NETD_SUCCESS) {
+                ret = NETD_FAILURE;
+                err = errno;
+            }
+        } else if (offloads->lro > 0 && ret == NETD_SUCCESS) {
+            ret = NETD_FAILURE;
+            err = errno;
+        }
+    }
+
+    if (ret != NETD_SUCCESS)
+        errno = err;
+    return ret;
+}
+
+static int __ethtool_set_ring(int ctl, char *iface_name, struct NetDevRing *ring) {
+    struct ethtool_ringparam er = {.cmd = ETHTOOL_GRINGPARAM};
+    unsigned int rx, tx;
+
+    if (__ethtool(ctl, iface_name, &er) != NETD_SUCCESS)
+        return NETD_FAILURE;
+
+    rx = __ethtool_param(ring->rx, er.rx_pending, er.rx_max_pending);
+    tx = __ethtool_param(ring->tx, er.tx_pending, er.tx_max_pending);
+    if (rx == er.rx_pending && tx == er.tx_pending)
+        return NETD_SUCCESS;
+
+    er.cmd = ETHTOOL_SRINGPARAM;
+    er.rx_pending = rx;
+    er.tx_pending = tx;
+    return __ethtool(ctl, iface_name, &er);
+}
 
 int netdev_burnedin_mac(char *iface_name, struct netaddr_mac *mac) {
 
@@ -71,6 +420,94 @@ int netdev_burnedin_mac(char *iface_name, struct netaddr_mac *mac) {
     return ret;
 }
 
+int netdev_apply_profile(char *iface_name, struct NetDevProfile *profile, struct NetDevProfile *applied) {
+    struct NetDevOffloads *off = &profile->offloads;
+    int ret = NETD_SUCCESS;
+    int err = 0;
+    int ctl;
+
+    // One control socket serves every request of the profile
+    if ((ctl = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0)) < 0)
+        return NETD_FAILURE;
+
+    if (profile->ring.rx != NETD_UNCHANGED || profile->ring.tx != NETD_UNCHANGED) {
+        if (__ethtool_set_ring(ctl, iface_name, &profile->ring) != NETD_SUCCESS) {
+            ret = NETD_FAILURE;
+            err = errno;
+        }
+    }
+
+    if (profile->channels.rx != NETD_UNCHANGED || profile->channels.tx != NETD_UNCHANGED
+        || profile->channels.combined != NETD_UNCHANGED) {
+        if (__ethtool_set_channels(ctl, iface_name, &profile->channels) != NETD_SUCCESS && ret == NETD_SUCCESS) {
+            ret = NETD_FAILURE;
+            err = errno;
+        }
+    }
+
+    if (profile->set_coalesce) {
+        if (__ethtool_set_coalesce(ctl, iface_name, &profile->coalesce) != NETD_SUCCESS && ret == NETD_SUCCESS) {
+            ret = NETD_FAILURE;
+            err = errno;
+        }
+    }
+
+    if (off->gro >= 0 || off->lro >= 0 || off->gso >= 0 || off->rxcsum >= 0) {
+        if (__ethtool_set_offloads(ctl, iface_name, off) != NETD_SUCCESS && ret == NETD_SUCCESS) {
+            ret = NETD_FAILURE;
+            err = errno;
+        }
+    }
+
+    if (applied != NULL) {
+        memset(applied, 0x00, sizeof(struct NetDevProfile));
+        if (__ethtool_get_ring(ctl, iface_name, &applied->ring) != NETD_SUCCESS)
+            memset(&applied->ring, 0x00, sizeof(struct NetDevRing));
+        if (__ethtool_get_channels(ctl, iface_name, &applied->channels) != NETD_SUCCESS)
+            memset(&applied->channels, 0x00, sizeof(struct NetDevChannels));
+        applied->set_coalesce = __ethtool_get_coalesce(ctl, iface_name, &applied->coalesce) == NETD_SUCCESS;
+        if (!applied->set_coalesce)
+            memset(&applied->coalesce, 0x00, sizeof(struct NetDevCoalesce));
+        __ethtool_get_offloads(ctl, iface_name, &applied->offloads);
+    }
+
+    close(ctl);
+    if (ret != NETD_SUCCESS)
+        errno = err;
+    return ret;
+}
+
+void netdev_capture_profile(struct NetDevProfile *profile) {
+    memset(profile, 0x00, sizeof(struct NetDevProfile));
+    profile->ring.rx = NETD_MAX;
+    profile->offloads.gro = 0;
+    profile->offloads.lro = 0;
+    profile->offloads.gso = 0;
+    profile->offloads.rxcsum = -1;
+}
+
+int netdev_get_channels(char *iface_name, struct NetDevChannels *channels) {
+    int ctl;
+    int ret;
+
+    if ((ctl = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0)) < 0)
+        return NETD_FAILURE;
+    ret = __ethtool_get_channels(ctl, iface_name, channels);
+    __ethtool_close(ctl);
+    return ret;
+}
+
+int netdev_get_coalesce(char *iface_name, struct NetDevCoalesce *coalesce) {
+    int ctl;
+    int ret;
+
+    if ((ctl = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0)) < 0)
+        return NETD_FAILURE;
+    ret = __ethtool_get_coalesce(ctl, iface_name, coalesce);
+    __ethtool_close(ctl);
+    return ret;
+}
+
 int netdev_get_flags(char *iface_name, short *flags) {
     int ret;
     int ctl_sock;
@@ -109,6 +546,72 @@ int netdev_get_mac(char *iface_name, struct netaddr_mac *mac) {
     return ret;
 }
 
+int netdev_get_offloads(char *iface_name, struct NetDevOffloads *offloads) {
+    int ctl;
+    int ret;
+
+    if ((ctl = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0)) < 0)
+        return NETD_FAILURE;
+    ret = __ethtool_get_offloads(ctl, iface_name, offloads);
+    __ethtool_close(ctl);
+    return ret;
+}
+
+int netdev_get_ring(char *iface_name, struct NetDevRing *ring) {
+    int ctl;
+    int ret;
+
+    if ((ctl = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0)) < 0)
+        return NETD_FAILURE;
+    ret = __ethtool_get_ring(ctl, iface_name, ring);
+    __ethtool_close(ctl);
+    return ret;
+}
+
+int netdev_set_channels(char *iface_name, struct NetDevChannels *channels) {
+    int ctl;
+    int ret;
+
+    if ((ctl = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0)) < 0)
+        return NETD_FAILURE;
+    ret = __ethtool_set_channels(ctl, iface_name, channels);
+    __ethtool_close(ctl);
+    return ret;
+}
+
+int netdev_set_coalesce(char *iface_name, struct NetDevCoalesce *coalesce) {
+    int ctl;
+    int ret;
+
+    if ((ctl = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0)) < 0)
+        return NETD_FAILURE;
+    ret = __ethtool_set_coalesce(ctl, iface_name, coalesce);
+    __ethtool_close(ctl);
+    return ret;
+}
+
+int netdev_set_offloads(char *iface_name, struct NetDevOffloads *offloads) {
+    int ctl;
+    int ret;
+
+    if ((ctl = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0)) < 0)
+        return NETD_FAILURE;
+    ret = __ethtool_set_offloads(ctl, iface_name, offloads);
+    __ethtool_close(ctl);
+    return ret;
+}
+
+int netdev_set_ring(char *iface_name, struct NetDevRing *ring) {
+    int ctl;
+    int ret;
+
+    if ((ctl = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0)) < 0)
+        return NETD_FAILURE;
+    ret = __ethtool_set_ring(ctl, iface_name, ring);
+    __ethtool_close(ctl);
+    return ret;
+}
+
 int netdev_set_flags(char *iface_name, short flags) {
     int ret;
     int ctl_sock;
@@ -153,37 +656,171 @@ int netdev_set_mac(char *iface_name, struct netaddr_mac *mac) {
 }
 
 struct NetDevList *netdev_get_iflist(unsigned int filter) {
-    struct ifaddrs *ifa = NULL;
-    struct ifaddrs *curr = NULL;
-    struct NetDevList *devs = NULL;
-    struct NetDevList *dev = NULL;
-    struct sockaddr_ll *sll = NULL;
-
-    if (getifaddrs(&ifa) < 0)
-        return NETD_FAILURE;
+    struct NetDevCtx *ctx;
+    struct NetDevList *devs;
+    struct NetDevList *dev;
+    unsigned int n = 0;
 
+    if ((ctx = netdev_ctx_new()) == NULL)
+        return NULL;
     filter = (filter == 0 ? ~filter : filter);
-    for (curr = ifa; curr != NULL; curr = curr->ifa_next) {
-        if (curr->ifa_addr->sa_family != AF_PACKET)
-            continue;
-        if (!(curr->ifa_flags & filter))
+    for (unsigned int i = 0; i < ctx->ndevs; i++)
+        n += (ctx->devs[i].flags & filter) != 0;
+    // All nodes live in one block, netdev_iflist_cleanup frees the head
+    if (n == 0 || (devs = (struct NetDevList *) malloc(n * sizeof(struct NetDevList))) == NULL) {
+        netdev_ctx_free(ctx);
+        return NULL;
+    }
+    dev = devs;
+    for (unsigned int i = 0; i < ctx->ndevs; i++) {
+        if (!(ctx->devs[i].flags & filter))
             continue;
-        if ((dev = (struct NetDevList *) malloc(sizeof(struct NetDevList))) == NULL) {
-            netdev_iflist_cleanup(devs);
-            return NULL;
-        }
-        memcpy(dev->name, curr->ifa_name, IFNAMSIZ);
-        dev->flags = curr->ifa_flags;
-        sll = (struct sockaddr_ll *) curr->ifa_addr;
-        memcpy(dev->mac.mac, sll->sll_addr, ETHHWASIZE);
-        dev->next = devs;
-        devs = dev;
-    }
-    freeifaddrs(ifa);
+        memcpy(dev->name, ctx->devs[i].name, IFNAMSIZ);
+        dev->flags = ctx->devs[i].flags;
+        dev->mac = ctx->devs[i].mac;
+        dev->next = dev + 1;
+        dev++;
+    }
+    devs[n - 1].next = NULL;
+    netdev_ctx_free(ctx);
     return devs;
 }
 
 inline void netdev_iflist_cleanup(struct NetDevList *NetDevList) {
-    struct NetDevList *tmp, *curr;
-    for (curr = NetDevList; curr != NULL; tmp = curr->next, free(curr), curr = tmp);
+    free(NetDevList);
+}
+
+struct NetDevInfo *netdev_ctx_byindex(struct NetDevCtx *ctx, unsigned int ifindex) {
+    struct NetDevInfo key;
+    key.ifindex = ifindex;
+    return (struct NetDevInfo *) bsearch(&key, ctx->devs, ctx->ndevs, sizeof(struct NetDevInfo), __ctx_cmp);
+}
+
+struct NetDevInfo *netdev_ctx_find(struct NetDevCtx *ctx, char *iface_name) {
+    unsigned int h;
+
+    if (ctx->names == NULL)
+        return NULL;
+    for (h = __ctx_hash(iface_name) & ctx->mask; ctx->names[h] != 0; h = (h + 1) & ctx->mask) {
+        if (strncmp(ctx->devs[ctx->names[h] - 1].name, iface_name, IFNAMSIZ) == 0)
+            return ctx->devs + ctx->names[h] - 1;
+    }
+    return NULL;
+}
+
+void netdev_ctx_free(struct NetDevCtx *ctx) {
+    if (ctx == NULL)
+        return;
+    if (ctx->nl != NULL) {
+        netlink_close((struct NlSock *) ctx->nl);
+        free(ctx->nl);
+    }
+    if (ctx->ctl >= 0)
+        close(ctx->ctl);
+    free(ctx->devs);
+    free(ctx->names);
+    free(ctx);
+}
+
+struct NetDevCtx *netdev_ctx_new() {
+    struct NetDevCtx *ctx;
+
+    if ((ctx = (struct NetDevCtx *) calloc(1, sizeof(struct NetDevCtx))) == NULL)
+        return NULL;
+    if ((ctx->ctl = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0)) < 0
+        || (ctx->nl = malloc(sizeof(struct NlSock))) == NULL) {
+        netdev_ctx_free(ctx);
+        return NULL;
+    }
+    if (netlink_open((struct NlSock *) ctx->nl, 0) != SPKSOCK_SUCCESS) {
+        free(ctx->nl);
+        ctx->nl = NULL;
+        netdev_ctx_free(ctx);
+        return NULL;
+    }
+    if (netdev_ctx_refresh(ctx) < 0) {
+        netdev_ctx_free(ctx);
+        return NULL;
+    }
+    return ctx;
+}
+
+unsigned int netdev_ctx_query(struct NetDevCtx *ctx, char **names, unsigned int n, struct NetDevInfo **devs) {
+    unsigned int found = 0;
+
+    for (unsigned int i = 0; i < n; i++)
+        found += (devs[i] = netdev_ctx_find(ctx, names[i])) != NULL;
+    return found;
+}
+
+int netdev_ctx_refresh(struct NetDevCtx *ctx) {
+    struct ifinfomsg ifi;
+    struct ifaddrmsg ifa;
+
+    memset(&ifi, 0x00, sizeof(struct ifinfomsg));
+    memset(&ifa, 0x00, sizeof(struct ifaddrmsg));
+    ifa.ifa_family = AF_INET;
+    ctx->ndevs = 0;
+    if (netlink_dump((struct NlSock *) ctx->nl, RTM_GETLINK, &ifi, sizeof(struct ifinfomsg), __ctx_link, ctx)
+        != SPKSOCK_SUCCESS)
+        return NETD_FAILURE;
+    ctx->stats_time = __ctx_now();
+    qsort(ctx->devs, ctx->ndevs, sizeof(struct NetDevInfo), __ctx_cmp);
+    if (netlink_dump((struct NlSock *) ctx->nl, RTM_GETADDR, &ifa, sizeof(struct ifaddrmsg), __ctx_addr, ctx)
+        != SPKSOCK_SUCCESS || !__ctx_index(ctx))
+        return NETD_FAILURE;
+    return (int) ctx->ndevs;
+}
+
+int netdev_ctx_stats(struct NetDevCtx *ctx) {
+    struct CtxStatsDump dump;
+    struct if_stats_msg ism;
+    struct ifinfomsg ifi;
+    int ret;
+
+    dump.ctx = ctx;
+    dump.updated = 0;
+    memset(&ism, 0x00, sizeof(struct if_stats_msg));
+    ism.filter_mask = IFLA_STATS_FILTER_BIT(IFLA_STATS_LINK_64);
+    ret = netlink_dump((struct NlSock *) ctx->nl, RTM_GETSTATS, &ism, sizeof(struct if_stats_msg), __ctx_stats, &dump);
+    if (ret != SPKSOCK_SUCCESS) {
+        // RTM_GETSTATS is available since Linux 4.7
+        memset(&ifi, 0x00, sizeof(struct ifinfomsg));
+        dump.updated = 0;
+        ret = netlink_dump((struct NlSock *) ctx->nl, RTM_GETLINK, &ifi, sizeof(struct ifinfomsg), __ctx_link_stats,
+                           &dump);
+        if (ret != SPKSOCK_SUCCESS)
+            return NETD_FAILURE;
+    }
+    ctx->stats_time = __ctx_now();
+    return (int) dump.updated;
+}
+
+int netdev_ctx_set_flags(struct NetDevCtx *ctx, char *iface_name, short flags) {
+    struct NetDevInfo *dev;
+    struct ifreq req;
+
+    memset(&req, 0x00, sizeof(struct ifreq));
+    strncpy(req.ifr_name, iface_name, IFNAMSIZ - 1);
+    req.ifr_flags = flags;
+    if (ioctl(ctx->ctl, SIOCSIFFLAGS, &req) < 0)
+        return NETD_FAILURE;
+    if ((dev = netdev_ctx_find(ctx, iface_name)) != NULL)
+        dev->flags = (dev->flags & ~0xFFFFU) | (unsigned short) flags;
+    return NETD_SUCCESS;
+}
+
+int netdev_ctx_set_mac(struct NetDevCtx *ctx, char *iface_name, struct netaddr_mac *mac) {
+    struct NetDevInfo *dev;
+    struct ifreq req;
+
+    memset(&req, 0x00, sizeof(struct ifreq));
+    strncpy(req.ifr_name, iface_name, IFNAMSIZ - 1);
+    memcpy(&req.ifr_hwaddr.sa_data, mac->mac, ETHHWASIZE);
+    req.ifr_hwaddr.sa_family = (unsigned short) 0x01;
+    if (ioctl(ctx->ctl, SIOCSIFHWADDR, &req) < 0)
+        return NETD_FAILURE;
+    if ((dev = netdev_ctx_find(ctx, iface_name)) != NULL)
+        dev->mac = *mac;
+    return NETD_SUCCESS;
 }
\ No newline at end of file
@@ -0,0 +1,156 @@
+/*
+ * Copyright (c) 2017 Jacopo De Luca
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/socket.h>
+
+#include <spksock.h>
+#include "netlink.h"
+
+static int __netlink_errno(int err) {
+    switch (err) {
+        case EINTR:
+        case EAGAIN:
+            return SPKSOCK_EINTR;
+        case ENOMEM:
+        case ENOBUFS:
+            return SPKSOCK_ENOMEM;
+        case EPERM:
+        case EACCES:
+            return SPKSOCK_EPERM;
+        case ENODEV:
+            return SPKSOCK_ENODEV;
+        case EOPNOTSUPP:
+            return SPKSOCK_ENOSUPPORT;
+        default:
+            return SPKSOCK_ERROR;
+    }
+}
+
+int netlink_open(struct NlSock *nl, unsigned int groups) {
+    struct sockaddr_nl addr;
+    socklen_t alen = sizeof(addr);
+
+    memset(nl, 0x00, sizeof(struct NlSock));
+    if ((nl->buf = (unsigned char *) malloc(NETLINK_BUFSIZE)) == NULL)
+        return SPKSOCK_ENOMEM;
+    nl->bufl = NETLINK_BUFSIZE;
+    if ((nl->fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE)) < 0) {
+        free(nl->buf);
+        return __netlink_errno(errno);
+    }
+    memset(&addr, 0x00, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = groups;
+    if (bind(nl->fd, (struct sockaddr *) &addr, sizeof(addr)) < 0
+        || getsockname(nl->fd, (struct sockaddr *) &addr, &alen) < 0) {
+        netlink_close(nl);
+        return __netlink_errno(errno);
+    }
+    nl->pid = addr.nl_pid;
+    nl->seq = (unsigned int) time(NULL);
+    return SPKSOCK_SUCCESS;
+}
+
+int netlink_request(struct NlSock *nl, unsigned short type, unsigned short flags, void *body, unsigned int len) {
+    struct sockaddr_nl kernel;
+    struct nlmsghdr hdr;
+    struct iovec iov[2];
+    struct msghdr msg;
+
+    memset(&kernel, 0x00, sizeof(kernel));
+    kernel.nl_family = AF_NETLINK;
+    hdr.nlmsg_len = NLMSG_LENGTH(len);
+    hdr.nlmsg_type = type;
+    hdr.nlmsg_flags = (unsigned short) (NLM_F_REQUEST | flags);
+    hdr.nlmsg_seq = ++nl->seq;
+    hdr.nlmsg_pid = 0;
+    iov[0].iov_base = &hdr;
+    iov[0].iov_len = NLMSG_HDRLEN;
+    iov[1].iov_base = body;
+    iov[1].iov_len = len;
+    memset(&msg, 0x00, sizeof(msg));
+    msg.msg_name = &kernel;
+    msg.msg_namelen = sizeof(kernel);
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    if (sendmsg(nl->fd, &msg, 0) < 0)
+        return __netlink_errno(errno);
+    return (int) (hdr.nlmsg_seq & 0x7FFFFFFF);
+}
+
+int netlink_recv(struct NlSock *nl, unsigned int seq, NlMsgCallback cb, void *arg) {
+    struct nlmsghdr *hdr;
+    struct nlmsgerr *err;
+    ssize_t len;
+    int ret;
+
+    if ((len = recv(nl->fd, nl->buf, nl->bufl, 0)) < 0)
+        return __netlink_errno(errno);
+    for (hdr = (struct nlmsghdr *) nl->buf; NLMSG_OK(hdr, len); hdr = NLMSG_NEXT(hdr, len)) {
+        if (seq != 0 && (hdr->nlmsg_seq & 0x7FFFFFFF) != seq)
+            continue;
+        if (hdr->nlmsg_type == NLMSG_DONE)
+            return 1;
+        if (hdr->nlmsg_type == NLMSG_ERROR) {
+            err = (struct nlmsgerr *) NLMSG_DATA(hdr);
+            if (err->error == 0)
+                return 1;
+            // Callers report errors through errno as well
+            errno = -err->error;
+            return __netlink_errno(errno);
+        }
+        if (cb != NULL && (ret = cb(hdr, arg)) < 0)
+            return ret;
+    }
+    return 0;
+}
+
+int netlink_dump(struct NlSock *nl, unsigned short type, void *body, unsigned int len, NlMsgCallback cb, void *arg) {
+    int seq;
+    int ret;
+
+    if ((seq = netlink_request(nl, type, NLM_F_DUMP, body, len)) < 0)
+        return seq;
+    while ((ret = netlink_recv(nl, (unsigned int) seq, cb, arg)) == 0 || ret == SPKSOCK_EINTR);
+    return ret < 0 ? ret : SPKSOCK_SUCCESS;
+}
+
+void netlink_attrs(struct rtattr **tb, unsigned short max, struct rtattr *rta, int len) {
+    memset(tb, 0x00, sizeof(struct rtattr *) * (max + 1));
+    for (; RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+        if (rta->rta_type <= max && tb[rta->rta_type] == NULL)
+            tb[rta->rta_type] = rta;
+    }
+}
+
+void netlink_close(struct NlSock *nl) {
+    if (nl->fd >= 0)
+        close(nl->fd);
+    free(nl->buf);
+    nl->fd = -1;
+    nl->buf = NULL;
+}
@@ -0,0 +1,104 @@
+/*
+ * Copyright (c) 2017 Jacopo De Luca
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+*/
+
+#ifndef SPARK_NETLINK_H
+#define SPARK_NETLINK_H
+
+#include <stdbool.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+
+#define NETLINK_BUFSIZE (32 * 1024)
+
+/// @brief rtnetlink socket (this struct is private).
+struct NlSock {
+    int fd;
+    unsigned int seq;
+    unsigned int pid;
+    unsigned char *buf;
+    unsigned int bufl;
+};
+
+/**
+ * @brief Callback invoked for each message of a dump.
+ * @return A value < 0 stops the dump and is returned by netlink_dump.
+ */
+typedef int (*NlMsgCallback)(struct nlmsghdr *, void *);
+
+/**
+ * @brief Opens a rtnetlink socket.
+ * @param __OUT__nl Pointer to NlSock.
+ * @param groups Multicast groups to join (RTMGRP_*), 0 for none.
+ * @return On success returns SPKSOCK_SUCCESS, otherwise a SPKSOCK_* error.
+ */
+int netlink_open(struct NlSock *nl, unsigned int groups);
+
+/**
+ * @brief Sends a request.
+ * @param __IN__nl Pointer to NlSock.
+ * @param type Message type (RTM_*).
+ * @param flags Message flags, NLM_F_REQUEST is always set.
+ * @param __IN__body Pointer to the request body (e.g. struct rtmsg) followed by the attributes.
+ * @param len Body length.
+ * @return On success returns the sequence number of the request, otherwise a SPKSOCK_* error.
+ */
+int netlink_request(struct NlSock *nl, unsigned short type, unsigned short flags, void *body, unsigned int len);
+
+/**
+ * @brief Receives pending messages and passes them to `cb`.
+ * @param __IN__nl Pointer to NlSock.
+ * @param seq Sequence number of the request, 0 to accept any message (e.g. notifications).
+ * @param cb Callback.
+ * @param arg Argument passed to the callback.
+ * @return Returns 1 when the dump is over (NLMSG_DONE or ack), 0 if more messages must be read,
+ * otherwise a SPKSOCK_* error (errno is set to the kernel error) or the value returned by the callback.
+ */
+int netlink_recv(struct NlSock *nl, unsigned int seq, NlMsgCallback cb, void *arg);
+
+/**
+ * @brief Requests a dump (NLM_F_DUMP) and passes each message to `cb`.
+ * @param __IN__nl Pointer to NlSock.
+ * @param type Message type (RTM_GET*).
+ * @param __IN__body Pointer to the request body.
+ * @param len Body length.
+ * @param cb Callback.
+ * @param arg Argument passed to the callback.
+ * @return On success returns SPKSOCK_SUCCESS, otherwise a SPKSOCK_* error or the value returned by the callback.
+ */
+int netlink_dump(struct NlSock *nl, unsigned short type, void *body, unsigned int len, NlMsgCallback cb, void *arg);
+
+/**
+ * @brief Indexes the attributes of a message by type, attributes > max are ignored.
+ * @param __OUT__tb Array of max + 1 pointers.
+ * @param max Max attribute type.
+ * @param __IN__rta Pointer to the first attribute.
+ * @param len Attributes length.
+ */
+void netlink_attrs(struct rtattr **tb, unsigned short max, struct rtattr *rta, int len);
+
+/**
+ * @brief Closes the rtnetlink socket.
+ * @param __IN__nl Pointer to NlSock.
+ */
+void netlink_close(struct NlSock *nl);
+
+#endif
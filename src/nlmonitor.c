@@ -0,0 +1,593 @@
+/*
+ * Copyright (c) 2017 Jacopo De Luca
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+
+#include <spksock.h>
+#include <ethernet.h>
+#include <nlmonitor.h>
+
+/// @brief Change waiting for its callback.
+struct NlmChange {
+    enum NlmEvent ev;
+    bool removed;
+    union {
+        struct NlmLink link;
+        struct NlmAddr addr;
+        struct NlmRoute route;
+        struct NlmNeigh neigh;
+    } rec;
+};
+
+static void __nlm_vector_init(struct NlmVector *vec, unsigned int recsize, unsigned int keylen) {
+    memset(vec, 0x00, sizeof(struct NlmVector));
+    vec->recsize = recsize;
+    vec->keylen = keylen;
+}
+
+static void *__nlm_vector_find(struct NlmVector *vec, void *rec) {
+    unsigned char *curr = vec->data;
+
+    for (unsigned int i = 0; i < vec->count; i++, curr += vec->recsize) {
+        if (memcmp(curr, rec, vec->keylen) == 0)
+            return curr;
+    }
+    return NULL;
+}
+
+static void *__nlm_vector_push(struct NlmVector *vec, void *rec) {
+    unsigned char *tmp;
+    unsigned int size;
+
+    if (vec->count == vec->size) {
+        size = vec->size == 0 ? 16 : vec->size * 2;
+        if ((tmp = realloc(vec->data, (unsigned long) size * vec->recsize)) == NULL)
+            return NULL;
+        vec->data = tmp;
+        vec->size = size;
+    }
+    tmp = vec->data + (unsigned long) vec->count++ * vec->recsize;
+    memcpy(tmp, rec, vec->recsize);
+    return tmp;
+}
+
+static void __nlm_vector_remove(struct NlmVector *vec, void *rec) {
+    unsigned char *last = vec->data + (unsigned long) (vec->count - 1) * vec->recsize;
+
+    if (rec != last)
+        memcpy(rec, last, vec->recsize);
+    vec->count--;
+}
+
+static void __nlm_change(struct NlMonitor *mon, enum NlmEvent ev, bool removed, void *rec) {
+    struct NlmChange change;
+
+    mon->dirty = true;
+    mon->changes++;
+    if (mon->on_change == NULL)
+        return;
+    memset(&change, 0x00, sizeof(struct NlmChange));
+    change.ev = ev;
+    change.removed = removed;
+    memcpy(&change.rec, rec, mon->state[ev].recsize);
+    __nlm_vector_push(&mon->events, &change);
+}
+
+/*
+ * Applies an update to the working state, records are compared as a whole
+ * so that notifications that do not change anything are not reported.
+ */
+static int __nlm_apply(struct NlMonitor *mon, enum NlmEvent ev, bool removed, void *rec) {
+    struct NlmVector *vec = mon->state + ev;
+    void *curr = __nlm_vector_find(vec, rec);
+
+    if (removed) {
+        if (curr == NULL)
+            return 0;
+        __nlm_change(mon, ev, true, curr);
+        __nlm_vector_remove(vec, curr);
+        return 1;
+    }
+    if (curr != NULL) {
+        if (memcmp(curr, rec, vec->recsize) == 0)
+            return 0;
+        memcpy(curr, rec, vec->recsize);
+    } else if (__nlm_vector_push(vec, rec) == NULL)
+        return SPKSOCK_ENOMEM;
+    __nlm_change(mon, ev, false, rec);
+    return 1;
+}
+
+static int __nlm_link_cmp(const void *a, const void *b) {
+    unsigned int i1 = ((const struct NlmLink *) a)->ifindex;
+    unsigned int i2 = ((const struct NlmLink *) b)->ifindex;
+    return i1 < i2 ? -1 : i1 > i2;
+}
+
+static void __nlm_snapshot_free(struct NlmSnapshot *snap) {
+    routev4_free(snap->lpm);
+    free(snap);
+}
+
+static void __nlm_reclaim(struct NlMonitor *mon) {
+    struct NlmSnapshot **curr = &mon->retired;
+    struct NlmSnapshot *snap;
+    unsigned long min = 0;
+    unsigned long version;
+    unsigned int n = atomic_load(&mon->nreaders);
+
+    for (unsigned int i = 0; i < n && i < NLMON_MAXREADERS; i++) {
+        version = atomic_load(&mon->readers[i]);
+        if (version != 0 && (min == 0 || version < min))
+            min = version;
+    }
+    // A reader that entered with version v may see v or any newer snapshot
+    while (*curr != NULL) {
+        if (min == 0 || (*curr)->version < min) {
+            snap = *curr;
+            *curr = snap->next;
+            __nlm_snapshot_free(snap);
+        } else
+            curr = &(*curr)->next;
+    }
+}
+
+static int __nlm_publish(struct NlMonitor *mon) {
+    struct NlmSnapshot *snap;
+    struct NlmSnapshot *old;
+    struct NlmRoute *route;
+    unsigned char *ptr;
+    unsigned long size = sizeof(struct NlmSnapshot);
+
+    for (int i = 0; i < 4; i++)
+        size += (unsigned long) mon->state[i].count * mon->state[i].recsize;
+    if ((snap = (struct NlmSnapshot *) calloc(1, size)) == NULL)
+        return SPKSOCK_ENOMEM;
+    ptr = (unsigned char *) (snap + 1);
+    snap->links = (struct NlmLink *) ptr;
+    snap->nlinks = mon->state[NLMON_EV_LINK].count;
+    ptr += snap->nlinks * sizeof(struct NlmLink);
+    snap->addrs = (struct NlmAddr *) ptr;
+    snap->naddrs = mon->state[NLMON_EV_ADDR].count;
+    ptr += snap->naddrs * sizeof(struct NlmAddr);
+    snap->routes = (struct NlmRoute *) ptr;
+    snap->nroutes = mon->state[NLMON_EV_ROUTE].count;
+    ptr += snap->nroutes * sizeof(struct NlmRoute);
+    snap->neighs = (struct NlmNeigh *) ptr;
+    snap->nneighs = mon->state[NLMON_EV_NEIGH].count;
+    for (int i = 0; i < 4; i++) {
+        if (mon->state[i].count > 0)
+            memcpy(i == NLMON_EV_LINK ? (void *) snap->links : i == NLMON_EV_ADDR ? (void *) snap->addrs
+                                                              : i == NLMON_EV_ROUTE ? (void *) snap->routes
+                                                                                    : (void *) snap->neighs,
+                   mon->state[i].data, (unsigned long) mon->state[i].count * mon->state[i].recsize);
+    }
+    qsort(snap->links, snap->nlinks, sizeof(struct NlmLink), __nlm_link_cmp);
+
+    if (mon->lpm) {
+        if ((snap->lpm = routev4_new()) == NULL) {
+            free(snap);
+            return SPKSOCK_ENOMEM;
+        }
+        for (unsigned int i = 0; i < snap->nroutes; i++) {
+            route = snap->routes + i;
+            routev4_add(snap->lpm, &route->dst, route->prefix, route->metric, &route->nh);
+        }
+        if (!routev4_build(snap->lpm)) {
+            __nlm_snapshot_free(snap);
+            return SPKSOCK_ENOMEM;
+        }
+    }
+
+    // The pointer is published before the version, see nlmon_acquire
+    snap->version = atomic_load(&mon->version) + 1;
+    old = atomic_exchange(&mon->current, snap);
+    atomic_store(&mon->version, snap->version);
+    if (old != NULL) {
+        old->next = mon->retired;
+        mon->retired = old;
+    }
+    mon->dirty = false;
+    __nlm_reclaim(mon);
+    return SPKSOCK_SUCCESS;
+}
+
+static void __nlm_fire(struct NlMonitor *mon) {
+    struct NlmChange *change = (struct NlmChange *) mon->events.data;
+
+    for (unsigned int i = 0; i < mon->events.count; i++, change++)
+        mon->on_change(mon, change->ev, change->removed, &change->rec, mon->arg);
+    mon->events.count = 0;
+}
+
+struct NlmSnapshot *nlmon_acquire(struct NlMonitor *mon, int slot) {
+    atomic_store(&mon->readers[slot], atomic_load(&mon->version));
+    return atomic_load(&mon->current);
+}
+
+bool nlmon_ipv4(struct NlmSnapshot *snap, char *iface_name, struct netaddr_ip *ip, struct netaddr_ip *netmask) {
+    struct NlmLink *link;
+
+    if ((link = nlmon_link(snap, iface_name)) == NULL)
+        return false;
+    for (unsigned int i = 0; i < snap->naddrs; i++) {
+        if (snap->addrs[i].ifindex == link->ifindex) {
+            if (ip != NULL)
+                *ip = snap->addrs[i].addr;
+            if (netmask != NULL)
+                *netmask = snap->addrs[i].netmask;
+            return true;
+        }
+    }
+    return false;
+}
+
+struct NlmLink *nlmon_link(struct NlmSnapshot *snap, char *iface_name) {
+    for (unsigned int i = 0; i < snap->nlinks; i++) {
+        if (strncmp(snap->links[i].name, iface_name, IFNAMSIZ) == 0)
+            return snap->links + i;
+    }
+    return NULL;
+}
+
+struct NlmLink *nlmon_link_byindex(struct NlmSnapshot *snap, unsigned int ifindex) {
+    struct NlmLink key;
+    key.ifindex = ifindex;
+    return (struct NlmLink *) bsearch(&key, snap->links, snap->nlinks, sizeof(struct NlmLink), __nlm_link_cmp);
+}
+
+int nlmon_reader(struct NlMonitor *mon) {
+    unsigned int slot = atomic_fetch_add(&mon->nreaders, 1);
+    return slot < NLMON_MAXREADERS ? (int) slot : -1;
+}
+
+inline void nlmon_release(struct NlMonitor *mon, int slot) {
+    atomic_store(&mon->readers[slot], 0);
+}
+
+#if defined(__linux__)
+
+#include <poll.h>
+#include <fcntl.h>
+#include <ipv4.h>
+#include "netlink/netlink.h"
+
+/// @brief Event and request sockets.
+struct NlmSockets {
+    struct NlSock ev;
+    struct NlSock req;
+};
+
+/*
+ * The kernel flushes the routes of an interface that is removed or goes down without notifying them,
+ * on removal addresses and neighbors are purged too in case their notifications were lost.
+ * Records of the events between first and last are removed.
+ */
+static void __nlm_purge(struct NlMonitor *mon, unsigned int ifindex, enum NlmEvent first, enum NlmEvent last) {
+    struct NlmVector *vec;
+    unsigned char *rec;
+    unsigned int owner;
+
+    for (unsigned int ev = first; ev <= last; ev++) {
+        vec = mon->state + ev;
+        for (unsigned int i = 0; i < vec->count;) {
+            rec = vec->data + (unsigned long) i * vec->recsize;
+            owner = ev == NLMON_EV_ROUTE ? ((struct NlmRoute *) rec)->nh.ifindex : *(unsigned int *) rec;
+            if (owner != ifindex) {
+                i++;
+                continue;
+            }
+            __nlm_change(mon, (enum NlmEvent) ev, true, rec);
+            __nlm_vector_remove(vec, rec);
+        }
+    }
+}
+
+static int __nlm_link_msg(struct NlMonitor *mon, struct nlmsghdr *hdr) {
+    struct ifinfomsg *ifi = (struct ifinfomsg *) NLMSG_DATA(hdr);
+    struct rtattr *tb[IFLA_MAX + 1];
+    struct NlmLink link;
+    struct NlmLink *curr;
+
+    memset(&link, 0x00, sizeof(struct NlmLink));
+    link.ifindex = (unsigned int) ifi->ifi_index;
+    if (hdr->nlmsg_type == RTM_DELLINK) {
+        __nlm_purge(mon, link.ifindex, NLMON_EV_ADDR, NLMON_EV_NEIGH);
+        return __nlm_apply(mon, NLMON_EV_LINK, true, &link);
+    }
+    netlink_attrs(tb, IFLA_MAX, IFLA_RTA(ifi), (int) IFLA_PAYLOAD(hdr));
+    link.flags = ifi->ifi_flags;
+    // Going down flushes the routes of the interface, addresses are kept
+    curr = __nlm_vector_find(mon->state + NLMON_EV_LINK, &link);
+    if (curr != NULL && (curr->flags & IFF_UP) && !(link.flags & IFF_UP))
+        __nlm_purge(mon, link.ifindex, NLMON_EV_ROUTE, NLMON_EV_ROUTE);
+    if (tb[IFLA_IFNAME] != NULL)
+        strncpy(link.name, (char *) RTA_DATA(tb[IFLA_IFNAME]), IFNAMSIZ - 1);
+    if (tb[IFLA_MTU] != NULL)
+        link.mtu = *(unsigned int *) RTA_DATA(tb[IFLA_MTU]);
+    if (tb[IFLA_ADDRESS] != NULL && RTA_PAYLOAD(tb[IFLA_ADDRESS]) == ETHHWASIZE)
+        memcpy(link.mac.mac, RTA_DATA(tb[IFLA_ADDRESS]), ETHHWASIZE);
+    if (tb[IFLA_OPERSTATE] != NULL)
+        link.operstate = *(unsigned char *) RTA_DATA(tb[IFLA_OPERSTATE]);
+    return __nlm_apply(mon, NLMON_EV_LINK, false, &link);
+}
+
+static int __nlm_addr_msg(struct NlMonitor *mon, struct nlmsghdr *hdr) {
+    struct ifaddrmsg *ifa = (struct ifaddrmsg *) NLMSG_DATA(hdr);
+    struct rtattr *tb[IFA_MAX + 1];
+    struct NlmAddr addr;
+
+    if (ifa->ifa_family != AF_INET)
+        return 0;
+    netlink_attrs(tb, IFA_MAX, IFA_RTA(ifa), (int) IFA_PAYLOAD(hdr));
+    memset(&addr, 0x00, sizeof(struct NlmAddr));
+    addr.ifindex = ifa->ifa_index;
+    addr.prefix = ifa->ifa_prefixlen;
+    if (tb[IFA_LOCAL] != NULL)
+        memcpy(&addr.addr.ip, RTA_DATA(tb[IFA_LOCAL]), IPV4ADDRSIZE);
+    else if (tb[IFA_ADDRESS] != NULL)
+        memcpy(&addr.addr.ip, RTA_DATA(tb[IFA_ADDRESS]), IPV4ADDRSIZE);
+    if (hdr->nlmsg_type == RTM_DELADDR)
+        return __nlm_apply(mon, NLMON_EV_ADDR, true, &addr);
+    get_ipv4netmask(addr.prefix, &addr.netmask);
+    if (tb[IFA_BROADCAST] != NULL)
+        memcpy(&addr.broadcast.ip, RTA_DATA(tb[IFA_BROADCAST]), IPV4ADDRSIZE);
+    if (tb[IFA_LABEL] != NULL)
+        strncpy(addr.label, (char *) RTA_DATA(tb[IFA_LABEL]), IFNAMSIZ - 1);
+    return __nlm_apply(mon, NLMON_EV_ADDR, false, &addr);
+}
+
+static int __nlm_route_msg(struct NlMonitor *mon, struct nlmsghdr *hdr) {
+    struct rtmsg *rtm = (struct rtmsg *) NLMSG_DATA(hdr);
+    struct rtattr *tb[RTA_MAX + 1];
+    struct rtattr *nhtb[RTA_MAX + 1];
+    struct rtnexthop *rtnh;
+    struct NlmRoute route;
+    unsigned int table;
+
+    if (rtm->rtm_family != AF_INET || rtm->rtm_type != RTN_UNICAST)
+        return 0;
+    netlink_attrs(tb, RTA_MAX, RTM_RTA(rtm), (int) RTM_PAYLOAD(hdr));
+    table = tb[RTA_TABLE] != NULL ? *(unsigned int *) RTA_DATA(tb[RTA_TABLE]) : rtm->rtm_table;
+    if (table != RT_TABLE_MAIN)
+        return 0;
+    memset(&route, 0x00, sizeof(struct NlmRoute));
+    route.prefix = rtm->rtm_dst_len;
+    if (tb[RTA_DST] != NULL)
+        memcpy(&route.dst.ip, RTA_DATA(tb[RTA_DST]), IPV4ADDRSIZE);
+    if (tb[RTA_PRIORITY] != NULL)
+        route.metric = *(unsigned int *) RTA_DATA(tb[RTA_PRIORITY]);
+    if (hdr->nlmsg_type == RTM_DELROUTE)
+        return __nlm_apply(mon, NLMON_EV_ROUTE, true, &route);
+    if (tb[RTA_PREFSRC] != NULL)
+        memcpy(&route.nh.prefsrc.ip, RTA_DATA(tb[RTA_PREFSRC]), IPV4ADDRSIZE);
+    if (tb[RTA_GATEWAY] != NULL)
+        memcpy(&route.nh.gateway.ip, RTA_DATA(tb[RTA_GATEWAY]), IPV4ADDRSIZE);
+    if (tb[RTA_OIF] != NULL)
+        route.nh.ifindex = *(unsigned int *) RTA_DATA(tb[RTA_OIF]);
+    if (tb[RTA_MULTIPATH] != NULL && RTA_PAYLOAD(tb[RTA_MULTIPATH]) >= sizeof(struct rtnexthop)) {
+        rtnh = (struct rtnexthop *) RTA_DATA(tb[RTA_MULTIPATH]);
+        route.nh.ifindex = (unsigned int) rtnh->rtnh_ifindex;
+        netlink_attrs(nhtb, RTA_MAX, RTNH_DATA(rtnh), rtnh->rtnh_len - (int) RTNH_LENGTH(0));
+        if (nhtb[RTA_GATEWAY] != NULL)
+            memcpy(&route.nh.gateway.ip, RTA_DATA(nhtb[RTA_GATEWAY]), IPV4ADDRSIZE);
+    }
+    if (if_indextoname(route.nh.ifindex, route.nh.ifname) == NULL)
+        route.nh.ifname[0] = '\0';
+    return __nlm_apply(mon, NLMON_EV_ROUTE, false, &route);
+}
+
+static int __nlm_neigh_msg(struct NlMonitor *mon, struct nlmsghdr *hdr) {
+    struct ndmsg *ndm = (struct ndmsg *) NLMSG_DATA(hdr);
+    struct rtattr *tb[NDA_MAX + 1];
+    struct NlmNeigh neigh;
+
+    if (ndm->ndm_family != AF_INET)
+        return 0;
+    netlink_attrs(tb, NDA_MAX, (struct rtattr *) ((unsigned char *) ndm + NLMSG_ALIGN(sizeof(struct ndmsg))),
+                  (int) (hdr->nlmsg_len - NLMSG_LENGTH(sizeof(struct ndmsg))));
+    if (tb[NDA_DST] == NULL)
+        return 0;
+    memset(&neigh, 0x00, sizeof(struct NlmNeigh));
+    neigh.ifindex = (unsigned int) ndm->ndm_ifindex;
+    memcpy(&neigh.ip.ip, RTA_DATA(tb[NDA_DST]), IPV4ADDRSIZE);
+    if (hdr->nlmsg_type == RTM_DELNEIGH)
+        return __nlm_apply(mon, NLMON_EV_NEIGH, true, &neigh);
+    neigh.state = ndm->ndm_state;
+    if (tb[NDA_LLADDR] != NULL && RTA_PAYLOAD(tb[NDA_LLADDR]) == ETHHWASIZE)
+        memcpy(neigh.mac.mac, RTA_DATA(tb[NDA_LLADDR]), ETHHWASIZE);
+    return __nlm_apply(mon, NLMON_EV_NEIGH, false, &neigh);
+}
+
+static int __nlm_msg(struct nlmsghdr *hdr, void *arg) {
+    struct NlMonitor *mon = (struct NlMonitor *) arg;
+    int ret;
+
+    switch (hdr->nlmsg_type) {
+        case RTM_NEWLINK:
+        case RTM_DELLINK:
+            ret = __nlm_link_msg(mon, hdr);
+            break;
+        case RTM_NEWADDR:
+        case RTM_DELADDR:
+            ret = __nlm_addr_msg(mon, hdr);
+            break;
+        case RTM_NEWROUTE:
+        case RTM_DELROUTE:
+            ret = __nlm_route_msg(mon, hdr);
+            break;
+        case RTM_NEWNEIGH:
+        case RTM_DELNEIGH:
+            ret = __nlm_neigh_msg(mon, hdr);
+            break;
+        default:
+            return 0;
+    }
+    return ret < 0 ? ret : 0;
+}
+
+static int __nlm_load(struct NlMonitor *mon) {
+    struct NlSock *req = &((struct NlmSockets *) mon->nl)->req;
+    struct ifinfomsg ifi;
+    struct ifaddrmsg ifa;
+    struct rtmsg rtm;
+    struct ndmsg ndm;
+    int ret = SPKSOCK_SUCCESS;
+
+    memset(&ifi, 0x00, sizeof(struct ifinfomsg));
+    memset(&ifa, 0x00, sizeof(struct ifaddrmsg));
+    memset(&rtm, 0x00, sizeof(struct rtmsg));
+    memset(&ndm, 0x00, sizeof(struct ndmsg));
+    ifa.ifa_family = AF_INET;
+    rtm.rtm_family = AF_INET;
+    ndm.ndm_family = AF_INET;
+    for (int i = 0; i < 4; i++)
+        mon->state[i].count = 0;
+    mon->dirty = true;
+    // Links are always loaded, addresses refer to them by index
+    ret = netlink_dump(req, RTM_GETLINK, &ifi, sizeof(struct ifinfomsg), __nlm_msg, mon);
+    if (ret == SPKSOCK_SUCCESS && (mon->groups & NLMON_ADDR) != 0)
+        ret = netlink_dump(req, RTM_GETADDR, &ifa, sizeof(struct ifaddrmsg), __nlm_msg, mon);
+    if (ret == SPKSOCK_SUCCESS && (mon->groups & NLMON_ROUTE) != 0)
+        ret = netlink_dump(req, RTM_GETROUTE, &rtm, sizeof(struct rtmsg), __nlm_msg, mon);
+    if (ret == SPKSOCK_SUCCESS && (mon->groups & NLMON_NEIGH) != 0)
+        ret = netlink_dump(req, RTM_GETNEIGH, &ndm, sizeof(struct ndmsg), __nlm_msg, mon);
+    return ret;
+}
+
+int nlmon_poll(struct NlMonitor *mon, int timeout) {
+    struct NlSock *ev = &((struct NlmSockets *) mon->nl)->ev;
+    struct pollfd pfd;
+    unsigned int changes;
+    int ret;
+
+    pfd.fd = ev->fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    poll(&pfd, 1, timeout);
+    while ((ret = netlink_recv(ev, 0, __nlm_msg, mon)) >= 0);
+    if (ret == SPKSOCK_ENOMEM) {
+        // Notifications lost (ENOBUFS): reload everything
+        mon->overruns++;
+        mon->events.count = 0;
+        while ((ret = netlink_recv(ev, 0, NULL, NULL)) >= 0);
+        if ((ret = __nlm_load(mon)) != SPKSOCK_SUCCESS)
+            return ret;
+        mon->events.count = 0;
+        mon->changes = 0;
+    } else if (ret != SPKSOCK_EINTR)
+        return ret;
+
+    if (!mon->dirty)
+        return 0;
+    changes = mon->changes;
+    mon->changes = 0;
+    if ((ret = __nlm_publish(mon)) != SPKSOCK_SUCCESS)
+        return ret;
+    if (mon->on_change != NULL)
+        __nlm_fire(mon);
+    return (int) changes;
+}
+
+struct NlMonitor *nlmon_new(unsigned int groups) {
+    struct NlMonitor *mon;
+    struct NlmSockets *socks;
+    unsigned int nlgroups = 0;
+
+    if ((mon = (struct NlMonitor *) calloc(1, sizeof(struct NlMonitor))) == NULL)
+        return NULL;
+    if ((socks = (struct NlmSockets *) calloc(1, sizeof(struct NlmSockets))) == NULL) {
+        free(mon);
+        return NULL;
+    }
+    socks->ev.fd = socks->req.fd = -1;
+    mon->nl = socks;
+    mon->groups = groups;
+    __nlm_vector_init(&mon->state[NLMON_EV_LINK], sizeof(struct NlmLink), sizeof(unsigned int));
+    __nlm_vector_init(&mon->state[NLMON_EV_ADDR], sizeof(struct NlmAddr), offsetof(struct NlmAddr, prefix) + 1);
+    __nlm_vector_init(&mon->state[NLMON_EV_ROUTE], sizeof(struct NlmRoute), offsetof(struct NlmRoute, nh));
+    __nlm_vector_init(&mon->state[NLMON_EV_NEIGH], sizeof(struct NlmNeigh), offsetof(struct NlmNeigh, mac));
+    __nlm_vector_init(&mon->events, sizeof(struct NlmChange), 0);
+
+    if ((groups & NLMON_LINK) != 0)
+        nlgroups |= RTMGRP_LINK;
+    if ((groups & NLMON_ADDR) != 0)
+        nlgroups |= RTMGRP_IPV4_IFADDR;
+    if ((groups & NLMON_ROUTE) != 0)
+        nlgroups |= RTMGRP_IPV4_ROUTE;
+    if ((groups & NLMON_NEIGH) != 0)
+        nlgroups |= RTMGRP_NEIGH;
+    // Subscribes before the dump, so that no change is lost in between
+    if (netlink_open(&socks->ev, nlgroups) != SPKSOCK_SUCCESS
+        || netlink_open(&socks->req, 0) != SPKSOCK_SUCCESS
+        || fcntl(socks->ev.fd, F_SETFL, fcntl(socks->ev.fd, F_GETFL) | O_NONBLOCK) < 0
+        || __nlm_load(mon) != SPKSOCK_SUCCESS || __nlm_publish(mon) != SPKSOCK_SUCCESS) {
+        nlmon_free(mon);
+        return NULL;
+    }
+    mon->events.count = 0;
+    mon->changes = 0;
+    return mon;
+}
+
+void nlmon_free(struct NlMonitor *mon) {
+    struct NlmSockets *socks = (struct NlmSockets *) mon->nl;
+    struct NlmSnapshot *snap;
+
+    if (socks != NULL) {
+        if (socks->ev.fd >= 0)
+            netlink_close(&socks->ev);
+        if (socks->req.fd >= 0)
+            netlink_close(&socks->req);
+        free(socks);
+    }
+    if ((snap = atomic_load(&mon->current)) != NULL)
+        __nlm_snapshot_free(snap);
+    while ((snap = mon->retired) != NULL) {
+        mon->retired = snap->next;
+        __nlm_snapshot_free(snap);
+    }
+    for (int i = 0; i < 4; i++)
+        free(mon->state[i].data);
+    free(mon->events.data);
+    free(mon);
+}
+
+#else
+
+int nlmon_poll(struct NlMonitor *mon, int timeout) {
+    // STUB
+    return SPKSOCK_ENOSUPPORT;
+}
+
+struct NlMonitor *nlmon_new(unsigned int groups) {
+    // STUB
+    return NULL;
+}
+
+void nlmon_free(struct NlMonitor *mon) {
+    // STUB
+}
+
+#endif
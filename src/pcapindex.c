@@ -0,0 +1,516 @@
+/*
+ * Copyright (c) 2017 Jacopo De Luca
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <pcapindex.h>
+
+#include "socket/spksock_common.h"
+
+#define PCAPIDX_PCAP_MAGIC  0xA1B2C3D4
+#define PCAPIDX_PCAP_NSEC   0xA1B23C4D
+#define PCAPIDX_PCAP_HDRLEN 24
+#define PCAPIDX_PCAP_RECLEN 16
+
+static int __pcapidx_errno() {
+    switch (errno) {
+        case EACCES:
+        case EPERM:
+            return SPKSOCK_EPERM;
+        case ENOENT:
+            return SPKSOCK_ENODEV;
+        case ENOMEM:
+            return SPKSOCK_ENOMEM;
+        default:
+            return SPKSOCK_ERROR;
+    }
+}
+
+static int __pcapidx_map(char *path, unsigned char **base, unsigned long long *size) {
+    struct stat st;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY)) < 0)
+        return __pcapidx_errno();
+    if (fstat(fd, &st) < 0 || st.st_size == 0) {
+        close(fd);
+        return SPKSOCK_ENOSUPPORT;
+    }
+    *size = (unsigned long long) st.st_size;
+    *base = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    return *base == MAP_FAILED ? __pcapidx_errno() : SPKSOCK_SUCCESS;
+}
+
+// Checks the global header of a pcap file
+static bool __pcapidx_pcap(unsigned char *base, unsigned long long size, bool *swap, bool *nsec, int *lktype) {
+    unsigned int magic;
+    unsigned int linktype;
+
+    if (size < PCAPIDX_PCAP_HDRLEN)
+        return false;
+    memcpy(&magic, base, sizeof(unsigned int));
+    if (magic == PCAPIDX_PCAP_MAGIC || magic == PCAPIDX_PCAP_NSEC)
+        *swap = false;
+    else if (__builtin_bswap32(magic) == PCAPIDX_PCAP_MAGIC || __builtin_bswap32(magic) == PCAPIDX_PCAP_NSEC)
+        *swap = true;
+    else
+        return false;
+    *nsec = magic == PCAPIDX_PCAP_NSEC || __builtin_bswap32(magic) == PCAPIDX_PCAP_NSEC;
+
+    memcpy(&linktype, base + 20, sizeof(unsigned int));
+    linktype = (*swap ? __builtin_bswap32(linktype) : linktype) & 0xFFFF;
+    *lktype = __ssock_linktype_dlt(linktype);
+    return true;
+}
+
+// Parses the record at offset, returns the captured length or -1 if the record is truncated
+static long __pcapidx_record(unsigned char *base, unsigned long long size, unsigned long long off, bool swap,
+                             bool nsec, unsigned char **pkt, long long *time) {
+    unsigned int rec[4];
+
+    if (off > size || size - off < PCAPIDX_PCAP_RECLEN)
+        return -1;
+    memcpy(rec, base + off, PCAPIDX_PCAP_RECLEN);
+    if (swap) {
+        for (int i = 0; i < 4; i++)
+            rec[i] = __builtin_bswap32(rec[i]);
+    }
+    if (rec[2] > size - off - PCAPIDX_PCAP_RECLEN)
+        return -1;
+    *pkt = base + off + PCAPIDX_PCAP_RECLEN;
+    *time = (long long) rec[0] * 1000000000LL + (nsec ? rec[1] : rec[1] * 1000LL);
+    return rec[2];
+}
+
+static int __pcapidx_cmpflow(const void *a, const void *b) {
+    const struct PcapIdxFlow *f1 = a;
+    const struct PcapIdxFlow *f2 = b;
+
+    if (f1->hash != f2->hash)
+        return f1->hash < f2->hash ? -1 : 1;
+    return memcmp(&f1->key, &f2->key, sizeof(struct FlowKey));
+}
+
+static bool __pcapidx_grow(void **array, unsigned long long *max, unsigned long long n, size_t size) {
+    unsigned long long len = *max == 0 ? 1024 : *max << 1;
+    void *tmp;
+
+    if (n < *max)
+        return true;
+    if ((tmp = realloc(*array, len * size)) == NULL)
+        return false;
+    *array = tmp;
+    *max = len;
+    return true;
+}
+
+static bool __pcapidx_rehash(struct PcapIdxBuilder *ib) {
+    unsigned int nslots = ib->nslots == 0 ? 1024 : ib->nslots << 1;
+    struct PcapIdxFlow *flows;
+    unsigned int *slots;
+    unsigned int i;
+    unsigned int j;
+
+    // The table is kept at most half full, flows has room for nslots / 2 entries
+    if ((flows = realloc(ib->flows, (nslots >> 1) * sizeof(struct PcapIdxFlow))) == NULL)
+        return false;
+    ib->flows = flows;
+    if ((slots = calloc(nslots, sizeof(unsigned int))) == NULL)
+        return false;
+    for (i = 0; i < ib->nflows; i++) {
+        for (j = ib->flows[i].hash & (nslots - 1); slots[j] != 0; j = (j + 1) & (nslots - 1));
+        slots[j] = i + 1;
+    }
+    free(ib->slots);
+    ib->slots = slots;
+    ib->nslots = nslots;
+    return true;
+}
+
+static long __pcapidx_flowid(struct PcapIdxBuilder *ib, struct FlowKey *key) {
+    unsigned int hash = flow_hash(key);
+    struct PcapIdxFlow *flow;
+    unsigned int j;
+
+    flow_canonical(key);
+    if (ib->nflows >= ib->nslots >> 1 && !__pcapidx_rehash(ib))
+        return -1;
+
+    for (j = hash & (ib->nslots - 1); ib->slots[j] != 0; j = (j + 1) & (ib->nslots - 1)) {
+        flow = ib->flows + ib->slots[j] - 1;
+        if (flow->hash == hash && memcmp(&flow->key, key, sizeof(struct FlowKey)) == 0)
+            return ib->slots[j] - 1;
+    }
+
+    flow = ib->flows + ib->nflows;
+    flow->key = *key;
+    flow->hash = hash;
+    flow->count = 0;
+    flow->first = 0;
+    ib->slots[j] = ++ib->nflows;
+    return ib->nflows - 1;
+}
+
+int pcapidx_new(int lktype, struct PcapIdxBuilder **ib) {
+    if (ib == NULL)
+        return SPKSOCK_ERROR;
+    if ((*ib = calloc(1, sizeof(struct PcapIdxBuilder))) == NULL)
+        return SPKSOCK_ENOMEM;
+    (*ib)->lktype = lktype;
+    return SPKSOCK_SUCCESS;
+}
+
+int pcapidx_add(struct PcapIdxBuilder *ib, unsigned long long offset, unsigned char *pkt, unsigned int caplen,
+                struct SpkTimeStamp *ts) {
+    struct FlowKey key;
+    unsigned long long max;
+    long long time;
+    long id;
+
+    time = (long long) ts->sec * 1000000000LL + (ts->prc == SPKSTAMP_NANO ? ts->nsec : ts->usec * 1000LL);
+
+    if (ib->nchecks == 0 || offset - ib->checks[ib->nchecks - 1].offset >= PCAPIDX_STEP) {
+        max = ib->maxchecks;
+        if (!__pcapidx_grow((void **) &ib->checks, &max, ib->nchecks, sizeof(struct PcapIdxCheck))) {
+            ib->failed = true;
+            return SPKSOCK_ENOMEM;
+        }
+        ib->maxchecks = (unsigned int) max;
+        ib->checks[ib->nchecks].time = time;
+        ib->checks[ib->nchecks++].offset = offset;
+    }
+
+    ib->packets++;
+    ib->covered = offset + PCAPIDX_PCAP_RECLEN + caplen;
+    if (!flow_dissect(pkt, caplen, ib->lktype, &key))
+        return SPKSOCK_SUCCESS;
+
+    if ((id = __pcapidx_flowid(ib, &key)) < 0) {
+        ib->failed = true;
+        return SPKSOCK_ENOMEM;
+    }
+
+    max = ib->maxoffsets;
+    if (!__pcapidx_grow((void **) &ib->offsets, &max, ib->noffsets, sizeof(unsigned long long))
+        || !__pcapidx_grow((void **) &ib->owners, &ib->maxoffsets, ib->noffsets, sizeof(unsigned int))) {
+        ib->failed = true;
+        return SPKSOCK_ENOMEM;
+    }
+    ib->offsets[ib->noffsets] = offset;
+    ib->owners[ib->noffsets++] = (unsigned int) id;
+    ib->flows[id].count++;
+    return SPKSOCK_SUCCESS;
+}
+
+int pcapidx_save(struct PcapIdxBuilder *ib, char *path) {
+    struct PcapIdxHeader hdr;
+    struct PcapIdxFlow *sorted;
+    unsigned long long *offsets;
+    unsigned long long *next;
+    unsigned long long pos;
+    unsigned int i;
+    FILE *fp;
+    int err = SPKSOCK_SUCCESS;
+
+    // An index missing records would return incomplete flows
+    if (ib->failed)
+        return SPKSOCK_ENOMEM;
+
+    sorted = malloc((ib->nflows + 1) * sizeof(struct PcapIdxFlow));
+    next = malloc((ib->nflows + 1) * sizeof(unsigned long long));
+    offsets = malloc((ib->noffsets + 1) * sizeof(unsigned long long));
+    if (sorted == NULL || next == NULL || offsets == NULL) {
+        free(sorted);
+        free(next);
+        free(offsets);
+        return SPKSOCK_ENOMEM;
+    }
+
+    // Sorts the flows, the builder id is kept in first until the offsets are placed
+    for (i = 0; i < ib->nflows; i++) {
+        sorted[i] = ib->flows[i];
+        sorted[i].first = i;
+    }
+    qsort(sorted, ib->nflows, sizeof(struct PcapIdxFlow), __pcapidx_cmpflow);
+    for (i = 0, pos = 0; i < ib->nflows; i++) {
+        next[sorted[i].first] = pos;
+        sorted[i].first = pos;
+        pos += sorted[i].count;
+    }
+    for (pos = 0; pos < ib->noffsets; pos++)
+        offsets[next[ib->owners[pos]]++] = ib->offsets[pos];
+
+    memset(&hdr, 0x00, sizeof(struct PcapIdxHeader));
+    hdr.magic = PCAPIDX_MAGIC;
+    hdr.version = PCAPIDX_VERSION;
+    hdr.covered = ib->covered;
+    hdr.packets = ib->packets;
+    hdr.nchecks = ib->nchecks;
+    hdr.nflows = ib->nflows;
+    hdr.noffsets = ib->noffsets;
+    hdr.checks_off = sizeof(struct PcapIdxHeader);
+    hdr.flows_off = hdr.checks_off + (unsigned long long) ib->nchecks * sizeof(struct PcapIdxCheck);
+    hdr.offsets_off = hdr.flows_off + (unsigned long long) ib->nflows * sizeof(struct PcapIdxFlow);
+
+    if ((fp = fopen(path, "wb")) == NULL)
+        err = __pcapidx_errno();
+    else {
+        if (fwrite(&hdr, sizeof(struct PcapIdxHeader), 1, fp) != 1
+            || fwrite(ib->checks, sizeof(struct PcapIdxCheck), ib->nchecks, fp) != ib->nchecks
+            || fwrite(sorted, sizeof(struct PcapIdxFlow), ib->nflows, fp) != ib->nflows
+            || fwrite(offsets, sizeof(unsigned long long), ib->noffsets, fp) != ib->noffsets)
+            err = SPKSOCK_ERROR;
+        if (fclose(fp) != 0)
+            err = SPKSOCK_ERROR;
+    }
+
+    free(sorted);
+    free(next);
+    free(offsets);
+    return err;
+}
+
+void pcapidx_free(struct PcapIdxBuilder *ib) {
+    if (ib == NULL)
+        return;
+    free(ib->checks);
+    free(ib->flows);
+    free(ib->slots);
+    free(ib->offsets);
+    free(ib->owners);
+    free(ib);
+}
+
+int pcapidx_build(char *pcap, char *path) {
+    struct PcapIdxBuilder *ib;
+    struct SpkTimeStamp ts;
+    unsigned char *base;
+    unsigned char *pkt;
+    unsigned long long size;
+    unsigned long long off;
+    long long time;
+    long caplen;
+    bool swap;
+    bool nsec;
+    int lktype;
+    int err;
+
+    if ((err = __pcapidx_map(pcap, &base, &size)) < 0)
+        return err;
+    madvise(base, size, MADV_SEQUENTIAL);
+
+    if (!__pcapidx_pcap(base, size, &swap, &nsec, &lktype)) {
+        munmap(base, size);
+        return SPKSOCK_ENOSUPPORT;
+    }
+
+    if ((err = pcapidx_new(lktype, &ib)) < 0) {
+        munmap(base, size);
+        return err;
+    }
+
+    ts.prc = SPKSTAMP_NANO;
+    off = PCAPIDX_PCAP_HDRLEN;
+    while ((caplen = __pcapidx_record(base, size, off, swap, nsec, &pkt, &time)) >= 0) {
+        ts.sec = (long) (time / 1000000000LL);
+        ts.nsec = (long) (time % 1000000000LL);
+        if ((err = pcapidx_add(ib, off, pkt, (unsigned int) caplen, &ts)) < 0)
+            break;
+        off += PCAPIDX_PCAP_RECLEN + caplen;
+    }
+
+    if (err == SPKSOCK_SUCCESS)
+        err = pcapidx_save(ib, path);
+    pcapidx_free(ib);
+    munmap(base, size);
+    return err;
+}
+
+int pcapidx_open(char *pcap, char *path, struct PcapIdx **idx) {
+    struct PcapIdx *ix;
+    struct PcapIdxHeader *hdr;
+    int err;
+
+    if (idx == NULL)
+        return SPKSOCK_ERROR;
+    if ((ix = calloc(1, sizeof(struct PcapIdx))) == NULL)
+        return SPKSOCK_ENOMEM;
+
+    if ((err = __pcapidx_map(pcap, &ix->base, &ix->size)) < 0) {
+        free(ix);
+        return err;
+    }
+    if ((err = __pcapidx_map(path, &ix->ibase, &ix->isize)) < 0) {
+        munmap(ix->base, ix->size);
+        free(ix);
+        return err;
+    }
+
+    // Lookups jump around the capture, read-ahead would only load unrelated pages
+    madvise(ix->base, ix->size, MADV_RANDOM);
+
+    hdr = (struct PcapIdxHeader *) ix->ibase;
+    if (!__pcapidx_pcap(ix->base, ix->size, &ix->swap, &ix->nsec, &ix->lktype)
+        || ix->isize < sizeof(struct PcapIdxHeader) || hdr->magic != PCAPIDX_MAGIC || hdr->version != PCAPIDX_VERSION
+        || hdr->covered > ix->size
+        || hdr->checks_off + (unsigned long long) hdr->nchecks * sizeof(struct PcapIdxCheck) > hdr->flows_off
+        || hdr->flows_off + (unsigned long long) hdr->nflows * sizeof(struct PcapIdxFlow) > hdr->offsets_off
+        || hdr->offsets_off + hdr->noffsets * sizeof(unsigned long long) > ix->isize) {
+        pcapidx_close(ix);
+        return SPKSOCK_ENOSUPPORT;
+    }
+
+    ix->hdr = hdr;
+    ix->checks = (struct PcapIdxCheck *) (ix->ibase + hdr->checks_off);
+    ix->flows = (struct PcapIdxFlow *) (ix->ibase + hdr->flows_off);
+    ix->offsets = (unsigned long long *) (ix->ibase + hdr->offsets_off);
+    *idx = ix;
+    return SPKSOCK_SUCCESS;
+}
+
+void pcapidx_time(struct PcapIdx *idx, struct SpkTimeStamp *from, struct SpkTimeStamp *to,
+                  struct PcapIdxCursor *cur) {
+    unsigned long long end = idx->size;
+    unsigned int lo = 0;
+    unsigned int hi = idx->hdr->nchecks;
+    unsigned int mid;
+    long page = sysconf(_SC_PAGESIZE);
+
+    memset(cur, 0x00, sizeof(struct PcapIdxCursor));
+    cur->from = (long long) from->sec * 1000000000LL
+                + (from->prc == SPKSTAMP_NANO ? from->nsec : from->usec * 1000LL);
+    cur->to = to == NULL ? LLONG_MAX : (long long) to->sec * 1000000000LL
+                                       + (to->prc == SPKSTAMP_NANO ? to->nsec : to->usec * 1000LL);
+
+    // Last checkpoint before from
+    while (lo < hi) {
+        mid = (lo + hi) >> 1;
+        if (idx->checks[mid].time < cur->from)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    cur->pos = lo == 0 ? PCAPIDX_PCAP_HDRLEN : idx->checks[lo - 1].offset;
+
+    // First checkpoint after to
+    for (hi = idx->hdr->nchecks; lo < hi;) {
+        mid = (lo + hi) >> 1;
+        if (idx->checks[mid].time <= cur->to)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo < idx->hdr->nchecks)
+        end = idx->checks[lo].offset;
+
+    // The range is read sequentially
+    madvise(idx->base + (cur->pos & ~(page - 1)), end - (cur->pos & ~(page - 1)), MADV_SEQUENTIAL);
+}
+
+unsigned long long pcapidx_flow(struct PcapIdx *idx, struct FlowKey *key, struct PcapIdxCursor *cur) {
+    struct FlowKey ckey = *key;
+    unsigned int lo = 0;
+    unsigned int hi = idx->hdr->nflows;
+    unsigned int mid;
+    unsigned int hash;
+
+    memset(cur, 0x00, sizeof(struct PcapIdxCursor));
+    memset(ckey.pad, 0x00, sizeof(ckey.pad));
+    flow_canonical(&ckey);
+    hash = flow_hash(&ckey);
+
+    while (lo < hi) {
+        mid = (lo + hi) >> 1;
+        if (idx->flows[mid].hash < hash)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    for (; lo < idx->hdr->nflows && idx->flows[lo].hash == hash; lo++) {
+        if (memcmp(&idx->flows[lo].key, &ckey, sizeof(struct FlowKey)) == 0) {
+            cur->offsets = idx->offsets + idx->flows[lo].first;
+            cur->count = idx->flows[lo].count;
+            return cur->count;
+        }
+    }
+    // Empty flow cursor
+    cur->offsets = idx->offsets;
+    return 0;
+}
+
+int pcapidx_next(struct PcapIdx *idx, struct PcapIdxCursor *cur, unsigned char **pkt, struct SpkTimeStamp *ts) {
+    unsigned long long off;
+    long long time;
+    long caplen;
+
+    for (;;) {
+        if (cur->offsets != NULL) {
+            if (cur->next >= cur->count)
+                return SPKSOCK_EOF;
+            off = cur->offsets[cur->next++];
+        } else {
+            off = cur->pos;
+        }
+
+        if ((caplen = __pcapidx_record(idx->base, idx->size, off, idx->swap, idx->nsec, pkt, &time)) < 0)
+            return SPKSOCK_EOF;
+
+        if (cur->offsets == NULL) {
+            cur->pos = off + PCAPIDX_PCAP_RECLEN + caplen;
+            if (time < cur->from)
+                continue;
+            if (time > cur->to) {
+                cur->pos = idx->size;
+                return SPKSOCK_EOF;
+            }
+        }
+        break;
+    }
+
+    if (ts != NULL) {
+        ts->sec = (long) (time / 1000000000LL);
+        ts->nsec = (long) (time % 1000000000LL);
+        ts->prc = SPKSTAMP_NANO;
+    }
+    return (int) caplen;
+}
+
+inline int pcapidx_lktype(struct PcapIdx *idx) {
+    return idx->lktype;
+}
+
+void pcapidx_close(struct PcapIdx *idx) {
+    if (idx == NULL)
+        return;
+    munmap(idx->base, idx->size);
+    munmap(idx->ibase, idx->isize);
+    free(idx);
+}
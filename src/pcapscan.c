@@ -0,0 +1,542 @@
+/*
+ * Copyright (c) 2017 Jacopo De Luca
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <pcapscan.h>
+
+#include "socket/spksock_common.h"
+
+#define PCAPSCAN_PCAP_MAGIC     0xA1B2C3D4
+#define PCAPSCAN_PCAP_NSEC      0xA1B23C4D
+#define PCAPSCAN_PCAP_HDRLEN    24
+#define PCAPSCAN_PCAP_RECLEN    16
+#define PCAPSCAN_MAXLEN         (1 << 20)   // Largest original length considered plausible
+#define PCAPSCAN_MAXSKEW        60          // Seconds a record can go back in time from the previous one
+#define PCAPSCAN_BATCH          64
+#define PCAPSCAN_END            (~0ULL)     // End of chunk marker
+
+/// @brief Sorted result reference (this struct is private).
+struct PcapScanEntry {
+    long long time;
+    unsigned long long off;
+};
+
+static int __pcapscan_errno() {
+    switch (errno) {
+        case EACCES:
+        case EPERM:
+            return SPKSOCK_EPERM;
+        case ENOENT:
+            return SPKSOCK_ENODEV;
+        case ENOMEM:
+            return SPKSOCK_ENOMEM;
+        default:
+            return SPKSOCK_ERROR;
+    }
+}
+
+static inline unsigned int __pcapscan_u32(struct PcapScan *scan, unsigned long long off) {
+    unsigned int val;
+
+    memcpy(&val, scan->base + off, sizeof(unsigned int));
+    return scan->swap ? __builtin_bswap32(val) : val;
+}
+
+// Parses the record at off, returns the captured length or -1 if the record is truncated
+static long __pcapscan_record(struct PcapScan *scan, unsigned long long off, struct SpkTimeStamp *ts) {
+    unsigned int caplen;
+
+    if (scan->size - off < PCAPSCAN_PCAP_RECLEN)
+        return -1;
+    if ((caplen = __pcapscan_u32(scan, off + 8)) > scan->size - off - PCAPSCAN_PCAP_RECLEN)
+        return -1;
+    if (ts != NULL) {
+        ts->sec = __pcapscan_u32(scan, off);
+        ts->nsec = __pcapscan_u32(scan, off + 4);
+        if (!scan->nsec)
+            ts->nsec *= 1000;
+        ts->usec = ts->nsec / 1000;
+        ts->prc = SPKSTAMP_NANO;
+    }
+    return caplen;
+}
+
+// Checks that PCAPSCAN_SYNC plausible records, or all the records up to the end of the file, start at off
+static bool __pcapscan_chain(struct PcapScan *scan, unsigned long long off) {
+    unsigned int frac = scan->nsec ? 1000000000 : 1000000;
+    unsigned long prev = scan->first;
+    unsigned long sec;
+    unsigned int caplen;
+    unsigned int len;
+
+    for (int i = 0; i < PCAPSCAN_SYNC; i++) {
+        if (off == scan->size)
+            return i > 0;
+        if (scan->size - off < PCAPSCAN_PCAP_RECLEN)
+            return false;
+        sec = __pcapscan_u32(scan, off);
+        caplen = __pcapscan_u32(scan, off + 8);
+        len = __pcapscan_u32(scan, off + 12);
+        if (len == 0 || caplen > scan->snaplen || caplen > len || len > PCAPSCAN_MAXLEN
+            || caplen > scan->size - off - PCAPSCAN_PCAP_RECLEN
+            || __pcapscan_u32(scan, off + 4) >= frac || sec < scan->first || sec + PCAPSCAN_MAXSKEW < prev)
+            return false;
+        prev = sec;
+        off += PCAPSCAN_PCAP_RECLEN + caplen;
+    }
+    return true;
+}
+
+// Returns the first record boundary at or after off
+static unsigned long long __pcapscan_sync(struct PcapScan *scan, unsigned long long off) {
+    for (; off < scan->size; off++) {
+        if (__pcapscan_chain(scan, off))
+            return off;
+    }
+    return scan->size;
+}
+
+static void __pcapscan_prefetch(struct PcapScan *scan, unsigned long long chunk) {
+    long page = sysconf(_SC_PAGESIZE);
+    unsigned long long start = scan->bounds[chunk] & ~(page - 1);
+
+    madvise(scan->base + start, scan->bounds[chunk + 1] - start, MADV_WILLNEED);
+}
+
+static inline bool __pcapscan_push(struct PcapScanQueue *q, unsigned long long val) {
+    unsigned int tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+
+    if (tail - atomic_load_explicit(&q->head, memory_order_acquire) == PCAPSCAN_QLEN)
+        return false;
+    q->slots[tail & (PCAPSCAN_QLEN - 1)] = val;
+    atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+    return true;
+}
+
+static inline bool __pcapscan_pop(struct PcapScanQueue *q, unsigned long long *val) {
+    unsigned int head = atomic_load_explicit(&q->head, memory_order_relaxed);
+
+    if (head == atomic_load_explicit(&q->tail, memory_order_acquire))
+        return false;
+    *val = q->slots[head & (PCAPSCAN_QLEN - 1)];
+    atomic_store_explicit(&q->head, head + 1, memory_order_release);
+    return true;
+}
+
+// Takes free chunks and processes them in the worker thread
+static void __pcapscan_chunks(struct PcapScanWorker *w) {
+    struct PcapScan *scan = w->scan;
+    struct SpkTimeStamp ts;
+    unsigned long long end;
+    long caplen;
+
+    while ((w->chunk = atomic_fetch_add(&scan->next, 1)) < scan->nchunks) {
+        __pcapscan_prefetch(scan, w->chunk);
+        end = scan->bounds[w->chunk + 1];
+        for (w->off = scan->bounds[w->chunk]; w->off < end; w->off += PCAPSCAN_PCAP_RECLEN + caplen) {
+            if ((caplen = __pcapscan_record(scan, w->off, &ts)) < 0)
+                break;
+            scan->on_packet(w->id, scan->base + w->off + PCAPSCAN_PCAP_RECLEN, (unsigned int) caplen, &ts,
+                            scan->arg);
+            w->packets++;
+        }
+        if (w->off != end)
+            w->resyncs++;
+    }
+}
+
+// Reads the worker's chunks (chunk, chunk + nw, ...) and sends each packet to the worker owning its flow
+static bool __pcapscan_produce(struct PcapScanWorker *w) {
+    struct PcapScan *scan = w->scan;
+    struct FlowKey key;
+    unsigned long long end;
+    unsigned int dst;
+    bool progress = false;
+    long caplen;
+
+    if (w->chunk >= scan->nchunks)
+        return false;
+
+    end = scan->bounds[w->chunk + 1];
+    for (int i = 0; i < PCAPSCAN_BATCH && w->off < end; i++) {
+        if ((caplen = __pcapscan_record(scan, w->off, NULL)) < 0) {
+            w->resyncs++;
+            w->off = end;
+            break;
+        }
+        dst = 0;
+        if (flow_dissect(scan->base + w->off + PCAPSCAN_PCAP_RECLEN, (unsigned int) caplen, scan->lktype, &key))
+            dst = flow_hash(&key) % scan->nw;
+        if (!__pcapscan_push(&scan->queues[w->id * scan->nw + dst], w->off))
+            return progress;
+        w->off += PCAPSCAN_PCAP_RECLEN + caplen;
+        progress = true;
+    }
+    if (w->off < end)
+        return progress;
+
+    // Every worker waits for the end of the chunk before moving to the next one
+    for (; w->mark < scan->nw; w->mark++) {
+        if (!__pcapscan_push(&scan->queues[w->id * scan->nw + w->mark], PCAPSCAN_END))
+            return progress;
+    }
+    if (w->off > end)
+        w->resyncs++;
+    w->mark = 0;
+    if ((w->chunk += scan->nw) < scan->nchunks) {
+        __pcapscan_prefetch(scan, w->chunk);
+        w->off = scan->bounds[w->chunk];
+    }
+    return true;
+}
+
+// Delivers the packets of the worker's flows, chunk after chunk to preserve the file order
+static bool __pcapscan_consume(struct PcapScanWorker *w) {
+    struct PcapScan *scan = w->scan;
+    struct SpkTimeStamp ts;
+    unsigned long long off;
+    bool progress = false;
+    long caplen;
+
+    for (int i = 0; i < PCAPSCAN_BATCH && w->cchunk < scan->nchunks; i++) {
+        if (!__pcapscan_pop(&scan->queues[(w->cchunk % scan->nw) * scan->nw + w->id], &off))
+            break;
+        progress = true;
+        if (off == PCAPSCAN_END) {
+            w->cchunk++;
+            continue;
+        }
+        caplen = __pcapscan_record(scan, off, &ts);
+        scan->on_packet(w->id, scan->base + off + PCAPSCAN_PCAP_RECLEN, (unsigned int) caplen, &ts, scan->arg);
+        w->packets++;
+    }
+    return progress;
+}
+
+static void *__pcapscan_worker(void *arg) {
+    struct PcapScanWorker *w = arg;
+    struct PcapScan *scan = w->scan;
+    bool produced;
+    bool consumed;
+
+    while (atomic_load(&scan->go) == 0)
+        sched_yield();
+    if (atomic_load(&scan->go) < 0)
+        return NULL;
+
+    if (!scan->byflow) {
+        __pcapscan_chunks(w);
+        return NULL;
+    }
+
+    // A worker that cannot push keeps consuming, the oldest chunk being read can always progress
+    w->chunk = w->id;
+    if (w->chunk < scan->nchunks) {
+        __pcapscan_prefetch(scan, w->chunk);
+        w->off = scan->bounds[w->chunk];
+    }
+    while (w->chunk < scan->nchunks || w->cchunk < scan->nchunks) {
+        produced = __pcapscan_produce(w);
+        consumed = __pcapscan_consume(w);
+        if (!produced && !consumed)
+            sched_yield();
+    }
+    return NULL;
+}
+
+static void __pcapscan_reset(struct PcapScan *scan) {
+    if (scan->workers != NULL) {
+        for (unsigned int i = 0; i < scan->nw; i++)
+            free(scan->workers[i].results);
+        free(scan->workers);
+    }
+    if (scan->queues != NULL) {
+        free(scan->queues[0].slots);
+        free(scan->queues);
+    }
+    free(scan->bounds);
+    scan->workers = NULL;
+    scan->queues = NULL;
+    scan->bounds = NULL;
+    scan->nchunks = 0;
+    scan->nw = 0;
+}
+
+static int __pcapscan_cmpentry(const void *a, const void *b) {
+    const struct PcapScanEntry *e1 = a;
+    const struct PcapScanEntry *e2 = b;
+
+    if (e1->time != e2->time)
+        return e1->time < e2->time ? -1 : 1;
+    return e1->off < e2->off ? -1 : e1->off > e2->off;
+}
+
+// Heap of workers ordered by the timestamp of their next result, ties broken by worker index
+static bool __pcapscan_before(struct PcapScanEntry **ent, unsigned long long *pos, unsigned int w1,
+                              unsigned int w2) {
+    long long t1 = ent[w1][pos[w1]].time;
+    long long t2 = ent[w2][pos[w2]].time;
+
+    return t1 < t2 || (t1 == t2 && w1 < w2);
+}
+
+static void __pcapscan_siftdown(unsigned int *heap, unsigned int len, unsigned int i, struct PcapScanEntry **ent,
+                                unsigned long long *pos) {
+    unsigned int min;
+    unsigned int tmp;
+
+    for (;;) {
+        min = i;
+        if (2 * i + 1 < len && __pcapscan_before(ent, pos, heap[2 * i + 1], heap[min]))
+            min = 2 * i + 1;
+        if (2 * i + 2 < len && __pcapscan_before(ent, pos, heap[2 * i + 2], heap[min]))
+            min = 2 * i + 2;
+        if (min == i)
+            return;
+        tmp = heap[i];
+        heap[i] = heap[min];
+        heap[min] = tmp;
+        i = min;
+    }
+}
+
+int pcapscan_open(char *path, struct PcapScan **scan) {
+    struct PcapScan *sc;
+    struct stat st;
+    unsigned int magic;
+    int fd;
+
+    if (scan == NULL)
+        return SPKSOCK_ERROR;
+    if ((fd = open(path, O_RDONLY)) < 0)
+        return __pcapscan_errno();
+    if (fstat(fd, &st) < 0 || st.st_size < PCAPSCAN_PCAP_HDRLEN) {
+        close(fd);
+        return SPKSOCK_ENOSUPPORT;
+    }
+    if ((sc = calloc(1, sizeof(struct PcapScan))) == NULL) {
+        close(fd);
+        return SPKSOCK_ENOMEM;
+    }
+    sc->size = (unsigned long long) st.st_size;
+    sc->base = mmap(NULL, sc->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (sc->base == MAP_FAILED) {
+        free(sc);
+        return __pcapscan_errno();
+    }
+
+    memcpy(&magic, sc->base, sizeof(unsigned int));
+    if (magic != PCAPSCAN_PCAP_MAGIC && magic != PCAPSCAN_PCAP_NSEC) {
+        magic = __builtin_bswap32(magic);
+        if (magic != PCAPSCAN_PCAP_MAGIC && magic != PCAPSCAN_PCAP_NSEC) {
+            munmap(sc->base, sc->size);
+            free(sc);
+            return SPKSOCK_ENOSUPPORT;
+        }
+        sc->swap = true;
+    }
+    sc->nsec = magic == PCAPSCAN_PCAP_NSEC;
+    sc->snaplen = __pcapscan_u32(sc, 16);
+    if (sc->snaplen == 0 || sc->snaplen > PCAPSCAN_MAXLEN)
+        sc->snaplen = PCAPSCAN_MAXLEN;
+    sc->lktype = __ssock_linktype_dlt(__pcapscan_u32(sc, 20) & 0xFFFF);
+    // Records older than the first one are not expected, used to reject false boundaries
+    if (sc->size - PCAPSCAN_PCAP_HDRLEN >= PCAPSCAN_PCAP_RECLEN)
+        sc->first = __pcapscan_u32(sc, PCAPSCAN_PCAP_HDRLEN);
+
+    madvise(sc->base, sc->size, MADV_SEQUENTIAL);
+    sc->chunk = PCAPSCAN_CHUNK;
+    atomic_init(&sc->next, 0);
+    atomic_init(&sc->go, 0);
+    *scan = sc;
+    return SPKSOCK_SUCCESS;
+}
+
+long long pcapscan_run(struct PcapScan *scan) {
+    unsigned long long chunk = scan->chunk < PCAPSCAN_MINCHUNK ? PCAPSCAN_MINCHUNK : scan->chunk;
+    unsigned long long *slots;
+    unsigned long long bound;
+    unsigned int nw = scan->nworkers;
+    unsigned int started;
+
+    if (scan->on_packet == NULL)
+        return SPKSOCK_ERROR;
+    if (nw == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        nw = cpus > 0 ? (unsigned int) cpus : 1;
+    }
+    if (nw > PCAPSCAN_MAXWORKERS)
+        nw = PCAPSCAN_MAXWORKERS;
+
+    __pcapscan_reset(scan);
+    scan->packets = 0;
+    scan->resyncs = 0;
+
+    scan->nchunks = (scan->size - PCAPSCAN_PCAP_HDRLEN + chunk - 1) / chunk;
+    if ((scan->bounds = malloc((scan->nchunks + 1) * sizeof(unsigned long long))) == NULL)
+        return SPKSOCK_ENOMEM;
+    scan->bounds[0] = PCAPSCAN_PCAP_HDRLEN;
+    for (unsigned long long i = 1; i < scan->nchunks; i++) {
+        bound = PCAPSCAN_PCAP_HDRLEN + i * chunk;
+        scan->bounds[i] = __pcapscan_sync(scan, bound > scan->bounds[i - 1] ? bound : scan->bounds[i - 1]);
+    }
+    scan->bounds[scan->nchunks] = scan->size;
+
+    if ((scan->workers = calloc(nw, sizeof(struct PcapScanWorker))) == NULL) {
+        __pcapscan_reset(scan);
+        return SPKSOCK_ENOMEM;
+    }
+    scan->nw = nw;
+    if (scan->byflow) {
+        if ((scan->queues = aligned_alloc(64, nw * nw * sizeof(struct PcapScanQueue))) == NULL
+            || (slots = malloc(nw * nw * PCAPSCAN_QLEN * sizeof(unsigned long long))) == NULL) {
+            free(scan->queues);
+            scan->queues = NULL;
+            __pcapscan_reset(scan);
+            return SPKSOCK_ENOMEM;
+        }
+        for (unsigned int i = 0; i < nw * nw; i++) {
+            atomic_init(&scan->queues[i].head, 0);
+            atomic_init(&scan->queues[i].tail, 0);
+            scan->queues[i].slots = slots + (unsigned long long) i * PCAPSCAN_QLEN;
+        }
+    }
+
+    // Workers start together, with byflow each one is needed by all the others
+    atomic_store(&scan->next, 0);
+    atomic_store(&scan->go, 0);
+    for (started = 0; started < nw; started++) {
+        scan->workers[started].scan = scan;
+        scan->workers[started].id = started;
+        if (pthread_create(&scan->workers[started].thread, NULL, __pcapscan_worker, &scan->workers[started]) != 0)
+            break;
+    }
+    atomic_store(&scan->go, started == nw ? 1 : -1);
+    for (unsigned int i = 0; i < started; i++) {
+        pthread_join(scan->workers[i].thread, NULL);
+        scan->packets += scan->workers[i].packets;
+        scan->resyncs += scan->workers[i].resyncs;
+    }
+    if (started != nw) {
+        __pcapscan_reset(scan);
+        return SPKSOCK_ERROR;
+    }
+    return (long long) scan->packets;
+}
+
+int pcapscan_emit(struct PcapScan *scan, unsigned int worker, struct SpkTimeStamp *ts, void *data,
+                  unsigned int len) {
+    struct PcapScanWorker *w = &scan->workers[worker];
+    struct PcapScanResult res;
+    unsigned long long need = sizeof(struct PcapScanResult) + ((len + 7ULL) & ~7ULL);
+    unsigned long long max;
+    unsigned char *tmp;
+
+    if (w->rmax - w->rlen < need) {
+        for (max = w->rmax == 0 ? 65536 : w->rmax; max - w->rlen < need; max <<= 1);
+        if ((tmp = realloc(w->results, max)) == NULL)
+            return SPKSOCK_ENOMEM;
+        w->results = tmp;
+        w->rmax = max;
+    }
+    res.time = (long long) ts->sec * 1000000000LL + (ts->prc == SPKSTAMP_NANO ? ts->nsec : ts->usec * 1000LL);
+    res.len = len;
+    res.pad = 0;
+    memcpy(w->results + w->rlen, &res, sizeof(struct PcapScanResult));
+    memcpy(w->results + w->rlen + sizeof(struct PcapScanResult), data, len);
+    w->rlen += need;
+    w->nresults++;
+    return SPKSOCK_SUCCESS;
+}
+
+long long pcapscan_merge(struct PcapScan *scan,
+                         void (*on_result)(struct SpkTimeStamp *ts, void *data, unsigned int len, void *arg),
+                         void *arg) {
+    struct PcapScanEntry *ent[PCAPSCAN_MAXWORKERS] = {NULL};
+    unsigned long long pos[PCAPSCAN_MAXWORKERS] = {0};
+    unsigned int heap[PCAPSCAN_MAXWORKERS];
+    unsigned int len = 0;
+    struct PcapScanWorker *w;
+    struct PcapScanResult res;
+    struct SpkTimeStamp ts;
+    long long delivered = 0;
+    unsigned long long off;
+    unsigned int i;
+
+    // Results of a worker are sorted on their own, then merged through a heap
+    for (i = 0; i < scan->nw; i++) {
+        w = &scan->workers[i];
+        if (w->nresults == 0)
+            continue;
+        if ((ent[i] = malloc(w->nresults * sizeof(struct PcapScanEntry))) == NULL) {
+            for (unsigned int j = 0; j < i; j++)
+                free(ent[j]);
+            return SPKSOCK_ENOMEM;
+        }
+        for (off = 0, pos[i] = 0; off < w->rlen; pos[i]++) {
+            memcpy(&res, w->results + off, sizeof(struct PcapScanResult));
+            ent[i][pos[i]].time = res.time;
+            ent[i][pos[i]].off = off;
+            off += sizeof(struct PcapScanResult) + ((res.len + 7ULL) & ~7ULL);
+        }
+        qsort(ent[i], w->nresults, sizeof(struct PcapScanEntry), __pcapscan_cmpentry);
+        pos[i] = 0;
+        heap[len++] = i;
+    }
+    for (i = len / 2; i-- > 0;)
+        __pcapscan_siftdown(heap, len, i, ent, pos);
+
+    ts.prc = SPKSTAMP_NANO;
+    while (len > 0) {
+        i = heap[0];
+        w = &scan->workers[i];
+        off = ent[i][pos[i]].off;
+        memcpy(&res, w->results + off, sizeof(struct PcapScanResult));
+        ts.sec = (long) (res.time / 1000000000LL);
+        ts.nsec = (long) (res.time % 1000000000LL);
+        ts.usec = ts.nsec / 1000;
+        on_result(&ts, w->results + off + sizeof(struct PcapScanResult), res.len, arg);
+        delivered++;
+        if (++pos[i] == w->nresults)
+            heap[0] = heap[--len];
+        __pcapscan_siftdown(heap, len, 0, ent, pos);
+    }
+
+    for (i = 0; i < scan->nw; i++)
+        free(ent[i]);
+    return delivered;
+}
+
+void pcapscan_close(struct PcapScan *scan) {
+    __pcapscan_reset(scan);
+    munmap(scan->base, scan->size);
+    free(scan);
+}
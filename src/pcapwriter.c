@@ -0,0 +1,452 @@
+/*
+ * Copyright (c) 2017 Jacopo De Luca
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <time.h>
+
+#include <pcapwriter.h>
+
+#include "socket/spksock_common.h"
+
+#ifndef O_DIRECT
+#define O_DIRECT 0
+#endif
+
+#define PCAPW_MAGIC_NSEC    0xA1B23C4D
+#define PCAPNG_SHB          0x0A0D0D0A
+#define PCAPNG_IDB          0x00000001
+#define PCAPNG_EPB          0x00000006
+#define PCAPNG_BOM          0x1A2B3C4D
+#define PCAPW_HDRLEN(fmt)   ((fmt) == PCAPW_PCAP ? 24 : 60)
+
+static inline unsigned char *__pcapw_buf(struct PcapWriter *writer, unsigned int idx) {
+    return writer->mem + (size_t) (idx % PCAPW_NBUFS) * PCAPW_BUFSIZE;
+}
+
+static void __pcapw_push(struct PcapWriter *writer, unsigned int flags) {
+    unsigned int head = atomic_load_explicit(&writer->head, memory_order_relaxed);
+
+    writer->lens[head % PCAPW_NBUFS] = writer->fill | flags;
+    writer->fill = 0;
+    atomic_store_explicit(&writer->head, head + 1, memory_order_release);
+    pthread_mutex_lock(&writer->lock);
+    pthread_cond_signal(&writer->wake);
+    pthread_mutex_unlock(&writer->lock);
+}
+
+static void __pcapw_put(struct PcapWriter *writer, const void *data, unsigned int len) {
+    const unsigned char *src = data;
+    unsigned int n;
+
+    while (len > 0) {
+        n = PCAPW_BUFSIZE - writer->fill;
+        if (n > len)
+            n = len;
+        memcpy(__pcapw_buf(writer, atomic_load_explicit(&writer->head, memory_order_relaxed)) + writer->fill, src, n);
+        writer->fill += n;
+        src += n;
+        len -= n;
+        if (writer->fill == PCAPW_BUFSIZE)
+            __pcapw_push(writer, 0);
+    }
+}
+
+static void __pcapw_store(struct PcapWriter *writer, unsigned char *buf, unsigned int len) {
+    unsigned int done = 0;
+    ssize_t n;
+
+    // The last buffer or one with a dropped header is not aligned, O_DIRECT must be dropped
+    if (writer->direct && (len % PCAPW_ALIGN != 0 || (uintptr_t) buf % PCAPW_ALIGN != 0)) {
+        fcntl(writer->fd, F_SETFL, fcntl(writer->fd, F_GETFL) & ~O_DIRECT);
+        writer->direct = false;
+    }
+
+    while (done < len) {
+        if ((n = pwrite(writer->fd, buf + done, len - done, (off_t) (writer->offset + done))) < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EINVAL && writer->direct) {
+                fcntl(writer->fd, F_SETFL, fcntl(writer->fd, F_GETFL) & ~O_DIRECT);
+                writer->direct = false;
+                continue;
+            }
+            atomic_fetch_add_explicit(&writer->errors, 1, memory_order_relaxed);
+            break;
+        }
+        done += n;
+    }
+    // Keeps the following buffers at their offset even if this one failed
+    writer->offset += len;
+    atomic_fetch_add_explicit(&writer->written, done, memory_order_relaxed);
+}
+
+static int __pcapw_file(struct PcapWriter *writer, unsigned int seq, bool *direct) {
+    char *name = writer->path;
+    int fd;
+
+    if (writer->name != NULL) {
+        sprintf(writer->name, "%s.%u", writer->path, seq);
+        name = writer->name;
+    }
+
+    // O_DIRECT is not supported by all file systems (e.g. tmpfs)
+    *direct = O_DIRECT != 0;
+    if ((fd = open(name, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644)) < 0 && errno == EINVAL) {
+        *direct = false;
+        fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    }
+    return fd;
+}
+
+static void __pcapw_prepare(struct PcapWriter *writer) {
+    if ((writer->nextfd = __pcapw_file(writer, writer->seq + 1, &writer->nextdirect)) < 0)
+        return;
+#ifdef __linux__
+    // Reserves the blocks without changing the file size, the excess is released when the file is completed
+    if (writer->maxsize > 0)
+        fallocate(writer->nextfd, FALLOC_FL_KEEP_SIZE, 0, (off_t) writer->maxsize);
+#endif
+}
+
+static bool __pcapw_switch(struct PcapWriter *writer) {
+    if (writer->nextfd < 0)
+        __pcapw_prepare(writer);
+    if (writer->nextfd < 0) {
+        // The records of the next file are appended to the current one
+        atomic_fetch_add_explicit(&writer->errors, 1, memory_order_relaxed);
+        return false;
+    }
+
+    ftruncate(writer->fd, (off_t) writer->offset);
+    close(writer->fd);
+    atomic_fetch_add_explicit(&writer->files, 1, memory_order_relaxed);
+
+    writer->fd = writer->nextfd;
+    writer->direct = writer->nextdirect;
+    writer->offset = 0;
+    writer->nextfd = -1;
+    writer->seq++;
+
+    if (writer->maxfiles > 0 && writer->seq >= writer->maxfiles) {
+        sprintf(writer->name, "%s.%u", writer->path, writer->seq - writer->maxfiles);
+        unlink(writer->name);
+    }
+    __pcapw_prepare(writer);
+    return true;
+}
+
+static void *__pcapw_thread(void *arg) {
+    struct PcapWriter *writer = arg;
+    unsigned int tail = atomic_load_explicit(&writer->tail, memory_order_relaxed);
+    unsigned int skip = 0;
+    unsigned char *buf;
+    unsigned int len;
+
+    if (writer->name != NULL)
+        __pcapw_prepare(writer);
+
+    for (;;) {
+        if (tail == atomic_load_explicit(&writer->head, memory_order_acquire)) {
+            pthread_mutex_lock(&writer->lock);
+            while (tail == atomic_load_explicit(&writer->head, memory_order_acquire) && !writer->stop)
+                pthread_cond_wait(&writer->wake, &writer->lock);
+            pthread_mutex_unlock(&writer->lock);
+            if (tail == atomic_load_explicit(&writer->head, memory_order_acquire))
+                break; // Stopped and drained
+            continue;
+        }
+        len = writer->lens[tail % PCAPW_NBUFS];
+        buf = __pcapw_buf(writer, tail);
+        // The next buffer starts with the header of the file that could not be opened
+        __pcapw_store(writer, buf + skip, (len & ~PCAPW_LAST) - skip);
+        skip = 0;
+        if ((len & PCAPW_LAST) != 0 && !__pcapw_switch(writer))
+            skip = PCAPW_HDRLEN(writer->format);
+        atomic_store_explicit(&writer->tail, ++tail, memory_order_release);
+    }
+    return NULL;
+}
+
+static void __pcapw_header(struct PcapWriter *writer) {
+    unsigned short linktype = (unsigned short) __ssock_dlt_linktype(writer->lktype);
+    unsigned int shb[7] = {PCAPNG_SHB, 28, PCAPNG_BOM, 0, 0xFFFFFFFF, 0xFFFFFFFF, 28};
+    unsigned char idb[32];
+    struct {
+        unsigned int magic;
+        unsigned short major;
+        unsigned short minor;
+        int thiszone;
+        unsigned int sigfigs;
+        unsigned int snaplen;
+        unsigned int linktype;
+    } ghdr = {PCAPW_MAGIC_NSEC, 2, 4, 0, 0, writer->snaplen, linktype};
+    unsigned short word[2];
+    unsigned int dword;
+
+    if (writer->format == PCAPW_PCAP) {
+        __pcapw_put(writer, &ghdr, 24);
+        return;
+    }
+
+    // Section header block, version 1.0, section length not specified
+    word[0] = 1;
+    word[1] = 0;
+    memcpy(shb + 3, word, 4);
+    __pcapw_put(writer, shb, sizeof(shb));
+
+    // Interface description block with if_tsresol = 9 (nanoseconds)
+    memset(idb, 0x00, sizeof(idb));
+    dword = PCAPNG_IDB;
+    memcpy(idb, &dword, 4);
+    dword = sizeof(idb);
+    memcpy(idb + 4, &dword, 4);
+    memcpy(idb + 28, &dword, 4);
+    memcpy(idb + 8, &linktype, 2);
+    memcpy(idb + 12, &writer->snaplen, 4);
+    word[0] = 9;
+    word[1] = 1;
+    memcpy(idb + 16, word, 4);
+    idb[20] = 9;
+    __pcapw_put(writer, idb, sizeof(idb));
+}
+
+static int __pcapw_open(char *path, enum PcapwFormat format, int lktype, unsigned int snaplen, bool ring,
+                        struct PcapWriter **writer) {
+    struct PcapWriter *pw;
+    int err;
+
+    if (path == NULL || writer == NULL)
+        return SPKSOCK_ERROR;
+
+    if ((pw = calloc(1, sizeof(struct PcapWriter))) == NULL)
+        return SPKSOCK_ENOMEM;
+
+    pw->nextfd = -1;
+    if ((pw->path = strdup(path)) == NULL
+        || (ring && (pw->name = malloc(strlen(path) + 12)) == NULL)
+        || posix_memalign((void **) &pw->mem, PCAPW_ALIGN, (size_t) PCAPW_NBUFS * PCAPW_BUFSIZE) != 0) {
+        free(pw->path);
+        free(pw->name);
+        free(pw);
+        return SPKSOCK_ENOMEM;
+    }
+
+    if ((pw->fd = __pcapw_file(pw, 0, &pw->direct)) < 0) {
+        switch (errno) {
+            case EACCES:
+            case EPERM:
+                err = SPKSOCK_EPERM;
+                break;
+            case ENOMEM:
+                err = SPKSOCK_ENOMEM;
+                break;
+            default:
+                err = SPKSOCK_ERROR;
+        }
+        free(pw->mem);
+        free(pw->path);
+        free(pw->name);
+        free(pw);
+        return err;
+    }
+
+    pw->format = format;
+    pw->lktype = lktype;
+    pw->snaplen = snaplen == 0 ? PCAPW_SNAPLEN : snaplen;
+    pthread_mutex_init(&pw->lock, NULL);
+    pthread_cond_init(&pw->wake, NULL);
+    __pcapw_header(pw);
+    pw->fbytes = PCAPW_HDRLEN(format);
+    *writer = pw;
+    return SPKSOCK_SUCCESS;
+}
+
+static int __pcapw_start(struct PcapWriter *writer) {
+    if (pthread_create(&writer->thread, NULL, __pcapw_thread, writer) != 0) {
+        pthread_mutex_destroy(&writer->lock);
+        pthread_cond_destroy(&writer->wake);
+        close(writer->fd);
+        free(writer->mem);
+        free(writer->path);
+        free(writer->name);
+        free(writer);
+        return SPKSOCK_ERROR;
+    }
+    return SPKSOCK_SUCCESS;
+}
+
+int pcapw_open(char *path, enum PcapwFormat format, int lktype, unsigned int snaplen, struct PcapWriter **writer) {
+    int err;
+
+    if ((err = __pcapw_open(path, format, lktype, snaplen, false, writer)) < 0)
+        return err;
+    return __pcapw_start(*writer);
+}
+
+int pcapw_open_ring(char *path, enum PcapwFormat format, int lktype, unsigned int snaplen, unsigned long long maxsize,
+                    unsigned int maxsecs, unsigned int maxfiles, struct PcapWriter **writer) {
+    int err;
+
+    if ((err = __pcapw_open(path, format, lktype, snaplen, true, writer)) < 0)
+        return err;
+    (*writer)->maxsize = maxsize;
+    (*writer)->maxsecs = maxsecs;
+    (*writer)->maxfiles = maxfiles;
+    return __pcapw_start(*writer);
+}
+
+unsigned int pcapw_write(struct PcapWriter *writer, unsigned char *pkt, unsigned int len, struct SpkTimeStamp *ts) {
+    static const unsigned char pad[4] = {0};
+    struct timespec now;
+    unsigned long long nsec;
+    unsigned int queued;
+    unsigned int caplen;
+    unsigned int reclen;
+    unsigned long long avail;
+    unsigned int rec[7];
+    long sec;
+    bool roll;
+
+    if (ts == NULL) {
+        clock_gettime(CLOCK_REALTIME, &now);
+        nsec = (unsigned long long) now.tv_sec * 1000000000ULL + now.tv_nsec;
+    } else
+        nsec = (unsigned long long) ts->sec * 1000000000ULL
+               + (ts->prc == SPKSTAMP_NANO ? (unsigned long long) ts->nsec : ts->usec * 1000ULL);
+
+    caplen = len > writer->snaplen ? writer->snaplen : len;
+    reclen = writer->format == PCAPW_PCAP ? 16 + caplen : 32 + ((caplen + 3) & ~3U);
+    sec = (long) (nsec / 1000000000ULL);
+
+    // A file contains at least one record
+    roll = false;
+    if (writer->name != NULL && writer->fbytes > PCAPW_HDRLEN(writer->format)) {
+        roll = (writer->maxsize > 0 && writer->fbytes + reclen > writer->maxsize)
+               || (writer->maxsecs > 0 && sec >= writer->fstart + (long) writer->maxsecs);
+    }
+
+    // Room left in the current buffer plus the free ones, the last byte must not complete a buffer
+    // that has no successor. When rolling the current buffer is queued as it is.
+    queued = atomic_load_explicit(&writer->head, memory_order_relaxed)
+             - atomic_load_explicit(&writer->tail, memory_order_acquire);
+    avail = (unsigned long long) (PCAPW_NBUFS - 1 - queued) * PCAPW_BUFSIZE;
+    if (!roll)
+        avail += PCAPW_BUFSIZE - writer->fill;
+    if (reclen + (roll ? PCAPW_HDRLEN(writer->format) : 0) >= avail) {
+        atomic_fetch_add_explicit(&writer->dropped, 1, memory_order_relaxed);
+        return 0;
+    }
+
+    if (roll) {
+        __pcapw_push(writer, PCAPW_LAST);
+        __pcapw_header(writer);
+        writer->fbytes = PCAPW_HDRLEN(writer->format);
+    }
+    if (writer->fbytes == PCAPW_HDRLEN(writer->format))
+        writer->fstart = sec;
+    if (writer->index != NULL) {
+        struct SpkTimeStamp its = {.sec = sec, .nsec = (long) (nsec % 1000000000ULL), .prc = SPKSTAMP_NANO};
+        // A failure is latched by the builder and reported by pcapidx_save
+        pcapidx_add(writer->index, writer->fbytes, pkt, caplen, &its);
+    }
+    writer->fbytes += reclen;
+
+    if (writer->format == PCAPW_PCAP) {
+        rec[0] = (unsigned int) (nsec / 1000000000ULL);
+        rec[1] = (unsigned int) (nsec % 1000000000ULL);
+        rec[2] = caplen;
+        rec[3] = len;
+        __pcapw_put(writer, rec, 16);
+        __pcapw_put(writer, pkt, caplen);
+    } else {
+        rec[0] = PCAPNG_EPB;
+        rec[1] = reclen;
+        rec[2] = 0;
+        rec[3] = (unsigned int) (nsec >> 32);
+        rec[4] = (unsigned int) nsec;
+        rec[5] = caplen;
+        rec[6] = len;
+        __pcapw_put(writer, rec, 28);
+        __pcapw_put(writer, pkt, caplen);
+        __pcapw_put(writer, pad, ((caplen + 3) & ~3U) - caplen);
+        __pcapw_put(writer, &reclen, 4);
+    }
+    atomic_fetch_add_explicit(&writer->packets, 1, memory_order_relaxed);
+    return reclen;
+}
+
+int pcapw_setindex(struct PcapWriter *writer, struct PcapIdxBuilder *ib) {
+    if (writer->format != PCAPW_PCAP || writer->name != NULL)
+        return SPKSOCK_ENOSUPPORT;
+    writer->index = ib;
+    return SPKSOCK_SUCCESS;
+}
+
+int pcapw_close(struct PcapWriter *writer) {
+    int err;
+
+    if (writer == NULL)
+        return SPKSOCK_ENINIT;
+
+    // The current buffer is always free to be queued
+    if (writer->fill > 0)
+        __pcapw_push(writer, 0);
+
+    pthread_mutex_lock(&writer->lock);
+    writer->stop = true;
+    pthread_cond_signal(&writer->wake);
+    pthread_mutex_unlock(&writer->lock);
+    pthread_join(writer->thread, NULL);
+
+    if (writer->name != NULL)
+        ftruncate(writer->fd, (off_t) writer->offset);
+    err = close(writer->fd) < 0 || writer->errors > 0 ? SPKSOCK_ERROR : SPKSOCK_SUCCESS;
+    if (writer->nextfd >= 0) {
+        // Removes the file prepared in advance
+        close(writer->nextfd);
+        sprintf(writer->name, "%s.%u", writer->path, writer->seq + 1);
+        unlink(writer->name);
+    }
+    pthread_mutex_destroy(&writer->lock);
+    pthread_cond_destroy(&writer->wake);
+    free(writer->mem);
+    free(writer->path);
+    free(writer->name);
+    free(writer);
+    return err;
+}
+
+void pcapw_stats(struct PcapWriter *writer, struct PcapwStats *stats) {
+    stats->packets = atomic_load_explicit(&writer->packets, memory_order_relaxed);
+    stats->dropped = atomic_load_explicit(&writer->dropped, memory_order_relaxed);
+    stats->written = atomic_load_explicit(&writer->written, memory_order_relaxed);
+    stats->errors = atomic_load_explicit(&writer->errors, memory_order_relaxed);
+    stats->files = atomic_load_explicit(&writer->files, memory_order_relaxed);
+}
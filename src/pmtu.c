@@ -0,0 +1,348 @@
+/*
+ * Copyright (c) 2017 Jacopo De Luca
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <net/if.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+
+#include <datatype.h>
+#include <ethernet.h>
+#include <ipv4.h>
+#include <icmp4.h>
+#include <spkrand.h>
+#include <pmtu.h>
+
+#define PMTU_FRAGNEEDED     4       // ICMPTY_DST_UNREACHABLE code
+#define IPV4_FRAGOFF_MASK   0x1FFF
+
+// RFC 1191 plateau table, used when the router does not report the next-hop MTU
+static const unsigned short __pmtu_plateaus[] = {32000, 17914, 8166, 4352, 2002, 1492, 1006, 508, 296, PMTU_MINMTU};
+
+static unsigned long long __pmtu_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static inline unsigned int __pmtu_hash(struct PmtuCache *cache, unsigned int ip) {
+    unsigned int h = ip * 0x9E3779B1U;
+    return (h ^ (h >> 16)) & cache->mask;
+}
+
+static struct PmtuEntry **__pmtu_find(struct PmtuCache *cache, unsigned int ip) {
+    struct PmtuEntry **curr = &cache->table[__pmtu_hash(cache, ip)];
+    for (; *curr != NULL && (*curr)->ip.ip != ip; curr = &(*curr)->next);
+    return curr;
+}
+
+static struct PmtuEntry *__pmtu_insert(struct PmtuCache *cache, unsigned int ip) {
+    struct PmtuEntry **head = &cache->table[__pmtu_hash(cache, ip)];
+    struct PmtuEntry *entry;
+
+    if ((entry = (struct PmtuEntry *) calloc(1, sizeof(struct PmtuEntry))) == NULL)
+        return NULL;
+    entry->ip.ip = ip;
+    entry->next = *head;
+    *head = entry;
+    cache->count++;
+    return entry;
+}
+
+static unsigned short __pmtu_linkmtu(struct SpkSock *ssock) {
+    struct ifreq req;
+    int ctl_sock;
+    unsigned short mtu = PMTU_DEFLINKMTU;
+
+    memset(&req, 0x00, sizeof(struct ifreq));
+    strncpy(req.ifr_name, ssock->iface_name, IFNAMSIZ - 1);
+    if ((ctl_sock = socket(AF_INET, SOCK_DGRAM, 0)) >= 0) {
+        if (ioctl(ctl_sock, SIOCGIFMTU, &req) >= 0 && req.ifr_mtu >= PMTU_MINMTU)
+            mtu = (unsigned short) (req.ifr_mtu > IPV4MAXSIZE ? IPV4MAXSIZE : req.ifr_mtu);
+        close(ctl_sock);
+    }
+    return mtu;
+}
+
+static void __pmtu_expired(struct TimerNode *node, void *arg);
+
+static void __pmtu_send(struct PmtuCache *cache, struct PmtuEntry *entry) {
+    struct Ipv4Header *ipv4 = (struct Ipv4Header *) (cache->frame + ETHHDRSIZE);
+    struct IcmpHeader *icmp = (struct IcmpHeader *) ipv4->data;
+    unsigned short paysize = (unsigned short) (entry->probe - IPV4HDRSIZE - ICMP4HDRSIZE);
+
+    entry->sqn = cache->next_sqn++;
+    entry->tries++;
+    // injects_ipv4_header sets Don't Fragment, the payload is all zeros and does not change the checksum
+    injects_ipv4_header((unsigned char *) ipv4, &cache->ipaddr, &entry->ip, IPV4DEFIHL, ipv4_mkid(),
+                        (unsigned short) (ICMP4HDRSIZE + paysize), IPV4DEFTTL, IPPROTO_ICMP);
+    injects_icmp4_echo_request((unsigned char *) icmp, cache->id, entry->sqn);
+    icmp->chksum = icmp4_checksum(icmp, 0);
+    spark_write(cache->ssock, cache->frame, ETHHDRSIZE + entry->probe);
+    cache->stats.probes++;
+    twheel_add(&cache->wheel, &entry->timer, __pmtu_now() + cache->timeout, __pmtu_expired, cache);
+}
+
+static void __pmtu_complete(struct PmtuCache *cache, struct PmtuEntry *entry, enum PmtuState state) {
+    twheel_del(&cache->wheel, &entry->timer);
+    if (entry->state == PMTU_SEARCHING)
+        cache->searching--;
+    entry->state = state;
+    entry->mtu = state == PMTU_DONE ? entry->lo : 0;
+    entry->expires = __pmtu_now() + cache->expiry;
+    cache->updates++;
+    if (cache->on_update != NULL)
+        cache->on_update(entry, cache->arg);
+}
+
+static void __pmtu_next(struct PmtuCache *cache, struct PmtuEntry *entry, unsigned short hint) {
+    unsigned short lo = entry->lo < PMTU_MINMTU ? PMTU_MINMTU - 1 : entry->lo;
+
+    if (entry->hi < PMTU_MINMTU) {
+        __pmtu_complete(cache, entry, PMTU_FAILED);
+        return;
+    }
+    if (entry->lo >= PMTU_MINMTU && (entry->lo == entry->hi || entry->hi - entry->lo < cache->granularity)) {
+        __pmtu_complete(cache, entry, PMTU_DONE);
+        return;
+    }
+    // The size suggested by the router (or by the plateau table) is tried first, then bisection
+    if (hint > lo && hint <= entry->hi)
+        entry->probe = hint;
+    else
+        entry->probe = (unsigned short) ((lo + entry->hi + 1) / 2);
+    if (entry->probe < IPV4HDRSIZE + ICMP4HDRSIZE)
+        entry->probe = IPV4HDRSIZE + ICMP4HDRSIZE;
+    entry->tries = 0;
+    __pmtu_send(cache, entry);
+}
+
+static unsigned short __pmtu_plateau(unsigned short size) {
+    for (unsigned int i = 0; i < sizeof(__pmtu_plateaus) / sizeof(unsigned short); i++)
+        if (__pmtu_plateaus[i] < size)
+            return __pmtu_plateaus[i];
+    return 0;
+}
+
+static void __pmtu_expired(struct TimerNode *node, void *arg) {
+    struct PmtuCache *cache = (struct PmtuCache *) arg;
+    struct PmtuEntry *entry = (struct PmtuEntry *) node;
+
+    cache->stats.lost++;
+    if (entry->tries < cache->max_tries) {
+        __pmtu_send(cache, entry);
+        return;
+    }
+    // ICMP filtered somewhere: a repeatedly lost probe is considered too big
+    entry->hi = (unsigned short) (entry->probe - 1);
+    __pmtu_next(cache, entry, 0);
+}
+
+static bool __pmtu_fragneeded(struct PmtuCache *cache, struct IcmpHeader *icmp, unsigned int len) {
+    struct Ipv4Header *qip = (struct Ipv4Header *) icmp->data;
+    struct IcmpHeader *qicmp;
+    struct PmtuEntry *entry;
+    unsigned short mtu = ntohs(icmp->mtu.mtu);
+    unsigned short qlen;
+    unsigned int qhlen;
+
+    if (len < ICMP4HDRSIZE + IPV4HDRSIZE || qip->saddr != cache->ipaddr.ip)
+        return false;
+    qhlen = (unsigned int) qip->ihl << 2;
+    qlen = ntohs(qip->len);
+    // Old routers report 0 (RFC 1191), bogus values larger than the dropped datagram are ignored as well
+    if (mtu < PMTU_MINMTU || mtu >= qlen)
+        mtu = 0;
+    cache->stats.fragneeded++;
+
+    entry = *__pmtu_find(cache, qip->daddr);
+    if (entry != NULL && entry->state == PMTU_SEARCHING) {
+        qicmp = (struct IcmpHeader *) (icmp->data + qhlen);
+        if (qhlen < IPV4HDRSIZE || len < ICMP4HDRSIZE + qhlen + ICMP4HDRSIZE || qip->protocol != IPPROTO_ICMP
+            || qicmp->type != ICMPTY_ECHO_REQUEST || ntohs(qicmp->echo.id) != cache->id
+            || ntohs(qicmp->echo.sqn) != entry->sqn)
+            return false;
+        twheel_del(&cache->wheel, &entry->timer);
+        entry->hi = mtu != 0 ? mtu : (unsigned short) (entry->probe - 1);
+        __pmtu_next(cache, entry, mtu != 0 ? mtu : __pmtu_plateau(entry->probe));
+        return true;
+    }
+
+    // Our own traffic hit a smaller link, records it without probing
+    if (mtu == 0)
+        mtu = __pmtu_plateau(qlen);
+    if (entry == NULL && (entry = __pmtu_insert(cache, qip->daddr)) == NULL)
+        return false;
+    if (entry->state == PMTU_DONE && entry->mtu <= mtu && entry->expires > __pmtu_now())
+        return true;
+    entry->lo = mtu;
+    entry->hi = mtu;
+    __pmtu_complete(cache, entry, PMTU_DONE);
+    return true;
+}
+
+bool pmtu_discover(struct PmtuCache *cache, struct netaddr_ip *dst) {
+    struct PmtuEntry *entry = *__pmtu_find(cache, dst->ip);
+
+    if (entry == NULL) {
+        if ((entry = __pmtu_insert(cache, dst->ip)) == NULL)
+            return false;
+    } else if (entry->state == PMTU_SEARCHING || (entry->state == PMTU_DONE && entry->expires > __pmtu_now()))
+        return true;
+
+    entry->state = PMTU_SEARCHING;
+    entry->lo = 0;
+    entry->hi = cache->link_mtu;
+    cache->searching++;
+    // The link MTU is the most likely answer, tries it first
+    __pmtu_next(cache, entry, cache->link_mtu);
+    return true;
+}
+
+bool pmtu_input(struct PmtuCache *cache, unsigned char *frame, unsigned int len) {
+    struct EthHeader *eth = (struct EthHeader *) frame;
+    struct Ipv4Header *ipv4 = (struct Ipv4Header *) eth->data;
+    struct IcmpHeader *icmp;
+    struct PmtuEntry *entry;
+    unsigned int hlen;
+    unsigned int plen;
+
+    if (len < ETHHDRSIZE + IPV4HDRSIZE + ICMP4HDRSIZE || eth->eth_type != htons(ETHTYPE_IP))
+        return false;
+    hlen = (unsigned int) ipv4->ihl << 2;
+    plen = ntohs(ipv4->len);
+    if (ipv4->protocol != IPPROTO_ICMP || ipv4->daddr != cache->ipaddr.ip || hlen < IPV4HDRSIZE
+        || plen < hlen + ICMP4HDRSIZE || plen > len - ETHHDRSIZE)
+        return false;
+    // Only the first fragment carries the ICMP header
+    if ((ntohs(ipv4->frag_off) & IPV4_FRAGOFF_MASK) != 0)
+        return false;
+    icmp = (struct IcmpHeader *) (eth->data + hlen);
+
+    if (icmp->type == ICMPTY_DST_UNREACHABLE && icmp->code == PMTU_FRAGNEEDED)
+        return __pmtu_fragneeded(cache, icmp, plen - hlen);
+    if (icmp->type != ICMPTY_ECHO_REPLY || ntohs(icmp->echo.id) != cache->id)
+        return false;
+    entry = *__pmtu_find(cache, ipv4->saddr);
+    if (entry == NULL || entry->state != PMTU_SEARCHING || ntohs(icmp->echo.sqn) != entry->sqn)
+        return false;
+    // The reply may come back fragmented, what matters is that the request went through unfragmented
+    twheel_del(&cache->wheel, &entry->timer);
+    cache->stats.confirmed++;
+    entry->lo = entry->probe;
+    __pmtu_next(cache, entry, 0);
+    return true;
+}
+
+unsigned short pmtu_lookup(struct PmtuCache *cache, struct netaddr_ip *dst) {
+    struct PmtuEntry *entry = *__pmtu_find(cache, dst->ip);
+
+    if (entry == NULL || entry->state != PMTU_DONE || entry->expires <= __pmtu_now())
+        return 0;
+    return entry->mtu;
+}
+
+int pmtu_poll(struct PmtuCache *cache, int timeout) {
+    struct pollfd pfd;
+    unsigned int updates = cache->updates;
+    int len;
+
+    pfd.fd = cache->ssock->sfd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    poll(&pfd, 1, timeout);
+    while ((len = spark_read(cache->ssock, cache->rxbuf, NULL)) > 0)
+        pmtu_input(cache, cache->rxbuf, (unsigned int) len);
+    if (len < 0 && len != SPKSOCK_EINTR)
+        return len;
+    twheel_advance(&cache->wheel, __pmtu_now());
+    return (int) (cache->updates - updates);
+}
+
+struct PmtuCache *pmtu_new(struct SpkSock *ssock, struct netaddr_ip *src, struct netaddr_mac *nexthop,
+                           unsigned int size) {
+    struct PmtuCache *cache;
+    unsigned int buckets = 1;
+
+    for (size = size == 0 ? PMTU_DEFSIZE : size; buckets < size; buckets <<= 1);
+
+    if ((cache = (struct PmtuCache *) calloc(1, sizeof(struct PmtuCache))) == NULL)
+        return NULL;
+    cache->table = (struct PmtuEntry **) calloc(buckets, sizeof(struct PmtuEntry *));
+    cache->frame = (unsigned char *) calloc(1, ETHHDRSIZE + IPV4MAXSIZE);
+    cache->rxbuf = (unsigned char *) malloc(ssock->bufl);
+    if (cache->table == NULL || cache->frame == NULL || cache->rxbuf == NULL) {
+        pmtu_free(cache);
+        return NULL;
+    }
+    cache->mask = buckets - 1;
+    cache->ssock = ssock;
+    cache->hwaddr = ssock->iaddr;
+    cache->nexthop = *nexthop;
+    cache->ipaddr = *src;
+    cache->link_mtu = __pmtu_linkmtu(ssock);
+    cache->id = (unsigned short) spkrand_u32();
+    cache->expiry = PMTU_DEFEXPIRY;
+    cache->timeout = PMTU_DEFTIMEOUT;
+    cache->max_tries = PMTU_DEFTRIES;
+    cache->granularity = PMTU_DEFGRANULARITY;
+    cache->next_sqn = (unsigned short) spkrand_u32();
+    twheel_init(&cache->wheel, __pmtu_now());
+    injects_ethernet_header(cache->frame, &cache->hwaddr, &cache->nexthop, ETHTYPE_IP);
+    spark_setnblock(ssock, true);
+    return cache;
+}
+
+void pmtu_del(struct PmtuCache *cache, struct netaddr_ip *dst) {
+    struct PmtuEntry **link = __pmtu_find(cache, dst->ip);
+    struct PmtuEntry *entry = *link;
+
+    if (entry == NULL)
+        return;
+    twheel_del(&cache->wheel, &entry->timer);
+    if (entry->state == PMTU_SEARCHING)
+        cache->searching--;
+    *link = entry->next;
+    free(entry);
+    cache->count--;
+}
+
+void pmtu_free(struct PmtuCache *cache) {
+    struct PmtuEntry *entry;
+
+    if (cache == NULL)
+        return;
+    for (unsigned int i = 0; cache->table != NULL && i <= cache->mask; i++) {
+        while ((entry = cache->table[i]) != NULL) {
+            cache->table[i] = entry->next;
+            free(entry);
+        }
+    }
+    free(cache->table);
+    free(cache->frame);
+    free(cache->rxbuf);
+    free(cache);
+}
@@ -0,0 +1,267 @@
+/*
+ * Copyright (c) 2017 Jacopo De Luca
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <replay.h>
+
+/// @brief Position in the schedule (this struct is private).
+struct ReplaySched {
+    unsigned long long start;
+    unsigned long long offset;
+    unsigned long long count;
+    unsigned long long bits;
+};
+
+static inline unsigned long long __replay_now() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void __replay_sleep_until(unsigned long long deadline) {
+    struct timespec ts;
+
+    ts.tv_sec = (time_t) (deadline / 1000000000ULL);
+    ts.tv_nsec = (long) (deadline % 1000000000ULL);
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
+// Sleeps until spin ns before the deadline, then busy-waits: wakeup latency of the scheduler is hidden
+static void __replay_wait(struct Replay *replay, unsigned long long deadline) {
+    if (deadline > __replay_now() + replay->spin)
+        __replay_sleep_until(deadline - replay->spin);
+    if (replay->spin > 0) {
+        while (__replay_now() < deadline);
+    }
+}
+
+// Splits the product to avoid overflows: value * 1e9 / rate
+static inline unsigned long long __replay_scale(unsigned long long value, unsigned long long rate) {
+    return value / rate * 1000000000ULL + value % rate * 1000000000ULL / rate;
+}
+
+// Returns the due time of pkt when it is the next packet of the schedule
+static unsigned long long __replay_due(struct Replay *replay, struct ReplaySched *sc, struct ReplayPkt *pkt) {
+    long long elapsed;
+
+    switch (replay->mode) {
+        case REPLAY_TIMED:
+            // Timestamps going back are sent immediately
+            elapsed = pkt->time - replay->pkts[0].time;
+            return sc->start + sc->offset + (elapsed > 0 ? (unsigned long long) (elapsed / replay->speed) : 0);
+        case REPLAY_PPS:
+            return sc->start + __replay_scale(sc->count, replay->rate);
+        case REPLAY_BPS:
+            return sc->start + __replay_scale(sc->bits, replay->rate);
+        default:
+            return 0;
+    }
+}
+
+int replay_open(char *path, struct SpkSock *tx, struct Replay **replay) {
+    struct Replay *rp;
+    struct SpkSock *file;
+    struct SpkTimeStamp ts;
+    struct ReplayPkt *tmp;
+    struct stat st;
+    unsigned long long max = 0;
+    unsigned char *pkt;
+    int len;
+
+    if (tx == NULL || replay == NULL)
+        return SPKSOCK_ERROR;
+    if (stat(path, &st) < 0)
+        return errno == ENOENT ? SPKSOCK_ENODEV : SPKSOCK_ERROR;
+    if ((len = spark_openfile(path, 0, &file)) < 0)
+        return len;
+    spark_settsprc(file, SPKSTAMP_NANO);
+
+    if ((rp = calloc(1, sizeof(struct Replay))) == NULL || (rp->arena = malloc((size_t) st.st_size)) == NULL) {
+        free(rp);
+        spark_close(file);
+        return SPKSOCK_ENOMEM;
+    }
+
+    // Packets are copied next to each other, record headers are dropped
+    while ((len = spark_next(file, &pkt, &ts)) >= 0) {
+        if (rp->npkts == max) {
+            max = max == 0 ? 1024 : max << 1;
+            if ((tmp = realloc(rp->pkts, max * sizeof(struct ReplayPkt))) == NULL) {
+                len = SPKSOCK_ENOMEM;
+                break;
+            }
+            rp->pkts = tmp;
+        }
+        rp->pkts[rp->npkts].data = rp->arena + rp->size;
+        rp->pkts[rp->npkts].len = (unsigned int) len;
+        rp->pkts[rp->npkts].time = (long long) ts.sec * 1000000000LL
+                                   + (ts.prc == SPKSTAMP_NANO ? ts.nsec : ts.usec * 1000LL);
+        memcpy(rp->arena + rp->size, pkt, (size_t) len);
+        rp->size += (unsigned long long) len;
+        if ((unsigned int) len > rp->maxlen)
+            rp->maxlen = (unsigned int) len;
+        rp->npkts++;
+    }
+    rp->lktype = spark_getltype(file);
+    spark_close(file);
+    if (len != SPKSOCK_EOF || rp->npkts == 0) {
+        replay_close(rp);
+        return len != SPKSOCK_EOF ? len : SPKSOCK_ENOSUPPORT;
+    }
+
+    // Loops must not wait for the disk
+    rp->locked = mlock(rp->arena, rp->size) == 0;
+
+    rp->tx = tx;
+    rp->mode = REPLAY_TIMED;
+    rp->speed = 1.0;
+    rp->loops = 1;
+    rp->batch = REPLAY_BATCH;
+    rp->spin = REPLAY_SPIN;
+    atomic_init(&rp->stop, false);
+    *replay = rp;
+    return SPKSOCK_SUCCESS;
+}
+
+long long replay_run(struct Replay *replay) {
+    struct ReplaySched sc;
+    struct ReplaySched next;
+    unsigned char *bufs[REPLAY_BATCH];
+    unsigned int lens[REPLAY_BATCH];
+    unsigned int batch = replay->batch == 0 || replay->batch > REPLAY_BATCH ? REPLAY_BATCH : replay->batch;
+    unsigned char *scratch = NULL;
+    unsigned long long span = 0;
+    unsigned long long due;
+    unsigned long long now;
+    unsigned long long i;
+    unsigned int count;
+    unsigned int sent;
+    int ret;
+
+    if ((replay->mode == REPLAY_TIMED && replay->speed <= 0)
+        || ((replay->mode == REPLAY_PPS || replay->mode == REPLAY_BPS) && replay->rate == 0))
+        return SPKSOCK_ERROR;
+
+    // Frames are sent as captured, the interface and the rules must share the link type
+    if (spark_getltype(replay->tx) != replay->lktype
+        || (replay->rewrite != NULL && replay->rewrite->lktype != replay->lktype))
+        return SPKSOCK_ENOSUPPORT;
+
+    // Rules work on copies, the next pass must see the original packets
+    if (replay->rewrite != NULL && (scratch = malloc((size_t) batch * replay->maxlen)) == NULL)
+        return SPKSOCK_ENOMEM;
+
+    replay->packets = 0;
+    replay->bytes = 0;
+    replay->skipped = 0;
+    replay->passes = 0;
+    replay->maxlag = 0;
+    atomic_store(&replay->stop, false);
+
+    if (replay->mode == REPLAY_TIMED && replay->npkts > 1
+        && replay->pkts[replay->npkts - 1].time > replay->pkts[0].time) {
+        // Next pass starts one average gap after the last packet
+        span = (unsigned long long) ((replay->pkts[replay->npkts - 1].time - replay->pkts[0].time) / replay->speed);
+        span += span / (replay->npkts - 1);
+    }
+
+    memset(&sc, 0x00, sizeof(struct ReplaySched));
+    sc.start = __replay_now();
+    while (replay->loops == 0 || replay->passes < replay->loops) {
+        for (i = 0; i < replay->npkts;) {
+            if (atomic_load_explicit(&replay->stop, memory_order_relaxed)) {
+                free(scratch);
+                return (long long) replay->packets;
+            }
+
+            due = __replay_due(replay, &sc, &replay->pkts[i]);
+            __replay_wait(replay, due);
+            now = __replay_now();
+            if (replay->mode != REPLAY_TOPSPEED && due < now && now - due > replay->maxlag)
+                replay->maxlag = now - due;
+
+            // The batch takes the following packets that are already due
+            next = sc;
+            count = 0;
+            do {
+                bufs[count] = replay->pkts[i + count].data;
+                lens[count] = replay->pkts[i + count].len;
+                next.count++;
+                next.bits += (unsigned long long) lens[count] << 3;
+                count++;
+            } while (count < batch && i + count < replay->npkts
+                     && __replay_due(replay, &next, &replay->pkts[i + count]) <= now);
+
+            if (scratch != NULL) {
+                for (unsigned int j = 0; j < count; j++) {
+                    memcpy(scratch + (size_t) j * replay->maxlen, bufs[j], lens[j]);
+                    bufs[j] = scratch + (size_t) j * replay->maxlen;
+                    rewrite_apply(replay->rewrite, bufs[j], lens[j]);
+                }
+            }
+
+            for (sent = 0; sent < count;) {
+                if ((ret = spark_writeb(replay->tx, bufs + sent, lens + sent, count - sent)) < 0) {
+                    if (ret == SPKSOCK_EINTR)
+                        continue;
+                    // The first frame of the batch exceeds the MTU, the others are still sent
+                    if (ret == SPKSOCK_ESIZE) {
+                        replay->skipped++;
+                        sent++;
+                        continue;
+                    }
+                    free(scratch);
+                    return ret;
+                }
+                for (unsigned int j = sent; j < sent + (unsigned int) ret; j++)
+                    replay->bytes += lens[j];
+                replay->packets += (unsigned int) ret;
+                sent += (unsigned int) ret;
+            }
+            sc = next;
+            i += count;
+        }
+        sc.offset += span;
+        replay->passes++;
+    }
+    free(scratch);
+    return (long long) replay->packets;
+}
+
+inline void replay_stop(struct Replay *replay) {
+    atomic_store(&replay->stop, true);
+}
+
+void replay_close(struct Replay *replay) {
+    if (replay->locked)
+        munlock(replay->arena, replay->size);
+    free(replay->arena);
+    free(replay->pkts);
+    free(replay);
+}
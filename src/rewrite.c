@@ -0,0 +1,354 @@
+/*
+ * Copyright (c) 2017 Jacopo De Luca
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include <ethernet.h>
+#include <ipv4.h>
+#include <rewrite.h>
+
+#define REWRITE_ETHTYPE_IP      0x0800
+#define REWRITE_ETHTYPE_VLAN    0x8100
+#define REWRITE_ETHTYPE_QINQ    0x88A8
+#define REWRITE_ETHTYPE_QINQ1   0x9100
+#define REWRITE_MAXVLAN         2
+#define REWRITE_MINSLOTS        64
+
+static inline unsigned int __rewrite_slot(unsigned int addr, unsigned int nslots) {
+    return (unsigned int) (((unsigned long long) addr * 0x9E3779B97F4A7C15ULL) >> 32) & (nslots - 1);
+}
+
+static bool __rewrite_rehash(struct Rewrite *rw) {
+    struct RewriteHost *old = rw->hosts;
+    unsigned int oslots = rw->hslots;
+    unsigned int slot;
+
+    rw->hslots = oslots == 0 ? REWRITE_MINSLOTS : oslots << 1;
+    if ((rw->hosts = calloc(rw->hslots, sizeof(struct RewriteHost))) == NULL) {
+        rw->hosts = old;
+        rw->hslots = oslots;
+        return false;
+    }
+    for (unsigned int i = 0; i < oslots; i++) {
+        if (!old[i].used)
+            continue;
+        for (slot = __rewrite_slot(old[i].from, rw->hslots); rw->hosts[slot].used; slot = (slot + 1) & (rw->hslots - 1));
+        rw->hosts[slot] = old[i];
+    }
+    free(old);
+    return true;
+}
+
+// Translates an address (network byte order)
+static unsigned int __rewrite_addr(struct Rewrite *rw, unsigned int addr) {
+    unsigned int slot;
+    unsigned int host;
+
+    if (rw->nhosts > 0) {
+        for (slot = __rewrite_slot(addr, rw->hslots); rw->hosts[slot].used; slot = (slot + 1) & (rw->hslots - 1)) {
+            if (rw->hosts[slot].from == addr)
+                return rw->hosts[slot].to;
+        }
+    }
+    host = ntohl(addr);
+    // Networks are sorted by prefix length, the first match is the longest one
+    for (unsigned int i = 0; i < rw->nnets; i++) {
+        if ((host & rw->nets[i].mask) == rw->nets[i].from)
+            return htonl(rw->nets[i].to | (host & ~rw->nets[i].mask));
+    }
+    return addr;
+}
+
+static unsigned int __rewrite_macs(struct Rewrite *rw, unsigned char *frame) {
+    unsigned int changed = 0;
+    bool dst = false;
+    bool src = false;
+
+    for (unsigned int i = 0; i < rw->nmacs && !(dst && src); i++) {
+        if (!dst && memcmp(frame, rw->macs[i].from, 6) == 0) {
+            memcpy(frame, rw->macs[i].to, 6);
+            dst = true;
+            changed++;
+        }
+        if (!src && memcmp(frame + 6, rw->macs[i].from, 6) == 0) {
+            memcpy(frame + 6, rw->macs[i].to, 6);
+            src = true;
+            changed++;
+        }
+    }
+    if (rw->set_dmac) {
+        memcpy(frame, rw->dmac, 6);
+        changed++;
+    }
+    if (rw->set_smac) {
+        memcpy(frame + 6, rw->smac, 6);
+        changed++;
+    }
+    return changed;
+}
+
+static unsigned int __rewrite_vlan(struct Rewrite *rw, unsigned char *tag) {
+    unsigned short tci;
+    unsigned short vid;
+
+    memcpy(&tci, tag, sizeof(unsigned short));
+    tci = ntohs(tci);
+    if ((vid = rw->vlans != NULL ? rw->vlans[tci & 0x0FFF] : REWRITE_NOVLAN) == REWRITE_NOVLAN)
+        vid = rw->anyvlan;
+    if (vid == REWRITE_NOVLAN || vid == (tci & 0x0FFF))
+        return 0;
+    tci = htons((unsigned short) ((tci & 0xF000) | vid));
+    memcpy(tag, &tci, sizeof(unsigned short));
+    return 1;
+}
+
+// Rewrites a port, l4sum is NULL if the checksum is not present
+static unsigned int __rewrite_port(struct Rewrite *rw, unsigned short *port, unsigned short *l4sum) {
+    unsigned short old = *port;
+
+    if (rw->ports[ntohs(old)] == 0)
+        return 0;
+    *port = htons(rw->ports[ntohs(old)]);
+    if (l4sum != NULL)
+        *l4sum = ipv4_csum_update16(*l4sum, old, *port);
+    return 1;
+}
+
+static unsigned int __rewrite_ipv4(struct Rewrite *rw, struct Ipv4Header *ip, unsigned int len) {
+    unsigned short *l4sum = NULL;
+    unsigned short *ports = NULL;
+    unsigned int changed = 0;
+    unsigned int ihl;
+    unsigned int addr;
+    unsigned short old;
+    unsigned short new;
+    unsigned char ttl;
+    bool udp = ip->protocol == IPPROTO_UDP;
+
+    if (len < IPV4HDRSIZE || ip->version != 4 || (ihl = (unsigned int) ip->ihl << 2) < IPV4HDRSIZE || ihl > len)
+        return 0;
+
+    // Only the first fragment contains the transport header
+    if ((ntohs(ip->frag_off) & 0x1FFF) == 0 && (ip->protocol == IPPROTO_TCP || udp)) {
+        if (len - ihl >= 4)
+            ports = (unsigned short *) ((unsigned char *) ip + ihl);
+        if (len - ihl >= (udp ? 8 : 18))
+            l4sum = (unsigned short *) ((unsigned char *) ip + ihl + (udp ? 6 : 16));
+        // A zero UDP checksum means no checksum
+        if (udp && l4sum != NULL && *l4sum == 0)
+            l4sum = NULL;
+    }
+
+    if (rw->nhosts > 0 || rw->nnets > 0) {
+        if ((addr = __rewrite_addr(rw, ip->saddr)) != ip->saddr) {
+            ip->checksum = ipv4_csum_update32(ip->checksum, ip->saddr, addr);
+            if (l4sum != NULL)
+                *l4sum = ipv4_csum_update32(*l4sum, ip->saddr, addr);
+            ip->saddr = addr;
+            changed++;
+        }
+        if ((addr = __rewrite_addr(rw, ip->daddr)) != ip->daddr) {
+            ip->checksum = ipv4_csum_update32(ip->checksum, ip->daddr, addr);
+            if (l4sum != NULL)
+                *l4sum = ipv4_csum_update32(*l4sum, ip->daddr, addr);
+            ip->daddr = addr;
+            changed++;
+        }
+    }
+
+    if (rw->ports != NULL && ports != NULL) {
+        changed += __rewrite_port(rw, &ports[0], l4sum);
+        changed += __rewrite_port(rw, &ports[1], l4sum);
+    }
+    if (udp && l4sum != NULL && *l4sum == 0)
+        *l4sum = 0xFFFF;
+
+    if (rw->ttl > 0) {
+        ttl = rw->ttl_dec ? (ip->ttl > rw->ttl ? (unsigned char) (ip->ttl - rw->ttl) : 1) : rw->ttl;
+        if (ttl != ip->ttl) {
+            // TTL and protocol share a 16 bit word of the header
+            memcpy(&old, &ip->ttl, sizeof(unsigned short));
+            ip->ttl = ttl;
+            memcpy(&new, &ip->ttl, sizeof(unsigned short));
+            ip->checksum = ipv4_csum_update16(ip->checksum, old, new);
+            changed++;
+        }
+    }
+    return changed;
+}
+
+int rewrite_new(int lktype, struct Rewrite **rw) {
+    if (rw == NULL)
+        return SPKSOCK_ERROR;
+    if (lktype != DLT_EN10MB && lktype != DLT_RAW)
+        return SPKSOCK_ENOSUPPORT;
+    if ((*rw = calloc(1, sizeof(struct Rewrite))) == NULL)
+        return SPKSOCK_ENOMEM;
+    (*rw)->lktype = lktype;
+    (*rw)->anyvlan = REWRITE_NOVLAN;
+    return SPKSOCK_SUCCESS;
+}
+
+int rewrite_mac(struct Rewrite *rw, struct netaddr_mac *from, struct netaddr_mac *to) {
+    struct RewriteMac *tmp;
+
+    for (unsigned int i = 0; i < rw->nmacs; i++) {
+        if (memcmp(rw->macs[i].from, from->mac, 6) == 0) {
+            memcpy(rw->macs[i].to, to->mac, 6);
+            return SPKSOCK_SUCCESS;
+        }
+    }
+    if ((tmp = realloc(rw->macs, (rw->nmacs + 1) * sizeof(struct RewriteMac))) == NULL)
+        return SPKSOCK_ENOMEM;
+    rw->macs = tmp;
+    memcpy(rw->macs[rw->nmacs].from, from->mac, 6);
+    memcpy(rw->macs[rw->nmacs].to, to->mac, 6);
+    rw->nmacs++;
+    return SPKSOCK_SUCCESS;
+}
+
+void rewrite_setmac(struct Rewrite *rw, struct netaddr_mac *src, struct netaddr_mac *dst) {
+    if ((rw->set_smac = src != NULL))
+        memcpy(rw->smac, src->mac, 6);
+    if ((rw->set_dmac = dst != NULL))
+        memcpy(rw->dmac, dst->mac, 6);
+}
+
+int rewrite_ip(struct Rewrite *rw, struct netaddr_ip *from, struct netaddr_ip *to) {
+    unsigned int slot;
+
+    if ((rw->nhosts + 1) * 2 > rw->hslots && !__rewrite_rehash(rw))
+        return SPKSOCK_ENOMEM;
+    for (slot = __rewrite_slot(from->ip, rw->hslots); rw->hosts[slot].used; slot = (slot + 1) & (rw->hslots - 1)) {
+        if (rw->hosts[slot].from == from->ip) {
+            rw->hosts[slot].to = to->ip;
+            return SPKSOCK_SUCCESS;
+        }
+    }
+    rw->hosts[slot].from = from->ip;
+    rw->hosts[slot].to = to->ip;
+    rw->hosts[slot].used = true;
+    rw->nhosts++;
+    return SPKSOCK_SUCCESS;
+}
+
+int rewrite_cidr(struct Rewrite *rw, struct netaddr_ip *from, unsigned char prefix, struct netaddr_ip *to) {
+    struct RewriteNet *tmp;
+    unsigned int mask;
+    unsigned int pos;
+
+    if (prefix > 32)
+        return SPKSOCK_ERROR;
+    if (prefix == 32)
+        return rewrite_ip(rw, from, to);
+
+    mask = prefix == 0 ? 0 : 0xFFFFFFFF << (32 - prefix);
+    for (pos = 0; pos < rw->nnets && rw->nets[pos].mask > mask; pos++);
+    for (unsigned int i = pos; i < rw->nnets && rw->nets[i].mask == mask; i++) {
+        if (rw->nets[i].from == (ntohl(from->ip) & mask)) {
+            rw->nets[i].to = ntohl(to->ip) & mask;
+            return SPKSOCK_SUCCESS;
+        }
+    }
+    if ((tmp = realloc(rw->nets, (rw->nnets + 1) * sizeof(struct RewriteNet))) == NULL)
+        return SPKSOCK_ENOMEM;
+    rw->nets = tmp;
+    memmove(rw->nets + pos + 1, rw->nets + pos, (rw->nnets - pos) * sizeof(struct RewriteNet));
+    rw->nets[pos].from = ntohl(from->ip) & mask;
+    rw->nets[pos].mask = mask;
+    rw->nets[pos].to = ntohl(to->ip) & mask;
+    rw->nnets++;
+    return SPKSOCK_SUCCESS;
+}
+
+int rewrite_port(struct Rewrite *rw, unsigned short from, unsigned short to) {
+    if (to == 0)
+        return SPKSOCK_ERROR;
+    if (rw->ports == NULL && (rw->ports = calloc(65536, sizeof(unsigned short))) == NULL)
+        return SPKSOCK_ENOMEM;
+    rw->ports[from] = to == from ? 0 : to;
+    return SPKSOCK_SUCCESS;
+}
+
+int rewrite_vlan(struct Rewrite *rw, int from, unsigned short to) {
+    if (from < REWRITE_ANYVLAN || from > 0x0FFF || to > 0x0FFF)
+        return SPKSOCK_ERROR;
+    if (from == REWRITE_ANYVLAN) {
+        rw->anyvlan = to;
+        return SPKSOCK_SUCCESS;
+    }
+    if (rw->vlans == NULL) {
+        if ((rw->vlans = malloc(4096 * sizeof(unsigned short))) == NULL)
+            return SPKSOCK_ENOMEM;
+        memset(rw->vlans, 0xFF, 4096 * sizeof(unsigned short));
+    }
+    rw->vlans[from] = to;
+    return SPKSOCK_SUCCESS;
+}
+
+void rewrite_ttl(struct Rewrite *rw, unsigned char ttl, bool dec) {
+    rw->ttl = ttl;
+    rw->ttl_dec = dec;
+}
+
+unsigned int rewrite_apply(struct Rewrite *rw, unsigned char *frame, unsigned int len) {
+    unsigned int changed = 0;
+    unsigned int off = 0;
+    unsigned short type;
+
+    rw->packets++;
+    if (rw->lktype == DLT_EN10MB) {
+        if (len < ETHHDRSIZE)
+            return 0;
+        changed += __rewrite_macs(rw, frame);
+        memcpy(&type, frame + 12, sizeof(unsigned short));
+        type = ntohs(type);
+        off = ETHHDRSIZE;
+        for (int i = 0; i < REWRITE_MAXVLAN && len - off >= 4 && (type == REWRITE_ETHTYPE_VLAN
+                                                                   || type == REWRITE_ETHTYPE_QINQ
+                                                                   || type == REWRITE_ETHTYPE_QINQ1); i++) {
+            if (i == 0)
+                changed += __rewrite_vlan(rw, frame + off);
+            memcpy(&type, frame + off + 2, sizeof(unsigned short));
+            type = ntohs(type);
+            off += 4;
+        }
+        if (type != REWRITE_ETHTYPE_IP)
+            off = len;
+    }
+    if (off < len)
+        changed += __rewrite_ipv4(rw, (struct Ipv4Header *) (frame + off), len - off);
+    if (changed > 0)
+        rw->modified++;
+    return changed;
+}
+
+void rewrite_free(struct Rewrite *rw) {
+    free(rw->macs);
+    free(rw->hosts);
+    free(rw->nets);
+    free(rw->ports);
+    free(rw->vlans);
+    free(rw);
+}
@@ -21,47 +21,256 @@
 */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <arpa/inet.h>
 
 #include <routev4.h>
 
+static int __routev4_cmp(const void *a, const void *b) {
+    const struct Route4Entry *r1 = (const struct Route4Entry *) a;
+    const struct Route4Entry *r2 = (const struct Route4Entry *) b;
+
+    // Shorter prefixes first, then the preferred route last so that it overwrites the others
+    if (r1->prefix != r2->prefix)
+        return r1->prefix < r2->prefix ? -1 : 1;
+    if (r1->metric != r2->metric)
+        return r1->metric > r2->metric ? -1 : 1;
+    return 0;
+}
+
+static unsigned short __routev4_nexthop(struct Route4Table *tbl, struct Route4Nexthop *nh) {
+    struct Route4Nexthop *tmp;
+    unsigned int max;
+    unsigned int i;
+
+    for (i = 0; i < tbl->nnexthops; i++) {
+        if (tbl->nexthops[i].gateway.ip == nh->gateway.ip && tbl->nexthops[i].prefsrc.ip == nh->prefsrc.ip
+            && tbl->nexthops[i].ifindex == nh->ifindex)
+            return (unsigned short) i;
+    }
+    if (tbl->nnexthops == ROUTEV4_MAXNH)
+        return ROUTEV4_MAXNH;
+    if (tbl->nnexthops == tbl->maxnexthops) {
+        max = tbl->maxnexthops == 0 ? 16 : tbl->maxnexthops * 2;
+        if ((tmp = realloc(tbl->nexthops, max * sizeof(struct Route4Nexthop))) == NULL)
+            return ROUTEV4_MAXNH;
+        tbl->nexthops = tmp;
+        tbl->maxnexthops = max;
+    }
+    tbl->nexthops[tbl->nnexthops] = *nh;
+    return (unsigned short) tbl->nnexthops++;
+}
+
+static bool __routev4_tbl8(struct Route4Table *tbl, unsigned int idx24) {
+    unsigned short *tmp;
+    unsigned int max;
+
+    if (tbl->ntbl8 == ROUTEV4_MAXNH + 1)
+        return false;
+    if (tbl->ntbl8 == tbl->maxtbl8) {
+        max = tbl->maxtbl8 == 0 ? 64 : tbl->maxtbl8 * 2;
+        if ((tmp = realloc(tbl->tbl8, max * ROUTEV4_TBL8 * sizeof(unsigned short))) == NULL)
+            return false;
+        tbl->tbl8 = tmp;
+        tbl->maxtbl8 = max;
+    }
+    // The group inherits the shorter prefix covering it
+    for (unsigned int i = 0; i < ROUTEV4_TBL8; i++)
+        tbl->tbl8[tbl->ntbl8 * ROUTEV4_TBL8 + i] = tbl->tbl24[idx24];
+    tbl->tbl24[idx24] = (unsigned short) (ROUTEV4_EXTENDED | tbl->ntbl8++);
+    return true;
+}
+
+bool routev4_add(struct Route4Table *tbl, struct netaddr_ip *dst, unsigned char prefix, unsigned int metric,
+                 struct Route4Nexthop *nh) {
+    struct Route4Entry *tmp;
+    struct Route4Entry *route;
+    unsigned short idx;
+    unsigned int max;
+
+    if (prefix > 32 || (idx = __routev4_nexthop(tbl, nh)) == ROUTEV4_MAXNH)
+        return false;
+    if (tbl->nroutes == tbl->maxroutes) {
+        max = tbl->maxroutes == 0 ? 64 : tbl->maxroutes * 2;
+        if ((tmp = realloc(tbl->routes, max * sizeof(struct Route4Entry))) == NULL)
+            return false;
+        tbl->routes = tmp;
+        tbl->maxroutes = max;
+    }
+    route = tbl->routes + tbl->nroutes++;
+    route->dst.ip = prefix == 0 ? 0 : dst->ip & htonl(0xFFFFFFFFU << (32 - prefix));
+    route->prefix = prefix;
+    route->metric = metric;
+    route->nh = idx;
+    return true;
+}
+
+bool routev4_build(struct Route4Table *tbl) {
+    struct Route4Entry *route;
+    unsigned short value;
+    unsigned int host;
+    unsigned int idx24;
+    unsigned int i;
+    unsigned int j;
+
+    if (tbl->tbl24 == NULL) {
+        if ((tbl->tbl24 = calloc(ROUTEV4_TBL24, sizeof(unsigned short))) == NULL)
+            return false;
+    } else
+        memset(tbl->tbl24, 0x00, ROUTEV4_TBL24 * sizeof(unsigned short));
+    tbl->ntbl8 = 0;
+
+    qsort(tbl->routes, tbl->nroutes, sizeof(struct Route4Entry), __routev4_cmp);
+    for (i = 0; i < tbl->nroutes; i++) {
+        route = tbl->routes + i;
+        host = ntohl(route->dst.ip);
+        value = (unsigned short) (route->nh + 1);
+        if (route->prefix <= 24) {
+            // Prefixes are sorted, tbl24 contains no tbl8 groups yet
+            idx24 = host >> 8;
+            for (j = 0; j < 1U << (24 - route->prefix); j++)
+                tbl->tbl24[idx24 + j] = value;
+            continue;
+        }
+        idx24 = host >> 8;
+        if ((tbl->tbl24[idx24] & ROUTEV4_EXTENDED) == 0 && !__routev4_tbl8(tbl, idx24))
+            return false;
+        idx24 = (unsigned int) (tbl->tbl24[idx24] & ~ROUTEV4_EXTENDED) * ROUTEV4_TBL8 + (host & 0xFF);
+        for (j = 0; j < 1U << (32 - route->prefix); j++)
+            tbl->tbl8[idx24 + j] = value;
+    }
+    return true;
+}
+
+inline struct Route4Nexthop *routev4_lookup(struct Route4Table *tbl, struct netaddr_ip *dst) {
+    unsigned int host = ntohl(dst->ip);
+    unsigned short value = tbl->tbl24[host >> 8];
+
+    if ((value & ROUTEV4_EXTENDED) != 0)
+        value = tbl->tbl8[(unsigned int) (value & ~ROUTEV4_EXTENDED) * ROUTEV4_TBL8 + (host & 0xFF)];
+    return value != 0 ? tbl->nexthops + value - 1 : NULL;
+}
+
+struct Route4Table *routev4_new() {
+    return (struct Route4Table *) calloc(1, sizeof(struct Route4Table));
+}
+
+void routev4_free(struct Route4Table *tbl) {
+    if (tbl == NULL)
+        return;
+    free(tbl->routes);
+    free(tbl->nexthops);
+    free(tbl->tbl24);
+    free(tbl->tbl8);
+    free(tbl);
+}
+
 #if defined(__linux__)
 
+#include <spksock.h>
+#include <ipv4.h>
+#include "netlink/netlink.h"
+
+static int __routev4_msg(struct nlmsghdr *hdr, void *arg) {
+    struct Route4Table *tbl = (struct Route4Table *) arg;
+    struct rtmsg *rtm = (struct rtmsg *) NLMSG_DATA(hdr);
+    struct rtattr *tb[RTA_MAX + 1];
+    struct rtattr *nhtb[RTA_MAX + 1];
+    struct rtnexthop *rtnh;
+    struct Route4Nexthop nh;
+    struct netaddr_ip dst = {0};
+    unsigned int table;
+    unsigned int metric = 0;
+
+    if (hdr->nlmsg_type != RTM_NEWROUTE || rtm->rtm_family != AF_INET || rtm->rtm_type != RTN_UNICAST)
+        return 0;
+    netlink_attrs(tb, RTA_MAX, RTM_RTA(rtm), (int) RTM_PAYLOAD(hdr));
+    table = tb[RTA_TABLE] != NULL ? *(unsigned int *) RTA_DATA(tb[RTA_TABLE]) : rtm->rtm_table;
+    if (table != RT_TABLE_MAIN)
+        return 0;
+
+    memset(&nh, 0x00, sizeof(struct Route4Nexthop));
+    if (tb[RTA_DST] != NULL)
+        memcpy(&dst.ip, RTA_DATA(tb[RTA_DST]), IPV4ADDRSIZE);
+    if (tb[RTA_PRIORITY] != NULL)
+        metric = *(unsigned int *) RTA_DATA(tb[RTA_PRIORITY]);
+    if (tb[RTA_PREFSRC] != NULL)
+        memcpy(&nh.prefsrc.ip, RTA_DATA(tb[RTA_PREFSRC]), IPV4ADDRSIZE);
+    if (tb[RTA_GATEWAY] != NULL)
+        memcpy(&nh.gateway.ip, RTA_DATA(tb[RTA_GATEWAY]), IPV4ADDRSIZE);
+    if (tb[RTA_OIF] != NULL)
+        nh.ifindex = *(unsigned int *) RTA_DATA(tb[RTA_OIF]);
+    if (tb[RTA_MULTIPATH] != NULL && RTA_PAYLOAD(tb[RTA_MULTIPATH]) >= sizeof(struct rtnexthop)) {
+        rtnh = (struct rtnexthop *) RTA_DATA(tb[RTA_MULTIPATH]);
+        nh.ifindex = (unsigned int) rtnh->rtnh_ifindex;
+        netlink_attrs(nhtb, RTA_MAX, RTNH_DATA(rtnh), rtnh->rtnh_len - (int) RTNH_LENGTH(0));
+        if (nhtb[RTA_GATEWAY] != NULL)
+            memcpy(&nh.gateway.ip, RTA_DATA(nhtb[RTA_GATEWAY]), IPV4ADDRSIZE);
+    }
+    if (if_indextoname(nh.ifindex, nh.ifname) == NULL)
+        nh.ifname[0] = '\0';
+    return routev4_add(tbl, &dst, rtm->rtm_dst_len, metric, &nh) ? 0 : SPKSOCK_ENOMEM;
+}
+
+static struct Route4Table *__routev4_dump() {
+    struct Route4Table *tbl;
+    struct NlSock nl;
+    struct rtmsg rtm;
+    int ret;
+
+    if ((tbl = routev4_new()) == NULL)
+        return NULL;
+    if (netlink_open(&nl, 0) != SPKSOCK_SUCCESS) {
+        routev4_free(tbl);
+        return NULL;
+    }
+    memset(&rtm, 0x00, sizeof(struct rtmsg));
+    rtm.rtm_family = AF_INET;
+    ret = netlink_dump(&nl, RTM_GETROUTE, &rtm, sizeof(struct rtmsg), __routev4_msg, tbl);
+    netlink_close(&nl);
+    if (ret != SPKSOCK_SUCCESS) {
+        routev4_free(tbl);
+        return NULL;
+    }
+    return tbl;
+}
+
 bool get_defgateway(char *iface_name, struct netaddr_ip *gateway) {
-    char buf[1024];
-    char ifa[24];
-    int dest;
-    unsigned int gate;
-    int flags;
-    char *line;
-    int fd = open(ROUTETABLE, O_RDONLY);
-    if (fd == -1)
+    struct Route4Table *tbl;
+    struct Route4Entry *best = NULL;
+    struct Route4Nexthop *nh;
+
+    if ((tbl = __routev4_dump()) == NULL)
         return false;
-    while (read(fd, buf, 1024) != 0) {
-        line = strtok(buf, "\n");
-        while (line != NULL) {
-            if (sscanf(line, "%s\t%u\t%x\t%u", ifa, &dest, &gate, &flags) != 4) {
-                line = strtok(NULL, "\n");
-                continue;
-            }
-            if (iface_name != NULL && strcmp(iface_name, ifa) != 0) {
-                line = strtok(NULL, "\n");
-                continue;
-            }
-            if (dest != 0 && flags < 2) {
-                line = strtok(NULL, "\n");
-                continue;
-            }
-            gateway->ip = gate;
-            close(fd);
-            return true;
-        }
+    for (unsigned int i = 0; i < tbl->nroutes; i++) {
+        nh = tbl->nexthops + tbl->routes[i].nh;
+        if (tbl->routes[i].prefix != 0 || nh->gateway.ip == 0)
+            continue;
+        if (iface_name != NULL && strcmp(iface_name, nh->ifname) != 0)
+            continue;
+        if (best == NULL || tbl->routes[i].metric < best->metric)
+            best = tbl->routes + i;
     }
-    close(fd);
-    return false;
+    if (best != NULL)
+        *gateway = tbl->nexthops[best->nh].gateway;
+    routev4_free(tbl);
+    return best != NULL;
+}
+
+struct Route4Table *routev4_load() {
+    struct Route4Table *tbl;
+
+    if ((tbl = __routev4_dump()) == NULL)
+        return NULL;
+    if (!routev4_build(tbl)) {
+        routev4_free(tbl);
+        return NULL;
+    }
+    return tbl;
 }
 
 #elif defined(__FreeBSD__) || (defined(__APPLE__) && defined(__MACH__))
@@ -71,4 +280,9 @@ bool get_defgateway(char *iface_name, struct netaddr_ip *gateway) {
     return false;
 }
 
-#endif
\ No newline at end of file
+struct Route4Table *routev4_load() {
+    // STUB
+    return NULL;
+}
+
+#endif
@@ -41,13 +41,14 @@ static const struct ErrorInfo __spk_error_table[] =
                 {SPKSOCK_EPERM,      "Permission denied"},
                 {SPKSOCK_ENODEV,     "No such device"},
                 {SPKSOCK_EINTR,      "Interrupted system call"},
-                {SPKSOCK_ESIZE,      "Message too large"}
+                {SPKSOCK_ESIZE,      "Message too large"},
+                {SPKSOCK_EOF,        "End of file"}
         };
 
 char *spark_strerror(int error) {
     char *ret = NULL;
 
-    for (int i = 0; i < (sizeof(__spk_error_table) / sizeof(struct ErrorInfo)); i++)
+    for (unsigned int i = 0; i < (sizeof(__spk_error_table) / sizeof(struct ErrorInfo)); i++)
         if (error == __spk_error_table[i].value) {
             ret = __spk_error_table[i].msg;
             return ret;
@@ -61,6 +62,35 @@ int spark_getltype(struct SpkSock *ssock) {
     return ssock->lktype;
 }
 
+int spark_next(struct SpkSock *ssock, unsigned char **pkt, struct SpkTimeStamp *ts) {
+    if (ssock == NULL)
+        return SPKSOCK_ENINIT;
+    if (ssock->op.next == NULL)
+        return SPKSOCK_ENOSUPPORT;
+    return ssock->op.next(ssock, pkt, ts);
+}
+
+int spark_openfile(char *path, unsigned int buflen, struct SpkSock **ssock) {
+    int errcode;
+
+    if (path == NULL || ssock == NULL)
+        return SPKSOCK_ERROR;
+
+    if (((*ssock) = calloc(1, sizeof(struct SpkSock))) == NULL)
+        return SPKSOCK_ENOMEM;
+
+    (*ssock)->iface_name = strdup(path);
+    (*ssock)->bufl = buflen;
+    (*ssock)->lktype = -1;
+
+    if ((errcode = __ssock_init_file(*ssock)) < 0) {
+        free((*ssock)->iface_name);
+        free(*ssock);
+    }
+
+    return errcode;
+}
+
 int spark_opensock(char *device, unsigned int buflen, struct SpkSock **ssock) {
     int errcode;
 
@@ -83,7 +113,13 @@ int spark_opensock(char *device, unsigned int buflen, struct SpkSock **ssock) {
 int spark_read(struct SpkSock *ssock, unsigned char *buf, struct SpkTimeStamp *ts) {
     if (ssock == NULL)
         return SPKSOCK_ENINIT;
-    return ssock->op.read(ssock, buf, ts);
+    return ssock->op.read(ssock, buf, ssock->bufl, ts);
+}
+
+int spark_readlen(struct SpkSock *ssock, unsigned char *buf, unsigned int len, struct SpkTimeStamp *ts) {
+    if (ssock == NULL)
+        return SPKSOCK_ENINIT;
+    return ssock->op.read(ssock, buf, len, ts);
 }
 
 int spark_setdirection(struct SpkSock *ssock, enum SpkDirection direction) {
@@ -94,6 +130,14 @@ int spark_setdirection(struct SpkSock *ssock, enum SpkDirection direction) {
     return ssock->op.setdir(ssock, direction);
 }
 
+int spark_setfilter(struct SpkSock *ssock, struct SpkFilterInsn *insns, unsigned int len) {
+    if (ssock == NULL)
+        return SPKSOCK_ENINIT;
+    if (ssock->op.setfilter == NULL)
+        return SPKSOCK_ENOSUPPORT;
+    return ssock->op.setfilter(ssock, insns, len);
+}
+
 int spark_setnblock(struct SpkSock *ssock, bool nonblock) {
     if (ssock == NULL)
         return SPKSOCK_ENINIT;
@@ -121,9 +165,28 @@ int spark_settsprc(struct SpkSock *ssock, enum SpkTimesPrc prc) {
 int spark_write(struct SpkSock *ssock, unsigned char *buf, unsigned int len) {
     if (ssock == NULL)
         return SPKSOCK_ENINIT;
+    if (ssock->op.write == NULL)
+        return SPKSOCK_ENOSUPPORT;
     return ssock->op.write(ssock, buf, len);
 }
 
+int spark_writeb(struct SpkSock *ssock, unsigned char **bufs, unsigned int *lens, unsigned int count) {
+    int ret;
+    unsigned int i;
+
+    if (ssock == NULL)
+        return SPKSOCK_ENINIT;
+    if (ssock->op.writeb != NULL)
+        return ssock->op.writeb(ssock, bufs, lens, count);
+    if (ssock->op.write == NULL)
+        return SPKSOCK_ENOSUPPORT;
+    for (i = 0; i < count; i++) {
+        if ((ret = ssock->op.write(ssock, bufs[i], lens[i])) < 0)
+            return i > 0 ? (int) i : ret;
+    }
+    return (int) i;
+}
+
 inline void spark_close(struct SpkSock *ssock) {
     if (ssock != NULL) {
         ssock->op.finalize(ssock);
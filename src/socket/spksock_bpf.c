@@ -37,7 +37,7 @@
 #include "spksock_common.h"
 #include "spksock_bpf.h"
 
-static int spksock_bpf_read(struct SpkSock *ssock, unsigned char *buf, struct SpkTimeStamp *ts) {
+static int spksock_bpf_read(struct SpkSock *ssock, unsigned char *buf, unsigned int len, struct SpkTimeStamp *ts) {
     struct SpkBpf *priv = (struct SpkBpf *) ssock->aux;
     struct bpf_hdr *bhdr;
 
@@ -58,10 +58,10 @@ static int spksock_bpf_read(struct SpkSock *ssock, unsigned char *buf, struct Sp
 
     bhdr = (struct bpf_hdr *) priv->cursor;
 
-    if (bhdr->bh_datalen < ssock->bufl)
+    if (bhdr->bh_datalen < len)
         memcpy(buf, priv->cursor + bhdr->bh_hdrlen, bhdr->bh_datalen);
     else
-        memcpy(buf, priv->cursor + bhdr->bh_hdrlen, ssock->bufl);
+        memcpy(buf, priv->cursor + bhdr->bh_hdrlen, len);
 
     if (ts != NULL) {
         ts->prc = ssock->tsprc;
@@ -111,6 +111,17 @@ static int spksock_bpf_setdir(struct SpkSock *ssock, enum SpkDirection direction
 #endif
 }
 
+static int spksock_bpf_setfilter(struct SpkSock *ssock, struct SpkFilterInsn *insns, unsigned int len) {
+    struct bpf_program prog;
+
+    prog.bf_len = len;
+    prog.bf_insns = (struct bpf_insn *) insns;
+
+    if (ioctl(ssock->sfd, BIOCSETF, &prog) < 0)
+        return SPKSOCK_ERROR;
+    return SPKSOCK_SUCCESS;
+}
+
 static int spksock_bpf_setnblock(struct SpkSock *ssock, bool nonblock) {
     int flags;
     if (nonblock)
@@ -264,6 +275,7 @@ int __ssock_init_socket(struct SpkSock *ssock) {
             ssock->tsprc = SPKSTAMP_MICRO;
             ssock->op.read = spksock_bpf_read;
             ssock->op.setdir = spksock_bpf_setdir;
+            ssock->op.setfilter = spksock_bpf_setfilter;
             ssock->op.setnblk = spksock_bpf_setnblock;
             ssock->op.setprc = spksock_bpf_setprc;
             ssock->op.setpromisc = spksock_bpf_setpromisc;
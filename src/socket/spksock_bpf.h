@@ -36,10 +36,12 @@ struct SpkBpf {
     int buflen;
 };
 
-static int spksock_bpf_read(struct SpkSock *, unsigned char *, struct SpkTimeStamp *);
+static int spksock_bpf_read(struct SpkSock *, unsigned char *, unsigned int, struct SpkTimeStamp *);
 
 static int spksock_bpf_setdir(struct SpkSock *, enum SpkDirection);
 
+static int spksock_bpf_setfilter(struct SpkSock *, struct SpkFilterInsn *, unsigned int);
+
 static int spksock_bpf_setnblock(struct SpkSock *, bool);
 
 static int spksock_bpf_setprc(struct SpkSock *, enum SpkTimesPrc);
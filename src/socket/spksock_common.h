@@ -25,6 +25,14 @@
 
 #include <spksock.h>
 
+int __ssock_init_file(struct SpkSock *);
+
 int __ssock_init_socket(struct SpkSock *);
 
+// Maps a LINKTYPE_ value of a capture file to its DLT_ value, -1 if unknown
+int __ssock_linktype_dlt(unsigned int linktype);
+
+// Maps a DLT_ value to the LINKTYPE_ value written in capture files
+unsigned int __ssock_dlt_linktype(int lktype);
+
 #endif
@@ -0,0 +1,392 @@
+/*
+ * Copyright (c) 2017 Jacopo De Luca
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "spksock_common.h"
+#include "spksock_file.h"
+
+static inline unsigned short __file_u16(struct SpkFile *file, unsigned char *p) {
+    unsigned short v;
+
+    memcpy(&v, p, sizeof(unsigned short));
+    return file->swap ? __builtin_bswap16(v) : v;
+}
+
+static inline unsigned int __file_u32(struct SpkFile *file, unsigned char *p) {
+    unsigned int v;
+
+    memcpy(&v, p, sizeof(unsigned int));
+    return file->swap ? __builtin_bswap32(v) : v;
+}
+
+static inline unsigned long long __file_u64(struct SpkFile *file, unsigned char *p) {
+    unsigned long long v;
+
+    memcpy(&v, p, sizeof(unsigned long long));
+    return file->swap ? __builtin_bswap64(v) : v;
+}
+
+static inline void __file_stamp(struct SpkSock *ssock, struct SpkTimeStamp *ts, long long sec, unsigned long nsec) {
+    if (ts == NULL)
+        return;
+    ts->sec = (long) sec;
+    if (ssock->tsprc == SPKSTAMP_MICRO)
+        ts->usec = (long) (nsec / 1000);
+    else
+        ts->nsec = (long) nsec;
+    ts->prc = ssock->tsprc;
+}
+
+static int __pcap_next(struct SpkSock *ssock, struct SpkFile *file, unsigned char **pkt, struct SpkTimeStamp *ts) {
+    unsigned char *rec;
+    unsigned int caplen;
+    unsigned int frac;
+
+    if (file->size - file->cursor < PCAP_RECLEN)
+        return SPKSOCK_EOF;
+
+    rec = file->base + file->cursor;
+    caplen = __file_u32(file, rec + 8);
+    if (caplen > file->size - file->cursor - PCAP_RECLEN)
+        return SPKSOCK_EOF; // Truncated capture
+
+    file->cursor += PCAP_RECLEN + caplen;
+    frac = __file_u32(file, rec + 4);
+    __file_stamp(ssock, ts, __file_u32(file, rec), file->nsec ? frac : (unsigned long) frac * 1000);
+    *pkt = rec + PCAP_RECLEN;
+    return (int) caplen;
+}
+
+static int __pcapng_iface(struct SpkFile *file, unsigned char *blk, unsigned int len) {
+    struct SpkFileIface *iface;
+    unsigned char *opt;
+    unsigned char *end;
+    unsigned short code;
+    unsigned short olen;
+    unsigned int v;
+
+    if (len < 20)
+        return SPKSOCK_SUCCESS;
+
+    if (file->nifaces == file->maxifaces) {
+        unsigned int max = file->maxifaces == 0 ? 4 : file->maxifaces << 1;
+        if ((iface = realloc(file->ifaces, max * sizeof(struct SpkFileIface))) == NULL)
+            return SPKSOCK_ENOMEM;
+        file->ifaces = iface;
+        file->maxifaces = max;
+    }
+
+    iface = file->ifaces + file->nifaces++;
+    iface->lktype = __ssock_linktype_dlt(__file_u16(file, blk + 8));
+    iface->snaplen = __file_u32(file, blk + 12);
+    iface->tsdiv = 1000000;
+    iface->tsoffset = 0;
+
+    opt = blk + 16;
+    end = blk + len - 4;
+    while (opt + 4 <= end) {
+        code = __file_u16(file, opt);
+        olen = __file_u16(file, opt + 2);
+        if (code == 0 || opt + 4 + olen > end)
+            break;
+        if (code == PCAPNG_OPT_TSRESOL && olen >= 1) {
+            v = opt[4];
+            if ((v & 0x80) != 0)
+                iface->tsdiv = 1ULL << ((v & 0x7F) > 63 ? 63 : v & 0x7F);
+            else {
+                iface->tsdiv = 1;
+                for (v = v > 19 ? 19 : v; v > 0; v--)
+                    iface->tsdiv *= 10;
+            }
+        } else if (code == PCAPNG_OPT_TSOFFSET && olen >= 8)
+            iface->tsoffset = (long long) __file_u64(file, opt + 4);
+        opt += 4 + ((olen + 3) & ~3);
+    }
+    return SPKSOCK_SUCCESS;
+}
+
+/*
+ * Walks the blocks until the next packet, if pkt is NULL stops in front of it without consuming it
+ * (used to load the section and interface headers when the file is opened).
+ */
+static int __pcapng_next(struct SpkSock *ssock, struct SpkFile *file, unsigned char **pkt, struct SpkTimeStamp *ts) {
+    struct SpkFileIface *iface;
+    unsigned char *blk;
+    unsigned char *data;
+    unsigned long long stamp;
+    unsigned int type;
+    unsigned int len;
+    unsigned int caplen;
+    unsigned int id;
+    unsigned int bom;
+
+    for (;;) {
+        if (file->size - file->cursor < 12)
+            return SPKSOCK_EOF;
+
+        blk = file->base + file->cursor;
+        type = __file_u32(file, blk);
+        if (type == PCAPNG_SHB) {
+            // New section, may change the byte order and resets the interfaces
+            memcpy(&bom, blk + 8, sizeof(unsigned int));
+            if (bom == PCAPNG_BOM)
+                file->swap = false;
+            else if (__builtin_bswap32(bom) == PCAPNG_BOM)
+                file->swap = true;
+            else
+                return SPKSOCK_ERROR;
+            file->nifaces = 0;
+        }
+
+        len = __file_u32(file, blk + 4);
+        if (len < 12 || (len & 3) != 0 || len > file->size - file->cursor)
+            return SPKSOCK_EOF; // Truncated capture
+
+        data = NULL;
+        stamp = 0;
+        id = 0;
+        caplen = 0;
+        switch (type) {
+            case PCAPNG_IDB:
+                if (__pcapng_iface(file, blk, len) < 0)
+                    return SPKSOCK_ENOMEM;
+                break;
+            case PCAPNG_EPB:
+            case PCAPNG_PB:
+                if (len < 32)
+                    break;
+                id = type == PCAPNG_EPB ? __file_u32(file, blk + 8) : __file_u16(file, blk + 8);
+                stamp = ((unsigned long long) __file_u32(file, blk + 12) << 32) | __file_u32(file, blk + 16);
+                caplen = __file_u32(file, blk + 20);
+                if (caplen > len - 32)
+                    return SPKSOCK_ERROR;
+                data = blk + 28;
+                break;
+            case PCAPNG_SPB:
+                if (len < 16 || file->nifaces == 0)
+                    break;
+                caplen = __file_u32(file, blk + 8);
+                if (caplen > len - 16)
+                    caplen = len - 16;
+                if (file->ifaces[0].snaplen != 0 && caplen > file->ifaces[0].snaplen)
+                    caplen = file->ifaces[0].snaplen;
+                data = blk + 12;
+                break;
+            default:
+                break;
+        }
+
+        if (data != NULL && pkt == NULL)
+            return SPKSOCK_SUCCESS;
+
+        file->cursor += len;
+        if (data == NULL || id >= file->nifaces)
+            continue;
+
+        iface = file->ifaces + id;
+        ssock->lktype = iface->lktype;
+        if (type == PCAPNG_SPB)
+            __file_stamp(ssock, ts, 0, 0);
+        else if (iface->tsdiv <= 1000000000ULL)
+            __file_stamp(ssock, ts, (long long) (stamp / iface->tsdiv) + iface->tsoffset,
+                         (unsigned long) ((stamp % iface->tsdiv) * (1000000000ULL / iface->tsdiv)));
+        else
+            __file_stamp(ssock, ts, (long long) (stamp / iface->tsdiv) + iface->tsoffset,
+                         (unsigned long) ((long double) (stamp % iface->tsdiv) * 1e9L / iface->tsdiv));
+        *pkt = data;
+        return (int) caplen;
+    }
+}
+
+static int spksock_file_next(struct SpkSock *ssock, unsigned char **pkt, struct SpkTimeStamp *ts) {
+    struct SpkFile *priv = (struct SpkFile *) ssock->aux;
+    size_t len;
+    int caplen;
+
+    // Keeps the kernel read-ahead well in front of the cursor
+    if (priv->ahead < priv->size && priv->cursor + (SPKFILE_READAHEAD >> 1) >= priv->ahead) {
+        len = priv->size - priv->ahead < SPKFILE_READAHEAD ? priv->size - priv->ahead : SPKFILE_READAHEAD;
+        madvise(priv->base + priv->ahead, len, MADV_WILLNEED);
+        priv->ahead += len;
+    }
+
+    if (priv->ng)
+        caplen = __pcapng_next(ssock, priv, pkt, ts);
+    else
+        caplen = __pcap_next(ssock, priv, pkt, ts);
+
+    if (caplen >= 0) {
+        ssock->sock_stats.rx_byte += caplen;
+        ssock->sock_stats.pkt_recv++;
+    }
+    return caplen;
+}
+
+static int spksock_file_read(struct SpkSock *ssock, unsigned char *buf, unsigned int len, struct SpkTimeStamp *ts) {
+    unsigned char *pkt;
+    int caplen;
+
+    if ((caplen = spksock_file_next(ssock, &pkt, ts)) < 0)
+        return caplen;
+    if ((unsigned int) caplen > len)
+        caplen = (int) len;
+    memcpy(buf, pkt, (size_t) caplen);
+    return caplen;
+}
+
+static int spksock_file_setprc(struct SpkSock *ssock, enum SpkTimesPrc prc) {
+    ssock->tsprc = prc;
+    return SPKSOCK_SUCCESS;
+}
+
+int __ssock_linktype_dlt(unsigned int linktype) {
+    // LINKTYPE_ values differ from DLT_ values only outside the matching range
+    switch (linktype) {
+        case 50:
+            return DLT_PPP_SERIAL;
+        case 51:
+            return DLT_PPP_ETHER;
+        case 99:
+            return DLT_SYMANTEC_FIREWALL;
+        case 100:
+            return DLT_ATM_RFC1483;
+        case 101:
+            return DLT_RAW;
+        case 102:
+            return DLT_SLIP_BSDOS;
+        case 103:
+            return DLT_PPP_BSDOS;
+        default:
+            if (linktype <= DLT_FDDI || linktype >= DLT_MATCHING_MIN)
+                return (int) linktype;
+            return -1;
+    }
+}
+
+unsigned int __ssock_dlt_linktype(int lktype) {
+    // DLT_ values differ from LINKTYPE_ values only outside the matching range
+    if (lktype == DLT_ATM_RFC1483)
+        return 100;
+    if (lktype == DLT_RAW)
+        return 101;
+    if (lktype == DLT_SLIP_BSDOS)
+        return 102;
+    if (lktype == DLT_PPP_BSDOS)
+        return 103;
+    return lktype < 0 ? 0 : (unsigned int) lktype;
+}
+
+int __ssock_init_file(struct SpkSock *ssock) {
+    struct SpkFile *priv;
+    struct stat st;
+    unsigned int magic;
+    int err = SPKSOCK_ERROR;
+
+    if ((ssock->sfd = open(ssock->iface_name, O_RDONLY)) < 0) {
+        switch (errno) {
+            case EACCES:
+            case EPERM:
+                return SPKSOCK_EPERM;
+            case ENOENT:
+                return SPKSOCK_ENODEV;
+            case ENOMEM:
+                return SPKSOCK_ENOMEM;
+            default:
+                return SPKSOCK_ERROR;
+        }
+    }
+
+    if (fstat(ssock->sfd, &st) < 0) {
+        close(ssock->sfd);
+        return SPKSOCK_ERROR;
+    }
+
+    if (st.st_size < PCAP_HDRLEN) {
+        close(ssock->sfd);
+        return SPKSOCK_ENOSUPPORT;
+    }
+
+    if ((priv = calloc(1, sizeof(struct SpkFile))) == NULL) {
+        close(ssock->sfd);
+        return SPKSOCK_ENOMEM;
+    }
+
+    priv->size = (size_t) st.st_size;
+    if ((priv->base = mmap(NULL, priv->size, PROT_READ, MAP_PRIVATE, ssock->sfd, 0)) == MAP_FAILED) {
+        err = errno == ENOMEM ? SPKSOCK_ENOMEM : SPKSOCK_ERROR;
+        free(priv);
+        close(ssock->sfd);
+        return err;
+    }
+    madvise(priv->base, priv->size, MADV_SEQUENTIAL);
+
+    memcpy(&magic, priv->base, sizeof(unsigned int));
+    if (magic == PCAP_MAGIC || magic == PCAP_MAGIC_NSEC
+        || __builtin_bswap32(magic) == PCAP_MAGIC || __builtin_bswap32(magic) == PCAP_MAGIC_NSEC) {
+        priv->swap = magic != PCAP_MAGIC && magic != PCAP_MAGIC_NSEC;
+        priv->nsec = magic == PCAP_MAGIC_NSEC || __builtin_bswap32(magic) == PCAP_MAGIC_NSEC;
+        priv->cursor = PCAP_HDRLEN;
+        ssock->lktype = __ssock_linktype_dlt(__file_u32(priv, priv->base + 20) & 0xFFFF);
+        err = SPKSOCK_SUCCESS;
+    } else if (magic == PCAPNG_SHB) {
+        priv->ng = true;
+        if ((err = __pcapng_next(ssock, priv, NULL, NULL)) == SPKSOCK_EOF)
+            err = SPKSOCK_SUCCESS; // Empty capture
+        if (priv->nifaces > 0)
+            ssock->lktype = priv->ifaces[0].lktype;
+    } else
+        err = SPKSOCK_ENOSUPPORT;
+
+    if (err != SPKSOCK_SUCCESS) {
+        munmap(priv->base, priv->size);
+        free(priv->ifaces);
+        free(priv);
+        close(ssock->sfd);
+        return err;
+    }
+
+    ssock->aux = priv;
+    ssock->direction = SPKDIR_BOTH;
+    ssock->tsprc = SPKSTAMP_MICRO;
+    ssock->op.finalize = spksock_file_finalize;
+    ssock->op.next = spksock_file_next;
+    ssock->op.read = spksock_file_read;
+    ssock->op.setprc = spksock_file_setprc;
+
+    return SPKSOCK_SUCCESS;
+}
+
+static void spksock_file_finalize(struct SpkSock *ssock) {
+    struct SpkFile *priv = (struct SpkFile *) ssock->aux;
+
+    munmap(priv->base, priv->size);
+    free(priv->ifaces);
+    free(priv);
+    close(ssock->sfd);
+}
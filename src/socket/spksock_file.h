@@ -0,0 +1,81 @@
+/*
+ * Copyright (c) 2017 Jacopo De Luca
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+*/
+
+#ifndef SPARK_SPKSOCK_FILE_H
+#define SPARK_SPKSOCK_FILE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <spksock.h>
+
+#define SPKFILE_READAHEAD   (64 << 20)
+
+#define PCAP_MAGIC          0xA1B2C3D4
+#define PCAP_MAGIC_NSEC     0xA1B23C4D
+#define PCAP_HDRLEN         24
+#define PCAP_RECLEN         16
+
+#define PCAPNG_SHB          0x0A0D0D0A
+#define PCAPNG_IDB          0x00000001
+#define PCAPNG_PB           0x00000002
+#define PCAPNG_SPB          0x00000003
+#define PCAPNG_EPB          0x00000006
+#define PCAPNG_BOM          0x1A2B3C4D
+#define PCAPNG_OPT_TSRESOL  9
+#define PCAPNG_OPT_TSOFFSET 14
+
+struct SpkFileIface {
+    int lktype;
+    unsigned int snaplen;
+    unsigned long long tsdiv;
+    long long tsoffset;
+};
+
+struct SpkFile {
+    unsigned char *base;
+    size_t size;
+    size_t cursor;
+    size_t ahead;
+    bool swap;
+    bool ng;
+    bool nsec;
+    struct SpkFileIface *ifaces;
+    unsigned int nifaces;
+    unsigned int maxifaces;
+};
+
+static int spksock_file_next(struct SpkSock *, unsigned char **, struct SpkTimeStamp *);
+
+static int spksock_file_read(struct SpkSock *, unsigned char *, unsigned int, struct SpkTimeStamp *);
+
+static int spksock_file_setprc(struct SpkSock *, enum SpkTimesPrc);
+
+static int __pcap_next(struct SpkSock *, struct SpkFile *, unsigned char **, struct SpkTimeStamp *);
+
+static int __pcapng_iface(struct SpkFile *, unsigned char *, unsigned int);
+
+static int __pcapng_next(struct SpkSock *, struct SpkFile *, unsigned char **, struct SpkTimeStamp *);
+
+static void spksock_file_finalize(struct SpkSock *);
+
+#endif
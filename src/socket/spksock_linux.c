@@ -20,6 +20,8 @@
  * SOFTWARE.
 */
 
+#define _GNU_SOURCE
+
 #include <stdbool.h>
 #include <errno.h>
 #include <string.h>
@@ -31,6 +33,8 @@
 #include <net/if_arp.h>
 #include <linux/if_packet.h>
 #include <linux/if_ether.h>
+#include <linux/sockios.h>
+#include <linux/filter.h>
 
 #include <ethernet.h>
 #include "spksock_common.h"
@@ -53,7 +57,7 @@ static bool __linux_discards_direction(struct SpkSock *ssock, struct sockaddr_ll
     return false;
 }
 
-static int spksock_linux_read(struct SpkSock *ssock, unsigned char *buf, struct SpkTimeStamp *ts) {
+static int spksock_linux_read(struct SpkSock *ssock, unsigned char *buf, unsigned int len, struct SpkTimeStamp *ts) {
     struct sockaddr_ll from;
     struct timeval tval;
     struct timespec tspec;
@@ -61,8 +65,8 @@ static int spksock_linux_read(struct SpkSock *ssock, unsigned char *buf, struct
     unsigned int flen = 0;
 
     do {
-        pkt_len = (unsigned int) recvfrom(ssock->sfd, buf, ssock->bufl, MSG_TRUNC, (struct sockaddr *) &from, &flen);
-        if (pkt_len == -1) {
+        pkt_len = (unsigned int) recvfrom(ssock->sfd, buf, len, MSG_TRUNC, (struct sockaddr *) &from, &flen);
+        if (pkt_len == (unsigned int) -1) {
             switch (errno) {
                 case EAGAIN:
                     return 0;
@@ -98,6 +102,23 @@ static int spksock_linux_setdir(struct SpkSock *ssock, enum SpkDirection directi
     return SPKSOCK_SUCCESS;
 }
 
+static int spksock_linux_setfilter(struct SpkSock *ssock, struct SpkFilterInsn *insns, unsigned int len) {
+    struct sock_fprog prog;
+
+    prog.len = (unsigned short) len;
+    prog.filter = (struct sock_filter *) insns;
+
+    if (setsockopt(ssock->sfd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(struct sock_fprog)) < 0) {
+        switch (errno) {
+            case ENOMEM:
+                return SPKSOCK_ENOMEM;
+            default:
+                return SPKSOCK_ERROR;
+        }
+    }
+    return SPKSOCK_SUCCESS;
+}
+
 static int spksock_linux_setnblock(struct SpkSock *ssock, bool nonblock) {
     int flags;
     if (nonblock)
@@ -153,6 +174,46 @@ static int spksock_linux_write(struct SpkSock *ssock, unsigned char *buf, unsign
     return byte;
 }
 
+static int spksock_linux_writeb(struct SpkSock *ssock, unsigned char **bufs, unsigned int *lens, unsigned int count) {
+    struct mmsghdr msgs[SPKSOCK_LINUX_MAXBATCH];
+    struct iovec iov[SPKSOCK_LINUX_MAXBATCH];
+    unsigned int sent = 0;
+    unsigned int chunk;
+    int ret;
+
+    memset(msgs, 0x00, sizeof(msgs));
+    while (sent < count) {
+        chunk = count - sent > SPKSOCK_LINUX_MAXBATCH ? SPKSOCK_LINUX_MAXBATCH : count - sent;
+        for (unsigned int i = 0; i < chunk; i++) {
+            iov[i].iov_base = bufs[sent + i];
+            iov[i].iov_len = lens[sent + i];
+            msgs[i].msg_hdr.msg_iov = iov + i;
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+        if ((ret = sendmmsg(ssock->sfd, msgs, chunk, 0)) < 0) {
+            if (sent > 0)
+                break;
+            switch (errno) {
+                case EAGAIN:
+                    return 0;
+                case EMSGSIZE:
+                    return SPKSOCK_ESIZE;
+                case EINTR:
+                    return SPKSOCK_EINTR;
+                default:
+                    return SPKSOCK_ERROR;
+            }
+        }
+        for (int i = 0; i < ret; i++)
+            ssock->sock_stats.tx_byte += msgs[i].msg_len;
+        ssock->sock_stats.pkt_send += ret;
+        sent += ret;
+        if ((unsigned int) ret < chunk)
+            break;
+    }
+    return (int) sent;
+}
+
 static int __linux_get_ifindex(struct SpkSock *ssock) {
     struct ifreq ifr;
 
@@ -210,10 +271,12 @@ int __ssock_init_socket(struct SpkSock *ssock) {
     ssock->op.finalize = spksock_linux_finalize;
     ssock->op.read = spksock_linux_read;
     ssock->op.setdir = spksock_linux_setdir;
+    ssock->op.setfilter = spksock_linux_setfilter;
     ssock->op.setnblk = spksock_linux_setnblock;
     ssock->op.setprc = spksock_linux_setprc;
     ssock->op.setpromisc = spksock_linux_setpromisc;
     ssock->op.write = spksock_linux_write;
+    ssock->op.writeb = spksock_linux_writeb;
 
     return SPKSOCK_SUCCESS;
 }
@@ -25,12 +25,16 @@
 
 #include <spksock.h>
 
+#define SPKSOCK_LINUX_MAXBATCH  64
+
 static bool __linux_discards_direction(struct SpkSock *, struct sockaddr_ll *);
 
-static int spksock_linux_read(struct SpkSock *, unsigned char *, struct SpkTimeStamp *);
+static int spksock_linux_read(struct SpkSock *, unsigned char *, unsigned int, struct SpkTimeStamp *);
 
 static int spksock_linux_setdir(struct SpkSock *, enum SpkDirection);
 
+static int spksock_linux_setfilter(struct SpkSock *, struct SpkFilterInsn *, unsigned int);
+
 static int spksock_linux_setnblock(struct SpkSock *, bool);
 
 static int spksock_linux_setprc(struct SpkSock *, enum SpkTimesPrc);
@@ -39,6 +43,8 @@ static int spksock_linux_setpromisc(struct SpkSock *, bool);
 
 static int spksock_linux_write(struct SpkSock *, unsigned char *, unsigned int);
 
+static int spksock_linux_writeb(struct SpkSock *, unsigned char **, unsigned int *, unsigned int);
+
 static int __linux_get_ifindex(struct SpkSock *);
 
 static void spksock_linux_finalize(struct SpkSock *);
@@ -0,0 +1,148 @@
+/*
+ * Copyright (c) 2017 Jacopo De Luca
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+*/
+
+#include <stdbool.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+
+#if defined(__linux__)
+#include <sys/syscall.h>
+#include <linux/random.h>
+#endif
+
+#include <spkrand.h>
+
+struct SpkRandState {
+    uint64_t s[4];
+    bool ready;
+};
+
+static _Thread_local struct SpkRandState __rnd_state;
+
+static inline uint64_t __rnd_rotl(uint64_t x, int k) {
+    return (x << k) | (x >> (64 - k));
+}
+
+static uint64_t __rnd_splitmix(uint64_t *state) {
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+static bool __rnd_entropy(void *buf, size_t len) {
+    ssize_t ret = -1;
+    int fd;
+
+#if defined(__linux__) && defined(SYS_getrandom)
+    if ((ret = syscall(SYS_getrandom, buf, len, GRND_NONBLOCK)) == (ssize_t) len)
+        return true;
+#endif
+    if ((fd = open("/dev/urandom", O_RDONLY)) < 0)
+        return false;
+    ret = read(fd, buf, len);
+    close(fd);
+    return ret == (ssize_t) len;
+}
+
+static void __rnd_init(struct SpkRandState *st) {
+    struct timespec now;
+    uint64_t seed;
+
+    if (!__rnd_entropy(st->s, sizeof(st->s))) {
+        // No entropy source, mixes whatever changes between threads and runs
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        seed = (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+        seed ^= (uint64_t) (uintptr_t) st ^ ((uint64_t) getpid() << 32);
+        for (int i = 0; i < 4; i++)
+            st->s[i] = __rnd_splitmix(&seed);
+    }
+    // The all-zero state is the only invalid one
+    if ((st->s[0] | st->s[1] | st->s[2] | st->s[3]) == 0)
+        st->s[0] = 0x9E3779B97F4A7C15ULL;
+    st->ready = true;
+}
+
+static inline uint64_t __rnd_next(struct SpkRandState *st) {
+    uint64_t res;
+    uint64_t t;
+
+    if (!st->ready)
+        __rnd_init(st);
+    res = __rnd_rotl(st->s[1] * 5, 7) * 9;
+    t = st->s[1] << 17;
+    st->s[2] ^= st->s[0];
+    st->s[3] ^= st->s[1];
+    st->s[1] ^= st->s[2];
+    st->s[0] ^= st->s[3];
+    st->s[2] ^= t;
+    st->s[3] = __rnd_rotl(st->s[3], 45);
+    return res;
+}
+
+uint32_t spkrand_bounded(uint32_t bound) {
+    // Lemire's multiply-shift with rejection, unbiased
+    uint64_t m = (uint64_t) spkrand_u32() * bound;
+    uint32_t low = (uint32_t) m;
+    uint32_t thr;
+
+    if (low < bound) {
+        thr = -bound % bound;
+        while (low < thr) {
+            m = (uint64_t) spkrand_u32() * bound;
+            low = (uint32_t) m;
+        }
+    }
+    return (uint32_t) (m >> 32);
+}
+
+inline uint32_t spkrand_u32() {
+    return (uint32_t) (__rnd_next(&__rnd_state) >> 32);
+}
+
+inline uint64_t spkrand_u64() {
+    return __rnd_next(&__rnd_state);
+}
+
+void spkrand_bytes(void *buf, size_t len) {
+    struct SpkRandState *st = &__rnd_state;
+    unsigned char *cursor = (unsigned char *) buf;
+    uint64_t r;
+
+    for (; len >= sizeof(uint64_t); len -= sizeof(uint64_t), cursor += sizeof(uint64_t)) {
+        r = __rnd_next(st);
+        memcpy(cursor, &r, sizeof(uint64_t));
+    }
+    if (len > 0) {
+        r = __rnd_next(st);
+        memcpy(cursor, &r, len);
+    }
+}
+
+void spkrand_seed(uint64_t seed) {
+    struct SpkRandState *st = &__rnd_state;
+    for (int i = 0; i < 4; i++)
+        st->s[i] = __rnd_splitmix(&seed);
+    st->ready = true;
+}
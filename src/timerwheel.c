@@ -0,0 +1,124 @@
+/*
+ * Copyright (c) 2017 Jacopo De Luca
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+*/
+
+#include <string.h>
+
+#include <timerwheel.h>
+
+static void __twheel_link(struct TimerWheel *wheel, struct TimerNode *node) {
+    unsigned long long expires = node->expires;
+    unsigned long long delta;
+    struct TimerNode **slot;
+    int level;
+
+    if (expires < wheel->next)
+        expires = wheel->next;
+    delta = expires - wheel->next;
+    for (level = 0; level < TWHEEL_LEVELS - 1; level++)
+        if (delta < (1ULL << (TWHEEL_BITS * (level + 1))))
+            break;
+    // Beyond the wheel range, parks the timer at the farthest slot, it is cascaded again later
+    if (level == TWHEEL_LEVELS - 1 && delta >= (1ULL << (TWHEEL_BITS * TWHEEL_LEVELS)))
+        expires = wheel->next + (1ULL << (TWHEEL_BITS * TWHEEL_LEVELS)) - 1;
+
+    slot = &wheel->slots[level][(expires >> (TWHEEL_BITS * level)) & TWHEEL_MASK];
+    node->next = *slot;
+    node->pprev = slot;
+    if (*slot != NULL)
+        (*slot)->pprev = &node->next;
+    *slot = node;
+}
+
+static void __twheel_unlink(struct TimerNode *node) {
+    *node->pprev = node->next;
+    if (node->next != NULL)
+        node->next->pprev = node->pprev;
+    node->next = NULL;
+    node->pprev = NULL;
+}
+
+static void __twheel_cascade(struct TimerWheel *wheel, int level, unsigned int idx) {
+    struct TimerNode *list = wheel->slots[level][idx];
+    struct TimerNode *tmp;
+
+    wheel->slots[level][idx] = NULL;
+    for (; list != NULL; list = tmp) {
+        tmp = list->next;
+        __twheel_link(wheel, list);
+    }
+}
+
+inline bool twheel_pending(struct TimerNode *node) {
+    return node->pprev != NULL;
+}
+
+unsigned int twheel_advance(struct TimerWheel *wheel, unsigned long long now) {
+    struct TimerNode *node;
+    unsigned int fired = 0;
+    unsigned int idx;
+
+    while (wheel->next <= now) {
+        if (wheel->count == 0) {
+            wheel->next = now + 1;
+            break;
+        }
+        idx = (unsigned int) (wheel->next & TWHEEL_MASK);
+        // When a level wraps, the matching slot of the upper level is redistributed
+        for (int level = 1; level < TWHEEL_LEVELS && idx == 0; level++) {
+            idx = (unsigned int) ((wheel->next >> (TWHEEL_BITS * level)) & TWHEEL_MASK);
+            __twheel_cascade(wheel, level, idx);
+        }
+        idx = (unsigned int) (wheel->next & TWHEEL_MASK);
+        while ((node = wheel->slots[0][idx]) != NULL) {
+            __twheel_unlink(node);
+            wheel->count--;
+            fired++;
+            node->cb(node, node->arg);
+        }
+        wheel->next++;
+    }
+    return fired;
+}
+
+void twheel_add(struct TimerWheel *wheel, struct TimerNode *node, unsigned long long expires, twheel_cb cb,
+                void *arg) {
+    if (twheel_pending(node))
+        __twheel_unlink(node);
+    else
+        wheel->count++;
+    node->expires = expires;
+    node->cb = cb;
+    node->arg = arg;
+    __twheel_link(wheel, node);
+}
+
+void twheel_del(struct TimerWheel *wheel, struct TimerNode *node) {
+    if (!twheel_pending(node))
+        return;
+    __twheel_unlink(node);
+    wheel->count--;
+}
+
+void twheel_init(struct TimerWheel *wheel, unsigned long long now) {
+    memset(wheel, 0x00, sizeof(struct TimerWheel));
+    wheel->next = now + 1;
+}
@@ -0,0 +1,477 @@
+/*
+ * Copyright (c) 2017 Jacopo De Luca
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <poll.h>
+#include <time.h>
+
+#include <datatype.h>
+#include <ethernet.h>
+#include <ipv4.h>
+#include <icmp4.h>
+#include <udp.h>
+#include <tcp.h>
+#include <spkrand.h>
+#include <traceroute.h>
+
+#define TRACE_L4LEN         TCPHDRSIZE
+#define TRACE_FRAMELEN      (ETHHDRSIZE + IPV4HDRSIZE + TRACE_L4LEN)
+#define TRACE_NSLOTS        65536
+#define TRACE_MAXOUT        65535   // Limited by the probe key
+#define TRACE_BATCH         32
+#define TRACE_MINTARGETS    64
+
+// ldh [12]; jeq #0x800; ldb [23]; jeq #IPPROTO_ICMP; jeq #IPPROTO_TCP; ret #0; ret #65535
+static struct SpkFilterInsn __trace_filter[] = {
+        {0x28, 0, 0, 12},
+        {0x15, 0, 3, ETHTYPE_IP},
+        {0x30, 0, 0, ETHHDRSIZE + 9},
+        {0x15, 2, 0, IPPROTO_ICMP},
+        {0x15, 1, 0, IPPROTO_TCP},
+        {0x06, 0, 0, 0},
+        {0x06, 0, 0, 0xFFFF}
+};
+
+static unsigned long long __trace_clock(clockid_t clk) {
+    struct timespec ts;
+    clock_gettime(clk, &ts);
+    return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static unsigned long long __trace_tsns(struct SpkTimeStamp *ts) {
+    if (ts->sec == 0 && ts->usec == 0 && ts->nsec == 0)
+        return __trace_clock(CLOCK_REALTIME);
+    if (ts->prc == SPKSTAMP_NANO)
+        return (unsigned long long) ts->sec * 1000000000ULL + ts->nsec;
+    return (unsigned long long) ts->sec * 1000000000ULL + ts->usec * 1000ULL;
+}
+
+static unsigned char __trace_l4len(enum TraceProto proto) {
+    if (proto == TRACE_TCP)
+        return TCPHDRSIZE;
+    return proto == TRACE_UDP ? UDPHDRSIZE : ICMP4HDRSIZE;
+}
+
+static void __trace_update(struct Traceroute *tr, unsigned int index) {
+    struct TraceTarget *target = tr->targets + index;
+    bool exhausted;
+
+    if (target->done)
+        return;
+    exhausted = target->reached || target->next_ttl > tr->max_ttl || target->gaps >= tr->gaplimit;
+    if (!exhausted || target->outstanding > 0)
+        return;
+
+    target->done = true;
+    tr->ndone++;
+    // Swap-remove from the active set
+    tr->active[target->active] = tr->active[--tr->nactive];
+    tr->targets[tr->active[target->active]].active = target->active;
+    if (tr->on_done != NULL)
+        tr->on_done(target, traceroute_hops(tr, index), tr->arg);
+}
+
+static void __trace_release(struct Traceroute *tr, struct TraceSlot *slot) {
+    slot->busy = false;
+    tr->outstanding--;
+    tr->targets[slot->target].outstanding--;
+}
+
+static void __trace_expired(struct TimerNode *node, void *arg) {
+    struct Traceroute *tr = (struct Traceroute *) arg;
+    struct TraceSlot *slot = (struct TraceSlot *) node;
+    struct TraceTarget *target = tr->targets + slot->target;
+
+    tr->stats.timeouts++;
+    if (!target->reached || slot->ttl < target->nhops)
+        target->gaps++;
+    __trace_release(tr, slot);
+    __trace_update(tr, slot->target);
+}
+
+static bool __trace_answer(struct Traceroute *tr, unsigned short key, unsigned int daddr, struct Ipv4Header *ipv4,
+                           unsigned char status, unsigned char code, struct SpkTimeStamp *ts) {
+    struct TraceSlot *slot = tr->slots + key;
+    struct TraceTarget *target;
+    struct TraceHop *hop;
+    unsigned long long now;
+
+    if (!slot->busy || tr->targets[slot->target].ip.ip != daddr) {
+        tr->stats.unmatched++;
+        return false;
+    }
+    twheel_del(&tr->wheel, &slot->timer);
+    target = tr->targets + slot->target;
+    hop = traceroute_hops(tr, slot->target) + slot->ttl - 1;
+    now = __trace_tsns(ts);
+    hop->addr.ip = ipv4->saddr;
+    hop->rtt = now > slot->sent ? (unsigned int) ((now - slot->sent) / 1000) : 0;
+    hop->status = status;
+    hop->code = code;
+    hop->ttl = ipv4->ttl;
+    tr->stats.answered++;
+
+    target->gaps = 0;
+    if (ipv4->saddr == daddr && status != TRACEHOP_TIMEEXCEEDED) {
+        // Closer probes can still be in flight, the destination distance is the smallest TTL that reached it
+        if (!target->reached || slot->ttl < target->nhops)
+            target->nhops = slot->ttl;
+        target->reached = true;
+    } else if (!target->reached && slot->ttl > target->nhops)
+        target->nhops = slot->ttl;
+    __trace_release(tr, slot);
+    __trace_update(tr, slot->target);
+    return true;
+}
+
+static bool __trace_quoted(struct Traceroute *tr, struct Ipv4Header *ipv4, struct IcmpHeader *icmp, unsigned int len,
+                           struct SpkTimeStamp *ts) {
+    struct Ipv4Header *qip = (struct Ipv4Header *) icmp->data;
+    struct IcmpHeader *qicmp;
+    struct UdpHeader *qudp;
+    struct TcpHeader *qtcp;
+    unsigned int qhlen;
+    unsigned short key;
+    unsigned char status;
+
+    // RFC 792 guarantees the IPv4 header plus the first 8 bytes of the L4 header
+    if (len < ICMP4HDRSIZE + IPV4HDRSIZE || qip->saddr != tr->ipaddr.ip)
+        return false;
+    qhlen = (unsigned int) qip->ihl << 2;
+    if (qhlen < IPV4HDRSIZE || len < ICMP4HDRSIZE + qhlen + 8)
+        return false;
+    switch (tr->proto) {
+        case TRACE_ICMP:
+            qicmp = (struct IcmpHeader *) (icmp->data + qhlen);
+            if (qip->protocol != IPPROTO_ICMP || qicmp->type != ICMPTY_ECHO_REQUEST || ntohs(qicmp->echo.id) != tr->port)
+                return false;
+            key = ntohs(qicmp->echo.sqn);
+            break;
+        case TRACE_UDP:
+            qudp = (struct UdpHeader *) (icmp->data + qhlen);
+            if (qip->protocol != IPPROTO_UDP || ntohs(qudp->srcport) != tr->port)
+                return false;
+            key = ntohs(qip->id);
+            break;
+        case TRACE_TCP:
+            qtcp = (struct TcpHeader *) (icmp->data + qhlen);
+            if (qip->protocol != IPPROTO_TCP || ntohs(qtcp->src) != tr->port)
+                return false;
+            key = (unsigned short) ntohl(qtcp->seqn);
+            break;
+        default:
+            return false;
+    }
+    status = icmp->type == ICMPTY_TIME_EXCEEDED ? TRACEHOP_TIMEEXCEEDED : TRACEHOP_UNREACHABLE;
+    return __trace_answer(tr, key, qip->daddr, ipv4, status, icmp->code, ts);
+}
+
+static void __trace_input(struct Traceroute *tr, struct SpkTimeStamp *ts, unsigned int len) {
+    struct EthHeader *eth = (struct EthHeader *) tr->rxbuf;
+    struct Ipv4Header *ipv4 = (struct Ipv4Header *) eth->data;
+    struct IcmpHeader *icmp;
+    struct TcpHeader *tcp;
+    unsigned int hlen;
+    unsigned int plen;
+
+    if (len < ETHHDRSIZE + IPV4HDRSIZE + ICMP4HDRSIZE || eth->eth_type != htons(ETHTYPE_IP))
+        return;
+    hlen = (unsigned int) ipv4->ihl << 2;
+    plen = ntohs(ipv4->len);
+    if (ipv4->daddr != tr->ipaddr.ip || hlen < IPV4HDRSIZE || plen < hlen + ICMP4HDRSIZE
+        || plen > len - ETHHDRSIZE)
+        return;
+
+    if (ipv4->protocol == IPPROTO_ICMP) {
+        icmp = (struct IcmpHeader *) (eth->data + hlen);
+        if (icmp->type == ICMPTY_TIME_EXCEEDED || icmp->type == ICMPTY_DST_UNREACHABLE)
+            __trace_quoted(tr, ipv4, icmp, plen - hlen, ts);
+        else if (icmp->type == ICMPTY_ECHO_REPLY && tr->proto == TRACE_ICMP && ntohs(icmp->echo.id) == tr->port)
+            __trace_answer(tr, ntohs(icmp->echo.sqn), ipv4->saddr, ipv4, TRACEHOP_REPLY, 0, ts);
+    } else if (ipv4->protocol == IPPROTO_TCP && tr->proto == TRACE_TCP && plen >= hlen + TCPHDRSIZE) {
+        tcp = (struct TcpHeader *) (eth->data + hlen);
+        if (ntohs(tcp->dst) != tr->port || ntohs(tcp->src) != tr->dport || !(tcp->flags & (TCPSYN | TCPRST)))
+            return;
+        // SYN/ACK and RST acknowledge our sequence number + 1
+        __trace_answer(tr, (unsigned short) (ntohl(tcp->ackn) - 1), ipv4->saddr, ipv4, TRACEHOP_REPLY,
+                       tcp->flags, ts);
+    }
+}
+
+static void __trace_refill(struct Traceroute *tr, unsigned long long now) {
+    double elapsed = (double) (now - tr->last_refill) / 1e9;
+
+    tr->last_refill = now;
+    tr->tokens = tr->pps == 0 ? TRACE_BATCH : tr->tokens + elapsed * tr->pps;
+    if (tr->tokens > TRACE_BATCH)
+        tr->tokens = TRACE_BATCH;
+    for (int ttl = tr->first_ttl; ttl <= tr->max_ttl; ttl++) {
+        tr->hop_tokens[ttl] = tr->hop_pps == 0 ? TRACE_BATCH : tr->hop_tokens[ttl] + elapsed * tr->hop_pps;
+        if (tr->hop_tokens[ttl] > TRACE_BATCH)
+            tr->hop_tokens[ttl] = TRACE_BATCH;
+    }
+}
+
+static void __trace_build(struct Traceroute *tr, unsigned char *frame, struct TraceTarget *target,
+                          unsigned char ttl, unsigned short key) {
+    struct Ipv4Header *ipv4 = (struct Ipv4Header *) (frame + ETHHDRSIZE);
+    struct IcmpHeader *icmp;
+    struct UdpHeader *udp;
+    struct TcpHeader *tcp;
+    unsigned short l4len = __trace_l4len(tr->proto);
+
+    memcpy(frame, tr->frames, ETHHDRSIZE + IPV4HDRSIZE + l4len);
+    ipv4->daddr = target->ip.ip;
+    ipv4->ttl = ttl;
+    ipv4->id = tr->proto == TRACE_UDP ? htons(key) : ipv4_mkid();
+    ipv4->checksum = ipv4_checksum(ipv4);
+    switch (tr->proto) {
+        case TRACE_ICMP:
+            icmp = (struct IcmpHeader *) ipv4->data;
+            icmp->echo.sqn = htons(key);
+            icmp->chksum = icmp4_checksum(icmp, 0);
+            break;
+        case TRACE_UDP:
+            udp = (struct UdpHeader *) ipv4->data;
+            udp->dstport = htons(tr->dport);
+            udp->checksum = udp_checksum4(udp, ipv4);
+            break;
+        case TRACE_TCP:
+            tcp = (struct TcpHeader *) ipv4->data;
+            tcp->seqn = htonl(key);
+            tcp->dst = htons(tr->dport);
+            tcp->checksum = tcp_checksum4(tcp, ipv4);
+            break;
+    }
+}
+
+static int __trace_output(struct Traceroute *tr) {
+    unsigned char *bufs[TRACE_BATCH];
+    unsigned int lens[TRACE_BATCH];
+    unsigned short keys[TRACE_BATCH];
+    struct TraceTarget *target;
+    struct TraceSlot *slot;
+    unsigned long long sent;
+    unsigned long long expires;
+    unsigned int count = 0;
+    unsigned int scanned;
+    unsigned int done = 0;
+    unsigned int index;
+    unsigned char ttl;
+    int ret;
+
+    // Admits new targets as the running ones complete
+    while (tr->nactive < tr->max_active && tr->next_target < tr->ntargets) {
+        tr->targets[tr->next_target].active = tr->nactive;
+        tr->active[tr->nactive++] = tr->next_target++;
+    }
+    __trace_refill(tr, __trace_clock(CLOCK_MONOTONIC));
+
+    // Round robin on the active targets, one probe per target per turn
+    for (scanned = 0; scanned < tr->nactive && count < TRACE_BATCH && tr->tokens >= 1
+                      && tr->outstanding < TRACE_MAXOUT; scanned++) {
+        if (tr->cursor >= tr->nactive)
+            tr->cursor = 0;
+        index = tr->active[tr->cursor++];
+        target = tr->targets + index;
+        ttl = target->next_ttl;
+        if (target->reached || ttl > tr->max_ttl || target->gaps >= tr->gaplimit
+            || target->outstanding >= tr->window || tr->hop_tokens[ttl] < 1)
+            continue;
+
+        while (tr->slots[tr->next_key].busy)
+            tr->next_key++;
+        keys[count] = tr->next_key++;
+        slot = tr->slots + keys[count];
+        slot->target = index;
+        slot->ttl = ttl;
+        slot->busy = true;
+        target->outstanding++;
+        target->next_ttl++;
+        tr->outstanding++;
+        tr->tokens -= 1;
+        tr->hop_tokens[ttl] -= 1;
+
+        bufs[count] = tr->frames + (count + 1) * TRACE_FRAMELEN;
+        lens[count] = ETHHDRSIZE + IPV4HDRSIZE + __trace_l4len(tr->proto);
+        __trace_build(tr, bufs[count], target, ttl, keys[count]);
+        count++;
+    }
+
+    sent = __trace_clock(CLOCK_REALTIME);
+    expires = __trace_clock(CLOCK_MONOTONIC) / 1000000ULL + tr->timeout;
+    for (unsigned int i = 0; i < count; i++) {
+        slot = tr->slots + keys[i];
+        slot->sent = sent;
+        twheel_add(&tr->wheel, &slot->timer, expires, __trace_expired, tr);
+    }
+    while (done < count) {
+        if ((ret = spark_writeb(tr->ssock, bufs + done, lens + done, count - done)) < 0) {
+            if (ret == SPKSOCK_EINTR)
+                continue;
+            // Unsent probes will be reported as silent hops
+            return ret;
+        }
+        done += ret;
+    }
+    tr->stats.sent += done;
+    return (int) done;
+}
+
+bool traceroute_done(struct Traceroute *tr) {
+    return tr->ndone == tr->ntargets;
+}
+
+inline struct TraceHop *traceroute_hops(struct Traceroute *tr, unsigned int index) {
+    return tr->hops + (unsigned long) index * tr->max_ttl;
+}
+
+bool traceroute_add(struct Traceroute *tr, struct netaddr_ip *target, void *udata) {
+    struct TraceTarget *targets;
+    struct TraceHop *hops;
+    unsigned int cap;
+
+    if (tr->ntargets == tr->cap) {
+        if (tr->max_ttl > TRACE_MAXTTL)
+            tr->max_ttl = TRACE_MAXTTL;
+        if (tr->first_ttl == 0)
+            tr->first_ttl = 1;
+        cap = tr->cap == 0 ? TRACE_MINTARGETS : tr->cap << 1;
+        if ((targets = (struct TraceTarget *) realloc(tr->targets, cap * sizeof(struct TraceTarget))) == NULL)
+            return false;
+        tr->targets = targets;
+        if ((hops = (struct TraceHop *) realloc(tr->hops, (unsigned long) cap * tr->max_ttl
+                                                          * sizeof(struct TraceHop))) == NULL)
+            return false;
+        tr->hops = hops;
+        tr->cap = cap;
+    }
+    targets = tr->targets + tr->ntargets;
+    memset(targets, 0x00, sizeof(struct TraceTarget));
+    memset(traceroute_hops(tr, tr->ntargets), 0x00, tr->max_ttl * sizeof(struct TraceHop));
+    targets->ip = *target;
+    targets->udata = udata;
+    targets->next_ttl = tr->first_ttl;
+    tr->ntargets++;
+    return true;
+}
+
+int traceroute_poll(struct Traceroute *tr, int timeout) {
+    struct SpkTimeStamp ts;
+    struct pollfd pfd;
+    unsigned int ndone = tr->ndone;
+    unsigned int *active;
+    int ret;
+
+    if (tr->active == NULL) {
+        if (tr->max_active == 0)
+            tr->max_active = 1;
+        if ((active = (unsigned int *) malloc(tr->max_active * sizeof(unsigned int))) == NULL)
+            return SPKSOCK_ENOMEM;
+        tr->active = active;
+    }
+    if ((ret = __trace_output(tr)) < 0)
+        return ret;
+
+    // Do not sleep past the next send opportunity
+    if (tr->nactive > 0 && tr->pps > 0 && tr->tokens < 1 && (ret = (int) ((1 - tr->tokens) * 1000 / tr->pps)) < timeout)
+        timeout = ret;
+    pfd.fd = tr->ssock->sfd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    poll(&pfd, 1, timeout);
+
+    memset(&ts, 0x00, sizeof(struct SpkTimeStamp));
+    while ((ret = spark_read(tr->ssock, tr->rxbuf, &ts)) > 0) {
+        __trace_input(tr, &ts, (unsigned int) ret);
+        memset(&ts, 0x00, sizeof(struct SpkTimeStamp));
+    }
+    if (ret < 0 && ret != SPKSOCK_EINTR)
+        return ret;
+    twheel_advance(&tr->wheel, __trace_clock(CLOCK_MONOTONIC) / 1000000ULL);
+    return (int) (tr->ndone - ndone);
+}
+
+struct Traceroute *traceroute_new(struct SpkSock *ssock, struct netaddr_ip *src, struct netaddr_mac *nexthop,
+                                  enum TraceProto proto) {
+    struct Traceroute *tr;
+    struct Ipv4Header *ipv4;
+    unsigned char l4proto;
+
+    if ((tr = (struct Traceroute *) calloc(1, sizeof(struct Traceroute))) == NULL)
+        return NULL;
+    tr->slots = (struct TraceSlot *) calloc(TRACE_NSLOTS, sizeof(struct TraceSlot));
+    tr->frames = (unsigned char *) malloc((TRACE_BATCH + 1) * TRACE_FRAMELEN);
+    tr->rxbuf = (unsigned char *) malloc(ssock->bufl);
+    if (tr->slots == NULL || tr->frames == NULL || tr->rxbuf == NULL) {
+        traceroute_free(tr);
+        return NULL;
+    }
+    tr->ssock = ssock;
+    tr->hwaddr = ssock->iaddr;
+    tr->nexthop = *nexthop;
+    tr->ipaddr = *src;
+    tr->proto = proto;
+    tr->port = (unsigned short) (spkrand_u32() | 0x8000);
+    tr->dport = proto == TRACE_TCP ? TRACE_DEFTCPPORT : TRACE_DEFUDPPORT;
+    tr->first_ttl = 1;
+    tr->max_ttl = TRACE_DEFMAXTTL;
+    tr->window = TRACE_DEFWINDOW;
+    tr->gaplimit = TRACE_DEFGAPLIMIT;
+    tr->pps = TRACE_DEFPPS;
+    tr->hop_pps = TRACE_DEFHOPPPS;
+    tr->timeout = TRACE_DEFTIMEOUT;
+    tr->max_active = TRACE_DEFACTIVE;
+    tr->next_key = (unsigned short) spkrand_u32();
+    tr->last_refill = __trace_clock(CLOCK_MONOTONIC);
+    twheel_init(&tr->wheel, tr->last_refill / 1000000ULL);
+
+    // Template: every probe only changes destination, TTL, key and checksums
+    l4proto = proto == TRACE_TCP ? IPPROTO_TCP : proto == TRACE_UDP ? IPPROTO_UDP : IPPROTO_ICMP;
+    injects_ethernet_header(tr->frames, &tr->hwaddr, &tr->nexthop, ETHTYPE_IP);
+    ipv4 = injects_ipv4_header(tr->frames + ETHHDRSIZE, &tr->ipaddr, &tr->ipaddr, IPV4DEFIHL, 0,
+                               __trace_l4len(proto), IPV4DEFTTL, l4proto);
+    if (proto == TRACE_ICMP)
+        injects_icmp4_echo_request(ipv4->data, tr->port, 0);
+    else if (proto == TRACE_UDP)
+        injects_udp_header(ipv4->data, tr->port, tr->dport, 0);
+    else
+        injects_tcp_header(ipv4->data, tr->port, tr->dport, 0, 0, TCPSYN, 65535, 0);
+
+    spark_setfilter(ssock, __trace_filter, sizeof(__trace_filter) / sizeof(struct SpkFilterInsn));
+    spark_settsprc(ssock, SPKSTAMP_NANO);
+    spark_setnblock(ssock, true);
+    return tr;
+}
+
+void traceroute_free(struct Traceroute *tr) {
+    if (tr == NULL)
+        return;
+    free(tr->targets);
+    free(tr->hops);
+    free(tr->active);
+    free(tr->slots);
+    free(tr->frames);
+    free(tr->rxbuf);
+    free(tr);
+}